@@ -0,0 +1,146 @@
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "hiredis.h"
+#include "hircluster.h"
+#include "command.h"
+#include "hiarray.h"
+
+/* Microbenchmark of the cluster command parsing: the time redis_parse_cmd
+ * takes per command, for short and long command names, and the time the
+ * slot of a key takes by its length. The best of a few rounds is
+ * reported, to keep the noise of the machine out. */
+
+#define ROUNDS 5
+#define SLOT_KEYS 1000
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static const char *commands[][2] = {
+    { "get",              "GET key:%d" },
+    { "set",              "SET key:%d value" },
+    { "hget",             "HGET key:%d field" },
+    { "mget",             "MGET key:%d key:2 key:3" },
+    { "expire",           "EXPIRE key:%d 100" },
+    { "lrange",           "LRANGE key:%d 0 10" },
+    { "hincrby",          "HINCRBY key:%d field 1" },
+    { "zscore",           "ZSCORE key:%d member" },
+    { "pfadd",            "PFADD key:%d element" },
+    { "smembers",         "SMEMBERS key:%d" },
+    { "zrangebyscore",    "ZRANGEBYSCORE key:%d 0 100" },
+    { "zremrangebyrank",  "ZREMRANGEBYRANK key:%d 0 1" },
+    { "zrevrangebyscore", "ZREVRANGEBYSCORE key:%d 100 0" },
+};
+
+static void bench(const char *name, const char *format, long iterations) {
+    struct cmd *command;
+    char *cmd;
+    int len;
+    long i;
+    int round;
+    long long t1, t2, best = -1;
+
+    len = redisFormatCommand(&cmd, format, 1);
+    if (len < 0) {
+        printf("%-18s format error\n", name);
+        exit(1);
+    }
+
+    command = command_get();
+    if (command == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+
+    command->cmd = cmd;
+    command->clen = (uint32_t)len;
+
+    for (round = 0; round < ROUNDS; round++) {
+        t1 = usec();
+        for (i = 0; i < iterations; i++) {
+            command->keys->nelem = 0;
+            command->reducer = NULL;
+            command->type = CMD_UNKNOWN;
+            redis_parse_cmd(command);
+            if (command->result != CMD_PARSE_OK) {
+                printf("%-18s parse error\n", name);
+                exit(1);
+            }
+        }
+        t2 = usec();
+
+        if (best < 0 || t2 - t1 < best) {
+            best = t2 - t1;
+        }
+    }
+
+    printf("%-18s %6.1f ns/parse\n", name, (double)best * 1000 / iterations);
+
+    command_destroy(command);
+}
+
+static void bench_slots(size_t keylen, int tagged, long iterations) {
+    const char *keys[SLOT_KEYS];
+    size_t lens[SLOT_KEYS];
+    int slots[SLOT_KEYS];
+    char *buf;
+    long i;
+    int j, round;
+    long long t1, t2, best = -1;
+
+    buf = malloc(SLOT_KEYS * keylen);
+    if (buf == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+
+    for (j = 0; j < SLOT_KEYS; j++) {
+        memset(buf + j * keylen, 'a' + j % 26, keylen);
+        snprintf(buf + j * keylen, keylen, tagged ? "{user:%d}" : "user:%d", j);
+        buf[j * keylen + strlen(buf + j * keylen)] = 'x';
+        keys[j] = buf + j * keylen;
+        lens[j] = keylen;
+    }
+
+    iterations = iterations / SLOT_KEYS + 1;
+    for (round = 0; round < ROUNDS; round++) {
+        t1 = usec();
+        for (i = 0; i < iterations; i++) {
+            redisClusterKeySlots(keys, lens, SLOT_KEYS, slots);
+        }
+        t2 = usec();
+
+        if (best < 0 || t2 - t1 < best) {
+            best = t2 - t1;
+        }
+    }
+
+    printf("slot %-4zu bytes%s %6.1f ns/key\n", keylen, tagged ? " {tag}" : "      ",
+        (double)best * 1000 / (iterations * SLOT_KEYS));
+
+    free(buf);
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t i;
+    static const size_t keylens[] = { 16, 32, 64, 256 };
+
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        bench(commands[i][0], commands[i][1], iterations);
+    }
+
+    for (i = 0; i < sizeof(keylens) / sizeof(keylens[0]); i++) {
+        bench_slots(keylens[i], 0, iterations);
+        bench_slots(keylens[i], 1, iterations);
+    }
+
+    return 0;
+}
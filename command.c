@@ -1,5 +1,7 @@
 #include <ctype.h>
 #include <errno.h>
+#include <string.h>
+#include <strings.h>
 
 #include "command.h"
 #include "hiutil.h"
@@ -8,63 +10,281 @@
 
 static uint64_t cmd_id = 0;          /* command id counter */
 
+/* The type and the key spec of a command known by name. */
+struct cmd_spec {
+    const char       *name;         /* command name, lower case */
+    uint32_t         len;           /* command name length */
+    cmd_type_t       type;
+    cmd_keyspec_t    keyspec;
+};
+
+/* Generated by utils/gen-command-table.py, do not edit. */
+
+#define CMD_NAME_MINLEN 3
+#define CMD_NAME_MAXLEN 16
+#define CMD_TABLE_SIZE  256
+
+static const uint8_t cmd_asso[32] = {
+    197, 138,  10,  64, 254,  19,   4,  48,  36, 111,  44, 253,  15,  48, 128, 193,
+    158, 151, 217, 169, 252, 103, 234, 110, 161, 246,  74, 226, 133,  31,   7,  47,
+};
+
+static const struct cmd_spec cmd_specs[] = {
+    { "get",               3, CMD_REQ_REDIS_GET,              CMD_KEYSPEC_ARG0 },
+    { "set",               3, CMD_REQ_REDIS_SET,              CMD_KEYSPEC_ARGN },
+    { "ttl",               3, CMD_REQ_REDIS_TTL,              CMD_KEYSPEC_ARG0 },
+    { "del",               3, CMD_REQ_REDIS_DEL,              CMD_KEYSPEC_MULTI },
+    { "pttl",              4, CMD_REQ_REDIS_PTTL,             CMD_KEYSPEC_ARG0 },
+    { "decr",              4, CMD_REQ_REDIS_DECR,             CMD_KEYSPEC_ARG0 },
+    { "dump",              4, CMD_REQ_REDIS_DUMP,             CMD_KEYSPEC_ARG0 },
+    { "hdel",              4, CMD_REQ_REDIS_HDEL,             CMD_KEYSPEC_ARGN },
+    { "hget",              4, CMD_REQ_REDIS_HGET,             CMD_KEYSPEC_ARG1 },
+    { "hlen",              4, CMD_REQ_REDIS_HLEN,             CMD_KEYSPEC_ARG0 },
+    { "hset",              4, CMD_REQ_REDIS_HSET,             CMD_KEYSPEC_ARG2 },
+    { "incr",              4, CMD_REQ_REDIS_INCR,             CMD_KEYSPEC_ARG0 },
+    { "llen",              4, CMD_REQ_REDIS_LLEN,             CMD_KEYSPEC_ARG0 },
+    { "lpop",              4, CMD_REQ_REDIS_LPOP,             CMD_KEYSPEC_ARG0 },
+    { "lrem",              4, CMD_REQ_REDIS_LREM,             CMD_KEYSPEC_ARG2 },
+    { "lset",              4, CMD_REQ_REDIS_LSET,             CMD_KEYSPEC_ARG2 },
+    { "rpop",              4, CMD_REQ_REDIS_RPOP,             CMD_KEYSPEC_ARG0 },
+    { "sadd",              4, CMD_REQ_REDIS_SADD,             CMD_KEYSPEC_ARGN },
+    { "spop",              4, CMD_REQ_REDIS_SPOP,             CMD_KEYSPEC_ARG0 },
+    { "srem",              4, CMD_REQ_REDIS_SREM,             CMD_KEYSPEC_ARGN },
+    { "type",              4, CMD_REQ_REDIS_TYPE,             CMD_KEYSPEC_ARG0 },
+    { "mget",              4, CMD_REQ_REDIS_MGET,             CMD_KEYSPEC_MULTI },
+    { "mset",              4, CMD_REQ_REDIS_MSET,             CMD_KEYSPEC_MULTI },
+    { "zadd",              4, CMD_REQ_REDIS_ZADD,             CMD_KEYSPEC_ARGN },
+    { "zrem",              4, CMD_REQ_REDIS_ZREM,             CMD_KEYSPEC_ARGN },
+    { "eval",              4, CMD_REQ_REDIS_EVAL,             CMD_KEYSPEC_EVAL },
+    { "sort",              4, CMD_REQ_REDIS_SORT,             CMD_KEYSPEC_ARG0 },
+    { "ping",              4, CMD_REQ_REDIS_PING,             CMD_KEYSPEC_NONE },
+    { "quit",              4, CMD_REQ_REDIS_QUIT,             CMD_KEYSPEC_NONE },
+    { "auth",              4, CMD_REQ_REDIS_AUTH,             CMD_KEYSPEC_ARG0 },
+    { "touch",             5, CMD_REQ_REDIS_TOUCH,            CMD_KEYSPEC_MULTI },
+    { "hkeys",             5, CMD_REQ_REDIS_HKEYS,            CMD_KEYSPEC_ARG0 },
+    { "hmget",             5, CMD_REQ_REDIS_HMGET,            CMD_KEYSPEC_ARGN },
+    { "hmset",             5, CMD_REQ_REDIS_HMSET,            CMD_KEYSPEC_ARGN },
+    { "hvals",             5, CMD_REQ_REDIS_HVALS,            CMD_KEYSPEC_ARG0 },
+    { "hscan",             5, CMD_REQ_REDIS_HSCAN,            CMD_KEYSPEC_ARGN },
+    { "lpush",             5, CMD_REQ_REDIS_LPUSH,            CMD_KEYSPEC_ARGN },
+    { "ltrim",             5, CMD_REQ_REDIS_LTRIM,            CMD_KEYSPEC_ARG2 },
+    { "rpush",             5, CMD_REQ_REDIS_RPUSH,            CMD_KEYSPEC_ARGN },
+    { "scard",             5, CMD_REQ_REDIS_SCARD,            CMD_KEYSPEC_ARG0 },
+    { "sdiff",             5, CMD_REQ_REDIS_SDIFF,            CMD_KEYSPEC_ARGN },
+    { "setex",             5, CMD_REQ_REDIS_SETEX,            CMD_KEYSPEC_ARG2 },
+    { "setnx",             5, CMD_REQ_REDIS_SETNX,            CMD_KEYSPEC_ARG1 },
+    { "smove",             5, CMD_REQ_REDIS_SMOVE,            CMD_KEYSPEC_ARG2 },
+    { "sscan",             5, CMD_REQ_REDIS_SSCAN,            CMD_KEYSPEC_ARGN },
+    { "zcard",             5, CMD_REQ_REDIS_ZCARD,            CMD_KEYSPEC_ARG0 },
+    { "zrank",             5, CMD_REQ_REDIS_ZRANK,            CMD_KEYSPEC_ARG1 },
+    { "zscan",             5, CMD_REQ_REDIS_ZSCAN,            CMD_KEYSPEC_ARGN },
+    { "pfadd",             5, CMD_REQ_REDIS_PFADD,            CMD_KEYSPEC_ARGN },
+    { "append",            6, CMD_REQ_REDIS_APPEND,           CMD_KEYSPEC_ARG1 },
+    { "decrby",            6, CMD_REQ_REDIS_DECRBY,           CMD_KEYSPEC_ARG1 },
+    { "exists",            6, CMD_REQ_REDIS_EXISTS,           CMD_KEYSPEC_MULTI },
+    { "unlink",            6, CMD_REQ_REDIS_UNLINK,           CMD_KEYSPEC_MULTI },
+    { "expire",            6, CMD_REQ_REDIS_EXPIRE,           CMD_KEYSPEC_ARG1 },
+    { "getbit",            6, CMD_REQ_REDIS_GETBIT,           CMD_KEYSPEC_ARG1 },
+    { "getset",            6, CMD_REQ_REDIS_GETSET,           CMD_KEYSPEC_ARG1 },
+    { "psetex",            6, CMD_REQ_REDIS_PSETEX,           CMD_KEYSPEC_ARG2 },
+    { "hsetnx",            6, CMD_REQ_REDIS_HSETNX,           CMD_KEYSPEC_ARG2 },
+    { "incrby",            6, CMD_REQ_REDIS_INCRBY,           CMD_KEYSPEC_ARG1 },
+    { "lindex",            6, CMD_REQ_REDIS_LINDEX,           CMD_KEYSPEC_ARG1 },
+    { "lpushx",            6, CMD_REQ_REDIS_LPUSHX,           CMD_KEYSPEC_ARG1 },
+    { "lrange",            6, CMD_REQ_REDIS_LRANGE,           CMD_KEYSPEC_ARG2 },
+    { "rpushx",            6, CMD_REQ_REDIS_RPUSHX,           CMD_KEYSPEC_ARG1 },
+    { "setbit",            6, CMD_REQ_REDIS_SETBIT,           CMD_KEYSPEC_ARG2 },
+    { "sinter",            6, CMD_REQ_REDIS_SINTER,           CMD_KEYSPEC_ARGN },
+    { "strlen",            6, CMD_REQ_REDIS_STRLEN,           CMD_KEYSPEC_ARG0 },
+    { "sunion",            6, CMD_REQ_REDIS_SUNION,           CMD_KEYSPEC_ARGN },
+    { "zcount",            6, CMD_REQ_REDIS_ZCOUNT,           CMD_KEYSPEC_ARG2 },
+    { "zrange",            6, CMD_REQ_REDIS_ZRANGE,           CMD_KEYSPEC_ARGN },
+    { "zscore",            6, CMD_REQ_REDIS_ZSCORE,           CMD_KEYSPEC_ARG1 },
+    { "persist",           7, CMD_REQ_REDIS_PERSIST,          CMD_KEYSPEC_ARG0 },
+    { "pexpire",           7, CMD_REQ_REDIS_PEXPIRE,          CMD_KEYSPEC_ARG1 },
+    { "hexists",           7, CMD_REQ_REDIS_HEXISTS,          CMD_KEYSPEC_ARG1 },
+    { "hgetall",           7, CMD_REQ_REDIS_HGETALL,          CMD_KEYSPEC_ARG0 },
+    { "hincrby",           7, CMD_REQ_REDIS_HINCRBY,          CMD_KEYSPEC_ARG2 },
+    { "linsert",           7, CMD_REQ_REDIS_LINSERT,          CMD_KEYSPEC_ARG3 },
+    { "zincrby",           7, CMD_REQ_REDIS_ZINCRBY,          CMD_KEYSPEC_ARG2 },
+    { "evalsha",           7, CMD_REQ_REDIS_EVALSHA,          CMD_KEYSPEC_EVAL },
+    { "restore",           7, CMD_REQ_REDIS_RESTORE,          CMD_KEYSPEC_ARG2 },
+    { "pfcount",           7, CMD_REQ_REDIS_PFCOUNT,          CMD_KEYSPEC_ARG0 },
+    { "pfmerge",           7, CMD_REQ_REDIS_PFMERGE,          CMD_KEYSPEC_ARGN },
+    { "expireat",          8, CMD_REQ_REDIS_EXPIREAT,         CMD_KEYSPEC_ARG1 },
+    { "bitcount",          8, CMD_REQ_REDIS_BITCOUNT,         CMD_KEYSPEC_ARGN },
+    { "getrange",          8, CMD_REQ_REDIS_GETRANGE,         CMD_KEYSPEC_ARG2 },
+    { "setrange",          8, CMD_REQ_REDIS_SETRANGE,         CMD_KEYSPEC_ARG2 },
+    { "smembers",          8, CMD_REQ_REDIS_SMEMBERS,         CMD_KEYSPEC_ARG0 },
+    { "zrevrank",          8, CMD_REQ_REDIS_ZREVRANK,         CMD_KEYSPEC_ARG1 },
+    { "pexpireat",         9, CMD_REQ_REDIS_PEXPIREAT,        CMD_KEYSPEC_ARG1 },
+    { "rpoplpush",         9, CMD_REQ_REDIS_RPOPLPUSH,        CMD_KEYSPEC_ARG1 },
+    { "sismember",         9, CMD_REQ_REDIS_SISMEMBER,        CMD_KEYSPEC_ARG1 },
+    { "zrevrange",         9, CMD_REQ_REDIS_ZREVRANGE,        CMD_KEYSPEC_ARGN },
+    { "zlexcount",         9, CMD_REQ_REDIS_ZLEXCOUNT,        CMD_KEYSPEC_ARG2 },
+    { "sdiffstore",       10, CMD_REQ_REDIS_SDIFFSTORE,       CMD_KEYSPEC_ARGN },
+    { "incrbyfloat",      11, CMD_REQ_REDIS_INCRBYFLOAT,      CMD_KEYSPEC_ARG1 },
+    { "sinterstore",      11, CMD_REQ_REDIS_SINTERSTORE,      CMD_KEYSPEC_ARGN },
+    { "srandmember",      11, CMD_REQ_REDIS_SRANDMEMBER,      CMD_KEYSPEC_ARGN },
+    { "sunionstore",      11, CMD_REQ_REDIS_SUNIONSTORE,      CMD_KEYSPEC_ARGN },
+    { "zinterstore",      11, CMD_REQ_REDIS_ZINTERSTORE,      CMD_KEYSPEC_ARGN },
+    { "zunionstore",      11, CMD_REQ_REDIS_ZUNIONSTORE,      CMD_KEYSPEC_ARGN },
+    { "zrangebylex",      11, CMD_REQ_REDIS_ZRANGEBYLEX,      CMD_KEYSPEC_ARGN },
+    { "hincrbyfloat",     12, CMD_REQ_REDIS_HINCRBYFLOAT,     CMD_KEYSPEC_ARG2 },
+    { "zrangebyscore",    13, CMD_REQ_REDIS_ZRANGEBYSCORE,    CMD_KEYSPEC_ARGN },
+    { "zremrangebylex",   14, CMD_REQ_REDIS_ZREMRANGEBYLEX,   CMD_KEYSPEC_ARG2 },
+    { "zremrangebyrank",  15, CMD_REQ_REDIS_ZREMRANGEBYRANK,  CMD_KEYSPEC_ARG2 },
+    { "zremrangebyscore", 16, CMD_REQ_REDIS_ZREMRANGEBYSCORE, CMD_KEYSPEC_ARG2 },
+    { "zrevrangebyscore", 16, CMD_REQ_REDIS_ZREVRANGEBYSCORE, CMD_KEYSPEC_ARGN },
+};
+
+/* The index in cmd_specs plus one of the command hashed to each slot */
+static const uint8_t cmd_index[CMD_TABLE_SIZE] = {
+      0,   0,   0,  89,  59,   0,   0,   6,   0,   0,  72,  62,   0,  70,   0,  94,
+      0,  34,  92,  66,   0, 103,   0,   0,   0,   3,   0,   0,  36,  97,   0,   0,
+      0,   0,   0,  41,   0,  87,  51,  78,   0,   0,   0,   0,   0,  49,  63,  47,
+      0,  18,   4,  84,   0,  13,  71,  93,   0,  30,   0,   0,  91,   0,   1,  27,
+      0,   0,  48, 106,   0,   0,  69,   0,  19,   0,  10,  55,   0, 102,   0,  40,
+     75,   0,   0,  98,   0,  35,   0,   8,   0,   0,   0, 101,   0,   0,   0,  15,
+      0,   0,   0,   9,  61,   0,   0,   0,  53,  29,   0,   0,   0,   0,   0,  22,
+     96,  42, 104,  65,   0,   0,  77,   0,  17,  74,   0,  52,   0,   0,   0,   0,
+      0,   0,   0,  58,   0,  67,   0,   0,  38, 105,   0,   0,   0,  31,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,  33,   0,  25,   0,  44,   0,   0,   0,
+      0,  45,   0,  60,   0,   0,  80,   0,   0,  26,  76,  79,  85,   0,  14,   0,
+     39,   0,  95,   0,  68,   0,   0,   2,   5,  83,  21,   0,   0,   0,  99,   0,
+      0,   0,   0,   0,  64,  82,   0,  16,   0,   0,   0,   0,   0,  86,   0,   0,
+      0,   0,  24,  90,   0,   7,   0,   0,  32, 100,  54,   0,  11,  50,  43,   0,
+      0,   0,   0,   0,   0,  12,  37,   0,  23,   0,  56,   0,   0,   0,   0,   0,
+     46,  28,   0,   0,   0,  88,   0,  73,   0,  20,   0,   0,   0,  57,   0,  81,
+};
+
+/* End of the generated command table. */
 
 /*
- * Return true, if the redis command take no key, otherwise
- * return false
+ * Return the spec of the command named by the len bytes at m, case
+ * insensitively, NULL if the command is unknown. The name is hashed by
+ * its length and a few of its characters into a perfect hash table, so
+ * at most one name is compared.
  */
-static int
-redis_argz(struct cmd *r)
+static const struct cmd_spec *
+redis_cmd_lookup(const char *m, uint32_t len)
 {
-    switch (r->type) {
-    case CMD_REQ_REDIS_PING:
-    case CMD_REQ_REDIS_QUIT:
-        return 1;
+    const struct cmd_spec *spec;
+    uint32_t h, i;
 
-    default:
-        break;
+    if (len < CMD_NAME_MINLEN || len > CMD_NAME_MAXLEN) {
+        return NULL;
     }
 
-    return 0;
+    h = len + cmd_asso[m[0] & 0x1f] + cmd_asso[m[1] & 0x1f] +
+        cmd_asso[m[2] & 0x1f] + cmd_asso[m[len - 1] & 0x1f];
+    if (len > 3) {
+        h += cmd_asso[m[3] & 0x1f];
+    }
+
+    i = cmd_index[h & (CMD_TABLE_SIZE - 1)];
+    if (i == 0) {
+        return NULL;
+    }
+
+    spec = &cmd_specs[i - 1];
+    if (spec->len != len) {
+        return NULL;
+    }
+
+    /* only letters are in the names, and (c | 0x20) is a lower case
+     * letter only for letters */
+    for (i = 0; i < len; i++) {
+        if ((m[i] | 0x20) != spec->name[i]) {
+            return NULL;
+        }
+    }
+
+    return spec;
 }
 
 /*
- * Return true, if the redis command accepts no arguments, otherwise
+ * Return the name of the idx-th command known by the parser, NULL past
+ * the last one
+ */
+const char *
+redis_cmd_name(uint32_t idx)
+{
+    if (idx >= sizeof(cmd_specs) / sizeof(cmd_specs[0])) {
+        return NULL;
+    }
+
+    return cmd_specs[idx].name;
+}
+
+
+/*
+ * Return true, if the redis command take no key, otherwise
  * return false
  */
 static int
-redis_arg0(struct cmd *r)
+redis_argz(struct cmd *r)
+{
+    return r->keyspec == CMD_KEYSPEC_NONE;
+}
+
+/*
+ * Return true, if the redis command only reads the keys and can be
+ * served by a replica, otherwise return false
+ */
+int
+redis_cmd_readonly(struct cmd *r)
 {
     switch (r->type) {
     case CMD_REQ_REDIS_EXISTS:
-    case CMD_REQ_REDIS_PERSIST:
     case CMD_REQ_REDIS_PTTL:
-    case CMD_REQ_REDIS_SORT:
     case CMD_REQ_REDIS_TTL:
     case CMD_REQ_REDIS_TYPE:
     case CMD_REQ_REDIS_DUMP:
 
-    case CMD_REQ_REDIS_DECR:
+    case CMD_REQ_REDIS_BITCOUNT:
     case CMD_REQ_REDIS_GET:
-    case CMD_REQ_REDIS_INCR:
+    case CMD_REQ_REDIS_GETBIT:
+    case CMD_REQ_REDIS_GETRANGE:
+    case CMD_REQ_REDIS_MGET:
     case CMD_REQ_REDIS_STRLEN:
 
+    case CMD_REQ_REDIS_HEXISTS:
+    case CMD_REQ_REDIS_HGET:
     case CMD_REQ_REDIS_HGETALL:
     case CMD_REQ_REDIS_HKEYS:
     case CMD_REQ_REDIS_HLEN:
+    case CMD_REQ_REDIS_HMGET:
+    case CMD_REQ_REDIS_HSCAN:
     case CMD_REQ_REDIS_HVALS:
 
+    case CMD_REQ_REDIS_LINDEX:
     case CMD_REQ_REDIS_LLEN:
-    case CMD_REQ_REDIS_LPOP:
-    case CMD_REQ_REDIS_RPOP:
+    case CMD_REQ_REDIS_LRANGE:
+
+    case CMD_REQ_REDIS_PFCOUNT:
 
     case CMD_REQ_REDIS_SCARD:
+    case CMD_REQ_REDIS_SDIFF:
+    case CMD_REQ_REDIS_SINTER:
+    case CMD_REQ_REDIS_SISMEMBER:
     case CMD_REQ_REDIS_SMEMBERS:
-    case CMD_REQ_REDIS_SPOP:
+    case CMD_REQ_REDIS_SRANDMEMBER:
+    case CMD_REQ_REDIS_SUNION:
+    case CMD_REQ_REDIS_SSCAN:
 
     case CMD_REQ_REDIS_ZCARD:
-    case CMD_REQ_REDIS_PFCOUNT:
-    case CMD_REQ_REDIS_AUTH:
+    case CMD_REQ_REDIS_ZCOUNT:
+    case CMD_REQ_REDIS_ZLEXCOUNT:
+    case CMD_REQ_REDIS_ZRANGE:
+    case CMD_REQ_REDIS_ZRANGEBYLEX:
+    case CMD_REQ_REDIS_ZRANGEBYSCORE:
+    case CMD_REQ_REDIS_ZRANK:
+    case CMD_REQ_REDIS_ZREVRANGE:
+    case CMD_REQ_REDIS_ZREVRANGEBYSCORE:
+    case CMD_REQ_REDIS_ZREVRANK:
+    case CMD_REQ_REDIS_ZSCORE:
+    case CMD_REQ_REDIS_ZSCAN:
         return 1;
 
     default:
@@ -74,6 +294,16 @@ redis_arg0(struct cmd *r)
     return 0;
 }
 
+/*
+ * Return true, if the redis command accepts no arguments, otherwise
+ * return false
+ */
+static int
+redis_arg0(struct cmd *r)
+{
+    return r->keyspec == CMD_KEYSPEC_ARG0;
+}
+
 /*
  * Return true, if the redis command accepts exactly 1 argument, otherwise
  * return false
@@ -81,40 +311,7 @@ redis_arg0(struct cmd *r)
 static int
 redis_arg1(struct cmd *r)
 {
-    switch (r->type) {
-    case CMD_REQ_REDIS_EXPIRE:
-    case CMD_REQ_REDIS_EXPIREAT:
-    case CMD_REQ_REDIS_PEXPIRE:
-    case CMD_REQ_REDIS_PEXPIREAT:
-
-    case CMD_REQ_REDIS_APPEND:
-    case CMD_REQ_REDIS_DECRBY:
-    case CMD_REQ_REDIS_GETBIT:
-    case CMD_REQ_REDIS_GETSET:
-    case CMD_REQ_REDIS_INCRBY:
-    case CMD_REQ_REDIS_INCRBYFLOAT:
-    case CMD_REQ_REDIS_SETNX:
-
-    case CMD_REQ_REDIS_HEXISTS:
-    case CMD_REQ_REDIS_HGET:
-
-    case CMD_REQ_REDIS_LINDEX:
-    case CMD_REQ_REDIS_LPUSHX:
-    case CMD_REQ_REDIS_RPOPLPUSH:
-    case CMD_REQ_REDIS_RPUSHX:
-
-    case CMD_REQ_REDIS_SISMEMBER:
-
-    case CMD_REQ_REDIS_ZRANK:
-    case CMD_REQ_REDIS_ZREVRANK:
-    case CMD_REQ_REDIS_ZSCORE:
-        return 1;
-
-    default:
-        break;
-    }
-
-    return 0;
+    return r->keyspec == CMD_KEYSPEC_ARG1;
 }
 
 /*
@@ -124,40 +321,7 @@ redis_arg1(struct cmd *r)
 static int
 redis_arg2(struct cmd *r)
 {
-    switch (r->type) {
-    case CMD_REQ_REDIS_GETRANGE:
-    case CMD_REQ_REDIS_PSETEX:
-    case CMD_REQ_REDIS_SETBIT:
-    case CMD_REQ_REDIS_SETEX:
-    case CMD_REQ_REDIS_SETRANGE:
-
-    case CMD_REQ_REDIS_HINCRBY:
-    case CMD_REQ_REDIS_HINCRBYFLOAT:
-    case CMD_REQ_REDIS_HSET:
-    case CMD_REQ_REDIS_HSETNX:
-
-    case CMD_REQ_REDIS_LRANGE:
-    case CMD_REQ_REDIS_LREM:
-    case CMD_REQ_REDIS_LSET:
-    case CMD_REQ_REDIS_LTRIM:
-
-    case CMD_REQ_REDIS_SMOVE:
-
-    case CMD_REQ_REDIS_ZCOUNT:
-    case CMD_REQ_REDIS_ZLEXCOUNT:
-    case CMD_REQ_REDIS_ZINCRBY:
-    case CMD_REQ_REDIS_ZREMRANGEBYLEX:
-    case CMD_REQ_REDIS_ZREMRANGEBYRANK:
-    case CMD_REQ_REDIS_ZREMRANGEBYSCORE:
-
-    case CMD_REQ_REDIS_RESTORE:
-        return 1;
-
-    default:
-        break;
-    }
-
-    return 0;
+    return r->keyspec == CMD_KEYSPEC_ARG2;
 }
 
 /*
@@ -167,15 +331,7 @@ redis_arg2(struct cmd *r)
 static int
 redis_arg3(struct cmd *r)
 {
-    switch (r->type) {
-    case CMD_REQ_REDIS_LINSERT:
-        return 1;
-
-    default:
-        break;
-    }
-
-    return 0;
+    return r->keyspec == CMD_KEYSPEC_ARG3;
 }
 
 /*
@@ -185,49 +341,134 @@ redis_arg3(struct cmd *r)
 static int
 redis_argn(struct cmd *r)
 {
-    switch (r->type) {
-    case CMD_REQ_REDIS_BITCOUNT:
+    return r->keyspec == CMD_KEYSPEC_ARGN;
+}
 
-    case CMD_REQ_REDIS_SET:
-    case CMD_REQ_REDIS_HDEL:
-    case CMD_REQ_REDIS_HMGET:
-    case CMD_REQ_REDIS_HMSET:
-    case CMD_REQ_REDIS_HSCAN:
+/*
+ * The multi-key commands split by slot in cluster mode, the ones
+ * registered by the application are looked up before them
+ */
+static const struct cmd_reducer cmd_reducers[] = {
+    { "del",    CMD_REQ_REDIS_DEL,    CMD_SPLIT_KEYS,       CMD_MERGE_SUM },
+    { "exists", CMD_REQ_REDIS_EXISTS, CMD_SPLIT_KEYS,       CMD_MERGE_SUM },
+    { "touch",  CMD_REQ_REDIS_TOUCH,  CMD_SPLIT_KEYS,       CMD_MERGE_SUM },
+    { "unlink", CMD_REQ_REDIS_UNLINK, CMD_SPLIT_KEYS,       CMD_MERGE_SUM },
+    { "mget",   CMD_REQ_REDIS_MGET,   CMD_SPLIT_KEYS,       CMD_MERGE_CONCAT },
+    { "mset",   CMD_REQ_REDIS_MSET,   CMD_SPLIT_KEY_VALUES, CMD_MERGE_ALL_OK },
+};
+
+static struct cmd_reducer *custom_reducers = NULL;
+static uint32_t ncustom_reducers = 0;
 
-    case CMD_REQ_REDIS_LPUSH:
-    case CMD_REQ_REDIS_RPUSH:
+static int
+redis_cmd_name_equal(const char *name, const char *m, uint32_t len)
+{
+    uint32_t i;
 
-    case CMD_REQ_REDIS_SADD:
-    case CMD_REQ_REDIS_SDIFF:
-    case CMD_REQ_REDIS_SDIFFSTORE:
-    case CMD_REQ_REDIS_SINTER:
-    case CMD_REQ_REDIS_SINTERSTORE:
-    case CMD_REQ_REDIS_SREM:
-    case CMD_REQ_REDIS_SUNION:
-    case CMD_REQ_REDIS_SUNIONSTORE:
-    case CMD_REQ_REDIS_SRANDMEMBER:
-    case CMD_REQ_REDIS_SSCAN:
+    for (i = 0; i < len; i++) {
+        if (name[i] == '\0' || name[i] != tolower((unsigned char)m[i])) {
+            return 0;
+        }
+    }
 
-    case CMD_REQ_REDIS_PFADD:
-    case CMD_REQ_REDIS_PFMERGE:
+    return name[len] == '\0';
+}
 
-    case CMD_REQ_REDIS_ZADD:
-    case CMD_REQ_REDIS_ZINTERSTORE:
-    case CMD_REQ_REDIS_ZRANGE:
-    case CMD_REQ_REDIS_ZRANGEBYSCORE:
-    case CMD_REQ_REDIS_ZREM:
-    case CMD_REQ_REDIS_ZREVRANGE:
-    case CMD_REQ_REDIS_ZRANGEBYLEX:
-    case CMD_REQ_REDIS_ZREVRANGEBYSCORE:
-    case CMD_REQ_REDIS_ZUNIONSTORE:
-    case CMD_REQ_REDIS_ZSCAN:
-        return 1;
+/*
+ * Register how the command named name is split and merged, replacing
+ * the former registration of it. A known command is only accepted if
+ * it is already split the same way, the arguments of the others are
+ * not all keys. Not thread safe, it is meant to be called before any
+ * command is sent.
+ */
+int
+command_reducer_register(const char *name, cmd_split_t split, cmd_merge_t merge)
+{
+    const struct cmd_spec *spec;
+    struct cmd_reducer *reducer;
+    char *lname;
+    uint32_t i, len;
 
-    default:
-        break;
+    if (name == NULL || (len = (uint32_t)strlen(name)) == 0) {
+        return REDIS_ERR;
     }
 
-    return 0;
+    spec = redis_cmd_lookup(name, len);
+    if (spec != NULL) {
+        if (spec->keyspec != CMD_KEYSPEC_MULTI) {
+            return REDIS_ERR;
+        }
+
+        for (i = 0; i < sizeof(cmd_reducers) / sizeof(cmd_reducers[0]); i++) {
+            if (cmd_reducers[i].type == spec->type &&
+                cmd_reducers[i].split != split) {
+                return REDIS_ERR;
+            }
+        }
+    }
+
+    for (i = 0; i < ncustom_reducers; i++) {
+        if (redis_cmd_name_equal(custom_reducers[i].name, name, len)) {
+            custom_reducers[i].split = split;
+            custom_reducers[i].merge = merge;
+            return REDIS_OK;
+        }
+    }
+
+    reducer = hi_realloc(custom_reducers,
+        (ncustom_reducers + 1) * sizeof(*custom_reducers));
+    if (reducer == NULL) {
+        return REDIS_ERR;
+    }
+    custom_reducers = reducer;
+
+    lname = hi_alloc(len + 1);
+    if (lname == NULL) {
+        return REDIS_ERR;
+    }
+
+    for (i = 0; i < len; i++) {
+        lname[i] = (char)tolower((unsigned char)name[i]);
+    }
+    lname[len] = '\0';
+
+    reducer = &custom_reducers[ncustom_reducers];
+    reducer->name = lname;
+    reducer->type = CMD_REQ_REDIS_CUSTOM;
+    reducer->split = split;
+    reducer->merge = merge;
+
+    ncustom_reducers++;
+
+    return REDIS_OK;
+}
+
+/*
+ * Return the reducer of the command of the given type named by m,
+ * NULL if the command can not be split by slot
+ */
+static const struct cmd_reducer *
+redis_cmd_reducer(cmd_type_t type, const char *m, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < ncustom_reducers; i++) {
+        if (redis_cmd_name_equal(custom_reducers[i].name, m, len)) {
+            return &custom_reducers[i];
+        }
+    }
+
+    if (type == CMD_UNKNOWN) {
+        return NULL;
+    }
+
+    for (i = 0; i < sizeof(cmd_reducers) / sizeof(cmd_reducers[0]); i++) {
+        if (cmd_reducers[i].type == type) {
+            return &cmd_reducers[i];
+        }
+    }
+
+    return NULL;
 }
 
 /*
@@ -237,16 +478,7 @@ redis_argn(struct cmd *r)
 static int
 redis_argx(struct cmd *r)
 {
-    switch (r->type) {
-    case CMD_REQ_REDIS_MGET:
-    case CMD_REQ_REDIS_DEL:
-        return 1;
-
-    default:
-        break;
-    }
-
-    return 0;
+    return r->reducer != NULL && r->reducer->split == CMD_SPLIT_KEYS;
 }
 
 /*
@@ -256,15 +488,7 @@ redis_argx(struct cmd *r)
 static int
 redis_argkvx(struct cmd *r)
 {
-    switch (r->type) {
-    case CMD_REQ_REDIS_MSET:
-        return 1;
-
-    default:
-        break;
-    }
-
-    return 0;
+    return r->reducer != NULL && r->reducer->split == CMD_SPLIT_KEY_VALUES;
 }
 
 /*
@@ -276,16 +500,7 @@ redis_argkvx(struct cmd *r)
 static int
 redis_argeval(struct cmd *r)
 {
-    switch (r->type) {
-    case CMD_REQ_REDIS_EVAL:
-    case CMD_REQ_REDIS_EVALSHA:
-        return 1;
-
-    default:
-        break;
-    }
-
-    return 0;
+    return r->keyspec == CMD_KEYSPEC_EVAL;
 }
 
 /*
@@ -317,6 +532,7 @@ redis_parse_cmd(struct cmd *r)
 {
     int len;
     char *p, *m, *token = NULL;
+    const struct cmd_spec *spec;
     char *cmd_end;
     char ch;
     uint32_t rlen = 0;  /* running length in parsing fsa */
@@ -375,661 +591,104 @@ redis_parse_cmd(struct cmd *r)
                 rnarg = 0;
                 state = SW_NARG;
             } else if (isdigit(ch)) {
-                rnarg = rnarg * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if (rnarg == 0) {
-                    goto error;
-                }
-                r->narg = rnarg;
-                r->narg_end = p;
-                token = NULL;
-                state = SW_NARG_LF;
-            } else {
-                goto error;
-            }
-
-            break;
-
-        case SW_NARG_LF:
-            switch (ch) {
-            case LF:
-                state = SW_REQ_TYPE_LEN;
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_REQ_TYPE_LEN:
-            if (token == NULL) {
-                if (ch != '$') {
-                    goto error;
-                }
-                token = p;
-                rlen = 0;
-            } else if (isdigit(ch)) {
-                rlen = rlen * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if (rlen == 0 || rnarg == 0) {
-                    goto error;
-                }
-                rnarg--;
-                token = NULL;
-                state = SW_REQ_TYPE_LEN_LF;
-            } else {
-                goto error;
-            }
-
-            break;
-
-        case SW_REQ_TYPE_LEN_LF:
-            switch (ch) {
-            case LF:
-                state = SW_REQ_TYPE;
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_REQ_TYPE:
-            if (token == NULL) {
-                token = p;
-            }
-
-            m = token + rlen;
-            if (m >= cmd_end) {
-                //m = cmd_end - 1;
-                //p = m;
-                //break;
-                goto error;
-            }
-
-            if (*m != CR) {
-                goto error;
-            }
-
-            p = m; /* move forward by rlen bytes */
-            rlen = 0;
-            m = token;
-            token = NULL;
-            r->type = CMD_UNKNOWN;
-
-            switch (p - m) {
-
-            case 3:
-                if (str3icmp(m, 'g', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_GET;
-                    break;
-                }
-
-                if (str3icmp(m, 's', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_SET;
-                    break;
-                }
-
-                if (str3icmp(m, 't', 't', 'l')) {
-                    r->type = CMD_REQ_REDIS_TTL;
-                    break;
-                }
-
-                if (str3icmp(m, 'd', 'e', 'l')) {
-                    r->type = CMD_REQ_REDIS_DEL;
-                    break;
-                }
-
-                break;
-
-            case 4:
-                if (str4icmp(m, 'p', 't', 't', 'l')) {
-                    r->type = CMD_REQ_REDIS_PTTL;
-                    break;
-                }
-
-                if (str4icmp(m, 'd', 'e', 'c', 'r')) {
-                    r->type = CMD_REQ_REDIS_DECR;
-                    break;
-                }
-
-                if (str4icmp(m, 'd', 'u', 'm', 'p')) {
-                    r->type = CMD_REQ_REDIS_DUMP;
-                    break;
-                }
-
-                if (str4icmp(m, 'h', 'd', 'e', 'l')) {
-                    r->type = CMD_REQ_REDIS_HDEL;
-                    break;
-                }
-
-                if (str4icmp(m, 'h', 'g', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_HGET;
-                    break;
-                }
-
-                if (str4icmp(m, 'h', 'l', 'e', 'n')) {
-                    r->type = CMD_REQ_REDIS_HLEN;
-                    break;
-                }
-
-                if (str4icmp(m, 'h', 's', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_HSET;
-                    break;
-                }
-
-                if (str4icmp(m, 'i', 'n', 'c', 'r')) {
-                    r->type = CMD_REQ_REDIS_INCR;
-                    break;
-                }
-
-                if (str4icmp(m, 'l', 'l', 'e', 'n')) {
-                    r->type = CMD_REQ_REDIS_LLEN;
-                    break;
-                }
-
-                if (str4icmp(m, 'l', 'p', 'o', 'p')) {
-                    r->type = CMD_REQ_REDIS_LPOP;
-                    break;
-                }
-
-                if (str4icmp(m, 'l', 'r', 'e', 'm')) {
-                    r->type = CMD_REQ_REDIS_LREM;
-                    break;
-                }
-
-                if (str4icmp(m, 'l', 's', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_LSET;
-                    break;
-                }
-
-                if (str4icmp(m, 'r', 'p', 'o', 'p')) {
-                    r->type = CMD_REQ_REDIS_RPOP;
-                    break;
-                }
-
-                if (str4icmp(m, 's', 'a', 'd', 'd')) {
-                    r->type = CMD_REQ_REDIS_SADD;
-                    break;
-                }
-
-                if (str4icmp(m, 's', 'p', 'o', 'p')) {
-                    r->type = CMD_REQ_REDIS_SPOP;
-                    break;
-                }
-
-                if (str4icmp(m, 's', 'r', 'e', 'm')) {
-                    r->type = CMD_REQ_REDIS_SREM;
-                    break;
-                }
-
-                if (str4icmp(m, 't', 'y', 'p', 'e')) {
-                    r->type = CMD_REQ_REDIS_TYPE;
-                    break;
-                }
-
-                if (str4icmp(m, 'm', 'g', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_MGET;
-                    break;
-                }
-                if (str4icmp(m, 'm', 's', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_MSET;
-                    break;
-                }
-
-                if (str4icmp(m, 'z', 'a', 'd', 'd')) {
-                    r->type = CMD_REQ_REDIS_ZADD;
-                    break;
-                }
-
-                if (str4icmp(m, 'z', 'r', 'e', 'm')) {
-                    r->type = CMD_REQ_REDIS_ZREM;
-                    break;
-                }
-
-                if (str4icmp(m, 'e', 'v', 'a', 'l')) {
-                    r->type = CMD_REQ_REDIS_EVAL;
-                    break;
-                }
-
-                if (str4icmp(m, 's', 'o', 'r', 't')) {
-                    r->type = CMD_REQ_REDIS_SORT;
-                    break;
-                }
-
-                if (str4icmp(m, 'p', 'i', 'n', 'g')) {
-                    r->type = CMD_REQ_REDIS_PING;
-                    r->noforward = 1;
-                    break;
-                }
-
-                if (str4icmp(m, 'q', 'u', 'i', 't')) {
-                    r->type = CMD_REQ_REDIS_QUIT;
-                    r->quit = 1;
-                    break;
-                }
-
-                if (str4icmp(m, 'a', 'u', 't', 'h')) {
-                    r->type = CMD_REQ_REDIS_AUTH;
-                    r->noforward = 1;
-                    break;
-                }
-
-                break;
-
-            case 5:
-                if (str5icmp(m, 'h', 'k', 'e', 'y', 's')) {
-                    r->type = CMD_REQ_REDIS_HKEYS;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 'm', 'g', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_HMGET;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 'm', 's', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_HMSET;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 'v', 'a', 'l', 's')) {
-                    r->type = CMD_REQ_REDIS_HVALS;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 's', 'c', 'a', 'n')) {
-                    r->type = CMD_REQ_REDIS_HSCAN;
-                    break;
-                }
-
-                if (str5icmp(m, 'l', 'p', 'u', 's', 'h')) {
-                    r->type = CMD_REQ_REDIS_LPUSH;
-                    break;
-                }
-
-                if (str5icmp(m, 'l', 't', 'r', 'i', 'm')) {
-                    r->type = CMD_REQ_REDIS_LTRIM;
-                    break;
-                }
-
-                if (str5icmp(m, 'r', 'p', 'u', 's', 'h')) {
-                    r->type = CMD_REQ_REDIS_RPUSH;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'c', 'a', 'r', 'd')) {
-                    r->type = CMD_REQ_REDIS_SCARD;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'd', 'i', 'f', 'f')) {
-                    r->type = CMD_REQ_REDIS_SDIFF;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'e', 't', 'e', 'x')) {
-                    r->type = CMD_REQ_REDIS_SETEX;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'e', 't', 'n', 'x')) {
-                    r->type = CMD_REQ_REDIS_SETNX;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'm', 'o', 'v', 'e')) {
-                    r->type = CMD_REQ_REDIS_SMOVE;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 's', 'c', 'a', 'n')) {
-                    r->type = CMD_REQ_REDIS_SSCAN;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 'c', 'a', 'r', 'd')) {
-                    r->type = CMD_REQ_REDIS_ZCARD;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 'r', 'a', 'n', 'k')) {
-                    r->type = CMD_REQ_REDIS_ZRANK;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 's', 'c', 'a', 'n')) {
-                    r->type = CMD_REQ_REDIS_ZSCAN;
-                    break;
-                }
-
-                if (str5icmp(m, 'p', 'f', 'a', 'd', 'd')) {
-                    r->type = CMD_REQ_REDIS_PFADD;
-                    break;
-                }
-
-                break;
-
-            case 6:
-                if (str6icmp(m, 'a', 'p', 'p', 'e', 'n', 'd')) {
-                    r->type = CMD_REQ_REDIS_APPEND;
-                    break;
-                }
-
-                if (str6icmp(m, 'd', 'e', 'c', 'r', 'b', 'y')) {
-                    r->type = CMD_REQ_REDIS_DECRBY;
-                    break;
-                }
-
-                if (str6icmp(m, 'e', 'x', 'i', 's', 't', 's')) {
-                    r->type = CMD_REQ_REDIS_EXISTS;
-                    break;
-                }
-
-                if (str6icmp(m, 'e', 'x', 'p', 'i', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_EXPIRE;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 't', 'b', 'i', 't')) {
-                    r->type = CMD_REQ_REDIS_GETBIT;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 't', 's', 'e', 't')) {
-                    r->type = CMD_REQ_REDIS_GETSET;
-                    break;
-                }
-
-                if (str6icmp(m, 'p', 's', 'e', 't', 'e', 'x')) {
-                    r->type = CMD_REQ_REDIS_PSETEX;
-                    break;
-                }
-
-                if (str6icmp(m, 'h', 's', 'e', 't', 'n', 'x')) {
-                    r->type = CMD_REQ_REDIS_HSETNX;
-                    break;
-                }
-
-                if (str6icmp(m, 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = CMD_REQ_REDIS_INCRBY;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'i', 'n', 'd', 'e', 'x')) {
-                    r->type = CMD_REQ_REDIS_LINDEX;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'p', 'u', 's', 'h', 'x')) {
-                    r->type = CMD_REQ_REDIS_LPUSHX;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = CMD_REQ_REDIS_LRANGE;
-                    break;
-                }
-
-                if (str6icmp(m, 'r', 'p', 'u', 's', 'h', 'x')) {
-                    r->type = CMD_REQ_REDIS_RPUSHX;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'e', 't', 'b', 'i', 't')) {
-                    r->type = CMD_REQ_REDIS_SETBIT;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'i', 'n', 't', 'e', 'r')) {
-                    r->type = CMD_REQ_REDIS_SINTER;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 't', 'r', 'l', 'e', 'n')) {
-                    r->type = CMD_REQ_REDIS_STRLEN;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'u', 'n', 'i', 'o', 'n')) {
-                    r->type = CMD_REQ_REDIS_SUNION;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = CMD_REQ_REDIS_ZCOUNT;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = CMD_REQ_REDIS_ZRANGE;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_ZSCORE;
-                    break;
-                }
-
-                break;
-
-            case 7:
-                if (str7icmp(m, 'p', 'e', 'r', 's', 'i', 's', 't')) {
-                    r->type = CMD_REQ_REDIS_PERSIST;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_PEXPIRE;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'e', 'x', 'i', 's', 't', 's')) {
-                    r->type = CMD_REQ_REDIS_HEXISTS;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'g', 'e', 't', 'a', 'l', 'l')) {
-                    r->type = CMD_REQ_REDIS_HGETALL;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = CMD_REQ_REDIS_HINCRBY;
-                    break;
-                }
-
-                if (str7icmp(m, 'l', 'i', 'n', 's', 'e', 'r', 't')) {
-                    r->type = CMD_REQ_REDIS_LINSERT;
-                    break;
-                }
-
-                if (str7icmp(m, 'z', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = CMD_REQ_REDIS_ZINCRBY;
-                    break;
-                }
-
-                if (str7icmp(m, 'e', 'v', 'a', 'l', 's', 'h', 'a')) {
-                    r->type = CMD_REQ_REDIS_EVALSHA;
-                    break;
-                }
-
-                if (str7icmp(m, 'r', 'e', 's', 't', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_RESTORE;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'f', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = CMD_REQ_REDIS_PFCOUNT;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'f', 'm', 'e', 'r', 'g', 'e')) {
-                    r->type = CMD_REQ_REDIS_PFMERGE;
-                    break;
-                }
-
-                break;
-
-            case 8:
-                if (str8icmp(m, 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                    r->type = CMD_REQ_REDIS_EXPIREAT;
-                    break;
-                }
-
-                if (str8icmp(m, 'b', 'i', 't', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = CMD_REQ_REDIS_BITCOUNT;
-                    break;
-                }
-
-                if (str8icmp(m, 'g', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = CMD_REQ_REDIS_GETRANGE;
-                    break;
-                }
-
-                if (str8icmp(m, 's', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = CMD_REQ_REDIS_SETRANGE;
-                    break;
-                }
-
-                if (str8icmp(m, 's', 'm', 'e', 'm', 'b', 'e', 'r', 's')) {
-                    r->type = CMD_REQ_REDIS_SMEMBERS;
-                    break;
-                }
-
-                if (str8icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'k')) {
-                    r->type = CMD_REQ_REDIS_ZREVRANK;
-                    break;
-                }
-
-                break;
-
-            case 9:
-                if (str9icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                    r->type = CMD_REQ_REDIS_PEXPIREAT;
-                    break;
-                }
-
-                if (str9icmp(m, 'r', 'p', 'o', 'p', 'l', 'p', 'u', 's', 'h')) {
-                    r->type = CMD_REQ_REDIS_RPOPLPUSH;
-                    break;
-                }
-
-                if (str9icmp(m, 's', 'i', 's', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = CMD_REQ_REDIS_SISMEMBER;
-                    break;
-                }
-
-                if (str9icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = CMD_REQ_REDIS_ZREVRANGE;
-                    break;
-                }
-
-                if (str9icmp(m, 'z', 'l', 'e', 'x', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = CMD_REQ_REDIS_ZLEXCOUNT;
-                    break;
-                }
-
-                break;
-
-            case 10:
-                if (str10icmp(m, 's', 'd', 'i', 'f', 'f', 's', 't', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_SDIFFSTORE;
-                    break;
-                }
-
-            case 11:
-                if (str11icmp(m, 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                    r->type = CMD_REQ_REDIS_INCRBYFLOAT;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_SINTERSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'r', 'a', 'n', 'd', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = CMD_REQ_REDIS_SRANDMEMBER;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_SUNIONSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_ZINTERSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_ZUNIONSTORE;
-                    break;
+                rnarg = rnarg * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if (rnarg == 0) {
+                    goto error;
                 }
+                r->narg = rnarg;
+                r->narg_end = p;
+                token = NULL;
+                state = SW_NARG_LF;
+            } else {
+                goto error;
+            }
 
-                if (str11icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                    r->type = CMD_REQ_REDIS_ZRANGEBYLEX;
-                    break;
-                }
+            break;
 
+        case SW_NARG_LF:
+            switch (ch) {
+            case LF:
+                state = SW_REQ_TYPE_LEN;
                 break;
 
-            case 12:
-                if (str12icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                    r->type = CMD_REQ_REDIS_HINCRBYFLOAT;
-                    break;
-                }
-
+            default:
+                goto error;
+            }
 
-                break;
+            break;
 
-            case 13:
-                if (str13icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_ZRANGEBYSCORE;
-                    break;
+        case SW_REQ_TYPE_LEN:
+            if (token == NULL) {
+                if (ch != '$') {
+                    goto error;
                 }
-
-                break;
-
-            case 14:
-                if (str14icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                    r->type = CMD_REQ_REDIS_ZREMRANGEBYLEX;
-                    break;
+                token = p;
+                rlen = 0;
+            } else if (isdigit(ch)) {
+                rlen = rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if (rlen == 0 || rnarg == 0) {
+                    goto error;
                 }
+                rnarg--;
+                token = NULL;
+                state = SW_REQ_TYPE_LEN_LF;
+            } else {
+                goto error;
+            }
 
+            break;
+
+        case SW_REQ_TYPE_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_REQ_TYPE;
                 break;
 
-            case 15:
-                if (str15icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'r', 'a', 'n', 'k')) {
-                    r->type = CMD_REQ_REDIS_ZREMRANGEBYRANK;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                break;
+            break;
 
-            case 16:
-                if (str16icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_ZREMRANGEBYSCORE;
-                    break;
-                }
+        case SW_REQ_TYPE:
+            if (token == NULL) {
+                token = p;
+            }
 
-                if (str16icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = CMD_REQ_REDIS_ZREVRANGEBYSCORE;
-                    break;
-                }
+            m = token + rlen;
+            if (m >= cmd_end) {
+                //m = cmd_end - 1;
+                //p = m;
+                //break;
+                goto error;
+            }
 
-                break;
+            if (*m != CR) {
+                goto error;
+            }
 
-            default:
-                break;
+            p = m; /* move forward by rlen bytes */
+            rlen = 0;
+            m = token;
+            token = NULL;
+            r->type = CMD_UNKNOWN;
+            r->keyspec = CMD_KEYSPEC_NONE;
+
+            spec = redis_cmd_lookup(m, (uint32_t)(p - m));
+            if (spec != NULL) {
+                r->type = spec->type;
+                r->keyspec = spec->keyspec;
             }
 
+            r->reducer = redis_cmd_reducer(r->type, m, (uint32_t)(p - m));
             if (r->type == CMD_UNKNOWN) {
-                goto error;
+                if (r->reducer == NULL) {
+                    goto error;
+                }
+                r->type = CMD_REQ_REDIS_CUSTOM;
+                r->keyspec = CMD_KEYSPEC_MULTI;
             }
 
             state = SW_REQ_TYPE_LF;
@@ -1127,7 +786,20 @@ redis_parse_cmd(struct cmd *r)
         case SW_KEY_LF:
             switch (ch) {
             case LF:
-                if (redis_arg0(r)) {
+                if (redis_argx(r)) {
+                    if (rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_KEY_LEN;
+                } else if (redis_argkvx(r)) {
+                    if (rnarg == 0) {
+                        goto done;
+                    }
+                    if (r->narg % 2 == 0) {
+                        goto error;
+                    }
+                    state = SW_ARG1_LEN;
+                } else if (redis_arg0(r)) {
                     if (rnarg != 0) {
                         goto error;
                     }
@@ -1152,19 +824,6 @@ redis_parse_cmd(struct cmd *r)
                         goto done;
                     }
                     state = SW_ARG1_LEN;
-                } else if (redis_argx(r)) {
-                    if (rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_KEY_LEN;
-                } else if (redis_argkvx(r)) {
-                    if (rnarg == 0) {
-                        goto done;
-                    }
-                    if (r->narg % 2 == 0) {
-                        goto error;
-                    }
-                    state = SW_ARG1_LEN;
                 } else if (redis_argeval(r)) {
                     if (rnarg == 0) {
                         goto done;
@@ -1620,6 +1279,398 @@ error:
     r->errstr[len] = '\0';
 }
 
+static void
+redis_cmd_set_error(struct cmd *r, const char *reason, uint32_t arg)
+{
+    int len;
+
+    r->result = CMD_PARSE_ERROR;
+    errno = EINVAL;
+    if(r->errstr == NULL){
+        r->errstr = hi_alloc(100*sizeof(*r->errstr));
+        if(r->errstr == NULL){
+            r->result = CMD_PARSE_ENOMEM;
+            return;
+        }
+    }
+
+    len = _scnprintf(r->errstr, 100, "Parse command error. %s, argument: %u.",
+        reason, arg);
+    r->errstr[len] = '\0';
+}
+
+/*
+ * Split the command into its arguments, the command name included, as
+ * keypos in args. It is the parsing of the commands redis_parse_cmd
+ * does not know, their keys are found by redis_parse_cmd_by_info.
+ */
+void
+redis_parse_args(struct cmd *r, struct hiarray *args)
+{
+    struct keypos *arg;
+    char *p, *end;
+    uint32_t i;
+    size_t len;
+
+    ASSERT(r->cmd != NULL && r->clen > 0);
+
+    p = r->cmd;
+    end = r->cmd + r->clen;
+
+    if (*p != '*') {
+        redis_cmd_set_error(r, "Not a multi bulk", 0);
+        return;
+    }
+
+    /* a count or a length larger than the rest of the command can not
+     * be right, and the check keeps them from overflowing */
+    r->narg_start = p;
+    for (p++, r->narg = 0; p < end && isdigit(*p); p++) {
+        r->narg = r->narg * 10 + (uint32_t)(*p - '0');
+        if (r->narg > (size_t)(end - p)) {
+            redis_cmd_set_error(r, "Bad argument count", 0);
+            return;
+        }
+    }
+    r->narg_end = p;
+
+    if (r->narg == 0 || (size_t)(end - p) < CRLF_LEN || p[0] != CR || p[1] != LF) {
+        redis_cmd_set_error(r, "Bad argument count", 0);
+        return;
+    }
+    p += CRLF_LEN;
+
+    for (i = 0; i < r->narg; i++) {
+        if (p >= end || *p != '$') {
+            redis_cmd_set_error(r, "Bad bulk length", i);
+            return;
+        }
+
+        for (p++, len = 0; p < end && isdigit(*p); p++) {
+            len = len * 10 + (size_t)(*p - '0');
+            if (len > (size_t)(end - p)) {
+                redis_cmd_set_error(r, "Bad bulk length", i);
+                return;
+            }
+        }
+
+        if ((size_t)(end - p) < CRLF_LEN || p[0] != CR || p[1] != LF ||
+            (size_t)(end - p - CRLF_LEN) < len + CRLF_LEN) {
+            redis_cmd_set_error(r, "Bad bulk length", i);
+            return;
+        }
+        p += CRLF_LEN;
+
+        arg = hiarray_push(args);
+        if (arg == NULL) {
+            r->result = CMD_PARSE_ENOMEM;
+            return;
+        }
+        arg->start = p;
+        arg->end = p + len;
+        arg->remain_len = 0;
+
+        p += len;
+        if (p[0] != CR || p[1] != LF) {
+            redis_cmd_set_error(r, "Bad bulk", i);
+            return;
+        }
+        p += CRLF_LEN;
+    }
+
+    if (p != end) {
+        redis_cmd_set_error(r, "Trailing bytes", r->narg);
+        return;
+    }
+
+    r->result = CMD_PARSE_OK;
+}
+
+/*
+ * Return the first argument of the keys of the key spec, 0 if the
+ * keys it describes are not in the arguments, like a keyword that is
+ * not given
+ */
+static uint32_t
+redis_key_spec_begin(const struct cmd_key_spec *spec,
+    const struct keypos *args, uint32_t nargs)
+{
+    uint32_t i, len;
+
+    if (spec->begin == CMD_KEY_BEGIN_INDEX) {
+        return spec->index > 0 ? (uint32_t)spec->index : 0;
+    }
+
+    len = (uint32_t)strlen(spec->keyword);
+
+    if (spec->startfrom >= 0) {
+        for (i = (uint32_t)spec->startfrom; i < nargs; i++) {
+            if (i > 0 && (uint32_t)(args[i].end - args[i].start) == len &&
+                strncasecmp(args[i].start, spec->keyword, len) == 0) {
+                return i + 1;
+            }
+        }
+    } else if ((uint32_t)-spec->startfrom <= nargs) {
+        for (i = nargs - (uint32_t)-spec->startfrom; i > 0; i--) {
+            if ((uint32_t)(args[i].end - args[i].start) == len &&
+                strncasecmp(args[i].start, spec->keyword, len) == 0) {
+                return i + 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Find the keys of the command with the arguments args by the arity and
+ * the key specs of info, as the server does, and push them to r->keys
+ */
+void
+redis_parse_cmd_by_info(struct cmd *r, const struct keypos *args,
+    uint32_t nargs, const struct cmd_info *info)
+{
+    const struct cmd_key_spec *spec;
+    const struct keypos *arg;
+    struct keypos *kpos;
+    uint32_t i, first, last, step, numkeys;
+    const char *p;
+    int64_t n;
+
+    if ((info->arity > 0 && nargs != (uint32_t)info->arity) ||
+        (info->arity < 0 && nargs < (uint32_t)-info->arity)) {
+        redis_cmd_set_error(r, "Wrong number of arguments", nargs);
+        return;
+    }
+
+    for (i = 0; i < info->nkey_specs; i++) {
+        spec = &info->key_specs[i];
+
+        first = redis_key_spec_begin(spec, args, nargs);
+        if (first == 0 || first >= nargs) {
+            continue;
+        }
+
+        if (spec->keystep <= 0) {
+            redis_cmd_set_error(r, "Bad key step", first);
+            return;
+        }
+        step = (uint32_t)spec->keystep;
+
+        if (spec->find == CMD_KEY_FIND_RANGE) {
+            if (spec->lastkey >= 0) {
+                n = (int64_t)first + spec->lastkey;
+            } else if (spec->limit <= 1) {
+                n = (int64_t)nargs + spec->lastkey;
+            } else {
+                n = (int64_t)first + (nargs - first) / (uint32_t)spec->limit +
+                    spec->lastkey;
+            }
+        } else {
+            if (spec->keynumidx < 0 ||
+                first + (uint32_t)spec->keynumidx >= nargs) {
+                redis_cmd_set_error(r, "No key count", first);
+                return;
+            }
+
+            arg = &args[first + (uint32_t)spec->keynumidx];
+            numkeys = 0;
+            for (p = arg->start; p < arg->end; p++) {
+                if (!isdigit(*p) || numkeys > nargs) {
+                    redis_cmd_set_error(r, "Bad key count",
+                        first + (uint32_t)spec->keynumidx);
+                    return;
+                }
+                numkeys = numkeys * 10 + (uint32_t)(*p - '0');
+            }
+
+            if (numkeys == 0) {
+                continue;
+            }
+
+            first += (uint32_t)spec->firstkey;
+            n = (int64_t)first + (int64_t)(numkeys - 1) * step;
+        }
+
+        if (n < (int64_t)first) {
+            continue;
+        }
+
+        if (n >= (int64_t)nargs) {
+            redis_cmd_set_error(r, "Keys out of the arguments", nargs);
+            return;
+        }
+        last = (uint32_t)n;
+
+        for (; first <= last; first += step) {
+            kpos = hiarray_push(r->keys);
+            if (kpos == NULL) {
+                r->result = CMD_PARSE_ENOMEM;
+                return;
+            }
+            kpos->start = args[first].start;
+            kpos->end = args[first].end;
+            kpos->remain_len = 0;
+        }
+    }
+
+    r->result = CMD_PARSE_OK;
+}
+
+/* The keys of the commands redis_parse_cmd knows, by their key spec. */
+static struct cmd_key_spec redis_key_first = {
+    CMD_KEY_BEGIN_INDEX, 1, NULL, 0, CMD_KEY_FIND_RANGE, 0, 1, 0, 0, 0
+};
+
+static struct cmd_key_spec redis_key_all = {
+    CMD_KEY_BEGIN_INDEX, 1, NULL, 0, CMD_KEY_FIND_RANGE, -1, 1, 0, 0, 0
+};
+
+static struct cmd_key_spec redis_key_pairs = {
+    CMD_KEY_BEGIN_INDEX, 1, NULL, 0, CMD_KEY_FIND_RANGE, -1, 2, 0, 0, 0
+};
+
+static struct cmd_key_spec redis_key_eval = {
+    CMD_KEY_BEGIN_INDEX, 2, NULL, 0, CMD_KEY_FIND_KEYNUM, 0, 1, 0, 0, 1
+};
+
+static const struct cmd_info redis_keyspec_infos[] = {
+    { NULL, -1, 0, 0, NULL },                  /* CMD_KEYSPEC_NONE */
+    { NULL,  2, 0, 1, &redis_key_first },      /* CMD_KEYSPEC_ARG0 */
+    { NULL,  3, 0, 1, &redis_key_first },      /* CMD_KEYSPEC_ARG1 */
+    { NULL,  4, 0, 1, &redis_key_first },      /* CMD_KEYSPEC_ARG2 */
+    { NULL,  5, 0, 1, &redis_key_first },      /* CMD_KEYSPEC_ARG3 */
+    { NULL, -2, 0, 1, &redis_key_first },      /* CMD_KEYSPEC_ARGN */
+    { NULL, -2, 0, 1, &redis_key_all },        /* CMD_KEYSPEC_MULTI */
+    { NULL, -3, 0, 1, &redis_key_eval },       /* CMD_KEYSPEC_EVAL */
+};
+
+static const struct cmd_info redis_argkvx_info = {
+    NULL, -3, 0, 1, &redis_key_pairs
+};
+
+/*
+ * Find the type and the keys of the command split into the arguments
+ * args, like redis_parse_cmd does for the RESP form of it. The keys
+ * point into the arguments. The type is CMD_UNKNOWN and the result an
+ * error if the command is not known.
+ */
+void
+redis_parse_cmd_args(struct cmd *r, const struct keypos *args, uint32_t nargs)
+{
+    const struct cmd_spec *spec;
+    const struct cmd_info *info;
+    uint32_t len;
+
+    ASSERT(nargs > 0);
+
+    len = (uint32_t)(args[0].end - args[0].start);
+
+    r->narg = nargs;
+    r->type = CMD_UNKNOWN;
+    r->keyspec = CMD_KEYSPEC_NONE;
+
+    spec = redis_cmd_lookup(args[0].start, len);
+    if (spec != NULL) {
+        r->type = spec->type;
+        r->keyspec = spec->keyspec;
+    }
+
+    r->reducer = redis_cmd_reducer(r->type, args[0].start, len);
+    if (r->type == CMD_UNKNOWN) {
+        if (r->reducer == NULL) {
+            redis_cmd_set_error(r, "Unknown command", 0);
+            return;
+        }
+        r->type = CMD_REQ_REDIS_CUSTOM;
+        r->keyspec = CMD_KEYSPEC_MULTI;
+    }
+
+    if (redis_argx(r)) {
+        info = &redis_keyspec_infos[CMD_KEYSPEC_MULTI];
+    } else if (redis_argkvx(r)) {
+        if (nargs % 2 == 0) {
+            redis_cmd_set_error(r, "Key without value", nargs);
+            return;
+        }
+        info = &redis_argkvx_info;
+    } else {
+        info = &redis_keyspec_infos[r->keyspec];
+    }
+
+    redis_parse_cmd_by_info(r, args, nargs, info);
+
+    /* like redis_parse_cmd, EVAL is routed by its first key */
+    if (r->result == CMD_PARSE_OK && redis_argeval(r) &&
+        hiarray_n(r->keys) > 1) {
+        r->keys->nelem = 1;
+    }
+}
+
+/*
+ * Create the info of the command named by the len bytes at name, with
+ * room for nkey_specs key specs
+ */
+struct cmd_info *
+cmd_info_create(const char *name, uint32_t len, int arity, uint32_t nkey_specs)
+{
+    struct cmd_info *info;
+    uint32_t i;
+
+    info = hi_zalloc(sizeof(*info));
+    if (info == NULL) {
+        return NULL;
+    }
+
+    info->name = hi_alloc(len + 1);
+    if (info->name == NULL) {
+        hi_free(info);
+        return NULL;
+    }
+
+    for (i = 0; i < len; i++) {
+        info->name[i] = (char)tolower((unsigned char)name[i]);
+    }
+    info->name[len] = '\0';
+
+    if (nkey_specs > 0) {
+        info->key_specs = hi_calloc(nkey_specs, sizeof(*info->key_specs));
+        if (info->key_specs == NULL) {
+            hi_free(info->name);
+            hi_free(info);
+            return NULL;
+        }
+    }
+
+    info->arity = arity;
+    info->nkey_specs = nkey_specs;
+
+    return info;
+}
+
+void
+cmd_info_destroy(struct cmd_info *info)
+{
+    uint32_t i;
+
+    if (info == NULL) {
+        return;
+    }
+
+    for (i = 0; i < info->nkey_specs; i++) {
+        if (info->key_specs[i].keyword != NULL) {
+            hi_free(info->key_specs[i].keyword);
+        }
+    }
+
+    if (info->key_specs != NULL) {
+        hi_free(info->key_specs);
+    }
+
+    hi_free(info->name);
+    hi_free(info);
+}
+
 struct cmd *command_get()
 {
     struct cmd *command;
@@ -1633,8 +1684,13 @@ struct cmd *command_get()
     command->result = CMD_PARSE_OK;
     command->errstr = NULL;
     command->type = CMD_UNKNOWN;
+    command->keyspec = CMD_KEYSPEC_NONE;
+    command->reducer = NULL;
     command->cmd = NULL;
     command->clen = 0;
+    command->argc = 0;
+    command->argv = NULL;
+    command->argvlen = NULL;
     command->keys = NULL;
     command->narg_start = NULL;
     command->narg_end = NULL;
@@ -1644,6 +1700,7 @@ struct cmd *command_get()
     command->slot_num = -1;
     command->frag_seq = NULL;
     command->reply = NULL;
+    command->node = NULL;
     command->sub_commands = NULL;
 
     command->keys = hiarray_create(1, sizeof(struct keypos));
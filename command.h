@@ -27,6 +27,8 @@ typedef enum cmd_parse_result {
     ACTION( REQ_REDIS_SORT )                                                                        \
     ACTION( REQ_REDIS_TTL )                                                                         \
     ACTION( REQ_REDIS_TYPE )                                                                        \
+    ACTION( REQ_REDIS_TOUCH )                                                                       \
+    ACTION( REQ_REDIS_UNLINK )                                                                      \
     ACTION( REQ_REDIS_APPEND )                 /* redis requests - string */                             \
     ACTION( REQ_REDIS_BITCOUNT )                                                                    \
     ACTION( REQ_REDIS_DECR )                                                                        \
@@ -120,6 +122,7 @@ typedef enum cmd_parse_result {
     ACTION( REQ_REDIS_PING )                   /* redis requests - ping/quit */                         \
     ACTION( REQ_REDIS_QUIT)                                                                         \
     ACTION( REQ_REDIS_AUTH)                                                                         \
+    ACTION( REQ_REDIS_CUSTOM )                 /* redis requests - registered with a reducer */         \
     ACTION( RSP_REDIS_STATUS )                 /* redis response */                                   \
     ACTION( RSP_REDIS_ERROR )                                                                       \
     ACTION( RSP_REDIS_INTEGER )                                                                     \
@@ -135,6 +138,73 @@ typedef enum cmd_type {
 #undef DEFINE_ACTION
 
 
+typedef enum cmd_split {
+    CMD_SPLIT_KEYS,                       /* every argument is a key, like del */
+    CMD_SPLIT_KEY_VALUES,                 /* the arguments are key-value pairs, like mset */
+} cmd_split_t;
+
+typedef enum cmd_merge {
+    CMD_MERGE_SUM,                        /* add up the integer replies */
+    CMD_MERGE_CONCAT,                     /* an array of one element per key, in key order */
+    CMD_MERGE_ALL_OK,                     /* OK if every fragment replied OK */
+} cmd_merge_t;
+
+/* Where the keys of a command are, and how many arguments follow them. */
+typedef enum cmd_keyspec {
+    CMD_KEYSPEC_NONE,                     /* no key, like ping */
+    CMD_KEYSPEC_ARG0,                     /* one key, no argument */
+    CMD_KEYSPEC_ARG1,                     /* one key, exactly 1 argument */
+    CMD_KEYSPEC_ARG2,                     /* one key, exactly 2 arguments */
+    CMD_KEYSPEC_ARG3,                     /* one key, exactly 3 arguments */
+    CMD_KEYSPEC_ARGN,                     /* one key, 0 or more arguments */
+    CMD_KEYSPEC_MULTI,                    /* one or more keys, as the reducer splits them */
+    CMD_KEYSPEC_EVAL,                     /* 2 arguments, then the keys and arguments */
+} cmd_keyspec_t;
+
+/* How a multi-key command is split by slot and its replies are merged. */
+struct cmd_reducer {
+    const char       *name;         /* command name, lower case */
+    cmd_type_t       type;          /* command type */
+    cmd_split_t      split;
+    cmd_merge_t      merge;
+};
+
+/* Where the keys of a command begin in its arguments... */
+typedef enum cmd_key_begin {
+    CMD_KEY_BEGIN_INDEX,                  /* at a fixed argument */
+    CMD_KEY_BEGIN_KEYWORD,                /* right after a keyword argument */
+} cmd_key_begin_t;
+
+/* ...and how they are found from there. */
+typedef enum cmd_key_find {
+    CMD_KEY_FIND_RANGE,                   /* up to the last key, every keystep */
+    CMD_KEY_FIND_KEYNUM,                  /* as many keys as an argument says */
+} cmd_key_find_t;
+
+/* A key spec of the COMMAND reply, the first/last/step of the older
+ * servers is a range one beginning at an index. */
+struct cmd_key_spec {
+    cmd_key_begin_t  begin;
+    int              index;         /* argument of the first key, begin index */
+    char             *keyword;      /* begin keyword */
+    int              startfrom;     /* argument the keyword is searched from, backward from the end if negative */
+    cmd_key_find_t   find;
+    int              lastkey;       /* range, relative to the first key, or from the end if negative */
+    int              keystep;
+    int              limit;         /* range to the end, 1/limit of the arguments left are keys */
+    int              keynumidx;     /* keynum, argument of the key count, relative to the begin */
+    int              firstkey;      /* keynum, relative to the begin */
+};
+
+/* The arity and key specs of a command the server knows. */
+struct cmd_info {
+    char                *name;      /* lower case, "container|sub" for a subcommand */
+    int                 arity;      /* argument count, or at least -arity if negative */
+    unsigned            subcommands:1;  /* the subcommands have their own info */
+    uint32_t            nkey_specs;
+    struct cmd_key_spec *key_specs;
+};
+
 struct keypos {
     char             *start;        /* key start pos */
     char             *end;          /* key end pos */
@@ -149,9 +219,15 @@ struct cmd {
     char                 *errstr;         /* error info when the command parse failed */
 
     cmd_type_t           type;            /* command type */
+    cmd_keyspec_t        keyspec;         /* where the keys are */
+    const struct cmd_reducer *reducer;    /* how to fragment it, NULL if it can not */
 
     char                 *cmd;
     uint32_t             clen;            /* command length */
+
+    int                  argc;            /* the command by argv, if cmd is NULL */
+    const char           **argv;
+    const size_t         *argvlen;
     
     struct hiarray       *keys;           /* array of keypos, for req */
 
@@ -167,11 +243,22 @@ struct cmd {
     struct cmd           **frag_seq;      /* sequence of fragment command, map from keys to fragments*/
 
     redisReply           *reply;
+    struct cluster_node  *node;           /* the node a pipelined command is sent to */
 
     hilist                 *sub_commands;   /* just for pipeline and multi-key commands */
 };
 
 void redis_parse_cmd(struct cmd *r);
+void redis_parse_args(struct cmd *r, struct hiarray *args);
+void redis_parse_cmd_args(struct cmd *r, const struct keypos *args, uint32_t nargs);
+void redis_parse_cmd_by_info(struct cmd *r, const struct keypos *args, uint32_t nargs, const struct cmd_info *info);
+int redis_cmd_readonly(struct cmd *r);
+const char *redis_cmd_name(uint32_t idx);
+
+int command_reducer_register(const char *name, cmd_split_t split, cmd_merge_t merge);
+
+struct cmd_info *cmd_info_create(const char *name, uint32_t len, int arity, uint32_t nkey_specs);
+void cmd_info_destroy(struct cmd_info *info);
 
 struct cmd *command_get(void);
 void command_destroy(struct cmd *command);
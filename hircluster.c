@@ -5,6 +5,11 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <ctype.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "hircluster.h"
 #include "hiutil.h"
@@ -17,7 +22,10 @@
 #define REDIS_COMMAND_CLUSTER_SLOTS "CLUSTER SLOTS"
 
 #define REDIS_COMMAND_ASKING "ASKING"
+#define REDIS_COMMAND_READONLY "READONLY"
 #define REDIS_COMMAND_PING "PING"
+#define REDIS_COMMAND_COMMAND "COMMAND"
+#define REDIS_COMMAND_CONFIG_GET_NODE_TIMEOUT "CONFIG GET cluster-node-timeout"
 
 #define REDIS_PROTOCOL_ASKING "*1\r\n$6\r\nASKING\r\n"
 
@@ -27,6 +35,35 @@
 
 #define CLUSTER_DEFAULT_MAX_REDIRECT_COUNT 5
 
+/* Time(msec) waited for a failover when the cluster-node-timeout of the
+ * cluster can not be read, the default of redis. */
+#define CLUSTER_DEFAULT_NODE_TIMEOUT 15000
+
+/* Delay(usec) of the full route update after a MOVED patched the route. */
+#define CLUSTER_DEFAULT_ROUTE_UPDATE_DELAY 100000
+/* Time(usec) the keys moved to the importing node of a slot are 
+ * remembered after the last ASK error for the slot. */
+#define CLUSTER_ASK_CACHE_TTL 5000000
+
+/* Max keys remembered for each slot in migration. */
+#define CLUSTER_ASK_CACHE_MAX_KEYS 1024
+
+/* Time(usec) a replica failed to serve a read is not used for reads. */
+#define CLUSTER_REPLICA_DOWN_TIME 1000000
+
+#define CLUSTER_NODE_READONLY_CON   0x1
+#define CLUSTER_NODE_READONLY_ACON  0x2
+
+/* Min interval(usec) between two route updates. */
+#define CLUSTER_DEFAULT_ROUTE_UPDATE_INTERVAL 100000
+
+/* Masters asked for the route by a refresh, the connect asks all. */
+#define CLUSTER_ROUTE_PROBE_NODES 3
+
+#define CLUSTER_ROUTE_UPDATE_START      0
+#define CLUSTER_ROUTE_UPDATE_COALESCED  1
+#define CLUSTER_ROUTE_UPDATE_SKIPPED    2
+
 typedef struct cluster_async_data
 {
     redisClusterAsyncContext *acc;
@@ -34,6 +71,12 @@ typedef struct cluster_async_data
     redisClusterCallbackFn *callback;
     int retry_count;
     void *privdata;
+    int64_t start_time;     /* sent time(usec) for the latency */
+    struct cluster_async_data *parent;  /* the multi-key command of a fragment */
+    redisClusterPartialCallbackFn *partial; /* called per fragment reply */
+    uint32_t pending;       /* fragments not replied yet */
+    int err;                /* the first fragment error */
+    sds errstr;
 }cluster_async_data;
 
 typedef enum CLUSTER_ERR_TYPE{
@@ -49,6 +92,7 @@ typedef enum CLUSTER_ERR_TYPE{
 static void cluster_node_deinit(cluster_node *node);
 static void cluster_slot_destroy(cluster_slot *slot);
 static void cluster_open_slot_destroy(copen_slot *oslot);
+static void cluster_ctx_set_block(redisContext *c, int block);
 
 void listClusterNodeDestructor(void *val)
 {
@@ -122,6 +166,35 @@ dictType clusterNodesRefDictType = {
     NULL                        /* val destructor */
 };
 
+/* Keys hash table, the keys moved to the importing node of a slot.
+ */
+dictType clusterAskKeysDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+void dictCommandInfoDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    cmd_info_destroy(val);
+}
+
+/* Commands hash table, mapping the lower case command names
+ * (get, object|encoding) to the cmd_info of the COMMAND reply.
+ */
+dictType clusterCommandInfoDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictCommandInfoDestructor   /* val destructor */
+};
 
 void listCommandFree(void *command)
 {
@@ -168,25 +241,26 @@ static void *__redisBlockForReply(redisContext *c) {
  * However if the key contains the {...} pattern, only the part between
  * { and } is hashed. This may be useful in the future to force certain
  * keys to be in the same node (assuming no resharding is in progress). */
-static unsigned int keyHashSlot(char *key, int keylen) {
-    int s, e; /* start-end indexes of { and } */
+static unsigned int keyHashSlot(const char *key, int keylen) {
+    const char *s, *e; /* { and } */
+
+    if (keylen <= 0) return 0; /* the crc16 of no bytes */
 
-    for (s = 0; s < keylen; s++)
-        if (key[s] == '{') break;
+    /* memchr is a word or vector scan in the libc, not a byte loop. */
+    s = memchr(key,'{',keylen);
 
     /* No '{' ? Hash the whole key. This is the base case. */
-    if (s == keylen) return crc16(key,keylen) & 0x3FFF;
+    if (s == NULL) return crc16(key,keylen) & 0x3FFF;
 
     /* '{' found? Check if we have the corresponding '}'. */
-    for (e = s+1; e < keylen; e++)
-        if (key[e] == '}') break;
+    e = memchr(s+1,'}',keylen-(s+1-key));
 
     /* No '}' or nothing betweeen {} ? Hash the whole key. */
-    if (e == keylen || e == s+1) return crc16(key,keylen) & 0x3FFF;
+    if (e == NULL || e == s+1) return crc16(key,keylen) & 0x3FFF;
 
     /* If we are here there is both a { and a } on its right. Hash
      * what is in the middle between { and }. */
-    return crc16(key+s+1,e-s-1) & 0x3FFF;
+    return crc16(s+1,(int)(e-s-1)) & 0x3FFF;
 }
 
 static void __redisClusterSetError(redisClusterContext *cc, int type, const char *str) {
@@ -270,6 +344,9 @@ static int cluster_node_init(cluster_node *node)
     node->acon = NULL;
     node->slots = NULL;
     node->failure_count = 0;
+    node->readonly = 0;
+    node->latency = 0;
+    node->down_until = 0;
     node->data = NULL;
     node->migrating = NULL;
     node->importing = NULL;
@@ -300,7 +377,9 @@ static void cluster_node_deinit(cluster_node *node)
 
     if(node->acon != NULL)
     {
+        node->acon->data = NULL;
         redisAsyncFree(node->acon);
+        node->acon = NULL;
     }
 
     if(node->slots != NULL)
@@ -603,13 +682,42 @@ error:
     return NULL;
 }
 
+static void cluster_node_swap_ctx(cluster_node *node_f, cluster_node *node_t)
+{
+    redisContext *c;
+    redisAsyncContext *ac;
+    uint8_t readonly;
+
+    readonly = node_f->readonly;
+    node_f->readonly = node_t->readonly;
+    node_t->readonly = readonly;
+    node_t->latency = node_f->latency;
+    node_t->down_until = node_f->down_until;
+    
+    if(node_f->con != NULL){
+        c = node_f->con;
+        node_f->con = node_t->con;
+        node_t->con = c;
+    }
+
+    if(node_f->acon != NULL){
+        ac = node_f->acon;
+        node_f->acon = node_t->acon;
+        node_t->acon = ac;
+
+        node_t->acon->data = node_t;
+        if (node_f->acon)
+            node_f->acon->data = node_f;
+    }
+}
+
 static void cluster_nodes_swap_ctx(dict *nodes_f, dict *nodes_t)
 {
     dictIterator *di;
     dictEntry *de_f, *de_t;
-    cluster_node *node_f, *node_t;
-    redisContext *c;
-    redisAsyncContext *ac;
+    cluster_node *node_f, *node_t, *slave_f, *slave_t;
+    listIter li_f, li_t;
+    listNode *ln_f, *ln_t;
 
     if(nodes_f == NULL || nodes_t == NULL){
         return;
@@ -628,20 +736,25 @@ static void cluster_nodes_swap_ctx(dict *nodes_f, dict *nodes_t)
         }
 
         node_f = dictGetEntryVal(de_f);
-        if(node_f->con != NULL){
-            c = node_f->con;
-            node_f->con = node_t->con;
-            node_t->con = c;
-        }
+        cluster_node_swap_ctx(node_f, node_t);
 
-        if(node_f->acon != NULL){
-            ac = node_f->acon;
-            node_f->acon = node_t->acon;
-            node_t->acon = ac;
+        //keep the connections to the replicas serving the reads
+        if(node_f->slaves == NULL || node_t->slaves == NULL){
+            continue;
+        }
 
-            node_t->acon->data = node_t;
-            if (node_f->acon)
-                node_f->acon->data = node_f;
+        listRewind(node_t->slaves, &li_t);
+        while((ln_t = listNext(&li_t)) != NULL){
+            slave_t = listNodeValue(ln_t);
+            
+            listRewind(node_f->slaves, &li_f);
+            while((ln_f = listNext(&li_f)) != NULL){
+                slave_f = listNodeValue(ln_f);
+                if(sdscmp(slave_f->addr, slave_t->addr) == 0){
+                    cluster_node_swap_ctx(slave_f, slave_t);
+                    break;
+                }
+            }
         }
     }
 
@@ -649,2974 +762,7733 @@ static void cluster_nodes_swap_ctx(dict *nodes_f, dict *nodes_t)
     
 }
 
-static int
-cluster_slot_start_cmp(const void *t1, const void *t2)
+struct redisClusterRouteShare {
+    char lock;              /* spin lock of the route pointer */
+    int refcount;
+    int updating;           /* a context is fetching the route */
+    uint64_t version;       /* version of the route published */
+    cluster_route *route;
+};
+
+#define route_share_lock(_share) \
+    while(__atomic_test_and_set(&(_share)->lock, __ATOMIC_ACQUIRE))
+#define route_share_unlock(_share) \
+    __atomic_clear(&(_share)->lock, __ATOMIC_RELEASE)
+#define route_share_version(_share) \
+    __atomic_load_n(&(_share)->version, __ATOMIC_ACQUIRE)
+
+static cluster_route *cluster_route_create(void)
 {
-    const cluster_slot **s1 = t1, **s2 = t2;
+    cluster_route *route;
 
-    return (*s1)->start > (*s2)->start?1:-1;
+    route = hi_zalloc(sizeof(*route));
+    if(route == NULL)
+    {
+        return NULL;
+    }
+
+    route->refcount = 1;
+    
+    return route;
 }
 
-static int
-cluster_master_slave_mapping_with_name(redisClusterContext *cc,
-    dict **nodes, cluster_node *node, sds master_name)
+static void cluster_route_release(cluster_route *route)
 {
-    int ret;
-    dictEntry *di;
-    cluster_node *node_old;
-    listNode *lnode;
+    if(route == NULL)
+    {
+        return;
+    }
 
-    if(node == NULL || master_name == NULL)
+    if(__atomic_sub_fetch(&route->refcount, 1, __ATOMIC_ACQ_REL) > 0)
     {
-        return REDIS_ERR;
+        return;
     }
 
-    if(*nodes == NULL)
+    if(route->slots != NULL)
     {
-        *nodes = dictCreate(
-            &clusterNodesRefDictType, NULL);
+        route->slots->nelem = 0;
+        hiarray_destroy(route->slots);
     }
 
-    di = dictFind(*nodes, master_name);
-    if(di == NULL)
+    if(route->nodes != NULL)
     {
-        ret = dictAdd(*nodes, 
-            sdsnewlen(master_name, sdslen(master_name)), node);
-        if(ret != DICT_OK)
+        dictRelease(route->nodes);
+    }
+
+    if(route->node_list != NULL)
+    {
+        hi_free(route->node_list);
+    }
+
+    hi_free(route);
+}
+
+/* Get the index of the master in the route, the master is added if 
+ * it is not in the route yet. Return 0 on error. */
+static uint16_t cluster_route_node_index(cluster_route *route, 
+    cluster_node *node)
+{
+    cluster_node **node_list;
+    uint32_t i, size;
+
+    for(i = 1; i < route->node_count; i ++)
+    {
+        if(route->node_list[i] == node)
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                "the address already exists in the nodes");
-            return REDIS_ERR;
+            return (uint16_t)i;
         }
+    }
 
+    if(route->node_count > UINT16_MAX)
+    {
+        return 0;
     }
-    else
+
+    if(route->node_count >= route->node_size)
     {
-        node_old = dictGetEntryVal(di);
-        if(node_old == NULL)
+        size = route->node_size ? route->node_size * 2 : 16;
+        node_list = hi_realloc(route->node_list, size * sizeof(*node_list));
+        if(node_list == NULL)
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                "dict get value null");
-            return REDIS_ERR;
+            return 0;
         }
 
-        if(node->role == REDIS_ROLE_MASTER &&
-            node_old->role == REDIS_ROLE_MASTER)
+        route->node_list = node_list;
+        route->node_size = size;
+        if(route->node_count == 0)
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                "two masters have the same name");
-            return REDIS_ERR;
+            route->node_list[route->node_count ++] = NULL;
         }
-        else if(node->role == REDIS_ROLE_MASTER
-            && node_old->role == REDIS_ROLE_SLAVE)
-        {
-            if(node->slaves == NULL)
-            {
-                node->slaves = listCreate();
-                if(node->slaves == NULL)
-                {
-                    __redisClusterSetError(cc,REDIS_ERR_OOM,
-                        "Out of memory");
-                    return REDIS_ERR;
-                }
+    }
 
-                node->slaves->free = 
-                    listClusterNodeDestructor;
-            }
-        
-            if(node_old->slaves != NULL)
-            {
-                node_old->slaves->free = NULL;
-                while(listLength(node_old->slaves) > 0)
-                {
-                    lnode = listFirst(node_old->slaves);
-                    listAddNodeHead(node->slaves, lnode->value);
-                    listDelNode(node_old->slaves, lnode);
-                }
-                listRelease(node_old->slaves);
-                node_old->slaves = NULL;
-            }
+    route->node_list[route->node_count] = node;
 
-            listAddNodeHead(node->slaves, node_old);
+    return (uint16_t)route->node_count ++;
+}
 
-            dictSetHashVal(*nodes, di, node);
-        }
-        else if(node->role == REDIS_ROLE_SLAVE)
-        {
-            if(node_old->slaves == NULL)
-            {
-                node_old->slaves = listCreate();
-                if(node_old->slaves == NULL)
-                {
-                    __redisClusterSetError(cc,REDIS_ERR_OOM,
-                        "Out of memory");
-                    return REDIS_ERR;
-                }
+/* Get a reference to the route published to the share. */
+static cluster_route *cluster_route_share_get(redisClusterRouteShare *share)
+{
+    cluster_route *route;
 
-                node_old->slaves->free = 
-                    listClusterNodeDestructor;
-            }
+    route_share_lock(share);
+    route = share->route;
+    if(route != NULL)
+    {
+        __atomic_add_fetch(&route->refcount, 1, __ATOMIC_RELAXED);
+    }
+    route_share_unlock(share);
 
-            listAddNodeTail(node_old->slaves, node);
+    return route;
+}
+
+/* Publish the route to the share, the reference is taken over. */
+static void cluster_route_share_set(redisClusterRouteShare *share, 
+    cluster_route *route)
+{
+    cluster_route *old;
+
+    route_share_lock(share);
+    old = share->route;
+    route->version = share->version + 1;
+    share->route = route;
+    __atomic_store_n(&share->version, route->version, __ATOMIC_RELEASE);
+    route_share_unlock(share);
+
+    cluster_route_release(old);
+}
+
+/* Copy the address and the role of the node and its slaves, 
+ * the connections and the slots are not copied. */
+static cluster_node *cluster_node_clone(cluster_node *node)
+{
+    cluster_node *clone, *slave;
+    listIter *li;
+    listNode *ln;
+
+    clone = hi_alloc(sizeof(*clone));
+    if(clone == NULL)
+    {
+        return NULL;
+    }
+
+    cluster_node_init(clone);
+    clone->name = node->name ? sdsdup(node->name) : NULL;
+    clone->addr = sdsdup(node->addr);
+    clone->host = sdsdup(node->host);
+    clone->port = node->port;
+    clone->role = node->role;
+    clone->myself = node->myself;
+
+    if(node->slaves != NULL)
+    {
+        clone->slaves = listCreate();
+        if(clone->slaves == NULL)
+        {
+            goto error;
         }
-        else
+
+        clone->slaves->free = listClusterNodeDestructor;
+
+        li = listGetIterator(node->slaves, AL_START_HEAD);
+        while((ln = listNext(li)) != NULL)
         {
-            NOT_REACHED();
+            slave = cluster_node_clone(listNodeValue(ln));
+            if(slave == NULL || listAddNodeTail(clone->slaves, slave) == NULL)
+            {
+                listClusterNodeDestructor(slave);
+                listReleaseIterator(li);
+                goto error;
+            }
         }
+        listReleaseIterator(li);
     }
-                
-    return REDIS_OK;
+
+    return clone;
+
+error:
+
+    cluster_node_deinit(clone);
+    hi_free(clone);
+
+    return NULL;
 }
 
-/**
-  * Parse the "cluster slots" command reply to nodes dict.
-  */
-dict * 
-parse_cluster_slots(redisClusterContext *cc,
-    redisReply *reply, int flags)
+/* Slot in migration: the importing node and the keys known to be moved 
+ * to it by the ASK errors. Only those keys go to the importing node 
+ * directly, the others may still live on the migrating node.
+ */
+typedef struct cluster_ask_slot
 {
-    int ret;
-    cluster_slot *slot = NULL;
-    dict *nodes = NULL;
-    dictEntry *den;
-    redisReply *elem_slots;
-    redisReply *elem_slots_begin, *elem_slots_end;
-    redisReply *elem_nodes;
-    redisReply *elem_ip, *elem_port;
-    cluster_node *master = NULL, *slave;
-    sds address;
-    uint32_t i, idx;
+    uint32_t slot_num;
+    sds addr;           /* address of the importing node */
+    dict *keys;         /* keys moved to the importing node */
+    int64_t expire;     /* usec the slot is forgotten */
+}cluster_ask_slot;
 
-    if(reply == NULL){
-        return NULL;
+static void cluster_ask_slot_destroy(void *ptr)
+{
+    cluster_ask_slot *aslot = ptr;
+
+    if(aslot == NULL)
+    {
+        return;
     }
 
-    nodes = dictCreate(&clusterNodesDictType, NULL);
-    if(nodes == NULL){
-        __redisClusterSetError(cc,REDIS_ERR_OOM,
-            "out of memory");
-        goto error;
+    if(aslot->addr != NULL)
+    {
+        sdsfree(aslot->addr);
     }
-    
-    if(reply->type != REDIS_REPLY_ARRAY || reply->elements <= 0){
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "Command(cluster slots) reply error: "
-            "reply is not an array.");
-        goto error;
+
+    if(aslot->keys != NULL)
+    {
+        dictRelease(aslot->keys);
     }
 
-    for(i = 0; i < reply->elements; i ++){
-        elem_slots = reply->element[i];
-        if(elem_slots->type != REDIS_REPLY_ARRAY || 
-            elem_slots->elements < 3){
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                "Command(cluster slots) reply error: "
-                "first sub_reply is not an array.");
-            goto error;
-        }
-        
-        slot = cluster_slot_create(NULL);
-        if(slot == NULL){
-            __redisClusterSetError(cc, REDIS_ERR_OOM, 
-                "Slot create failed: out of memory.");
-            goto error;
-        }
+    hi_free(aslot);
+}
 
-        //one slots region
-        for(idx = 0; idx < elem_slots->elements; idx ++){
-            if(idx == 0){
-                elem_slots_begin = elem_slots->element[idx];
-                if(elem_slots_begin->type != REDIS_REPLY_INTEGER){
-                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                        "Command(cluster slots) reply error: "
-                        "slot begin is not an integer.");
-                    goto error;
-                }
-                slot->start = (int)(elem_slots_begin->integer);
-            }else if(idx == 1){
-                elem_slots_end = elem_slots->element[idx];
-                if(elem_slots_end->type != REDIS_REPLY_INTEGER){
-                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                        "Command(cluster slots) reply error: "
-                        "slot end is not an integer.");
-                    goto error;
-                }
-                
-                slot->end = (int)(elem_slots_end->integer);
+static cluster_ask_slot *cluster_ask_slot_create(uint32_t slot_num, sds addr)
+{
+    cluster_ask_slot *aslot;
 
-                if(slot->start > slot->end){
-                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                        "Command(cluster slots) reply error: "
-                        "slot begin is bigger than slot end.");
-                    goto error;
-                }
-            }else{
-                elem_nodes = elem_slots->element[idx];
-                if(elem_nodes->type != REDIS_REPLY_ARRAY || 
-                    elem_nodes->elements != 3){
-                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                        "Command(cluster slots) reply error: "
-                        "nodes sub_reply is not an correct array.");
-                    goto error;
-                }
+    aslot = hi_alloc(sizeof(*aslot));
+    if(aslot == NULL)
+    {
+        return NULL;
+    }
 
-                elem_ip = elem_nodes->element[0];
-                elem_port = elem_nodes->element[1];
+    aslot->slot_num = slot_num;
+    aslot->addr = sdsdup(addr);
+    aslot->keys = dictCreate(&clusterAskKeysDictType, NULL);
+    aslot->expire = 0;
 
-                if(elem_ip == NULL || elem_port == NULL ||
-                    elem_ip->type != REDIS_REPLY_STRING || 
-                    elem_port->type != REDIS_REPLY_INTEGER){
-                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                        "Command(cluster slots) reply error: "
-                        "master ip or port is not correct.");
-                    goto error;
-                }
+    if(aslot->addr == NULL || aslot->keys == NULL)
+    {
+        cluster_ask_slot_destroy(aslot);
+        return NULL;
+    }
 
-                //this is master.
-                if(idx == 2){
-                    address = sdsnewlen(elem_ip->str, elem_ip->len);
-                    address = sdscatfmt(address, ":%i", elem_port->integer);
+    return aslot;
+}
 
-                    den = dictFind(nodes, address);
-                    //master already exits, break to the next slots region.
-                    if(den != NULL){
-                        sdsfree(address);
+/* Get the slot in migration, the expired one is dropped. */
+static listNode *cluster_ask_slot_get(redisClusterContext *cc, 
+    uint32_t slot_num)
+{
+    cluster_ask_slot *aslot;
+    listNode *ln;
+    listIter li;
 
-                        master = dictGetEntryVal(den);
-                        ret = cluster_slot_ref_node(slot, master);
-                        if(ret != REDIS_OK){
-                            __redisClusterSetError(cc, REDIS_ERR_OOM, 
-                                "Slot ref node failed: out of memory.");
-                            goto error;
-                        }
+    if(cc->ask_slots == NULL)
+    {
+        return NULL;
+    }
 
-                        slot = NULL;
-                        break;
-                    }
+    listRewind(cc->ask_slots, &li);
+    while((ln = listNext(&li)) != NULL)
+    {
+        aslot = listNodeValue(ln);
+        if(aslot->slot_num != slot_num)
+        {
+            continue;
+        }
 
-                    sdsfree(address);
-                    master = node_get_with_slots(cc, elem_ip, 
-                        elem_port, REDIS_ROLE_MASTER);
-                    if(master == NULL){
-                        goto error;
-                    }
+        if(aslot->expire < hi_usec_now())
+        {
+            listDelNode(cc->ask_slots, ln);
+            return NULL;
+        }
 
-                    ret = dictAdd(nodes, 
-                        sdsnewlen(master->addr, sdslen(master->addr)), master);
-                    if(ret != DICT_OK){
-                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                            "The address already exists in the nodes");
-                        cluster_node_deinit(master);
-                        hi_free(master);
-                        goto error;
-                    }
-                    
-                    ret = cluster_slot_ref_node(slot, master);
-                    if(ret != REDIS_OK){
-                        __redisClusterSetError(cc, REDIS_ERR_OOM, 
-                            "Slot ref node failed: out of memory.");
-                        goto error;
-                    }
+        return ln;
+    }
 
-                    slot = NULL;
-                }else if(flags & HIRCLUSTER_FLAG_ADD_SLAVE){
-                    slave = node_get_with_slots(cc, elem_ip, 
-                            elem_port, REDIS_ROLE_SLAVE);
-                    if(slave == NULL){
-                        goto error;
-                    }
+    return NULL;
+}
 
-                    if(master->slaves == NULL){
-                        master->slaves = listCreate();
-                        if(master->slaves == NULL){
-                            __redisClusterSetError(cc,REDIS_ERR_OOM,
-                                "Out of memory");
-                            cluster_node_deinit(slave);
-                            goto error;
-                        }
+static void cluster_ask_cache_drop(redisClusterContext *cc, 
+    uint32_t slot_num)
+{
+    listNode *ln;
 
-                        master->slaves->free = 
-                            listClusterNodeDestructor;
-                    }
+    ln = cluster_ask_slot_get(cc, slot_num);
+    if(ln != NULL)
+    {
+        listDelNode(cc->ask_slots, ln);
+    }
+}
 
-                    listAddNodeTail(master->slaves, slave);
-                }
-            }
+/* Remember the keys of the command as moved to the node from the 
+ * "ASK <slot> <ip:port>" error reply. */
+static void cluster_ask_cache_add(redisClusterContext *cc, 
+    struct cmd *command, uint32_t slot_num, cluster_node *node)
+{
+    cluster_ask_slot *aslot;
+    struct keypos *kp;
+    listNode *ln;
+    sds key;
+    uint32_t i;
+
+    if(command->keys == NULL || hiarray_n(command->keys) == 0)
+    {
+        return;
+    }
+
+    if(cc->ask_slots == NULL)
+    {
+        cc->ask_slots = listCreate();
+        if(cc->ask_slots == NULL)
+        {
+            return;
         }
+
+        cc->ask_slots->free = cluster_ask_slot_destroy;
     }
 
-    return nodes;
+    ln = cluster_ask_slot_get(cc, slot_num);
+    if(ln != NULL)
+    {
+        aslot = listNodeValue(ln);
 
-error:
+        //the slot is migrating to another node now
+        if(sdscmp(aslot->addr, node->addr) != 0)
+        {
+            listDelNode(cc->ask_slots, ln);
+            ln = NULL;
+        }
+    }
 
-    if(nodes != NULL){
-        dictRelease(nodes);
+    if(ln == NULL)
+    {
+        aslot = cluster_ask_slot_create(slot_num, node->addr);
+        if(aslot == NULL)
+        {
+            return;
+        }
+
+        if(listAddNodeTail(cc->ask_slots, aslot) == NULL)
+        {
+            cluster_ask_slot_destroy(aslot);
+            return;
+        }
     }
 
-    if(slot != NULL){
-        cluster_slot_destroy(slot);
+    aslot->expire = hi_usec_now() + CLUSTER_ASK_CACHE_TTL;
+
+    for(i = 0; i < hiarray_n(command->keys); i ++)
+    {
+        if(dictSize(aslot->keys) >= CLUSTER_ASK_CACHE_MAX_KEYS)
+        {
+            break;
+        }
+        
+        kp = hiarray_get(command->keys, i);
+        key = sdsnewlen(kp->start, (size_t)(kp->end - kp->start));
+        if(key == NULL)
+        {
+            break;
+        }
+
+        if(dictAdd(aslot->keys, key, NULL) != DICT_OK)
+        {
+            sdsfree(key);
+        }
     }
-    
-    return NULL;
 }
 
-/**
-  * Parse the "cluster nodes" command reply to nodes dict.
-  */
-dict *
-parse_cluster_nodes(redisClusterContext *cc, 
-    char *str, int str_len, int flags)
+/* Get the importing node the keys of the command are all moved to, 
+ * the command is sent to it with ASKING ahead. Return NULL if any key
+ * is not known to be moved. */
+static cluster_node *node_get_by_ask_cache(redisClusterContext *cc, 
+    struct cmd *command)
 {
-    int ret;
-    dict *nodes = NULL;
-    dict *nodes_name = NULL;
-    cluster_node *master, *slave;
-    cluster_slot *slot;
-    char *pos, *start, *end, *line_start, *line_end;
-    char *role;
-    int role_len;
-    uint8_t myself = 0;
-    int slot_start, slot_end;
-    sds *part = NULL, *slot_start_end = NULL;
-    int count_part = 0, count_slot_start_end = 0;
-    int k;
-    int len;
+    cluster_ask_slot *aslot;
+    struct keypos *kp;
+    listNode *ln;
+    dictEntry *de;
+    sds key;
+    uint32_t i;
 
-    nodes = dictCreate(&clusterNodesDictType, NULL);
-    if(nodes == NULL){
-        __redisClusterSetError(cc,REDIS_ERR_OOM,
-            "out of memory");
-        goto error;
+    if(command->slot_num < 0 || command->keys == NULL || 
+        hiarray_n(command->keys) == 0)
+    {
+        return NULL;
     }
 
-    start = str;
-    end = start + str_len;
-    
-    line_start = start;
+    ln = cluster_ask_slot_get(cc, (uint32_t)command->slot_num);
+    if(ln == NULL)
+    {
+        return NULL;
+    }
 
-    for(pos = start; pos < end; pos ++){
-        if(*pos == '\n'){
-            line_end = pos - 1;
-            len = line_end - line_start;
-            
-            part = sdssplitlen(line_start, len + 1, " ", 1, &count_part);
+    aslot = listNodeValue(ln);
 
-            if(part == NULL || count_part < 8){
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "split cluster nodes error");
-                goto error;
-            }
+    for(i = 0; i < hiarray_n(command->keys); i ++)
+    {
+        kp = hiarray_get(command->keys, i);
+        key = sdsnewlen(kp->start, (size_t)(kp->end - kp->start));
+        if(key == NULL)
+        {
+            return NULL;
+        }
 
-            //the address string is ":0", skip this node.
-            if(sdslen(part[1]) == 2 && strcmp(part[1], ":0") == 0){
-                sdsfreesplitres(part, count_part);
-                count_part = 0;
-                part = NULL;
-                
-                start = pos + 1;
-                line_start = start;
-                pos = start;
-                
-                continue;
-            }
+        de = dictFind(aslot->keys, key);
+        sdsfree(key);
+        if(de == NULL)
+        {
+            return NULL;
+        }
+    }
 
-            if(sdslen(part[2]) >= 7 && memcmp(part[2], "myself,", 7) == 0){
-                role_len = sdslen(part[2]) - 7;
-                role = part[2] + 7;
-                myself = 1;
-            }else{
-                role_len = sdslen(part[2]);
-                role = part[2];
+    de = dictFind(cc->nodes, aslot->addr);
+    if(de == NULL)
+    {
+        listDelNode(cc->ask_slots, ln);
+        return NULL;
+    }
+
+    return dictGetEntryVal(de);
+}
+
+/* Check the slot in migration against the open slot parsed from the 
+ * new route: it is kept for another while if it is still migrating to 
+ * the same node, and forgotten if it is migrating to another one. */
+static void cluster_ask_cache_check(redisClusterContext *cc, 
+    uint32_t slot_num, sds addr)
+{
+    cluster_ask_slot *aslot;
+    listNode *ln;
+
+    ln = cluster_ask_slot_get(cc, slot_num);
+    if(ln == NULL)
+    {
+        return;
+    }
+
+    aslot = listNodeValue(ln);
+    if(sdscmp(aslot->addr, addr) == 0)
+    {
+        aslot->expire = hi_usec_now() + CLUSTER_ASK_CACHE_TTL;
+    }
+    else
+    {
+        listDelNode(cc->ask_slots, ln);
+    }
+}
+
+/* Check the slots in migration against the open slots parsed from the
+ * new route. Only the node replying "cluster nodes" shows its open slots,
+ * so a slot not found stays until it expires. */
+static void cluster_ask_cache_reconcile(redisClusterContext *cc, 
+    dict *nodes)
+{
+    cluster_node *master, *node;
+    copen_slot **oslot;
+    dictIterator *di, *dj;
+    dictEntry *de;
+    uint32_t i;
+
+    if(cc->ask_slots == NULL || listLength(cc->ask_slots) == 0 || 
+        nodes == NULL || !(cc->flags & HIRCLUSTER_FLAG_ADD_OPENSLOT))
+    {
+        return;
+    }
+
+    di = dictGetIterator(nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        master = dictGetEntryVal(de);
+
+        for(i = 0; master->importing != NULL && 
+            i < hiarray_n(master->importing); i ++)
+        {
+            oslot = hiarray_get(master->importing, i);
+            cluster_ask_cache_check(cc, (*oslot)->slot_num, master->addr);
+        }
+
+        for(i = 0; master->migrating != NULL && 
+            i < hiarray_n(master->migrating); i ++)
+        {
+            oslot = hiarray_get(master->migrating, i);
+
+            dj = dictGetIterator(nodes);
+            while((de = dictNext(dj)) != NULL)
+            {
+                node = dictGetEntryVal(de);
+                if(node->name != NULL && 
+                    sdscmp(node->name, (*oslot)->remote_name) == 0)
+                {
+                    cluster_ask_cache_check(cc, (*oslot)->slot_num, node->addr);
+                    break;
+                }
+            }
+            dictReleaseIterator(dj);
+        }
+    }
+    dictReleaseIterator(di);
+}
+
+/* Pick up the route published to the share if it is newer than the 
+ * one in use. The context keeps its own nodes holding the connections,
+ * the connections to the nodes still in the route are kept.
+ */
+static int cluster_route_sync(redisClusterContext *cc)
+{
+    cluster_route *route;
+    cluster_node *node, **route_nodes;
+    dictIterator *di;
+    dictEntry *de;
+    dict *nodes;
+    uint32_t i;
+
+    if(cc->route_share == NULL || 
+        route_share_version(cc->route_share) == cc->route_version)
+    {
+        return REDIS_OK;
+    }
+
+    //the pipelined requests still wait for the replies
+    if(cc->requests != NULL && listLength(cc->requests) > 0)
+    {
+        return REDIS_OK;
+    }
+
+    route = cluster_route_share_get(cc->route_share);
+    if(route == NULL)
+    {
+        return REDIS_OK;
+    }
+
+    nodes = dictCreate(&clusterNodesDictType, NULL);
+    if(nodes == NULL)
+    {
+        goto oom;
+    }
+
+    di = dictGetIterator(route->nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        node = cluster_node_clone(dictGetEntryVal(de));
+        if(node == NULL)
+        {
+            dictReleaseIterator(di);
+            goto oom;
+        }
+
+        if(dictAdd(nodes, sdsdup(node->addr), node) != DICT_OK)
+        {
+            dictClusterNodeDestructor(NULL, node);
+            dictReleaseIterator(di);
+            goto oom;
+        }
+    }
+    dictReleaseIterator(di);
+
+    route_nodes = hi_zalloc((route->node_count + 1) * sizeof(*route_nodes));
+    if(route_nodes == NULL)
+    {
+        goto oom;
+    }
+
+    for(i = 1; i < route->node_count; i ++)
+    {
+        de = dictFind(nodes, route->node_list[i]->addr);
+        route_nodes[i] = de ? dictGetEntryVal(de) : NULL;
+    }
+
+    cluster_nodes_swap_ctx(cc->nodes, nodes);
+    if(cc->nodes != NULL)
+    {
+        dictRelease(cc->nodes);
+    }
+    cc->nodes = nodes;
+
+    if(cc->route_nodes != NULL)
+    {
+        hi_free(cc->route_nodes);
+    }
+    cc->route_nodes = route_nodes;
+
+    cluster_route_release(cc->route);
+    cc->route = route;
+    cc->route_version = route->version;
+
+    cluster_ask_cache_reconcile(cc, route->nodes);
+
+    return REDIS_OK;
+
+oom:
+
+    if(nodes != NULL)
+    {
+        dictRelease(nodes);
+    }
+
+    cluster_route_release(route);
+    __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+    
+    return REDIS_ERR;
+}
+
+/* Install the route built from the "cluster nodes" or "cluster slots" 
+ * reply. A private route takes over the connections of the old nodes, 
+ * a shared route is published and picked up as any other context does.
+ */
+static int cluster_route_install(redisClusterContext *cc, 
+    cluster_route *route, dict *nodes)
+{
+    cluster_route *old;
+    
+    if(cc->route_share != NULL)
+    {
+        route->nodes = nodes;
+        cluster_route_share_set(cc->route_share, route);
+        return cluster_route_sync(cc);
+    }
+
+    cluster_nodes_swap_ctx(cc->nodes, nodes);
+    if(cc->nodes != NULL)
+    {
+        dictRelease(cc->nodes);
+    }
+    cc->nodes = nodes;
+
+    old = cc->route;
+    route->version = ++ cc->route_version;
+    cc->route = route;
+    cluster_route_release(old);
+
+    cluster_ask_cache_reconcile(cc, nodes);
+
+    return REDIS_OK;
+}
+
+static int
+cluster_slot_start_cmp(const void *t1, const void *t2)
+{
+    const cluster_slot **s1 = t1, **s2 = t2;
+
+    return (*s1)->start > (*s2)->start?1:-1;
+}
+
+static int
+cluster_master_slave_mapping_with_name(redisClusterContext *cc,
+    dict **nodes, cluster_node *node, sds master_name)
+{
+    int ret;
+    dictEntry *di;
+    cluster_node *node_old;
+    listNode *lnode;
+
+    if(node == NULL || master_name == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(*nodes == NULL)
+    {
+        *nodes = dictCreate(
+            &clusterNodesRefDictType, NULL);
+    }
+
+    di = dictFind(*nodes, master_name);
+    if(di == NULL)
+    {
+        ret = dictAdd(*nodes, 
+            sdsnewlen(master_name, sdslen(master_name)), node);
+        if(ret != DICT_OK)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "the address already exists in the nodes");
+            return REDIS_ERR;
+        }
+
+    }
+    else
+    {
+        node_old = dictGetEntryVal(di);
+        if(node_old == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "dict get value null");
+            return REDIS_ERR;
+        }
+
+        if(node->role == REDIS_ROLE_MASTER &&
+            node_old->role == REDIS_ROLE_MASTER)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "two masters have the same name");
+            return REDIS_ERR;
+        }
+        else if(node->role == REDIS_ROLE_MASTER
+            && node_old->role == REDIS_ROLE_SLAVE)
+        {
+            if(node->slaves == NULL)
+            {
+                node->slaves = listCreate();
+                if(node->slaves == NULL)
+                {
+                    __redisClusterSetError(cc,REDIS_ERR_OOM,
+                        "Out of memory");
+                    return REDIS_ERR;
+                }
+
+                node->slaves->free = 
+                    listClusterNodeDestructor;
+            }
+        
+            if(node_old->slaves != NULL)
+            {
+                node_old->slaves->free = NULL;
+                while(listLength(node_old->slaves) > 0)
+                {
+                    lnode = listFirst(node_old->slaves);
+                    listAddNodeHead(node->slaves, lnode->value);
+                    listDelNode(node_old->slaves, lnode);
+                }
+                listRelease(node_old->slaves);
+                node_old->slaves = NULL;
+            }
+
+            listAddNodeHead(node->slaves, node_old);
+
+            dictSetHashVal(*nodes, di, node);
+        }
+        else if(node->role == REDIS_ROLE_SLAVE)
+        {
+            if(node_old->slaves == NULL)
+            {
+                node_old->slaves = listCreate();
+                if(node_old->slaves == NULL)
+                {
+                    __redisClusterSetError(cc,REDIS_ERR_OOM,
+                        "Out of memory");
+                    return REDIS_ERR;
+                }
+
+                node_old->slaves->free = 
+                    listClusterNodeDestructor;
+            }
+
+            listAddNodeTail(node_old->slaves, node);
+        }
+        else
+        {
+            NOT_REACHED();
+        }
+    }
+                
+    return REDIS_OK;
+}
+
+/**
+  * Parse the "cluster slots" command reply to nodes dict.
+  */
+dict * 
+parse_cluster_slots(redisClusterContext *cc,
+    redisReply *reply, int flags)
+{
+    int ret;
+    cluster_slot *slot = NULL;
+    dict *nodes = NULL;
+    dictEntry *den;
+    redisReply *elem_slots;
+    redisReply *elem_slots_begin, *elem_slots_end;
+    redisReply *elem_nodes;
+    redisReply *elem_ip, *elem_port;
+    cluster_node *master = NULL, *slave;
+    sds address;
+    uint32_t i, idx;
+
+    if(reply == NULL){
+        return NULL;
+    }
+
+    nodes = dictCreate(&clusterNodesDictType, NULL);
+    if(nodes == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,
+            "out of memory");
+        goto error;
+    }
+    
+    if(reply->type != REDIS_REPLY_ARRAY || reply->elements <= 0){
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "Command(cluster slots) reply error: "
+            "reply is not an array.");
+        goto error;
+    }
+
+    for(i = 0; i < reply->elements; i ++){
+        elem_slots = reply->element[i];
+        if(elem_slots->type != REDIS_REPLY_ARRAY || 
+            elem_slots->elements < 3){
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "Command(cluster slots) reply error: "
+                "first sub_reply is not an array.");
+            goto error;
+        }
+        
+        slot = cluster_slot_create(NULL);
+        if(slot == NULL){
+            __redisClusterSetError(cc, REDIS_ERR_OOM, 
+                "Slot create failed: out of memory.");
+            goto error;
+        }
+
+        //one slots region
+        for(idx = 0; idx < elem_slots->elements; idx ++){
+            if(idx == 0){
+                elem_slots_begin = elem_slots->element[idx];
+                if(elem_slots_begin->type != REDIS_REPLY_INTEGER){
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                        "Command(cluster slots) reply error: "
+                        "slot begin is not an integer.");
+                    goto error;
+                }
+                slot->start = (int)(elem_slots_begin->integer);
+            }else if(idx == 1){
+                elem_slots_end = elem_slots->element[idx];
+                if(elem_slots_end->type != REDIS_REPLY_INTEGER){
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                        "Command(cluster slots) reply error: "
+                        "slot end is not an integer.");
+                    goto error;
+                }
+                
+                slot->end = (int)(elem_slots_end->integer);
+
+                if(slot->start > slot->end){
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                        "Command(cluster slots) reply error: "
+                        "slot begin is bigger than slot end.");
+                    goto error;
+                }
+            }else{
+                elem_nodes = elem_slots->element[idx];
+                if(elem_nodes->type != REDIS_REPLY_ARRAY || 
+                    elem_nodes->elements != 3){
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                        "Command(cluster slots) reply error: "
+                        "nodes sub_reply is not an correct array.");
+                    goto error;
+                }
+
+                elem_ip = elem_nodes->element[0];
+                elem_port = elem_nodes->element[1];
+
+                if(elem_ip == NULL || elem_port == NULL ||
+                    elem_ip->type != REDIS_REPLY_STRING || 
+                    elem_port->type != REDIS_REPLY_INTEGER){
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                        "Command(cluster slots) reply error: "
+                        "master ip or port is not correct.");
+                    goto error;
+                }
+
+                //this is master.
+                if(idx == 2){
+                    address = sdsnewlen(elem_ip->str, elem_ip->len);
+                    address = sdscatfmt(address, ":%i", elem_port->integer);
+
+                    den = dictFind(nodes, address);
+                    //master already exits, break to the next slots region.
+                    if(den != NULL){
+                        sdsfree(address);
+
+                        master = dictGetEntryVal(den);
+                        ret = cluster_slot_ref_node(slot, master);
+                        if(ret != REDIS_OK){
+                            __redisClusterSetError(cc, REDIS_ERR_OOM, 
+                                "Slot ref node failed: out of memory.");
+                            goto error;
+                        }
+
+                        slot = NULL;
+                        break;
+                    }
+
+                    sdsfree(address);
+                    master = node_get_with_slots(cc, elem_ip, 
+                        elem_port, REDIS_ROLE_MASTER);
+                    if(master == NULL){
+                        goto error;
+                    }
+
+                    ret = dictAdd(nodes, 
+                        sdsnewlen(master->addr, sdslen(master->addr)), master);
+                    if(ret != DICT_OK){
+                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                            "The address already exists in the nodes");
+                        cluster_node_deinit(master);
+                        hi_free(master);
+                        goto error;
+                    }
+                    
+                    ret = cluster_slot_ref_node(slot, master);
+                    if(ret != REDIS_OK){
+                        __redisClusterSetError(cc, REDIS_ERR_OOM, 
+                            "Slot ref node failed: out of memory.");
+                        goto error;
+                    }
+
+                    slot = NULL;
+                }else if(flags & HIRCLUSTER_FLAG_ADD_SLAVE){
+                    slave = node_get_with_slots(cc, elem_ip, 
+                            elem_port, REDIS_ROLE_SLAVE);
+                    if(slave == NULL){
+                        goto error;
+                    }
+
+                    if(master->slaves == NULL){
+                        master->slaves = listCreate();
+                        if(master->slaves == NULL){
+                            __redisClusterSetError(cc,REDIS_ERR_OOM,
+                                "Out of memory");
+                            cluster_node_deinit(slave);
+                            goto error;
+                        }
+
+                        master->slaves->free = 
+                            listClusterNodeDestructor;
+                    }
+
+                    listAddNodeTail(master->slaves, slave);
+                }
+            }
+        }
+    }
+
+    return nodes;
+
+error:
+
+    if(nodes != NULL){
+        dictRelease(nodes);
+    }
+
+    if(slot != NULL){
+        cluster_slot_destroy(slot);
+    }
+    
+    return NULL;
+}
+
+/**
+  * Parse the "cluster nodes" command reply to nodes dict.
+  */
+dict *
+parse_cluster_nodes(redisClusterContext *cc, 
+    char *str, int str_len, int flags)
+{
+    int ret;
+    dict *nodes = NULL;
+    dict *nodes_name = NULL;
+    cluster_node *master, *slave;
+    cluster_slot *slot;
+    char *pos, *start, *end, *line_start, *line_end;
+    char *role;
+    int role_len;
+    uint8_t myself = 0;
+    int slot_start, slot_end;
+    sds *part = NULL, *slot_start_end = NULL;
+    int count_part = 0, count_slot_start_end = 0;
+    int k;
+    int len;
+
+    nodes = dictCreate(&clusterNodesDictType, NULL);
+    if(nodes == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,
+            "out of memory");
+        goto error;
+    }
+
+    start = str;
+    end = start + str_len;
+    
+    line_start = start;
+
+    for(pos = start; pos < end; pos ++){
+        if(*pos == '\n'){
+            line_end = pos - 1;
+            len = line_end - line_start;
+            
+            part = sdssplitlen(line_start, len + 1, " ", 1, &count_part);
+
+            if(part == NULL || count_part < 8){
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "split cluster nodes error");
+                goto error;
+            }
+
+            //the address string is ":0", skip this node.
+            if(sdslen(part[1]) == 2 && strcmp(part[1], ":0") == 0){
+                sdsfreesplitres(part, count_part);
+                count_part = 0;
+                part = NULL;
+                
+                start = pos + 1;
+                line_start = start;
+                pos = start;
+                
+                continue;
+            }
+
+            if(sdslen(part[2]) >= 7 && memcmp(part[2], "myself,", 7) == 0){
+                role_len = sdslen(part[2]) - 7;
+                role = part[2] + 7;
+                myself = 1;
+            }else{
+                role_len = sdslen(part[2]);
+                role = part[2];
+            }
+
+            //add master node
+            if(role_len >= 6 && memcmp(role, "master", 6) == 0){
+                if(count_part < 8){
+                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                        "Master node parts number error: less than 8.");
+                    goto error;
+                }
+                
+                master = node_get_with_nodes(cc, 
+                    part, count_part, REDIS_ROLE_MASTER);
+                if(master == NULL){
+                    goto error;
+                }
+
+                ret = dictAdd(nodes, 
+                    sdsnewlen(master->addr, sdslen(master->addr)), master);
+                if(ret != DICT_OK){
+                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                        "The address already exists in the nodes");
+                    cluster_node_deinit(master);
+                    hi_free(master);
+                    goto error;
+                }
+
+                if(flags & HIRCLUSTER_FLAG_ADD_SLAVE){
+                    ret = cluster_master_slave_mapping_with_name(cc, 
+                        &nodes_name, master, master->name);
+                    if(ret != REDIS_OK){
+                        cluster_node_deinit(master);
+                        hi_free(master);
+                        goto error;
+                    }
+                }
+
+                if(myself) master->myself = 1;
+                
+                for(k = 8; k < count_part; k ++){
+                    slot_start_end = sdssplitlen(part[k], 
+                        sdslen(part[k]), "-", 1, &count_slot_start_end);
+                    
+                    if(slot_start_end == NULL){
+                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                            "split slot start end error(NULL)");
+                        goto error;
+                    }else if(count_slot_start_end == 1){
+                        slot_start = 
+                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));
+                        slot_end = slot_start;
+                    }else if(count_slot_start_end == 2){
+                        slot_start = 
+                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));;
+                        slot_end = 
+                            hi_atoi(slot_start_end[1], sdslen(slot_start_end[1]));;
+                    }else{
+                        //add open slot for master
+                        if(flags & HIRCLUSTER_FLAG_ADD_OPENSLOT && 
+                            count_slot_start_end == 3 && 
+                            sdslen(slot_start_end[0]) > 1 &&
+                            sdslen(slot_start_end[1]) == 1 && 
+                            sdslen(slot_start_end[2]) > 1 && 
+                            slot_start_end[0][0] == '[' && 
+                            slot_start_end[2][sdslen(slot_start_end[2])-1] == ']'){
+                            
+                            copen_slot *oslot, **oslot_elem;
+                            
+                            sdsrange(slot_start_end[0], 1, -1);
+                            sdsrange(slot_start_end[2], 0, -2);
+                            
+                            if(slot_start_end[1][0] == '>'){
+                                oslot = cluster_open_slot_create(
+                                    hi_atoi(slot_start_end[0],
+                                    sdslen(slot_start_end[0])), 
+                                    1, slot_start_end[2], master);
+                                if(oslot == NULL){
+                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                        "create open slot error");
+                                    goto error;
+                                }
+ 
+                                if(master->migrating == NULL){
+                                    master->migrating = hiarray_create(1, sizeof(oslot));
+                                    if(master->migrating == NULL){
+                                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                            "create migrating array error");
+                                        cluster_open_slot_destroy(oslot);
+                                        goto error;
+                                    }
+                                }
+
+                                oslot_elem = hiarray_push(master->migrating);
+                                if(oslot_elem == NULL){
+                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                        "Push migrating array error: out of memory");
+                                    cluster_open_slot_destroy(oslot);
+                                    goto error;
+                                }
+
+                                *oslot_elem = oslot;
+                            }else if(slot_start_end[1][0] == '<'){
+                                oslot = cluster_open_slot_create(hi_atoi(slot_start_end[0],
+                                    sdslen(slot_start_end[0])), 0, slot_start_end[2],
+                                    master);
+                                if(oslot == NULL){
+                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                        "create open slot error");
+                                    goto error;
+                                }
+
+                                if(master->importing == NULL){
+                                    master->importing = hiarray_create(1, sizeof(oslot));
+                                    if(master->importing == NULL){
+                                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                            "create migrating array error");
+                                        cluster_open_slot_destroy(oslot);
+                                        goto error;
+                                    }
+                                }
+
+                                oslot_elem = hiarray_push(master->importing);
+                                if(oslot_elem == NULL){
+                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                        "push migrating array error: out of memory");
+                                    cluster_open_slot_destroy(oslot);
+                                    goto error;
+                                }
+
+                                *oslot_elem = oslot;
+                            }
+                        }
+                        
+                        slot_start = -1;
+                        slot_end = -1;
+                    }
+                    
+                    sdsfreesplitres(slot_start_end, count_slot_start_end);
+                    count_slot_start_end = 0;
+                    slot_start_end = NULL;
+
+                    if(slot_start < 0 || slot_end < 0 || 
+                        slot_start > slot_end || slot_end >= REDIS_CLUSTER_SLOTS){
+                        continue;
+                    }
+
+                    slot = cluster_slot_create(master);
+                    if(slot == NULL){
+                        __redisClusterSetError(cc,REDIS_ERR_OOM,
+                            "Out of memory");
+                        goto error;
+                    }
+                    
+                    slot->start = (uint32_t)slot_start;
+                    slot->end = (uint32_t)slot_end;                    
+                }
+
+            }
+            //add slave node
+            else if((flags & HIRCLUSTER_FLAG_ADD_SLAVE) && 
+                (role_len >= 5 && memcmp(role, "slave", 5) == 0)){
+                slave = node_get_with_nodes(cc, part, 
+                    count_part, REDIS_ROLE_SLAVE);
+                if(slave == NULL){
+                    goto error;
+                }
+
+                ret = cluster_master_slave_mapping_with_name(cc, 
+                    &nodes_name, slave, part[3]);
+                if(ret != REDIS_OK){
+                    cluster_node_deinit(slave);
+                    hi_free(slave);
+                    goto error;
+                }
+
+                if(myself) slave->myself = 1;
+            }
+
+            if(myself == 1){
+                myself = 0;
+            }
+
+            sdsfreesplitres(part, count_part);
+            count_part = 0;
+            part = NULL;
+            
+            start = pos + 1;
+            line_start = start;
+            pos = start;
+        }
+    }
+
+    if(nodes_name != NULL){
+        dictRelease(nodes_name);
+    }
+    
+    return nodes;
+
+error:
+        
+    if(part != NULL){
+        sdsfreesplitres(part, count_part);
+        count_part = 0;
+        part = NULL;
+    }
+
+    if(slot_start_end != NULL){
+        sdsfreesplitres(slot_start_end, count_slot_start_end);
+        count_slot_start_end = 0;
+        slot_start_end = NULL;
+    }
+
+    if(nodes != NULL){
+        dictRelease(nodes);
+    }
+
+    if(nodes_name != NULL){
+        dictRelease(nodes_name);
+    }
+    
+    return NULL;
+}
+
+/* Route file: the masters with their slaves and the slot regions of 
+ * the route, in host byte order.
+ * 
+ * header : magic(4) format(4) route_version(8) masters(4) regions(4)
+ * master : port(2) host_len(2) host slaves(2), then the slaves as
+ *          port(2) host_len(2) host
+ * region : start(2) end(2) master(2), the masters are counted from 1
+ */
+#define CLUSTER_ROUTE_FILE_MAGIC    0x46525648  /* "HVRF" */
+#define CLUSTER_ROUTE_FILE_FORMAT   1
+
+static int route_file_put(sds *buf, const void *p, size_t len)
+{
+    sds s;
+
+    s = sdscatlen(*buf, p, len);
+    if(s == NULL){
+        return REDIS_ERR;
+    }
+
+    *buf = s;
+    
+    return REDIS_OK;
+}
+
+static int route_file_put_node(sds *buf, cluster_node *node)
+{
+    uint16_t port, len;
+
+    if(node->host == NULL || sdslen(node->host) > UINT16_MAX){
+        return REDIS_ERR;
+    }
+
+    port = (uint16_t)node->port;
+    len = (uint16_t)sdslen(node->host);
+    
+    if(route_file_put(buf, &port, sizeof(port)) != REDIS_OK ||
+        route_file_put(buf, &len, sizeof(len)) != REDIS_OK ||
+        route_file_put(buf, node->host, len) != REDIS_OK){
+        return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+static int route_file_get(const char **p, const char *end, 
+    void *out, size_t len)
+{
+    if((size_t)(end - *p) < len){
+        return REDIS_ERR;
+    }
+
+    memcpy(out, *p, len);
+    *p += len;
+
+    return REDIS_OK;
+}
+
+static cluster_node *route_file_get_node(const char **p, const char *end, 
+    uint8_t role)
+{
+    cluster_node *node;
+    uint16_t port, len;
+
+    if(route_file_get(p, end, &port, sizeof(port)) != REDIS_OK ||
+        route_file_get(p, end, &len, sizeof(len)) != REDIS_OK ||
+        (size_t)(end - *p) < len || !hi_valid_port(port)){
+        return NULL;
+    }
+
+    node = hi_alloc(sizeof(cluster_node));
+    if(node == NULL){
+        return NULL;
+    }
+
+    cluster_node_init(node);
+    node->host = sdsnewlen(*p, len);
+    node->port = port;
+    node->addr = sdscatprintf(sdsempty(), "%s%s%u", 
+        node->host, IP_PORT_SEPARATOR, (unsigned int)port);
+    node->role = role;
+    *p += len;
+
+    return node;
+}
+
+/* Write the route to cc->route_file, through a temporary file of its
+ * own synced and renamed over it, so readers never see a partial file
+ * even if several processes save the same route file. */
+static int cluster_route_file_save(redisClusterContext *cc, 
+    cluster_route *route)
+{
+    sds buf = NULL, tmp = NULL;
+    uint32_t magic = CLUSTER_ROUTE_FILE_MAGIC;
+    uint32_t format = CLUSTER_ROUTE_FILE_FORMAT;
+    uint64_t version = cc->route_version;
+    uint32_t i, masters, regions;
+    uint16_t slaves, start, end;
+    cluster_node *master;
+    cluster_slot **slot_elem;
+    listIter *li;
+    listNode *ln;
+    ssize_t nwritten;
+    size_t off;
+    int fd = -1;
+
+    masters = route->node_count > 0 ? route->node_count - 1 : 0;
+    regions = hiarray_n(route->slots);
+
+    buf = sdsempty();
+    if(buf == NULL ||
+        route_file_put(&buf, &magic, sizeof(magic)) != REDIS_OK ||
+        route_file_put(&buf, &format, sizeof(format)) != REDIS_OK ||
+        route_file_put(&buf, &version, sizeof(version)) != REDIS_OK ||
+        route_file_put(&buf, &masters, sizeof(masters)) != REDIS_OK ||
+        route_file_put(&buf, &regions, sizeof(regions)) != REDIS_OK){
+        goto error;
+    }
+
+    for(i = 1; i < route->node_count; i ++){
+        master = route->node_list[i];
+        slaves = master->slaves ? (uint16_t)listLength(master->slaves) : 0;
+        
+        if(route_file_put_node(&buf, master) != REDIS_OK ||
+            route_file_put(&buf, &slaves, sizeof(slaves)) != REDIS_OK){
+            goto error;
+        }
+
+        if(slaves == 0){
+            continue;
+        }
+
+        li = listGetIterator(master->slaves, AL_START_HEAD);
+        while((ln = listNext(li)) != NULL){
+            if(route_file_put_node(&buf, listNodeValue(ln)) != REDIS_OK){
+                listReleaseIterator(li);
+                goto error;
+            }
+        }
+        listReleaseIterator(li);
+    }
+
+    for(i = 0; i < regions; i ++){
+        slot_elem = hiarray_get(route->slots, i);
+        start = (uint16_t)(*slot_elem)->start;
+        end = (uint16_t)(*slot_elem)->end;
+        
+        if(route_file_put(&buf, &start, sizeof(start)) != REDIS_OK ||
+            route_file_put(&buf, &end, sizeof(end)) != REDIS_OK ||
+            route_file_put(&buf, &route->table[start], 
+                sizeof(route->table[start])) != REDIS_OK){
+            goto error;
+        }
+    }
+
+    tmp = sdscatprintf(sdsempty(), "%s.XXXXXX", cc->route_file);
+    if(tmp == NULL){
+        goto error;
+    }
+
+    fd = mkstemp(tmp);
+    if(fd < 0){
+        sdsfree(tmp);
+        tmp = NULL;
+        goto error;
+    }
+
+    if(fchmod(fd, 0644) != 0){
+        goto error;
+    }
+
+    for(off = 0; off < sdslen(buf); off += nwritten){
+        nwritten = write(fd, buf + off, sdslen(buf) - off);
+        if(nwritten < 0){
+            if(errno == EINTR){
+                nwritten = 0;
+                continue;
+            }
+            
+            goto error;
+        }
+    }
+
+    if(fsync(fd) != 0){
+        goto error;
+    }
+
+    close(fd);
+    fd = -1;
+
+    if(rename(tmp, cc->route_file) != 0){
+        goto error;
+    }
+
+    sdsfree(tmp);
+    sdsfree(buf);
+
+    return REDIS_OK;
+
+error:
+
+    if(fd >= 0){
+        close(fd);
+    }
+
+    if(tmp != NULL){
+        unlink(tmp);
+        sdsfree(tmp);
+    }
+
+    if(buf != NULL){
+        sdsfree(buf);
+    }
+
+    return REDIS_ERR;
+}
+
+/* Save the route installed since the last save, right after the route
+ * update of the sync client. The async client does not save the routes
+ * it fetches: the write and the fsync would block the event loop. */
+static void cluster_route_file_flush(redisClusterContext *cc)
+{
+    if(!cc->route_file_dirty){
+        return;
+    }
+
+    cc->route_file_dirty = 0;
+
+    //the route is still usable if the file can not be written
+    if(cc->route_file != NULL && cc->route != NULL){
+        cluster_route_file_save(cc, cc->route);
+    }
+}
+
+static int cluster_update_route_by_nodes(redisClusterContext *cc, 
+    dict *nodes, int from_file);
+
+/* Load the route from cc->route_file. The route is used right away and 
+ * verified by a route update soon after, or dropped on the first MOVED.
+ */
+static int cluster_route_file_load(redisClusterContext *cc)
+{
+    int fd;
+    struct stat st;
+    char *map = NULL;
+    const char *p, *end;
+    uint32_t magic, format, masters, regions, i;
+    uint64_t version;
+    uint16_t slaves, start, stop, index;
+    dict *nodes = NULL;
+    cluster_node **master_list = NULL, *master, *slave;
+    cluster_slot *slot;
+
+    fd = open(cc->route_file, O_RDONLY);
+    if(fd < 0){
+        return REDIS_ERR;
+    }
+
+    if(fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return REDIS_ERR;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        return REDIS_ERR;
+    }
+
+    p = map;
+    end = map + st.st_size;
+
+    if(route_file_get(&p, end, &magic, sizeof(magic)) != REDIS_OK ||
+        route_file_get(&p, end, &format, sizeof(format)) != REDIS_OK ||
+        route_file_get(&p, end, &version, sizeof(version)) != REDIS_OK ||
+        route_file_get(&p, end, &masters, sizeof(masters)) != REDIS_OK ||
+        route_file_get(&p, end, &regions, sizeof(regions)) != REDIS_OK){
+        goto error;
+    }
+
+    if(magic != CLUSTER_ROUTE_FILE_MAGIC || 
+        format != CLUSTER_ROUTE_FILE_FORMAT ||
+        masters == 0 || masters > UINT16_MAX || 
+        regions > REDIS_CLUSTER_SLOTS){
+        goto error;
+    }
+
+    nodes = dictCreate(&clusterNodesDictType, NULL);
+    master_list = hi_zalloc((masters + 1) * sizeof(*master_list));
+    if(nodes == NULL || master_list == NULL){
+        goto error;
+    }
+
+    for(i = 1; i <= masters; i ++){
+        master = route_file_get_node(&p, end, REDIS_ROLE_MASTER);
+        if(master == NULL){
+            goto error;
+        }
+
+        if(dictAdd(nodes, sdsdup(master->addr), master) != DICT_OK){
+            dictClusterNodeDestructor(NULL, master);
+            goto error;
+        }
+        master_list[i] = master;
+
+        if(route_file_get(&p, end, &slaves, sizeof(slaves)) != REDIS_OK){
+            goto error;
+        }
+
+        if(slaves == 0){
+            continue;
+        }
+
+        master->slaves = listCreate();
+        if(master->slaves == NULL){
+            goto error;
+        }
+        master->slaves->free = listClusterNodeDestructor;
+
+        while(slaves --){
+            slave = route_file_get_node(&p, end, REDIS_ROLE_SLAVE);
+            if(slave == NULL){
+                goto error;
+            }
+
+            if(listAddNodeTail(master->slaves, slave) == NULL){
+                listClusterNodeDestructor(slave);
+                goto error;
+            }
+        }
+    }
+
+    for(i = 0; i < regions; i ++){
+        if(route_file_get(&p, end, &start, sizeof(start)) != REDIS_OK ||
+            route_file_get(&p, end, &stop, sizeof(stop)) != REDIS_OK ||
+            route_file_get(&p, end, &index, sizeof(index)) != REDIS_OK){
+            goto error;
+        }
+
+        if(start > stop || stop >= REDIS_CLUSTER_SLOTS || 
+            index == 0 || index > masters){
+            goto error;
+        }
+
+        slot = cluster_slot_create(master_list[index]);
+        if(slot == NULL){
+            goto error;
+        }
+        
+        slot->start = start;
+        slot->end = stop;
+    }
+
+    munmap(map, st.st_size);
+    hi_free(master_list);
+
+    cc->route_version = version > 0 ? version - 1 : 0;
+
+    return cluster_update_route_by_nodes(cc, nodes, 1);
+
+error:
+
+    munmap(map, st.st_size);
+
+    if(master_list != NULL){
+        hi_free(master_list);
+    }
+
+    if(nodes != NULL){
+        dictRelease(nodes);
+    }
+
+    return REDIS_ERR;
+}
+
+/**
+  * Update route with the master nodes parsed from the "cluster nodes" or
+  * "cluster slots" command reply, or loaded from the route file.
+  * The nodes are taken over, also on error.
+  */
+static int 
+cluster_update_route_by_nodes(redisClusterContext *cc, dict *nodes, 
+    int from_file)
+{
+    cluster_route *route = NULL;
+    struct hiarray *slots = NULL;
+    cluster_node *master;
+    cluster_slot *slot, **slot_elem;
+    dictIterator *dit = NULL;
+    dictEntry *den;
+    listIter *lit = NULL;
+    listNode *lnode;
+    uint32_t k;
+    uint16_t index;
+    
+    route = cluster_route_create();
+    if(route == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,
+            "Route create failed: out of memory");
+        goto error;
+    }
+    
+    slots = hiarray_create(dictSize(nodes), sizeof(cluster_slot*));
+    if(slots == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "Slots array create failed: out of memory");
+        goto error;
+    }
+    route->slots = slots;
+    
+    dit = dictGetIterator(nodes);
+    if(dit == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,
+            "Dict get iterator failed: out of memory");
+        goto error;
+    }
+    
+    while((den = dictNext(dit))){
+        master = dictGetEntryVal(den);
+        if(master->role != REDIS_ROLE_MASTER){
+            __redisClusterSetError(cc,REDIS_ERR_OOM,
+                "Node role must be master");
+            goto error;
+        }
+
+        if(master->slots == NULL){
+            continue;
+        }
+
+        index = cluster_route_node_index(route, master);
+        if(index == 0){
+            __redisClusterSetError(cc, REDIS_ERR_OOM,
+                "Route node index failed: out of memory");
+            goto error;
+        }
+        
+        lit = listGetIterator(master->slots, AL_START_HEAD);
+        if(lit == NULL){
+            __redisClusterSetError(cc, REDIS_ERR_OOM,
+                "List get iterator failed: out of memory");
+            goto error;
+        }
+        
+        while((lnode = listNext(lit))){
+            slot = listNodeValue(lnode);
+            if(slot->start > slot->end || 
+                slot->end >= REDIS_CLUSTER_SLOTS){
+                __redisClusterSetError(cc, REDIS_ERR_OTHER,
+                    "Slot region for node is error");
+                goto error;
+            }
+
+            for(k = slot->start; k <= slot->end; k ++){
+                if(route->table[k] != 0){
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER,
+                        "Diffent node hold a same slot");
+                    goto error;
+                }
+
+                route->table[k] = index;
+            }
+            
+            slot_elem = hiarray_push(slots);
+            *slot_elem = slot;
+        }
+
+        listReleaseIterator(lit);
+        lit = NULL;
+    }
+
+    dictReleaseIterator(dit);
+    dit = NULL;
+
+    hiarray_sort(slots, cluster_slot_start_cmp);
+
+    route->from_file = from_file;
+    if(cluster_route_install(cc, route, nodes) != REDIS_OK){
+        return REDIS_ERR;
+    }
+
+    //saved by cluster_route_file_flush of the sync client
+    if(!from_file && cc->route_file != NULL){
+        cc->route_file_dirty = 1;
+    }
+    
+    return REDIS_OK;
+
+error:
+
+    if(dit != NULL){
+        dictReleaseIterator(dit);
+    }
+
+    if(lit != NULL){
+        listReleaseIterator(lit);    
+    }
+
+    cluster_route_release(route);
+
+    if(nodes != NULL){
+        dictRelease(nodes);
+    }
+    
+    return REDIS_ERR;
+}
+
+/**
+  * Update route with the "cluster nodes" or "cluster slots" command reply.
+  * The reply is not freed here, it still belongs to the caller.
+  */
+static int 
+cluster_update_route_by_reply(redisClusterContext *cc, redisReply *reply)
+{
+    dict *nodes = NULL;
+
+    if(cc == NULL || reply == NULL){
+        return REDIS_ERR;
+    }
+
+    if(cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS){
+        if(reply->type != REDIS_REPLY_ARRAY){
+            if(reply->type == REDIS_REPLY_ERROR){
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    reply->str);
+            }else{
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "Command(cluster slots) reply error: type is not array.");
+            }
+            
+            return REDIS_ERR;
+        }
+
+        nodes = parse_cluster_slots(cc, reply, cc->flags);
+    } else {
+        if(reply->type != REDIS_REPLY_STRING){
+            if(reply->type == REDIS_REPLY_ERROR){
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    reply->str);
+            }else{
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "Command(cluster nodes) reply error: type is not string.");
+            }
+            
+            return REDIS_ERR;
+        }
+
+        nodes = parse_cluster_nodes(cc, reply->str, reply->len, cc->flags);
+    }
+
+    if(nodes == NULL){
+        return REDIS_ERR;
+    }
+
+    return cluster_update_route_by_nodes(cc, nodes, 0);
+}
+
+/* Get the value of the field name in the reply of alternating field 
+ * names and values, like the key specs of COMMAND. */
+static redisReply *cluster_reply_field(redisReply *reply, const char *name)
+{
+    size_t i;
+
+    if(reply == NULL || reply->type != REDIS_REPLY_ARRAY)
+    {
+        return NULL;
+    }
+
+    for(i = 0; i + 1 < reply->elements; i += 2)
+    {
+        if(reply->element[i]->type == REDIS_REPLY_STRING && 
+            strcasecmp(reply->element[i]->str, name) == 0)
+        {
+            return reply->element[i + 1];
+        }
+    }
+
+    return NULL;
+}
+
+static int cluster_reply_field_int(redisReply *reply, const char *name, 
+    int *value)
+{
+    reply = cluster_reply_field(reply, name);
+    if(reply == NULL || reply->type != REDIS_REPLY_INTEGER)
+    {
+        return REDIS_ERR;
+    }
+
+    *value = (int)reply->integer;
+
+    return REDIS_OK;
+}
+
+/**
+  * Fill the key spec by the one of the COMMAND reply of redis 7.0:
+  *   "begin_search" ["type" "index" "spec" ["index" 1]] or
+  *                  ["type" "keyword" "spec" ["keyword" "STREAMS" "startfrom" 1]]
+  *   "find_keys"    ["type" "range" "spec" ["lastkey" 0 "keystep" 1 "limit" 0]] or
+  *                  ["type" "keynum" "spec" ["keynumidx" 0 "firstkey" 1 "keystep" 1]]
+  * Return REDIS_ERR if the keys can not be found by it.
+  */
+static int cluster_key_spec_parse(struct cmd_key_spec *spec, redisReply *reply)
+{
+    redisReply *begin, *find, *type, *args, *keyword;
+
+    begin = cluster_reply_field(reply, "begin_search");
+    find = cluster_reply_field(reply, "find_keys");
+    
+    type = cluster_reply_field(begin, "type");
+    args = cluster_reply_field(begin, "spec");
+    if(type == NULL || type->type != REDIS_REPLY_STRING)
+    {
+        return REDIS_ERR;
+    }
+
+    if(strcmp(type->str, "index") == 0)
+    {
+        spec->begin = CMD_KEY_BEGIN_INDEX;
+        if(cluster_reply_field_int(args, "index", &spec->index) != REDIS_OK)
+        {
+            return REDIS_ERR;
+        }
+    }
+    else if(strcmp(type->str, "keyword") == 0)
+    {
+        spec->begin = CMD_KEY_BEGIN_KEYWORD;
+        keyword = cluster_reply_field(args, "keyword");
+        if(keyword == NULL || keyword->type != REDIS_REPLY_STRING ||
+            cluster_reply_field_int(args, "startfrom", 
+            &spec->startfrom) != REDIS_OK)
+        {
+            return REDIS_ERR;
+        }
+
+        spec->keyword = hi_alloc(keyword->len + 1);
+        if(spec->keyword == NULL)
+        {
+            return REDIS_ERR;
+        }
+        memcpy(spec->keyword, keyword->str, keyword->len);
+        spec->keyword[keyword->len] = '\0';
+    }
+    else
+    {
+        return REDIS_ERR;
+    }
+
+    type = cluster_reply_field(find, "type");
+    args = cluster_reply_field(find, "spec");
+    if(type == NULL || type->type != REDIS_REPLY_STRING)
+    {
+        return REDIS_ERR;
+    }
+
+    if(strcmp(type->str, "range") == 0)
+    {
+        spec->find = CMD_KEY_FIND_RANGE;
+        if(cluster_reply_field_int(args, "lastkey", &spec->lastkey) != REDIS_OK ||
+            cluster_reply_field_int(args, "keystep", &spec->keystep) != REDIS_OK ||
+            cluster_reply_field_int(args, "limit", &spec->limit) != REDIS_OK)
+        {
+            return REDIS_ERR;
+        }
+    }
+    else if(strcmp(type->str, "keynum") == 0)
+    {
+        spec->find = CMD_KEY_FIND_KEYNUM;
+        if(cluster_reply_field_int(args, "keynumidx", &spec->keynumidx) != REDIS_OK ||
+            cluster_reply_field_int(args, "firstkey", &spec->firstkey) != REDIS_OK ||
+            cluster_reply_field_int(args, "keystep", &spec->keystep) != REDIS_OK)
+        {
+            return REDIS_ERR;
+        }
+    }
+    else
+    {
+        return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+/**
+  * Add the command of an element of the COMMAND reply, and its 
+  * subcommands, to infos. The element is:
+  *   name, arity, flags, first key, last key, step, 
+  *   (redis 6.0) acl categories, (redis 7.0) tips, key specs, subcommands
+  * The key specs are used if the server has them, the first key, last
+  * key and step otherwise.
+  */
+static int cluster_command_info_add(dict *infos, redisReply *elem)
+{
+    struct cmd_info *info;
+    redisReply *specs = NULL, *subs = NULL;
+    uint32_t i, n;
+    int first, last;
+    sds name;
+
+    if(elem->type != REDIS_REPLY_ARRAY || elem->elements < 6 ||
+        elem->element[0]->type != REDIS_REPLY_STRING ||
+        elem->element[1]->type != REDIS_REPLY_INTEGER ||
+        elem->element[3]->type != REDIS_REPLY_INTEGER ||
+        elem->element[4]->type != REDIS_REPLY_INTEGER ||
+        elem->element[5]->type != REDIS_REPLY_INTEGER)
+    {
+        return REDIS_ERR;
+    }
+
+    if(elem->elements > 8 && elem->element[8]->type == REDIS_REPLY_ARRAY)
+    {
+        specs = elem->element[8];
+    }
+
+    if(elem->elements > 9 && elem->element[9]->type == REDIS_REPLY_ARRAY)
+    {
+        subs = elem->element[9];
+    }
+
+    first = (int)elem->element[3]->integer;
+    last = (int)elem->element[4]->integer;
+
+    if(specs != NULL)
+    {
+        n = (uint32_t)specs->elements;
+    }
+    else
+    {
+        n = first > 0 ? 1 : 0;
+    }
+
+    info = cmd_info_create(elem->element[0]->str, 
+        (uint32_t)elem->element[0]->len, 
+        (int)elem->element[1]->integer, n);
+    if(info == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(specs != NULL)
+    {
+        //the key specs can not be used are dropped
+        n = 0;
+        for(i = 0; i < specs->elements; i ++)
+        {
+            if(cluster_key_spec_parse(&info->key_specs[n], 
+                specs->element[i]) == REDIS_OK)
+            {
+                n ++;
+            }
+            else if(info->key_specs[n].keyword != NULL)
+            {
+                hi_free(info->key_specs[n].keyword);
+                info->key_specs[n].keyword = NULL;
+            }
+        }
+        info->nkey_specs = n;
+    }
+    else if(n > 0)
+    {
+        info->key_specs[0].begin = CMD_KEY_BEGIN_INDEX;
+        info->key_specs[0].index = first;
+        info->key_specs[0].find = CMD_KEY_FIND_RANGE;
+        info->key_specs[0].lastkey = last < 0 ? last : last - first;
+        info->key_specs[0].keystep = (int)elem->element[5]->integer;
+    }
+
+    info->subcommands = subs != NULL && subs->elements > 0;
+
+    name = sdsnew(info->name);
+    if(name == NULL)
+    {
+        cmd_info_destroy(info);
+        return REDIS_ERR;
+    }
+
+    if(dictReplace(infos, name, info) == 0)
+    {
+        //replaced, the key in the table is kept
+        sdsfree(name);
+    }
+
+    if(subs != NULL)
+    {
+        for(i = 0; i < subs->elements; i ++)
+        {
+            if(cluster_command_info_add(infos, subs->element[i]) != REDIS_OK)
+            {
+                return REDIS_ERR;
+            }
+        }
+    }
+
+    return REDIS_OK;
+}
+
+/* Replace the command infos by the ones in the COMMAND reply. */
+static int cluster_command_infos_set(redisClusterContext *cc, 
+    redisReply *reply)
+{
+    dict *infos;
+    size_t i;
+
+    if(reply->type != REDIS_REPLY_ARRAY || reply->elements == 0)
+    {
+        return REDIS_ERR;
+    }
+
+    infos = dictCreate(&clusterCommandInfoDictType, NULL);
+    if(infos == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    for(i = 0; i < reply->elements; i ++)
+    {
+        if(cluster_command_info_add(infos, reply->element[i]) != REDIS_OK)
+        {
+            dictRelease(infos);
+            return REDIS_ERR;
+        }
+    }
+
+    if(cc->command_infos != NULL)
+    {
+        dictRelease(cc->command_infos);
+    }
+    
+    cc->command_infos = infos;
+
+    return REDIS_OK;
+}
+
+/**
+  * Load the server commands by COMMAND on c, an idle connection of 
+  * the route update, or on a new connection to a node if c is NULL.
+  * The commands loaded before are kept if it fails.
+  */
+static void cluster_command_infos_load(redisClusterContext *cc, 
+    redisContext *c)
+{
+    redisContext *own = NULL;
+    redisReply *reply;
+    cluster_node *node = NULL;
+    dictIterator *di;
+    dictEntry *de;
+
+    if(c == NULL)
+    {
+        if(cc->nodes == NULL)
+        {
+            return;
+        }
+
+        di = dictGetIterator(cc->nodes);
+        while((de = dictNext(di)) != NULL)
+        {
+            node = dictGetEntryVal(de);
+            if(node != NULL && node->host != NULL && node->port > 0)
+            {
+                break;
+            }
+            node = NULL;
+        }
+        dictReleaseIterator(di);
+
+        if(node == NULL)
+        {
+            return;
+        }
+
+        if(cc->connect_timeout)
+        {
+            own = redisConnectWithTimeout(node->host, node->port, 
+                *cc->connect_timeout);
+        }
+        else
+        {
+            own = redisConnect(node->host, node->port);
+        }
+
+        c = own;
+    }
+    else
+    {
+        cluster_ctx_set_block(c, 1);
+    }
+
+    if(c == NULL || c->err)
+    {
+        goto done;
+    }
+
+    if(cc->timeout)
+    {
+        redisSetTimeout(c, *cc->timeout);
+    }
+
+    reply = redisCommand(c, REDIS_COMMAND_COMMAND);
+    if(reply != NULL)
+    {
+        //COMMAND renamed or disabled is not asked again by each route
+        //update, the empty infos know no command
+        if(cluster_command_infos_set(cc, reply) != REDIS_OK && 
+            cc->command_infos == NULL)
+        {
+            cc->command_infos = dictCreate(&clusterCommandInfoDictType, NULL);
+        }
+        
+        freeReplyObject(reply);
+    }
+
+done:
+
+    if(own != NULL)
+    {
+        redisFree(own);
+    }
+}
+
+/**
+  * Find the keys of the command split into the arguments args by the
+  * infos of the server commands. The result of the parser is kept if
+  * the server does not know the command either.
+  */
+static void cluster_command_parse_args_by_info(redisClusterContext *cc, 
+    struct cmd *command, const struct keypos *args, uint32_t nargs)
+{
+    struct cmd_info *info, *sub;
+    dictEntry *de;
+    sds name, subname;
+
+    name = sdsnewlen(args[0].start, args[0].end - args[0].start);
+    if(name == NULL)
+    {
+        command->result = CMD_PARSE_ENOMEM;
+        return;
+    }
+    sdstolower(name);
+
+    de = dictFind(cc->command_infos, name);
+    info = de != NULL ? dictGetEntryVal(de) : NULL;
+    
+    if(info != NULL && info->subcommands && nargs > 1)
+    {
+        //sdscatlen keeps the sds on failure, it is freed here
+        subname = sdscatlen(name, "|", 1);
+        if(subname != NULL)
+        {
+            name = subname;
+            subname = sdscatlen(name, args[1].start, 
+                args[1].end - args[1].start);
+        }
+        
+        if(subname == NULL)
+        {
+            sdsfree(name);
+            command->result = CMD_PARSE_ENOMEM;
+            return;
+        }
+        name = subname;
+        sdstolower(name);
+
+        de = dictFind(cc->command_infos, name);
+        sub = de != NULL ? dictGetEntryVal(de) : NULL;
+        if(sub != NULL)
+        {
+            info = sub;
+        }
+    }
+
+    sdsfree(name);
+
+    if(info == NULL)
+    {
+        command->result = CMD_PARSE_ERROR;
+        return;
+    }
+
+    redis_parse_cmd_by_info(command, args, nargs, info);
+}
+
+/**
+  * Find the keys of a command the parser does not know by the infos
+  * of the server commands. The result of the parser is kept if the 
+  * server does not know the command either.
+  */
+static void cluster_command_parse_by_info(redisClusterContext *cc, 
+    struct cmd *command)
+{
+    struct hiarray *args;
+
+    args = hiarray_create(8, sizeof(struct keypos));
+    if(args == NULL)
+    {
+        return;
+    }
+
+    redis_parse_args(command, args);
+    if(command->result == CMD_PARSE_OK)
+    {
+        cluster_command_parse_args_by_info(cc, command, 
+            hiarray_get(args, 0), hiarray_n(args));
+    }
+
+    args->nelem = 0;
+    hiarray_destroy(args);
+}
+
+/* A seed node probed for the route by cluster_update_route(). */
+typedef struct cluster_route_probe {
+    redisContext *c;
+    redisReply *reply;
+    int64_t epoch;      /* -1 if the reply can not be used */
+} cluster_route_probe;
+
+/**
+  * Get the max config epoch in the "cluster nodes" reply, the reply
+  * of "cluster slots" carries no epoch and gets 0.
+  * Return -1 if the reply can not be used to update the route.
+  */
+static int64_t 
+cluster_route_reply_epoch(redisClusterContext *cc, redisReply *reply)
+{
+    char *p, *end, *line_end, *field;
+    int64_t epoch, max_epoch = 0;
+    int i;
+
+    if(reply->type == REDIS_REPLY_ERROR){
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, reply->str);
+        return -1;
+    }
+
+    if(cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS){
+        if(reply->type != REDIS_REPLY_ARRAY){
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "Command(cluster slots) reply error: type is not array.");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if(reply->type != REDIS_REPLY_STRING){
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "Command(cluster nodes) reply error: type is not string.");
+        return -1;
+    }
+
+    p = reply->str;
+    end = reply->str + reply->len;
+    while(p < end){
+        line_end = memchr(p, '\n', end - p);
+        if(line_end == NULL){
+            line_end = end;
+        }
+
+        //<id> <ip:port> <flags> <master> <ping-sent> <pong-recv> <config-epoch> ...
+        field = p;
+        for(i = 0; i < 6 && field != NULL; i ++){
+            field = memchr(field, ' ', line_end - field);
+            if(field != NULL){
+                field ++;
+            }
+        }
+
+        if(field != NULL){
+            epoch = 0;
+            while(field < line_end && isdigit((unsigned char)*field)){
+                epoch = epoch * 10 + (*field - '0');
+                field ++;
+            }
+
+            if(epoch > max_epoch){
+                max_epoch = epoch;
+            }
+        }
+
+        p = line_end + 1;
+    }
+
+    return max_epoch;
+}
+
+static void 
+cluster_route_probe_start(redisClusterContext *cc, 
+    cluster_route_probe *probe, const char *ip, int port)
+{
+    probe->epoch = -1;
+    probe->reply = NULL;
+    
+    probe->c = redisConnectNonBlock(ip, port);
+    if(probe->c == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "Init redis context error(return NULL)");
+        return;
+    }else if(probe->c->err){
+        __redisClusterSetError(cc,probe->c->err,probe->c->errstr);
+        return;
+    }
+
+    if(cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS){
+        redisAppendCommand(probe->c, REDIS_COMMAND_CLUSTER_SLOTS);
+    }else{
+        redisAppendCommand(probe->c, REDIS_COMMAND_CLUSTER_NODES);
+    }
+}
+
+/* Flush the probe command and read the reply as the socket allows. */
+static void 
+cluster_route_probe_io(redisClusterContext *cc, 
+    cluster_route_probe *probe, short revents)
+{
+    redisContext *c = probe->c;
+    void *reply = NULL;
+    int done;
+
+    if(revents & POLLOUT){
+        if(redisBufferWrite(c, &done) != REDIS_OK){
+            goto error;
+        }
+    }
+
+    if(revents & (POLLIN | POLLERR | POLLHUP)){
+        if(redisBufferRead(c) != REDIS_OK){
+            goto error;
+        }
+
+        if(redisGetReplyFromReader(c, &reply) != REDIS_OK){
+            goto error;
+        }
+
+        if(reply != NULL){
+            probe->reply = reply;
+            probe->epoch = cluster_route_reply_epoch(cc, probe->reply);
+        }
+    }
+
+    return;
+
+error:
+
+    __redisClusterSetError(cc,c->err,c->errstr);
+}
+
+static int64_t 
+cluster_timeval_to_usec(const struct timeval *tv)
+{
+    return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+/**
+  * Update route with the "cluster nodes" or "cluster slots" command reply.
+  * If full, the seed and all the known nodes are probed at once with 
+  * non-blocking connections, the reply with the highest config epoch 
+  * arrived within one more round trip after the first valid one is used.
+  * Otherwise a few of the masters are probed, taking turns by the route
+  * version, and the first valid reply is used.
+  */
+static int
+cluster_route_probe_run(redisClusterContext *cc, int full)
+{
+    int ret = REDIS_ERR;
+    uint32_t i, n = 0, max_probes, pending, skip = 0, nnodes = 0;
+    cluster_route_probe *probes = NULL;
+    cluster_node **nodes = NULL;
+    struct pollfd *pfds = NULL;
+    redisContext *c;
+    cluster_node *node;
+    dictIterator *it;
+    dictEntry *de;
+    int best = -1;
+    int timeout_ms;
+    int64_t start, now, limit, deadline = -1, grace = -1;
+    
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if((cc->ip == NULL || cc->port <= 0) && cc->nodes == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "no server address");
+        return REDIS_ERR;
+    }
+
+    max_probes = (cc->nodes == NULL ? 0 : dictSize(cc->nodes)) + 1;
+    probes = hi_zalloc(max_probes * sizeof(*probes));
+    pfds = hi_zalloc(max_probes * sizeof(*pfds));
+    nodes = hi_zalloc(max_probes * sizeof(*nodes));
+    if(probes == NULL || pfds == NULL || nodes == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto done;
+    }
+
+    if(full && cc->ip != NULL && cc->port > 0)
+    {
+        cluster_route_probe_start(cc, &probes[n++], cc->ip, cc->port);
+    }
+
+    if(cc->nodes != NULL)
+    {
+        it = dictGetIterator(cc->nodes);
+        while ((de = dictNext(it)) != NULL)
+        {
+            node = dictGetEntryVal(de);
+            if(node == NULL || node->host == NULL || node->port <= 0)
+            {
+                continue;
+            }
+
+            if(full && cc->ip != NULL && cc->port == node->port && 
+                strcmp(cc->ip, node->host) == 0)
+            {
+                continue;
+            }
+
+            if(!full && node->role != REDIS_ROLE_MASTER)
+            {
+                continue;
+            }
+
+            nodes[nnodes ++] = node;
+        }
+        
+        dictReleaseIterator(it);
+    }
+
+    if(!full && nnodes > CLUSTER_ROUTE_PROBE_NODES)
+    {
+        skip = (uint32_t)(cc->route_version % nnodes);
+    }
+
+    for(i = 0; i < nnodes && (full || n < CLUSTER_ROUTE_PROBE_NODES); i ++)
+    {
+        node = nodes[(skip + i) % nnodes];
+        cluster_route_probe_start(cc, &probes[n++], node->host, node->port);
+    }
+
+    if(n == 0)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "no valid server address");
+        goto done;
+    }
+
+    start = hi_usec_now();
+    if(cc->connect_timeout != NULL || cc->timeout != NULL)
+    {
+        deadline = start;
+        if(cc->connect_timeout != NULL)
+        {
+            deadline += cluster_timeval_to_usec(cc->connect_timeout);
+        }
+        if(cc->timeout != NULL)
+        {
+            deadline += cluster_timeval_to_usec(cc->timeout);
+        }
+    }
+
+    while(1)
+    {
+        pending = 0;
+        for(i = 0; i < n; i ++)
+        {
+            c = probes[i].c;
+            pfds[i].fd = -1;
+            pfds[i].events = 0;
+            pfds[i].revents = 0;
+            
+            if(c == NULL || c->err || probes[i].reply != NULL)
+            {
+                continue;
+            }
+
+            pfds[i].fd = c->fd;
+            pfds[i].events = POLLIN;
+            if(sdslen(c->obuf) > 0)
+            {
+                pfds[i].events |= POLLOUT;
+            }
+            
+            pending ++;
+        }
+
+        if(pending == 0)
+        {
+            break;
+        }
+
+        limit = deadline;
+        if(grace >= 0 && (limit < 0 || grace < limit))
+        {
+            limit = grace;
+        }
+
+        now = hi_usec_now();
+        if(limit < 0)
+        {
+            timeout_ms = -1;
+        }
+        else if(now >= limit)
+        {
+            break;
+        }
+        else
+        {
+            timeout_ms = (int)((limit - now + 999)/1000);
+        }
+
+        if(poll(pfds, n, timeout_ms) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            __redisClusterSetError(cc, REDIS_ERR_IO, "poll(2) error");
+            break;
+        }
+
+        for(i = 0; i < n; i ++)
+        {
+            if(pfds[i].fd < 0 || pfds[i].revents == 0)
+            {
+                continue;
+            }
+
+            cluster_route_probe_io(cc, &probes[i], pfds[i].revents);
+            if(probes[i].epoch < 0)
+            {
+                continue;
+            }
+
+            if(best < 0)
+            {
+                //wait one more round trip for a newer route
+                now = hi_usec_now();
+                grace = (!full || cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS) ? 
+                    now : now + (now - start);
+            }
+            
+            if(best < 0 || probes[i].epoch > probes[best].epoch)
+            {
+                best = i;
+            }
+        }
+    }
+
+    while(best >= 0)
+    {
+        ret = cluster_update_route_by_reply(cc, probes[best].reply);
+        if(ret == REDIS_OK)
+        {
+            break;
+        }
+
+        probes[best].epoch = -1;
+        best = -1;
+        for(i = 0; i < n; i ++)
+        {
+            if(probes[i].epoch >= 0 && 
+                (best < 0 || probes[i].epoch > probes[best].epoch))
+            {
+                best = i;
+            }
+        }
+    }
+
+    if(ret == REDIS_OK)
+    {
+        //the commands are loaded again only by the full probe
+        if(full || cc->command_infos == NULL)
+        {
+            cluster_command_infos_load(cc, probes[best].c);
+        }
+    }
+    else if(cc->err == 0)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "no valid route reply from the server addresses");
+    }
+
+done:
+
+    if(probes != NULL)
+    {
+        for(i = 0; i < n; i ++)
+        {
+            if(probes[i].reply != NULL)
+            {
+                freeReplyObject(probes[i].reply);
+            }
+            
+            if(probes[i].c != NULL)
+            {
+                redisFree(probes[i].c);
+            }
+        }
+
+        hi_free(probes);
+    }
+
+    if(pfds != NULL)
+    {
+        hi_free(pfds);
+    }
+
+    if(nodes != NULL)
+    {
+        hi_free(nodes);
+    }
+
+    if(ret == REDIS_OK && cc->err)
+    {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
+
+    return ret;
+}
+
+/**
+  * Update route by the probes of cluster_route_probe_run. The connect
+  * probes all the nodes, a refresh probes a few masters first and all
+  * the nodes and the seed only if none of them answered.
+  */
+static int
+cluster_update_route_probe(redisClusterContext *cc)
+{
+    int ret;
+    
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+    
+    if(cc->route != NULL && cc->nodes != NULL && 
+        dictSize(cc->nodes) > 0 &&
+        cluster_route_probe_run(cc, 0) == REDIS_OK)
+    {
+        cluster_route_file_flush(cc);
+        return REDIS_OK;
+    }
+
+    if(cc->err)
+    {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
+
+    ret = cluster_route_probe_run(cc, 1);
+    cluster_route_file_flush(cc);
+
+    return ret;
+}
+
+/**
+  * Update route. The contexts attached to a route share fetch the route 
+  * one at a time, and a context just picks up the route published by 
+  * another one since its own route was installed.
+  */
+int
+cluster_update_route(redisClusterContext *cc)
+{
+    int ret;
+    redisClusterRouteShare *share;
+    
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    share = cc->route_share;
+    if(share == NULL)
+    {
+        return cluster_update_route_probe(cc);
+    }
+
+    if(route_share_version(share) != cc->route_version)
+    {
+        //the route is fetched by another context, not the commands
+        ret = cluster_route_sync(cc);
+        if(ret == REDIS_OK && cc->command_infos == NULL)
+        {
+            cluster_command_infos_load(cc, NULL);
+        }
+        
+        return ret;
+    }
+
+    if(__atomic_exchange_n(&share->updating, 1, __ATOMIC_ACQUIRE))
+    {
+        //no route to use yet, fetch it anyway
+        if(cc->route == NULL)
+        {
+            return cluster_update_route_probe(cc);
+        }
+        
+        //wait for the update of the other context and take its route
+        cc->route_update_coalesced ++;
+        while(__atomic_load_n(&share->updating, __ATOMIC_ACQUIRE))
+        {
+            poll(NULL, 0, 1);
+        }
+        
+        return cluster_route_sync(cc);
+    }
+
+    ret = cluster_update_route_probe(cc);
+
+    __atomic_store_n(&share->updating, 0, __ATOMIC_RELEASE);
+
+    return ret;
+}
+
+static void print_cluster_node_list(redisClusterContext *cc)
+{
+    dictIterator *di = NULL;
+    dictEntry *de;
+    listIter *it;
+    listNode *ln;
+    cluster_node *master, *slave;
+    hilist *slaves;
+
+    if(cc == NULL)
+    {
+        return;
+    }
+
+    di = dictGetIterator(cc->nodes);
+
+    printf("name\taddress\trole\tslaves\n");
+    
+    while((de = dictNext(di)) != NULL) {
+        master = dictGetEntryVal(de);
+
+        printf("%s\t%s\t%d\t%s\n",master->name, master->addr, 
+            master->role, master->slaves?"hava":"null");
+
+        slaves = master->slaves;
+        if(slaves == NULL)
+        {
+            continue;
+        }
+        
+        it = listGetIterator(slaves, AL_START_HEAD);
+        while((ln = listNext(it)) != NULL)
+        {
+            slave = listNodeValue(ln);
+            printf("%s\t%s\t%d\t%s\n",slave->name, slave->addr, 
+                slave->role, slave->slaves?"hava":"null");
+        }
+
+        listReleaseIterator(it);
+
+        printf("\n");
+    }
+}
+
+
+/* Route update governor: only one route update is in flight at a time,
+ * and two route updates start at least cc->route_update_interval apart.
+ * A request arrived during the route update in flight waits for it,
+ * and a request arrived too early is delayed to the end of the interval
+ * through cc->update_route_time, where all such requests are merged.
+ */
+static int cluster_route_update_admit(redisClusterContext *cc, int64_t now)
+{
+    int64_t next;
+    
+    if(cc->route_updating)
+    {
+        cc->route_update_coalesced ++;
+        return CLUSTER_ROUTE_UPDATE_COALESCED;
+    }
+
+    if(cc->last_route_update_time > 0 && cc->route_update_interval > 0)
+    {
+        next = cc->last_route_update_time + cc->route_update_interval;
+        if(now < next)
+        {
+            cc->route_update_skipped ++;
+            if(cc->update_route_time == 0 || cc->update_route_time > next)
+            {
+                cc->update_route_time = next;
+            }
+            
+            return CLUSTER_ROUTE_UPDATE_SKIPPED;
+        }
+    }
+
+    return CLUSTER_ROUTE_UPDATE_START;
+}
+
+static void cluster_route_update_started(redisClusterContext *cc, int64_t now)
+{
+    cc->route_updating = 1;
+    cc->last_route_update_time = now;
+    cc->route_update_count ++;
+}
+
+/* Update the route through the governor. A merged or delayed request
+ * keeps the current route and returns CLUSTER_ROUTE_UPDATE_COALESCED
+ * or CLUSTER_ROUTE_UPDATE_SKIPPED instead of REDIS_OK.
+ */
+static int cluster_update_route_governed(redisClusterContext *cc)
+{
+    int ret;
+    int64_t now;
+
+    now = hi_usec_now();
+    ret = cluster_route_update_admit(cc, now);
+    if(ret != CLUSTER_ROUTE_UPDATE_START)
+    {
+        return ret;
+    }
+
+    cluster_route_update_started(cc, now);
+    ret = cluster_update_route(cc);
+    cc->route_updating = 0;
+
+    if(ret == REDIS_OK)
+    {
+        cc->update_route_time = 0LL;
+    }
+
+    return ret;
+}
+
+int test_cluster_update_route(redisClusterContext *cc)
+{
+    int ret;
+    
+    ret = cluster_update_route(cc);
+
+    //print_cluster_node_list(cc);
+    
+    return ret;
+}
+
+int test_cluster_command_infos_set(redisClusterContext *cc, redisReply *reply)
+{
+    return cluster_command_infos_set(cc, reply);
+}
+
+/* Find the keys of the command like a formatted command is parsed. */
+void test_cluster_command_parse(redisClusterContext *cc, struct cmd *command)
+{
+    redis_parse_cmd(command);
+    if(command->result == CMD_PARSE_ERROR && 
+        command->type == CMD_UNKNOWN && cc->command_infos != NULL)
+    {
+        cluster_command_parse_by_info(cc, command);
+    }
+}
+
+redisClusterContext *redisClusterContextInit(void) {
+    redisClusterContext *cc;
+
+    cc = calloc(1,sizeof(redisClusterContext));
+    if (cc == NULL)
+        return NULL;
+
+    cc->err = 0;
+    cc->errstr[0] = '\0';
+    cc->ip = NULL;
+    cc->port = 0;
+    cc->flags = 0;
+    cc->connect_timeout = NULL;
+    cc->timeout = NULL;
+    cc->nodes = NULL;
+    cc->route = NULL;
+    cc->route_share = NULL;
+    cc->route_nodes = NULL;
+    cc->route_file = NULL;
+    cc->route_file_dirty = 0;
+    cc->max_redirect_count = CLUSTER_DEFAULT_MAX_REDIRECT_COUNT;
+    cc->retry_count = 0;
+    cc->read_preference = HIRCLUSTER_READ_MASTER;
+    cc->command_infos = NULL;
+    cc->ask_slots = NULL;
+    cc->requests = NULL;
+    cc->requests_fetched = 0;
+    cc->requests_redirected = 0;
+    cc->need_update_route = 0;
+    cc->update_route_time = 0LL;
+
+    cc->route_updating = 0;
+    cc->route_update_interval = CLUSTER_DEFAULT_ROUTE_UPDATE_INTERVAL;
+    cc->last_route_update_time = 0LL;
+    cc->route_update_count = 0;
+    cc->route_update_skipped = 0;
+    cc->route_update_coalesced = 0;
+
+    cc->route_version = 0LL;
+
+    cc->flags |= REDIS_BLOCK;
+    
+    return cc;
+}
+
+void redisClusterFree(redisClusterContext *cc) {
+    
+    if (cc == NULL)
+        return;
+
+    if(cc->ip)
+    {
+        sdsfree(cc->ip);
+        cc->ip = NULL;
+    }
+
+    if (cc->connect_timeout)
+    {
+        free(cc->connect_timeout);
+    }
+
+    if (cc->timeout)
+    {
+        free(cc->timeout);
+    }
+
+    cluster_route_release(cc->route);
+    cc->route = NULL;
+
+    if(cc->route_nodes != NULL)
+    {
+        hi_free(cc->route_nodes);
+    }
+
+    if(cc->route_file != NULL)
+    {
+        sdsfree(cc->route_file);
+    }
+
+    if(cc->nodes != NULL)
+    {
+        dictRelease(cc->nodes);
+    }
+
+    if(cc->route_share != NULL)
+    {
+        redisClusterRouteShareRelease(cc->route_share);
+    }
+
+    if(cc->command_infos != NULL)
+    {
+        dictRelease(cc->command_infos);
+    }
+
+    if(cc->ask_slots != NULL)
+    {
+        listRelease(cc->ask_slots);
+    }
+
+    if(cc->requests != NULL)
+    {
+        listRelease(cc->requests);
+    }
+    
+    free(cc);
+}
+
+/* Connect to a Redis cluster. On error the field error in the returned
+ * context will be set to the return value of the error function.
+ * When no set of reply functions is given, the default set will be used. */
+static int _redisClusterConnect2(redisClusterContext *cc)
+{
+
+    if ((cc->nodes == NULL || dictSize(cc->nodes) == 0) && 
+        (cc->route_share == NULL || route_share_version(cc->route_share) == 0))
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"servers address does not set up");
+        return REDIS_ERR;
+    }
+
+    if(cc->route_file != NULL && cc->route == NULL && 
+        (cc->route_share == NULL || route_share_version(cc->route_share) == 0) &&
+        cluster_route_file_load(cc) == REDIS_OK)
+    {
+        cc->update_route_time = hi_usec_now() + 
+            CLUSTER_DEFAULT_ROUTE_UPDATE_DELAY;
+        return REDIS_OK;
+    }
+    
+    return cluster_update_route(cc);
+}
+
+/* Connect to a Redis cluster. On error the field error in the returned
+ * context will be set to the return value of the error function.
+ * When no set of reply functions is given, the default set will be used. */
+static redisClusterContext *_redisClusterConnect(redisClusterContext *cc, const char *addrs) {
+
+    int ret;
+    
+    ret = redisClusterSetOptionAddNodes(cc, addrs);
+    if (ret != REDIS_OK)
+    {
+        return cc;
+    }
+    
+    cluster_update_route(cc);
+
+    return cc;
+}
+
+redisClusterContext *redisClusterConnect(const char *addrs, int flags)
+{
+    redisClusterContext *cc;
+
+    cc = redisClusterContextInit();
+
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    cc->flags |= REDIS_BLOCK;
+    if(flags)
+    {
+        cc->flags |= flags;
+    }
+    
+    return _redisClusterConnect(cc, addrs);
+}
+
+redisClusterContext *redisClusterConnectWithTimeout(
+    const char *addrs, const struct timeval tv, int flags)
+{
+    redisClusterContext *cc;
+
+    cc = redisClusterContextInit();
+
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    cc->flags |= REDIS_BLOCK;
+    if(flags)
+    {
+        cc->flags |= flags;
+    }
+    
+    if (cc->connect_timeout == NULL)
+    {
+        cc->connect_timeout = malloc(sizeof(struct timeval));
+    }
+    
+    memcpy(cc->connect_timeout, &tv, sizeof(struct timeval));
+    
+    return _redisClusterConnect(cc, addrs);
+}
+
+redisClusterContext *redisClusterConnectNonBlock(const char *addrs, int flags) {
+
+    redisClusterContext *cc;
+
+    cc = redisClusterContextInit();
+
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    cc->flags &= ~REDIS_BLOCK;
+    if(flags)
+    {
+        cc->flags |= flags;
+    }
+    
+    return _redisClusterConnect(cc, addrs);
+}
+
+int redisClusterSetOptionAddNode(redisClusterContext *cc, const char *addr)
+{
+    dictEntry *node_entry;
+    cluster_node *node;
+    sds *ip_port = NULL;
+    int ip_port_count = 0;
+    sds ip;
+    int port;
+    sds addr_sds = NULL;
+    
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(cc->nodes == NULL)
+    {
+        cc->nodes = dictCreate(&clusterNodesDictType, NULL);
+        if(cc->nodes == NULL)
+        {
+            return REDIS_ERR;
+        }
+    }
+
+    addr_sds = sdsnew(addr);
+    node_entry = dictFind(cc->nodes, addr_sds);
+    sdsfree(addr_sds);
+    if(node_entry == NULL)
+    {
+        ip_port = sdssplitlen(addr, strlen(addr), 
+            IP_PORT_SEPARATOR, strlen(IP_PORT_SEPARATOR), &ip_port_count);
+        if(ip_port == NULL || ip_port_count != 2 || 
+            sdslen(ip_port[0]) <= 0 || sdslen(ip_port[1]) <= 0)
+        {
+            if(ip_port != NULL)
+            {
+                sdsfreesplitres(ip_port, ip_port_count);
+            }
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"server address is error(correct is like: 127.0.0.1:1234)");
+            return REDIS_ERR;
+        }
+
+        ip = ip_port[0];
+        port = hi_atoi(ip_port[1], sdslen(ip_port[1]));
+
+        if(port <= 0)
+        {
+            sdsfreesplitres(ip_port, ip_port_count);
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"server port is error");
+            return REDIS_ERR;
+        }
+
+        sdsfree(ip_port[1]);
+        free(ip_port);
+        ip_port = NULL;
+    
+        node = hi_alloc(sizeof(cluster_node));
+        if(node == NULL)
+        {
+            sdsfree(ip);
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"alloc cluster node error");
+            return REDIS_ERR;
+        }
+
+        cluster_node_init(node);
+
+        node->addr = sdsnew(addr);
+        if(node->addr == NULL)
+        {
+            sdsfree(ip);
+            hi_free(node);
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"new node address error");
+            return REDIS_ERR;
+        }
+
+        node->host = ip;
+        node->port = port;
+
+        dictAdd(cc->nodes, sdsnewlen(node->addr, sdslen(node->addr)), node);
+    }
+    
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionAddNodes(redisClusterContext *cc, const char *addrs)
+{
+    int ret;
+    sds *address = NULL;
+    int address_count = 0;
+    int i;
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    address = sdssplitlen(addrs, strlen(addrs), CLUSTER_ADDRESS_SEPARATOR, 
+        strlen(CLUSTER_ADDRESS_SEPARATOR), &address_count);
+    if(address == NULL || address_count <= 0)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"servers address is error(correct is like: 127.0.0.1:1234,127.0.0.2:5678)");
+        return REDIS_ERR;
+    }
+
+    for(i = 0; i < address_count; i ++)
+    {
+        ret = redisClusterSetOptionAddNode(cc, address[i]);
+        if(ret != REDIS_OK)
+        {
+            sdsfreesplitres(address, address_count);
+            return REDIS_ERR;
+        }
+    }
+
+    sdsfreesplitres(address, address_count);
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionConnectBlock(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= REDIS_BLOCK;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionConnectNonBlock(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags &= ~REDIS_BLOCK;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionParseSlaves(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= HIRCLUSTER_FLAG_ADD_SLAVE;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionParseOpenSlots(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= HIRCLUSTER_FLAG_ADD_OPENSLOT;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionRouteUseSlots(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= HIRCLUSTER_FLAG_ROUTE_USE_SLOTS;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionConnectTimeout(redisClusterContext *cc, const struct timeval tv)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if (cc->connect_timeout == NULL)
+    {
+        cc->connect_timeout = malloc(sizeof(struct timeval));
+    }
+    
+    memcpy(cc->connect_timeout, &tv, sizeof(struct timeval));
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionTimeout(redisClusterContext *cc, const struct timeval tv)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if (cc->timeout == NULL)
+    {
+        cc->timeout = malloc(sizeof(struct timeval));
+        memcpy(cc->timeout, &tv, sizeof(struct timeval));
+    }
+    else if (cc->timeout->tv_sec != tv.tv_sec || cc->timeout->tv_usec != tv.tv_usec)
+    {
+        memcpy(cc->timeout, &tv, sizeof(struct timeval));
+
+        if (cc->nodes && dictSize(cc->nodes) > 0)
+        {
+            dictEntry *de;
+            dictIterator *di;
+            cluster_node *node;
+
+            di = dictGetIterator(cc->nodes);
+
+            while (de=dictNext(di))
+            {
+                node = dictGetEntryVal(de);
+                if (node->con && node->con->flags&REDIS_CONNECTED && node->con->err == 0)
+                {
+                    redisSetTimeout(node->con, tv);
+                }
+
+                if (node->slaves && listLength(node->slaves) > 0)
+                {
+                    cluster_node *slave;
+                    listIter *li;
+                    listNode *ln;
+                    
+                    li = listGetIterator(node->slaves, AL_START_HEAD);
+                    while (ln = listNext(li))
+                    {
+                        slave = listNodeValue(ln);
+                        if (slave->con && slave->con->flags&REDIS_CONNECTED && slave->con->err == 0)
+                        {
+                            redisSetTimeout(slave->con, tv);
+                        }
+                    }
+
+                    listReleaseIterator(li);
+                }
+            }
+
+            dictReleaseIterator(di);
+        }
+    }
+    
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionMaxRedirect(redisClusterContext *cc, int max_redirect_count)
+{
+    if(cc == NULL || max_redirect_count <= 0)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->max_redirect_count = max_redirect_count;
+
+    return REDIS_OK;
+}
+
+/* Set the min interval between two route updates, 0 means no limit. */
+int redisClusterSetOptionRouteUpdateInterval(redisClusterContext *cc, 
+    const struct timeval tv)
+{
+    if(cc == NULL || tv.tv_sec < 0 || tv.tv_usec < 0)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->route_update_interval = tv.tv_sec * 1000000LL + tv.tv_usec;
+
+    return REDIS_OK;
+}
+
+/* Keep the route in the file, the route is loaded from it when 
+ * connecting, and saved to it after each route update of the sync
+ * client. The async client only saves the route of its connect. */
+int redisClusterSetOptionRouteFile(redisClusterContext *cc, const char *path)
+{
+    if(cc == NULL || path == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(cc->route_file != NULL)
+    {
+        sdsfree(cc->route_file);
+    }
+
+    cc->route_file = sdsnew(path);
+    if(cc->route_file == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+/* Set the node the read only commands are sent to, the replicas are
+ * parsed from the route for any preference but the master. */
+int redisClusterSetOptionReadPreference(redisClusterContext *cc, 
+    int read_preference)
+{
+    if(cc == NULL || read_preference < HIRCLUSTER_READ_MASTER || 
+        read_preference > HIRCLUSTER_READ_NEAREST)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->read_preference = read_preference;
+    if(read_preference != HIRCLUSTER_READ_MASTER)
+    {
+        cc->flags |= HIRCLUSTER_FLAG_ADD_SLAVE;
+    }
+
+    return REDIS_OK;
+}
+
+/* Attach the context to the route share before connecting, the route
+ * is then fetched once for all the contexts attached to the share. */
+int redisClusterSetOptionRouteShare(redisClusterContext *cc, 
+    redisClusterRouteShare *share)
+{
+    if(cc == NULL || share == NULL || cc->route_share != NULL || 
+        cc->route != NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    __atomic_add_fetch(&share->refcount, 1, __ATOMIC_RELAXED);
+    cc->route_share = share;
+
+    return REDIS_OK;
+}
+
+redisClusterRouteShare *redisClusterRouteShareCreate(void)
+{
+    redisClusterRouteShare *share;
+
+    share = hi_zalloc(sizeof(*share));
+    if(share == NULL)
+    {
+        return NULL;
+    }
+
+    share->refcount = 1;
+
+    return share;
+}
+
+/* Release the reference of the caller, the share is freed after all 
+ * the contexts attached to it are freed. */
+void redisClusterRouteShareRelease(redisClusterRouteShare *share)
+{
+    if(share == NULL)
+    {
+        return;
+    }
+
+    if(__atomic_sub_fetch(&share->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        return;
+    }
+
+    cluster_route_release(share->route);
+    hi_free(share);
+}
+
+int redisClusterConnect2(redisClusterContext *cc)
+{
+    
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+    
+    return _redisClusterConnect2(cc);
+}
+
+redisContext *ctx_get_by_node(redisClusterContext *cc, cluster_node *node)
+{
+    redisContext *c = NULL;
+    if(node == NULL)
+    {
+        return NULL;
+    }
+
+    c = node->con;
+    if(c != NULL)
+    {
+        if(c->err)
+        {
+            node->readonly &= ~CLUSTER_NODE_READONLY_CON;
+            redisReconnect(c);
+
+            if (cc->timeout && c->err == 0) {
+                redisSetTimeout(c, *cc->timeout);
+            }
+        }
+
+        return c;
+    }
+
+    if(node->host == NULL || node->port <= 0)
+    {
+        return NULL;
+    }
+
+    if(cc->connect_timeout)
+    {
+        c = redisConnectWithTimeout(node->host, node->port, *cc->connect_timeout);
+    }
+    else
+    {
+        c = redisConnect(node->host, node->port);
+    }
+
+    if (cc->timeout && c != NULL && c->err == 0) {
+        redisSetTimeout(c, *cc->timeout);
+    }
+
+    node->con = c;
+    node->readonly &= ~CLUSTER_NODE_READONLY_CON;
+
+    return c;
+}
+
+/* Get the connection to the replica for the reads, READONLY is sent
+ * once on each new connection. The replica is not used for reads 
+ * for a while if it fails. */
+static redisContext *ctx_get_by_replica(redisClusterContext *cc, 
+    cluster_node *node)
+{
+    redisContext *c;
+    redisReply *reply;
+
+    c = ctx_get_by_node(cc, node);
+    if(c == NULL || c->err)
+    {
+        goto down;
+    }
+
+    if(node->readonly & CLUSTER_NODE_READONLY_CON)
+    {
+        return c;
+    }
+
+    reply = redisCommand(c, REDIS_COMMAND_READONLY);
+    if(reply == NULL || reply->type != REDIS_REPLY_STATUS)
+    {
+        if(reply != NULL)
+        {
+            freeReplyObject(reply);
+        }
+        
+        goto down;
+    }
+
+    freeReplyObject(reply);
+    node->readonly |= CLUSTER_NODE_READONLY_CON;
+
+    return c;
+
+down:
+
+    node->down_until = hi_usec_now() + CLUSTER_REPLICA_DOWN_TIME;
+
+    return NULL;
+}
+
+/* Get the node the read only command for the slot of the master is sent
+ * to by the read preference, the healthy node with the least latency
+ * wins. Return NULL if no replica is healthy for the replica only reads.
+ */
+static cluster_node *node_get_for_read(redisClusterContext *cc, 
+    cluster_node *master)
+{
+    cluster_node *node, *best = NULL;
+    listIter li;
+    listNode *ln;
+    int64_t now;
+
+    if(cc->read_preference == HIRCLUSTER_READ_NEAREST)
+    {
+        best = master;
+    }
+
+    if(master->slaves != NULL)
+    {
+        now = hi_usec_now();
+        
+        listRewind(master->slaves, &li);
+        while((ln = listNext(&li)) != NULL)
+        {
+            node = listNodeValue(ln);
+            if(node->down_until > now)
+            {
+                continue;
+            }
+
+            if(best == NULL || node->latency < best->latency)
+            {
+                best = node;
+            }
+        }
+    }
+
+    if(best == NULL && cc->read_preference == HIRCLUSTER_READ_PREFER_REPLICA)
+    {
+        best = master;
+    }
+
+    return best;
+}
+
+static void node_latency_update(cluster_node *node, int64_t start)
+{
+    int64_t latency;
+
+    if(start <= 0)
+    {
+        return;
+    }
+
+    latency = hi_usec_now() - start;
+    if(latency < 0)
+    {
+        return;
+    }
+
+    node->latency = node->latency == 0 ? 
+        latency : (node->latency * 7 + latency) / 8;
+}
+
+static cluster_node *node_get_by_slot(redisClusterContext *cc, uint32_t slot_num)
+{
+    struct hiarray *slots;
+    uint32_t slot_count;
+    cluster_slot **slot;
+    uint32_t middle, start, end;
+    uint8_t stop = 0;
+    
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    if(slot_num >= REDIS_CLUSTER_SLOTS)
+    {
+        return NULL;
+    }
+
+    slots = cc->route ? cc->route->slots : NULL;
+    if(slots == NULL)
+    {
+        return NULL;
+    }
+    slot_count = hiarray_n(slots);
+
+    start = 0;
+    end = slot_count - 1;
+    middle = 0;
+
+    do{
+        if(start >= end)
+        {
+            stop = 1;
+            middle = end;
+        }
+        else
+        {
+            middle = start + (end - start)/2;
+        }
+
+        ASSERT(middle < slot_count);
+
+        slot = hiarray_get(slots, middle);
+        if((*slot)->start > slot_num)
+        {
+            end = middle - 1;
+        }
+        else if((*slot)->end < slot_num)
+        {
+            start = middle + 1;
+        }
+        else
+        {
+            return (*slot)->node;
+        }
+            
+        
+    }while(!stop);
+
+    printf("slot_num : %d\n", slot_num);
+    printf("slot_count : %d\n", slot_count);
+    printf("start : %d\n", start);
+    printf("end : %d\n", end);
+    printf("middle : %d\n", middle);
+
+    return NULL;
+}
+
+
+static cluster_node *node_get_by_table(redisClusterContext *cc, uint32_t slot_num)
+{   
+    uint16_t index;
+    
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    if(slot_num >= REDIS_CLUSTER_SLOTS)
+    {
+        return NULL;
+    }
+
+    if(cc->route_share != NULL)
+    {
+        cluster_route_sync(cc);
+    }
+
+    if(cc->route == NULL)
+    {
+        return NULL;
+    }
+
+    index = cc->route->table[slot_num];
+    if(index == 0)
+    {
+        return NULL;
+    }
+
+    //the shared route, get the node holding the connections
+    if(cc->route_nodes != NULL)
+    {
+        return cc->route_nodes[index];
+    }
+
+    return cc->route->node_list[index];
+}
+
+static cluster_node *node_get_witch_connected(redisClusterContext *cc)
+{
+    dictIterator *di;
+    dictEntry *de;
+    struct cluster_node *node;
+    redisContext *c = NULL;
+    redisReply *reply = NULL;
+
+    if(cc == NULL || cc->nodes == NULL)
+    {
+        return NULL;
+    }
+
+    di = dictGetIterator(cc->nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        node = dictGetEntryVal(de);
+        if(node == NULL)
+        {
+            continue;
+        }
+        
+        c = ctx_get_by_node(cc, node);
+        if(c == NULL || c->err)
+        {
+            continue;
+        }
+
+        reply = redisCommand(c, REDIS_COMMAND_PING);
+        if(reply != NULL && reply->type == REDIS_REPLY_STATUS &&
+            reply->str != NULL && strcmp(reply->str, "PONG") == 0)
+        {
+            freeReplyObject(reply);
+            reply = NULL;
+            
+            dictReleaseIterator(di);            
+        
+            return node;
+        }
+        else if(reply != NULL)
+        {
+            freeReplyObject(reply);
+            reply = NULL;
+        }
+    }
+
+    dictReleaseIterator(di);
+
+    return NULL;
+}
+
+static int slot_get_by_command(redisClusterContext *cc, char *cmd, int len)
+{
+    struct cmd *command = NULL;
+    struct keypos *kp;
+    int key_count;
+    uint32_t i;
+    int slot_num = -1;
+
+    if(cc == NULL || cmd == NULL || len <= 0)
+    {
+        goto done;
+    }
+
+    command = command_get();
+    if(command == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto done;
+    }
+    
+    command->cmd = cmd;
+    command->clen = len;
+    redis_parse_cmd(command);
+    if(command->result != CMD_PARSE_OK)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, "parse command error");
+        goto done;
+    }
+
+    key_count = hiarray_n(command->keys);
+
+    if(key_count <= 0)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "no keys in command(must have keys for redis cluster mode)");
+        goto done;
+    }
+    else if(key_count == 1)
+    {
+        kp = hiarray_get(command->keys, 0);
+        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+
+        goto done;
+    }
+    
+    for(i = 0; i < hiarray_n(command->keys); i ++)
+    {
+        kp = hiarray_get(command->keys, i);
+
+        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+    }
+
+done:
+    
+    if(command != NULL)
+    {
+        command->cmd = NULL;
+        command_destroy(command);
+    }
+    
+    return slot_num;
+}
+
+/* Helper function for the redisClusterAppendCommand* family of functions.
+ *
+ * Write a formatted command to the output buffer. When this family
+ * is used, you need to call redisGetReply yourself to retrieve
+ * the reply (or replies in pub/sub).
+ */
+static int __redisClusterAppendCommand(redisClusterContext *cc, 
+    struct cmd *command) {
+
+    cluster_node *node;
+    redisContext *c = NULL;
+
+    if(cc == NULL || command == NULL)
+    {
+        return REDIS_ERR;
+    }
+    
+    node = node_get_by_table(cc, (uint32_t)command->slot_num);
+    if(node == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by slot error");
+        return REDIS_ERR;
+    }
+
+    c = ctx_get_by_node(cc, node);
+    if(c == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
+        return REDIS_ERR;
+    }
+    else if(c->err)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
+
+    if (__redisAppendCommand(c, command->cmd, command->clen) != REDIS_OK) 
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
+
+    //the reply is read from this node even if the route changes
+    command->node = node;
+    
+    return REDIS_OK;
+}
+
+/* Get the node from the "MOVED/ASK <slot> <ip:port>" error reply,
+ * the node is created and added to cc->nodes if it does not exist.
+ * The slot in the reply is stored in slot_num if it is not NULL.
+ */
+static cluster_node *node_get_by_redirect_reply(
+    redisClusterContext *cc, redisReply *reply, int *slot_num)
+{
+    sds *part = NULL, *ip_port = NULL;
+    int part_len = 0, ip_port_len = 0;
+    int error_type, slot;
+    dictEntry *de;
+    cluster_node *node = NULL;
+
+    if(cc == NULL || reply == NULL || cc->nodes == NULL)
+    {
+        return NULL;
+    }
+
+    error_type = cluster_reply_error_type(reply);
+    if(error_type != CLUSTER_ERR_MOVED && error_type != CLUSTER_ERR_ASK)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "reply is not moved or ask error!");
+        return NULL;
+    }
+    
+    part = sdssplitlen(reply->str, reply->len, " ", 1, &part_len);
+    if(part == NULL || part_len != 3)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "redirect error reply parse error!");
+        goto done;
+    }
+
+    slot = hi_atoi(part[1], sdslen(part[1]));
+    if(slot < 0 || slot >= REDIS_CLUSTER_SLOTS)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "redirect error reply slot parse error!");
+        goto done;
+    }
+
+    ip_port = sdssplitlen(part[2], sdslen(part[2]), 
+        IP_PORT_SEPARATOR, strlen(IP_PORT_SEPARATOR), &ip_port_len);
+    if(ip_port == NULL || ip_port_len != 2 || 
+        !hi_valid_port(hi_atoi(ip_port[1], sdslen(ip_port[1]))))
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "redirect error reply address part parse error!");
+        goto done;
+    }
+
+    if(slot_num != NULL)
+    {
+        *slot_num = slot;
+    }
+
+    de = dictFind(cc->nodes, part[2]);
+    if(de != NULL)
+    {
+        node = dictGetEntryVal(de);
+        goto done;
+    }
+
+    node = hi_alloc(sizeof(cluster_node));
+    if(node == NULL)
+    {
+        __redisClusterSetError(cc, 
+            REDIS_ERR_OOM, "Out of memory");
+        goto done;
+    }
+
+    cluster_node_init(node);
+    node->addr = part[2];
+    node->host = ip_port[0];
+    node->port = hi_atoi(ip_port[1], sdslen(ip_port[1]));
+    node->role = REDIS_ROLE_MASTER;
+
+    if(dictAdd(cc->nodes, sdsnewlen(node->addr, sdslen(node->addr)), 
+        node) != DICT_OK)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "the address already exists in the nodes");
+        cluster_node_deinit(node);
+        hi_free(node);
+        part[2] = NULL;
+        ip_port[0] = NULL;
+        goto done;
+    }
+
+    part[2] = NULL;
+    ip_port[0] = NULL;
+
+done:
+
+    if(part != NULL)
+    {
+        sdsfreesplitres(part, part_len);
+        part = NULL;
+    }
+
+    if(ip_port != NULL)
+    {
+        sdsfreesplitres(ip_port, ip_port_len);
+        ip_port = NULL;
+    }
+    
+    return node;
+}
+
+/* Patch the slot in the route table with the node from the 
+ * "MOVED <slot> <ip:port>" error reply, instead of fetching the
+ * whole route. A full route update is scheduled to reconcile the
+ * table, it is coalesced for all the MOVED errors arrived before it.
+ */
+static cluster_node *cluster_update_route_by_moved(
+    redisClusterContext *cc, redisReply *reply)
+{
+    cluster_node *node;
+    int slot_num = -1;
+    uint16_t index;
+
+    node = node_get_by_redirect_reply(cc, reply, &slot_num);
+    if(node == NULL)
+    {
+        return NULL;
+    }
+
+    //the migration of the slot is over
+    cluster_ask_cache_drop(cc, (uint32_t)slot_num);
+
+    //drop the route loaded from the route file, update it instead
+    if(cc->route != NULL && cc->route->from_file)
+    {
+        return NULL;
+    }
+
+    //the shared route is read only, the full route update fixes it
+    if(cc->route != NULL && cc->route->nodes == NULL)
+    {
+        index = cluster_route_node_index(cc->route, node);
+        if(index != 0 && cc->route->table[slot_num] != index)
+        {
+            cc->route->table[slot_num] = index;
+            cc->route_version ++;
+        }
+    }
+
+    if(cc->update_route_time == 0)
+    {
+        cc->update_route_time = hi_usec_now() + 
+            CLUSTER_DEFAULT_ROUTE_UPDATE_DELAY;
+    }
+    else
+    {
+        cc->route_update_coalesced ++;
+    }
+
+    return node;
+}
+
+/* Do the full route update scheduled by cluster_update_route_by_moved
+ * when it is due and no pipelined request is waiting for replies.
+ */
+static void cluster_update_route_deferred(redisClusterContext *cc)
+{
+    int64_t now;
+
+    if(cc->update_route_time == 0)
+    {
+        return;
+    }
+
+    if(cc->requests != NULL && listLength(cc->requests) > 0)
+    {
+        return;
+    }
+
+    now = hi_usec_now();
+    if(now < cc->update_route_time)
+    {
+        return;
+    }
+
+    if(cluster_update_route_governed(cc) == REDIS_ERR)
+    {
+        //keep the patched route and try again later
+        cc->update_route_time = now + CLUSTER_DEFAULT_ROUTE_UPDATE_DELAY;
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
+}
+
+/* Helper function for the redisClusterGetReply* family of functions.
+ */
+static void *redis_cluster_command_execute(redisClusterContext *cc, 
+    struct cmd *command);
+
+/* Whether the replies of the pipelined requests other than the command
+ * are all read, the ones before it are answered and the ones behind it
+ * are read ahead by cluster_pipeline_fetch.
+ */
+static int cluster_requests_drained(redisClusterContext *cc, 
+    struct cmd *command)
+{
+    struct cmd *request, *sub_command;
+    listNode *ln, *ln_sub;
+
+    for(ln = listFirst(cc->requests); ln != NULL; ln = listNextNode(ln))
+    {
+        request = listNodeValue(ln);
+        if(request == command)
+        {
+            continue;
+        }
+        
+        if(request->sub_commands == NULL)
+        {
+            if(request->reply == NULL)
+            {
+                return 0;
+            }
+            
+            continue;
+        }
+
+        for(ln_sub = listFirst(request->sub_commands); ln_sub != NULL; 
+            ln_sub = listNextNode(ln_sub))
+        {
+            sub_command = listNodeValue(ln_sub);
+            if(sub_command != command && sub_command->reply == NULL)
+            {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static int __redisClusterGetReply(redisClusterContext *cc, 
+    struct cmd *command, void **reply)
+{
+    cluster_node *node;
+    redisContext *c;
+    int slot_num, error_type;
+
+    if(cc == NULL || command == NULL || reply == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    //the reply read ahead by cluster_pipeline_fetch
+    if(command->reply != NULL)
+    {
+        *reply = command->reply;
+        command->reply = NULL;
+        goto moved;
+    }
+
+    slot_num = command->slot_num;
+    if(slot_num < 0)
+    {
+        return REDIS_ERR;
+    }
+
+    node = command->node;
+    if(node == NULL)
+    {
+        node = node_get_by_table(cc, (uint32_t)slot_num);
+    }
+    
+    if(node == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table is null");
+        return REDIS_ERR;
+    }
+
+    c = ctx_get_by_node(cc, node);
+    if(c == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    else if(c->err)
+    {
+        if(cc->need_update_route == 0)
+        {
+            cc->retry_count ++;
+            if(cc->retry_count > cc->max_redirect_count)
+            {
+                cc->need_update_route = 1;
+                cc->retry_count = 0;
+            }
+        }
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
+
+    if(redisGetReply(c, reply) != REDIS_OK)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
+
+moved:
+
+    error_type = cluster_reply_error_type(*reply);
+    if(error_type == CLUSTER_ERR_MOVED)
+    {
+        if(cluster_update_route_by_moved(cc, *reply) == NULL)
+        {
+            if(cc->need_update_route)
+            {
+                cc->route_update_coalesced ++;
+            }
+            cc->need_update_route = 1;
+            cc->err = 0;
+            memset(cc->errstr, '\0', strlen(cc->errstr));
+        }
+    }
+    else if(error_type == CLUSTER_ERR_ASK)
+    {
+        node = node_get_by_redirect_reply(cc, *reply, &slot_num);
+        if(node != NULL)
+        {
+            cluster_ask_cache_add(cc, command, (uint32_t)slot_num, node);
+        }
+        
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
+    else
+    {
+        return REDIS_OK;
+    }
+
+    //send it again only if the replies of all the requests behind it
+    //are read ahead, the connections have nothing else to read then
+    if(command->cmd == NULL || !cluster_requests_drained(cc, command))
+    {
+        return REDIS_OK;
+    }
+
+    freeReplyObject(*reply);
+    cc->requests_redirected ++;
+
+    *reply = redis_cluster_command_execute(cc, command);
+    cc->retry_count = 0;
+    if(*reply == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+/**
+  * Write the command to the output buffer of c. A command given by argv
+  * is formatted right into the buffer, it is not formatted anywhere else.
+  */
+static int cluster_append_command(redisContext *c, struct cmd *command)
+{
+    size_t len, totlen;
+    sds newbuf;
+    int j;
+
+    if(command->cmd != NULL)
+    {
+        return __redisAppendCommand(c, command->cmd, command->clen);
+    }
+
+    //"*<argc>\r\n" and "$<len>\r\n<arg>\r\n", 20 digits at most
+    totlen = 1 + 20 + 2;
+    for(j = 0; j < command->argc; j ++)
+    {
+        len = command->argvlen ? command->argvlen[j] : 
+            strlen(command->argv[j]);
+        totlen += 1 + 20 + 2 + len + 2;
+    }
+
+    newbuf = sdsMakeRoomFor(c->obuf, totlen);
+    if(newbuf == NULL)
+    {
+        __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
+    c->obuf = newbuf;
+
+    //the room is made, the buffer is not moved below
+    c->obuf = sdscatfmt(c->obuf, "*%i\r\n", command->argc);
+    for(j = 0; j < command->argc; j ++)
+    {
+        len = command->argvlen ? command->argvlen[j] : 
+            strlen(command->argv[j]);
+        c->obuf = sdscatfmt(c->obuf, "$%U\r\n", (unsigned long long)len);
+        c->obuf = sdscatlen(c->obuf, command->argv[j], len);
+        c->obuf = sdscatlen(c->obuf, "\r\n", 2);
+    }
+
+    return REDIS_OK;
+}
+
+static void *redis_cluster_command_execute(redisClusterContext *cc, 
+    struct cmd *command)
+{
+    int ret;
+    void *reply = NULL;
+    cluster_node *node, *node_read;
+    redisContext *c = NULL;
+    int error_type;
+    int slot_num;
+    int asking = 0;
+    int64_t start = 0;
+
+retry:
+
+    //the keys known to be moved go to the importing node directly
+    if(cc->ask_slots != NULL && listLength(cc->ask_slots) > 0)
+    {
+        node = node_get_by_ask_cache(cc, command);
+        if(node != NULL)
+        {
+            c = ctx_get_by_node(cc, node);
+            if(c != NULL && c->err == 0)
+            {
+                asking = 1;
+                goto ask_retry;
+            }
+        }
+    }
+    
+    node = node_get_by_table(cc, (uint32_t)command->slot_num);
+    if(node == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table error");
+        return NULL;
+    }
+
+    if(cc->read_preference != HIRCLUSTER_READ_MASTER && 
+        redis_cmd_readonly(command))
+    {
+        node_read = node_get_for_read(cc, node);
+        if(node_read == NULL)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "no healthy replica for the read");
+            return NULL;
+        }
+
+        if(node_read != node)
+        {
+            c = ctx_get_by_replica(cc, node_read);
+            if(c != NULL)
+            {
+                node = node_read;
+                goto ask_retry;
+            }
+
+            if(cc->read_preference == HIRCLUSTER_READ_REPLICA_ONLY)
+            {
+                cc->retry_count ++;
+                if(cc->retry_count > cc->max_redirect_count)
+                {
+                    __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
+                        "too many cluster redirect");
+                    return NULL;
+                }
+                
+                goto retry;
+            }
+        }
+    }
+
+    c = ctx_get_by_node(cc, node);
+    if(c == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
+        return NULL;
+    }
+    else if(c->err)
+    {
+        node = node_get_witch_connected(cc);
+        if(node == NULL)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, "no reachable node in cluster");
+            return NULL;
+        }
+
+        cc->retry_count ++;
+        if(cc->retry_count > cc->max_redirect_count)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
+                "too many cluster redirect");
+            return NULL;
+        }
+
+        c = ctx_get_by_node(cc, node);
+        if(c == NULL)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node error");
+            return NULL;
+        }
+        else if(c->err)
+        {
+            __redisClusterSetError(cc, c->err, c->errstr);
+            return NULL;
+        }
+    }
+
+ask_retry:
+
+    if(cc->read_preference != HIRCLUSTER_READ_MASTER)
+    {
+        start = hi_usec_now();
+    }
+
+    //ASKING and the command are written to the node together
+    if(asking && __redisAppendCommand(c, REDIS_PROTOCOL_ASKING, 
+        strlen(REDIS_PROTOCOL_ASKING)) != REDIS_OK)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return NULL;
+    }
+
+    if (cluster_append_command(c, command) != REDIS_OK) 
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return NULL;
+    }
+
+    if(asking)
+    {
+        asking = 0;
+        
+        reply = __redisBlockForReply(c);
+        if(reply == NULL)
+        {
+            __redisClusterSetError(cc, c->err, c->errstr);
+            return NULL;
+        }
+
+        if(((redisReply *)reply)->type != REDIS_REPLY_STATUS)
+        {
+            freeReplyObject(reply);
+
+            //drop the reply of the command behind it
+            reply = __redisBlockForReply(c);
+            if(reply != NULL)
+            {
+                freeReplyObject(reply);
+            }
+
+            cluster_ask_cache_drop(cc, (uint32_t)command->slot_num);
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "asking error reply from the importing node");
+            return NULL;
+        }
+
+        freeReplyObject(reply);
+    }
+    
+    reply = __redisBlockForReply(c);
+    if(reply == NULL)
+    {
+        //read it again from another node
+        if(node->role == REDIS_ROLE_SLAVE)
+        {
+            node->down_until = hi_usec_now() + CLUSTER_REPLICA_DOWN_TIME;
+            cc->retry_count ++;
+            if(cc->retry_count <= cc->max_redirect_count)
+            {
+                goto retry;
             }
+        }
+        
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return NULL;
+    }
 
-            //add master node
-            if(role_len >= 6 && memcmp(role, "master", 6) == 0){
-                if(count_part < 8){
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                        "Master node parts number error: less than 8.");
-                    goto error;
+    node_latency_update(node, start);
+
+    error_type = cluster_reply_error_type(reply);
+    if(error_type > CLUSTER_NOT_ERR && error_type < CLUSTER_ERR_SENTINEL)
+    {
+        cc->retry_count ++;
+        if(cc->retry_count > cc->max_redirect_count)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
+                "too many cluster redirect");
+            freeReplyObject(reply);
+            return NULL;
+        }
+        
+        switch(error_type)
+        {
+        case CLUSTER_ERR_MOVED:
+            node = cluster_update_route_by_moved(cc, reply);
+            if(node == NULL)
+            {
+                ret = cluster_update_route_governed(cc);
+                if(ret == REDIS_ERR)
+                {
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                        "route update error, please recreate redisClusterContext!");
+                    freeReplyObject(reply);
+                    return NULL;
                 }
-                
-                master = node_get_with_nodes(cc, 
-                    part, count_part, REDIS_ROLE_MASTER);
-                if(master == NULL){
-                    goto error;
+                else if(ret == REDIS_OK)
+                {
+                    freeReplyObject(reply);
+                    reply = NULL;
+                    goto retry;
                 }
 
-                ret = dictAdd(nodes, 
-                    sdsnewlen(master->addr, sdslen(master->addr)), master);
-                if(ret != DICT_OK){
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                        "The address already exists in the nodes");
-                    cluster_node_deinit(master);
-                    hi_free(master);
-                    goto error;
+                //the update is delayed or run by another caller, the
+                //table is still stale, so follow the node of the reply
+                node = node_get_by_redirect_reply(cc, reply, NULL);
+                if(node == NULL)
+                {
+                    cc->err = 0;
+                    memset(cc->errstr, '\0', strlen(cc->errstr));
+                    freeReplyObject(reply);
+                    reply = NULL;
+                    goto retry;
                 }
+            }
+            
+            freeReplyObject(reply);
+            reply = NULL;
 
-                if(flags & HIRCLUSTER_FLAG_ADD_SLAVE){
-                    ret = cluster_master_slave_mapping_with_name(cc, 
-                        &nodes_name, master, master->name);
-                    if(ret != REDIS_OK){
-                        cluster_node_deinit(master);
-                        hi_free(master);
-                        goto error;
-                    }
-                }
+            //a shared route is not patched by the reply, so the command
+            //goes to the node of the reply, not by the stale table
+            c = ctx_get_by_node(cc, node);
+            if(c == NULL || c->err)
+            {
+                goto retry;
+            }
 
-                if(myself) master->myself = 1;
-                
-                for(k = 8; k < count_part; k ++){
-                    slot_start_end = sdssplitlen(part[k], 
-                        sdslen(part[k]), "-", 1, &count_slot_start_end);
-                    
-                    if(slot_start_end == NULL){
-                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                            "split slot start end error(NULL)");
-                        goto error;
-                    }else if(count_slot_start_end == 1){
-                        slot_start = 
-                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));
-                        slot_end = slot_start;
-                    }else if(count_slot_start_end == 2){
-                        slot_start = 
-                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));;
-                        slot_end = 
-                            hi_atoi(slot_start_end[1], sdslen(slot_start_end[1]));;
-                    }else{
-                        //add open slot for master
-                        if(flags & HIRCLUSTER_FLAG_ADD_OPENSLOT && 
-                            count_slot_start_end == 3 && 
-                            sdslen(slot_start_end[0]) > 1 &&
-                            sdslen(slot_start_end[1]) == 1 && 
-                            sdslen(slot_start_end[2]) > 1 && 
-                            slot_start_end[0][0] == '[' && 
-                            slot_start_end[2][sdslen(slot_start_end[2])-1] == ']'){
-                            
-                            copen_slot *oslot, **oslot_elem;
-                            
-                            sdsrange(slot_start_end[0], 1, -1);
-                            sdsrange(slot_start_end[2], 0, -2);
-                            
-                            if(slot_start_end[1][0] == '>'){
-                                oslot = cluster_open_slot_create(
-                                    hi_atoi(slot_start_end[0],
-                                    sdslen(slot_start_end[0])), 
-                                    1, slot_start_end[2], master);
-                                if(oslot == NULL){
-                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                        "create open slot error");
-                                    goto error;
-                                }
- 
-                                if(master->migrating == NULL){
-                                    master->migrating = hiarray_create(1, sizeof(oslot));
-                                    if(master->migrating == NULL){
-                                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                            "create migrating array error");
-                                        cluster_open_slot_destroy(oslot);
-                                        goto error;
-                                    }
-                                }
+            goto ask_retry;
+            
+            break;
+        case CLUSTER_ERR_ASK:
+            node = node_get_by_redirect_reply(cc, reply, &slot_num);
+            if(node == NULL)
+            {
+                freeReplyObject(reply);
+                return NULL;
+            }
 
-                                oslot_elem = hiarray_push(master->migrating);
-                                if(oslot_elem == NULL){
-                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                        "Push migrating array error: out of memory");
-                                    cluster_open_slot_destroy(oslot);
-                                    goto error;
-                                }
+            freeReplyObject(reply);
+            reply = NULL;
 
-                                *oslot_elem = oslot;
-                            }else if(slot_start_end[1][0] == '<'){
-                                oslot = cluster_open_slot_create(hi_atoi(slot_start_end[0],
-                                    sdslen(slot_start_end[0])), 0, slot_start_end[2],
-                                    master);
-                                if(oslot == NULL){
-                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                        "create open slot error");
-                                    goto error;
-                                }
+            cluster_ask_cache_add(cc, command, (uint32_t)slot_num, node);
+
+            c = ctx_get_by_node(cc, node);
+            if(c == NULL)
+            {
+                __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node error");
+                return NULL;
+            }
+            else if(c->err)
+            {
+                __redisClusterSetError(cc, c->err, c->errstr);
+                return NULL;
+            }
+
+            asking = 1;
+            goto ask_retry;
+
+            break;
+        case CLUSTER_ERR_TRYAGAIN:
+        case CLUSTER_ERR_CROSSSLOT:
+        case CLUSTER_ERR_CLUSTERDOWN:
+            freeReplyObject(reply);
+            reply = NULL;
+            goto retry;
+            
+            break;
+        default:
+
+            break;
+        }
+    }
+    
+    return reply;
+}
+
+static int command_pre_fragment(redisClusterContext *cc, 
+    struct cmd *command, hilist *commands)
+{
+    
+    struct keypos *kp, *sub_kp;
+    uint32_t key_count;
+    uint32_t i, j;
+    uint32_t idx;
+    uint32_t key_len;
+    uint32_t map_size, sub_count = 0;
+    uint32_t name_len;
+    int slot_num = -1;
+    struct cmd *sub_command;
+    struct cmd **sub_commands = NULL, **sub_list;
+    char num_str[12];
+    uint8_t num_str_len;
+    
+
+    if(command == NULL || commands == NULL)
+    {
+        goto done;
+    }
+
+    key_count = hiarray_n(command->keys);
+
+    //the commands without a reducer, like sunion, can only be sent
+    //when all the keys are in one slot
+    if(command->reducer == NULL)
+    {
+        for(i = 0; i < key_count; i ++)
+        {
+            kp = hiarray_get(command->keys, i);
+            idx = (uint32_t)keyHashSlot(kp->start, kp->end - kp->start);
+            if(i > 0 && (int)idx != slot_num)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "The keys of the command are in different slots");
+                return -1;
+            }
+
+            slot_num = (int)idx;
+        }
+
+        command->slot_num = slot_num;
+        return slot_num;
+    }
+
+    //sub_commands maps the slots to the subcommands by open addressing,
+    //sub_list keeps them grouped by node after it
+    map_size = 16;
+    while(map_size < key_count * 2)
+    {
+        map_size <<= 1;
+    }
+
+    sub_commands = hi_zalloc((map_size + key_count) * sizeof(*sub_commands));
+    if (sub_commands == NULL) 
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto done;
+    }
+
+    sub_list = sub_commands + map_size;
+
+    command->frag_seq = hi_alloc(key_count * sizeof(*command->frag_seq));
+    if(command->frag_seq == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto done;
+    }
+    
+    
+    for(i = 0; i < key_count; i ++)
+    {
+        kp = hiarray_get(command->keys, i);
+
+        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+
+        if(slot_num < 0 || slot_num >= REDIS_CLUSTER_SLOTS)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"keyHashSlot return error");
+            goto done;
+        }
+
+        idx = (uint32_t)slot_num & (map_size - 1);
+        while (sub_commands[idx] != NULL && 
+            sub_commands[idx]->slot_num != slot_num) {
+            idx = (idx + 1) & (map_size - 1);
+        }
 
-                                if(master->importing == NULL){
-                                    master->importing = hiarray_create(1, sizeof(oslot));
-                                    if(master->importing == NULL){
-                                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                            "create migrating array error");
-                                        cluster_open_slot_destroy(oslot);
-                                        goto error;
-                                    }
-                                }
+        if (sub_commands[idx] == NULL) {
+            sub_commands[idx] = command_get();
+            if (sub_commands[idx] == NULL) {
+                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+                slot_num = -1;
+                goto done;
+            }
 
-                                oslot_elem = hiarray_push(master->importing);
-                                if(oslot_elem == NULL){
-                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                        "push migrating array error: out of memory");
-                                    cluster_open_slot_destroy(oslot);
-                                    goto error;
-                                }
+            sub_commands[idx]->slot_num = slot_num;
+            sub_list[sub_count++] = sub_commands[idx];
+        }
 
-                                *oslot_elem = oslot;
-                            }
-                        }
-                        
-                        slot_start = -1;
-                        slot_end = -1;
-                    }
-                    
-                    sdsfreesplitres(slot_start_end, count_slot_start_end);
-                    count_slot_start_end = 0;
-                    slot_start_end = NULL;
+        command->frag_seq[i] = sub_command = sub_commands[idx];
 
-                    if(slot_start < 0 || slot_end < 0 || 
-                        slot_start > slot_end || slot_end >= REDIS_CLUSTER_SLOTS){
-                        continue;
-                    }
+        sub_command->narg++;
 
-                    slot = cluster_slot_create(master);
-                    if(slot == NULL){
-                        __redisClusterSetError(cc,REDIS_ERR_OOM,
-                            "Out of memory");
-                        goto error;
-                    }
-                    
-                    slot->start = (uint32_t)slot_start;
-                    slot->end = (uint32_t)slot_end;                    
-                }
+        sub_kp = hiarray_push(sub_command->keys);
+        if (sub_kp == NULL) {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            slot_num = -1;
+            goto done;
+        }
+        
+        sub_kp->start = kp->start;
+        sub_kp->end = kp->end;
 
-            }
-            //add slave node
-            else if((flags & HIRCLUSTER_FLAG_ADD_SLAVE) && 
-                (role_len >= 5 && memcmp(role, "slave", 5) == 0)){
-                slave = node_get_with_nodes(cc, part, 
-                    count_part, REDIS_ROLE_SLAVE);
-                if(slave == NULL){
-                    goto error;
-                }
+        key_len = (uint32_t)(kp->end - kp->start);
 
-                ret = cluster_master_slave_mapping_with_name(cc, 
-                    &nodes_name, slave, part[3]);
-                if(ret != REDIS_OK){
-                    cluster_node_deinit(slave);
-                    hi_free(slave);
-                    goto error;
-                }
+        sub_command->clen += key_len + uint_len(key_len);
 
-                if(myself) slave->myself = 1;
-            }
+        sub_command->slot_num = slot_num;
 
-            if(myself == 1){
-                myself = 0;
+        if (command->reducer->split == CMD_SPLIT_KEY_VALUES) {
+            uint32_t len = 0;
+            char *p;
+
+            for (p = sub_kp->end + 1; !isdigit(*p); p++){}
+            
+            p = sub_kp->end + 1;
+            while(!isdigit(*p))
+            {
+                p ++;
             }
 
-            sdsfreesplitres(part, count_part);
-            count_part = 0;
-            part = NULL;
+            for (; isdigit(*p); p++) {              
+                len = len * 10 + (uint32_t)(*p - '0');
+            }
             
-            start = pos + 1;
-            line_start = start;
-            pos = start;
+            len += CRLF_LEN * 2;
+            len += (p - sub_kp->end);
+            sub_kp->remain_len = len;
+            sub_command->clen += len;
         }
     }
 
-    if(nodes_name != NULL){
-        dictRelease(nodes_name);
-    }
-    
-    return nodes;
+    //redis cluster refuses the keys of different slots in one command,
+    //so the subcommands stay by slot but the ones for a node are put
+    //next to each other to be sent together
+    if (cc->route != NULL && sub_count > 1) {
+        uint32_t *node_start;
+        uint32_t node_count = cc->route->node_count + 1;
 
-error:
-        
-    if(part != NULL){
-        sdsfreesplitres(part, count_part);
-        count_part = 0;
-        part = NULL;
-    }
+        node_start = hi_zalloc((node_count + 1) * sizeof(*node_start));
+        if (node_start == NULL) {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            slot_num = -1;
+            goto done;
+        }
 
-    if(slot_start_end != NULL){
-        sdsfreesplitres(slot_start_end, count_slot_start_end);
-        count_slot_start_end = 0;
-        slot_start_end = NULL;
-    }
+        for (i = 0; i < sub_count; i++) {
+            node_start[cc->route->table[sub_list[i]->slot_num] + 1]++;
+        }
 
-    if(nodes != NULL){
-        dictRelease(nodes);
-    }
+        for (i = 1; i <= node_count; i++) {
+            node_start[i] += node_start[i - 1];
+        }
 
-    if(nodes_name != NULL){
-        dictRelease(nodes_name);
+        //the slot map is not used any more, it keeps the grouped ones
+        for (i = 0; i < sub_count; i++) {
+            sub_command = sub_list[i];
+            sub_commands[node_start[
+                cc->route->table[sub_command->slot_num]]++] = sub_command;
+        }
+
+        memcpy(sub_list, sub_commands, sub_count * sizeof(*sub_list));
+        hi_free(node_start);
     }
-    
-    return NULL;
-}
 
-/**
-  * Update route with the "cluster nodes" or "cluster slots" command reply.
-  */
-static int 
-cluster_update_route_by_addr(redisClusterContext *cc, 
-    const char *ip, int port)
-{
-    redisContext *c = NULL;
-    redisReply *reply = NULL;
-    dict *nodes = NULL;
-    struct hiarray *slots = NULL;
-    cluster_node *master;
-    cluster_slot *slot, **slot_elem;
-    dictIterator *dit = NULL;
-    dictEntry *den;
-    listIter *lit = NULL;
-    listNode *lnode;
-    cluster_node *table[REDIS_CLUSTER_SLOTS];
-    uint32_t j, k;
+    name_len = (uint32_t)strlen(command->reducer->name);
 
-    if(cc == NULL){
-        return REDIS_ERR;
-    }
+    for (i = 0; i < sub_count; i++) {     /* prepend command header */
+        sub_command = sub_list[i];
 
-    if(ip == NULL || port <= 0){
-        __redisClusterSetError(cc,
-            REDIS_ERR_OTHER,"Ip or port error!");
-        goto error;
-    }
+        //"*%d\r\n$%d\r\n%s\r\n", the values of mset keep their own "$%d\r\n"
+        idx = 0;
+        if (command->reducer->split == CMD_SPLIT_KEY_VALUES) {
+            sub_command->clen += 3*sub_command->narg;
+            sub_command->narg *= 2;
+        } else {
+            sub_command->clen += 5*sub_command->narg;
+        }
 
-    if(cc->connect_timeout){
-        c = redisConnectWithTimeout(ip, port, *cc->connect_timeout);
-    }else{
-        c = redisConnect(ip, port);
-    }
+        sub_command->narg ++;
+
+        hi_itoa(num_str, sub_command->narg);
+        num_str_len = (uint8_t)strlen(num_str);
+
+        sub_command->clen += 8 + num_str_len + uint_len(name_len) + name_len;
+
+        sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
+        if(sub_command->cmd == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            slot_num = -1;
+            goto done;
+        }
+
+        sub_command->cmd[idx++] = '*';
+        memcpy(sub_command->cmd + idx, num_str, num_str_len);
+        idx += num_str_len;
+        memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+        idx += CRLF_LEN;
+
+        hi_itoa(num_str, name_len);
+        num_str_len = (uint8_t)strlen(num_str);
+
+        sub_command->cmd[idx++] = '$';
+        memcpy(sub_command->cmd + idx, num_str, num_str_len);
+        idx += num_str_len;
+        memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+        idx += CRLF_LEN;
+        memcpy(sub_command->cmd + idx, command->reducer->name, name_len);
+        idx += name_len;
+        memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+        idx += CRLF_LEN;
+
+        for(j = 0; j < hiarray_n(sub_command->keys); j ++)
+        {
+            kp = hiarray_get(sub_command->keys, j);
+            key_len = (uint32_t)(kp->end - kp->start);
+            hi_itoa(num_str, key_len);
+            num_str_len = strlen(num_str);
+
+            sub_command->cmd[idx++] = '$';
+            memcpy(sub_command->cmd + idx, num_str, num_str_len);
+            idx += num_str_len;
+            memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+            idx += CRLF_LEN;
+
+            if (command->reducer->split == CMD_SPLIT_KEY_VALUES) {
+                memcpy(sub_command->cmd + idx, kp->start, key_len + kp->remain_len);
+                idx += key_len + kp->remain_len;
+            } else {
+                memcpy(sub_command->cmd + idx, kp->start, key_len);
+                idx += key_len;
+                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+                idx += CRLF_LEN;
+            }
+        }
+
+        //printf("len : %d\n", sub_command->clen);
+        //print_string_with_length_fix_CRLF(sub_command->cmd, sub_command->clen);
         
-    if (c == NULL){
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "Init redis context error(return NULL)");
-        goto error;
-    }else if(c->err){
-        __redisClusterSetError(cc,c->err,c->errstr);
-        goto error;
+        sub_command->type = command->type;
+        sub_command->keyspec = command->keyspec;
+        sub_command->reducer = command->reducer;
+
+        listAddNodeTail(commands, sub_command);
     }
 
-    if (cc->timeout) {
-        redisSetTimeout(c, *cc->timeout);
+done:
+
+    if(sub_commands != NULL)
+    {
+        hi_free(sub_commands);
     }
 
-    if(cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS){
-        reply = redisCommand(c, REDIS_COMMAND_CLUSTER_SLOTS);
-        if(reply == NULL){
-            if (c->err == REDIS_ERR_TIMEOUT) {
-                __redisClusterSetError(cc,c->err,
-                    "Command(cluster slots) reply error(socket timeout)");
-            } else {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "Command(cluster slots) reply error(NULL).");
+    if(slot_num >= 0 && commands != NULL 
+        && listLength(commands) == 1)
+    {
+        listNode *list_node = listFirst(commands);
+        listDelNode(commands, list_node);
+        if(command->frag_seq)
+        {
+            hi_free(command->frag_seq);
+            command->frag_seq = NULL;
+        }
+
+        command->slot_num = slot_num;
+    }
+
+    return slot_num;
+}
+
+static void *command_post_fragment(redisClusterContext *cc, 
+    struct cmd *command, hilist *commands)
+{
+    struct cmd *sub_command;
+    listNode *list_node;
+    listIter *list_iter;
+    redisReply *reply, *sub_reply;
+    long long count = 0;
+    
+    list_iter = listGetIterator(commands, AL_START_HEAD);
+    while((list_node = listNext(list_iter)) != NULL)
+    {
+        sub_command = list_node->value;
+        reply = sub_command->reply;
+        if(reply == NULL)
+        {
+            return NULL;
+        }
+        else if(reply->type == REDIS_REPLY_ERROR)
+        {
+            //the error reply is handed to the caller
+            sub_command->reply = NULL;
+            listReleaseIterator(list_iter);
+            return reply;
+        }
+
+        if (command->reducer->merge == CMD_MERGE_CONCAT) {
+            if(reply->type != REDIS_REPLY_ARRAY)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be array)");
+                return NULL;
             }
-            goto error;
-        }else if(reply->type != REDIS_REPLY_ARRAY){
-            if(reply->type == REDIS_REPLY_ERROR){
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    reply->str);
-            }else{
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "Command(cluster slots) reply error: type is not array.");
+        }else if(command->reducer->merge == CMD_MERGE_SUM){
+            if(reply->type != REDIS_REPLY_INTEGER)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be integer)");
+                return NULL;
             }
-            
-            goto error;
-        }
 
-        nodes = parse_cluster_slots(cc, reply, cc->flags);
-    } else {
-        reply = redisCommand(c, REDIS_COMMAND_CLUSTER_NODES);
-        if(reply == NULL){
-            if (c->err == REDIS_ERR_TIMEOUT) {
-                __redisClusterSetError(cc,c->err,
-                    "Command(cluster nodes) reply error(socket timeout)");
-            } else {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "Command(cluster nodes) reply error(NULL).");
-            }
-            goto error;
-        }else if(reply->type != REDIS_REPLY_STRING){
-            if(reply->type == REDIS_REPLY_ERROR){
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    reply->str);
-            }else{
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "Command(cluster nodes) reply error: type is not string.");
+            count += reply->integer;
+        }else if(command->reducer->merge == CMD_MERGE_ALL_OK){
+            if(reply->type != REDIS_REPLY_STATUS ||
+                reply->len != 2 || strcmp(reply->str, REDIS_STATUS_OK) != 0)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be status and ok)");
+                return NULL;
             }
-            
-            goto error;
+        }else {
+            NOT_REACHED();
         }
-
-        nodes = parse_cluster_nodes(cc, reply->str, reply->len, cc->flags);
     }
 
-    if(nodes == NULL){
-        goto error;
-    }
-    
-    memset(table, 0, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
-    
-    slots = hiarray_create(dictSize(nodes), sizeof(cluster_slot*));
-    if(slots == NULL){
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "Slots array create failed: out of memory");
-        goto error;
-    }
-    
-    dit = dictGetIterator(nodes);
-    if(dit == NULL){
-        __redisClusterSetError(cc,REDIS_ERR_OOM,
-            "Dict get iterator failed: out of memory");
-        goto error;
+    reply = hi_calloc(1,sizeof(*reply));
+
+    if (reply == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
     }
-    
-    while((den = dictNext(dit))){
-        master = dictGetEntryVal(den);
-        if(master->role != REDIS_ROLE_MASTER){
-            __redisClusterSetError(cc,REDIS_ERR_OOM,
-                "Node role must be master");
-            goto error;
-        }
 
-        if(master->slots == NULL){
-            continue;
-        }
-        
-        lit = listGetIterator(master->slots, AL_START_HEAD);
-        if(lit == NULL){
-            __redisClusterSetError(cc, REDIS_ERR_OOM,
-                "List get iterator failed: out of memory");
-            goto error;
+    if (command->reducer->merge == CMD_MERGE_CONCAT) {
+        int i;
+        uint32_t key_count;
+
+        reply->type = REDIS_REPLY_ARRAY;
+
+        key_count = hiarray_n(command->keys);
+
+        reply->elements = key_count;
+        reply->element = hi_calloc(key_count, sizeof(*reply));
+        if (reply->element == NULL) {
+            freeReplyObject(reply);
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            return NULL;
         }
-        
-        while((lnode = listNext(lit))){
-            slot = listNodeValue(lnode);
-            if(slot->start > slot->end || 
-                slot->end >= REDIS_CLUSTER_SLOTS){
-                __redisClusterSetError(cc, REDIS_ERR_OTHER,
-                    "Slot region for node is error");
-                goto error;
-            }
             
-            slot_elem = hiarray_push(slots);
-            *slot_elem = slot;
+        for (i = key_count - 1; i >= 0; i--) {      /* for each key */
+            sub_reply = command->frag_seq[i]->reply;            /* get it's reply */
+            if (sub_reply == NULL) {
+                freeReplyObject(reply);
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,"sub reply is null");
+                return NULL;
+            }
+
+            if(sub_reply->type == REDIS_REPLY_STRING)
+            {
+                reply->element[i] = sub_reply;
+            }
+            else if(sub_reply->type == REDIS_REPLY_ARRAY)
+            {
+                if(sub_reply->elements == 0)
+                {
+                    freeReplyObject(reply);
+                    __redisClusterSetError(cc,REDIS_ERR_OTHER,"sub reply elements error");
+                    return NULL;
+                }
+                
+                reply->element[i] = sub_reply->element[sub_reply->elements - 1];
+                sub_reply->elements --;
+            }
+        }
+    }else if(command->reducer->merge == CMD_MERGE_SUM){
+        reply->type = REDIS_REPLY_INTEGER;
+        reply->integer = count;
+    }else if(command->reducer->merge == CMD_MERGE_ALL_OK){
+        reply->type = REDIS_REPLY_STATUS;
+        uint32_t str_len = strlen(REDIS_STATUS_OK);
+        reply->str = hi_alloc((str_len + 1) * sizeof(char*));
+        if(reply->str == NULL)
+        {
+            freeReplyObject(reply);
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            return NULL;
         }
 
-        listReleaseIterator(lit);
+        reply->len = str_len;
+        memcpy(reply->str, REDIS_STATUS_OK, str_len);
+        reply->str[str_len] = '\0';
+    }else {
+        NOT_REACHED();
     }
 
-    dictReleaseIterator(dit);
+    return reply;
+}
 
-    hiarray_sort(slots, cluster_slot_start_cmp);
-    for(j = 0; j < hiarray_n(slots); j ++){
-        slot_elem = hiarray_get(slots, j);
-        
-        for(k = (*slot_elem)->start; k <= (*slot_elem)->end; k ++){
-            if(table[k] != NULL){
-                __redisClusterSetError(cc, REDIS_ERR_OTHER,
-                    "Diffent node hold a same slot");
-                goto error;
-            }
-            
-            table[k] = (*slot_elem)->node;
-        }
+/* A node connection the replies are collected from by cluster_fanout_io(). */
+typedef struct cluster_fanout {
+    redisContext *c;
+    void **replies;     /* the replies in order */
+    uint32_t expected;  /* replies wanted */
+    uint32_t received;  /* replies arrived */
+} cluster_fanout;
+
+static void cluster_ctx_set_block(redisContext *c, int block)
+{
+    int flags;
+
+    if(block)
+    {
+        c->flags |= REDIS_BLOCK;
     }
-    
-    cluster_nodes_swap_ctx(cc->nodes, nodes);
-    if(cc->nodes != NULL){
-        dictRelease(cc->nodes);
-        cc->nodes = NULL;
+    else
+    {
+        c->flags &= ~REDIS_BLOCK;
     }
-    cc->nodes = nodes;
 
-    if(cc->slots != NULL)
+    flags = fcntl(c->fd, F_GETFL);
+    if(flags == -1)
     {
-        cc->slots->nelem = 0;
-        hiarray_destroy(cc->slots);
-        cc->slots = NULL;
+        return;
     }
-    cc->slots = slots;
-
-    memcpy(cc->table, table, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
-    cc->route_version ++;
-    
-    freeReplyObject(reply);
 
-    if(c != NULL){
-        redisFree(c);
-    }
-    
-    return REDIS_OK;
+    flags = block ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    fcntl(c->fd, F_SETFL, flags);
+}
 
-error:
+/* Flush the output buffers of all the connections at once and read the
+ * replies from all of them as they arrive, until each one got the 
+ * replies wanted or failed. A connection failed or timed out has its 
+ * err set and fewer replies than wanted.
+ */
+static int cluster_fanout_io(redisClusterContext *cc, 
+    cluster_fanout *fans, uint32_t n)
+{
+    struct pollfd *pfds;
+    cluster_fanout *fan;
+    redisContext *c;
+    void *reply;
+    uint32_t i, pending;
+    int64_t deadline = -1, now;
+    int timeout_ms, done, ret;
 
-    if(dit != NULL){
-        dictReleaseIterator(dit);
+    pfds = hi_zalloc(n * sizeof(*pfds));
+    if(pfds == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
     }
 
-    if(lit != NULL){
-        listReleaseIterator(lit);    
+    if(cc->timeout != NULL)
+    {
+        deadline = hi_usec_now() + cluster_timeval_to_usec(cc->timeout);
     }
 
-    if(slots != NULL)
+    for(i = 0; i < n; i ++)
     {
-        if(slots == cc->slots)
+        if(fans[i].c != NULL && fans[i].c->err == 0)
         {
-            cc->slots = NULL;
+            cluster_ctx_set_block(fans[i].c, 0);
         }
-        
-        slots->nelem = 0;
-        hiarray_destroy(slots);
     }
 
-    if(nodes != NULL){
-        if(nodes == cc->nodes){
-            cc->nodes = NULL;
+    while(1)
+    {
+        pending = 0;
+        for(i = 0; i < n; i ++)
+        {
+            fan = &fans[i];
+            c = fan->c;
+            pfds[i].fd = -1;
+            pfds[i].events = 0;
+            pfds[i].revents = 0;
+
+            if(c == NULL || c->err || fan->received >= fan->expected)
+            {
+                continue;
+            }
+
+            pfds[i].fd = c->fd;
+            pfds[i].events = POLLIN;
+            if(sdslen(c->obuf) > 0)
+            {
+                pfds[i].events |= POLLOUT;
+            }
+
+            pending ++;
         }
 
-        dictRelease(nodes);
-    }
+        if(pending == 0)
+        {
+            break;
+        }
 
-    if(reply != NULL){
-        freeReplyObject(reply);
-        reply = NULL;
-    }
+        timeout_ms = -1;
+        if(deadline >= 0)
+        {
+            now = hi_usec_now();
+            timeout_ms = now >= deadline ? 0 : (int)((deadline - now + 999) / 1000);
+        }
 
-    if(c != NULL){
-        redisFree(c);
-    }
-    
-    return REDIS_ERR;
-}
+        ret = poll(pfds, n, timeout_ms);
+        if(ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if(ret <= 0)
+        {
+            //the connections keep the replies not read yet, drop them
+            for(i = 0; i < n; i ++)
+            {
+                if(pfds[i].fd >= 0)
+                {
+                    __redisSetError(fans[i].c, ret == 0 ? 
+                        REDIS_ERR_TIMEOUT : REDIS_ERR_IO, 
+                        ret == 0 ? "Socket timeout" : strerror(errno));
+                }
+            }
 
+            break;
+        }
 
-/**
-  * Update route with the "cluster nodes" command reply.
-  */
-static int 
-cluster_update_route_with_nodes_old(redisClusterContext *cc, 
-    const char *ip, int port)
-{
-    int ret;
-    redisContext *c = NULL;
-    redisReply *reply = NULL;
-    struct hiarray *slots = NULL;
-    dict *nodes = NULL;
-    dict *nodes_name = NULL;
-    cluster_node *master, *slave;
-    cluster_slot **slot;
-    char *pos, *start, *end, *line_start, *line_end;
-    char *role;
-    int role_len;
-    uint8_t myself = 0;
-    int slot_start, slot_end;
-    sds *part = NULL, *slot_start_end = NULL;
-    int count_part = 0, count_slot_start_end = 0;
-    int j, k;
-    int len;
-    cluster_node *table[REDIS_CLUSTER_SLOTS] = {NULL};
+        for(i = 0; i < n; i ++)
+        {
+            fan = &fans[i];
+            c = fan->c;
+            if(pfds[i].fd < 0 || pfds[i].revents == 0)
+            {
+                continue;
+            }
 
-    if(cc == NULL)
-    {
-        return REDIS_ERR;
-    }
+            if(pfds[i].revents & POLLOUT)
+            {
+                if(redisBufferWrite(c, &done) != REDIS_OK)
+                {
+                    continue;
+                }
+            }
+
+            if(pfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                if(redisBufferRead(c) != REDIS_OK)
+                {
+                    continue;
+                }
+                
+                while(fan->received < fan->expected)
+                {
+                    reply = NULL;
+                    if(redisGetReplyFromReader(c, &reply) != REDIS_OK || 
+                        reply == NULL)
+                    {
+                        break;
+                    }
 
-    if(ip == NULL || port <= 0)
-    {
-        __redisClusterSetError(cc,
-            REDIS_ERR_OTHER,"ip or port error!");
-        goto error;
+                    fan->replies[fan->received ++] = reply;
+                }
+            }
+        }
     }
 
-    if(cc->connect_timeout)
+    //the failed ones too, they are reconnected in the blocking mode
+    for(i = 0; i < n; i ++)
     {
-        c = redisConnectWithTimeout(ip, port, *cc->connect_timeout);
+        if(fans[i].c != NULL)
+        {
+            cluster_ctx_set_block(fans[i].c, 1);
+        }
     }
-    else
+
+    hi_free(pfds);
+
+    return REDIS_OK;
+}
+
+/* Get the connection the subcommands for the node are sent to, 
+ * or NULL if they should be executed one by one. */
+static redisContext *ctx_get_by_node_group(redisClusterContext *cc, 
+    struct cmd *command, cluster_node *node)
+{
+    cluster_node *node_read;
+    redisContext *c;
+
+    if(cc->read_preference != HIRCLUSTER_READ_MASTER && 
+        redis_cmd_readonly(command))
     {
-        c = redisConnect(ip, port);
-    }
+        node_read = node_get_for_read(cc, node);
+        if(node_read == NULL)
+        {
+            return NULL;
+        }
         
-    if (c == NULL)
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "init redis context error(return NULL)");
-        goto error;
+        if(node_read != node)
+        {
+            return ctx_get_by_replica(cc, node_read);
+        }
     }
-    else if(c->err)
+
+    c = ctx_get_by_node(cc, node);
+    if(c == NULL || c->err)
     {
-        __redisClusterSetError(cc,c->err,c->errstr);
-        goto error;
+        return NULL;
     }
 
-    reply = redisCommand(c, REDIS_COMMAND_CLUSTER_NODES);
+    return c;
+}
 
-    if(reply == NULL)
+/* Execute the subcommands of the multi-key command. The subcommands 
+ * for one node are written to it together, all the nodes are written
+ * at once and their replies are read as they arrive, so the command 
+ * takes as long as the slowest node. The subcommand redirected by its
+ * node is executed again by its slot on its own, the command fails if
+ * a node timed out or its connection failed.
+ */
+static int command_execute_by_node(redisClusterContext *cc, 
+    struct cmd *command, hilist *commands)
+{
+    struct cmd *sub_command;
+    cluster_node *node;
+    cluster_fanout *fans = NULL;
+    redisContext *c;
+    redisReply *reply;
+    listNode *ln, *ln_end;
+    listNode **groups = NULL;
+    uint32_t i, j, n = 0;
+    int error_type, slot_num;
+    int ret = REDIS_ERR;
+
+    //at most one group for each subcommand
+    fans = hi_zalloc(listLength(commands) * sizeof(*fans));
+    groups = hi_zalloc((listLength(commands) + 1) * sizeof(*groups));
+    if(fans == NULL || groups == NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "command(cluster nodes) reply error(NULL)");
-        goto error;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto done;
     }
-    else if(reply->type != REDIS_REPLY_STRING)
+
+    ln = listFirst(commands);
+    while(ln != NULL)
     {
-        if(reply->type == REDIS_REPLY_ERROR)
+        sub_command = listNodeValue(ln);
+        node = node_get_by_table(cc, (uint32_t)sub_command->slot_num);
+        
+        groups[n] = ln;
+        fans[n].expected = 1;
+        
+        ln_end = listNextNode(ln);
+        while(ln_end != NULL && node != NULL && node == node_get_by_table(cc, 
+            (uint32_t)((struct cmd *)listNodeValue(ln_end))->slot_num))
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                reply->str);
+            fans[n].expected ++;
+            ln_end = listNextNode(ln_end);
         }
-        else
+
+        c = node != NULL ? ctx_get_by_node_group(cc, command, node) : NULL;
+
+        //the replies on one connection are read by one group only
+        for(i = 0; c != NULL && i < n; i ++)
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                "command(cluster nodes) reply error(type is not string)");
+            if(fans[i].c == c)
+            {
+                c = NULL;
+            }
         }
         
-        goto error;
+        if(c != NULL)
+        {
+            fans[n].replies = hi_zalloc(fans[n].expected * sizeof(void *));
+            if(fans[n].replies == NULL)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+                goto done;
+            }
+        }
+
+        for(; c != NULL && ln != ln_end; ln = listNextNode(ln))
+        {
+            sub_command = listNodeValue(ln);
+            if(__redisAppendCommand(c, sub_command->cmd, 
+                sub_command->clen) != REDIS_OK)
+            {
+                __redisClusterSetError(cc, c->err, c->errstr);
+                goto done;
+            }
+        }
+
+        fans[n].c = c;
+        ln = ln_end;
+        n ++;
     }
 
-    nodes = dictCreate(&clusterNodesDictType, NULL);
-    
-    slots = hiarray_create(10, sizeof(cluster_slot*));
-    if(slots == NULL)
+    groups[n] = NULL;
+
+    if(cc->err)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "array create error");
-        goto error;
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
     }
 
-    start = reply->str;
-    end = start + reply->len;
-    
-    line_start = start;
+    if(cluster_fanout_io(cc, fans, n) != REDIS_OK)
+    {
+        goto done;
+    }
 
-    for(pos = start; pos < end; pos ++)
+    for(i = 0; i < n; i ++)
     {
-        if(*pos == '\n')
+        for(ln = groups[i], j = 0; ln != groups[i + 1]; ln = listNextNode(ln), j ++)
         {
-            line_end = pos - 1;
-            len = line_end - line_start;
-            
-            part = sdssplitlen(line_start, len + 1, " ", 1, &count_part);
-
-            if(part == NULL || count_part < 8)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "split cluster nodes error");
-                goto error;
-            }
+            sub_command = listNodeValue(ln);
 
-            //the address string is ":0", skip this node.
-            if(sdslen(part[1]) == 2 && strcmp(part[1], ":0") == 0)
+            //not sent, it is executed on its own below
+            if(fans[i].c == NULL)
             {
-                sdsfreesplitres(part, count_part);
-                count_part = 0;
-                part = NULL;
-                
-                start = pos + 1;
-                line_start = start;
-                pos = start;
-                
                 continue;
             }
 
-            if(sdslen(part[2]) >= 7 && memcmp(part[2], "myself,", 7) == 0)
-            {
-                role_len = sdslen(part[2]) - 7;
-                role = part[2] + 7;
-                myself = 1;
-            }
-            else
-            {
-                role_len = sdslen(part[2]);
-                role = part[2];
-            }
-
-            //add master node
-            if(role_len >= 6 && memcmp(role, "master", 6) == 0)
+            //the node may have executed it, so it is not sent again
+            if(j >= fans[i].received)
             {
-                if(count_part < 8)
-                {
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                        "master node part number error");
-                    goto error;
-                }
-                
-                master = node_get_with_nodes(cc, 
-                    part, count_part, REDIS_ROLE_MASTER);
-                if(master == NULL)
-                {
-                    goto error;
-                }
-
-                ret = dictAdd(nodes, 
-                    sdsnewlen(master->addr, sdslen(master->addr)), master);
-                if(ret != DICT_OK)
+                if(fans[i].c->err)
                 {
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                        "the address already exists in the nodes");
-                    cluster_node_deinit(master);
-                    hi_free(master);
-                    goto error;
+                    __redisClusterSetError(cc, fans[i].c->err, fans[i].c->errstr);
                 }
-
-                if(cc->flags & HIRCLUSTER_FLAG_ADD_SLAVE)
+                else
                 {
-                    ret = cluster_master_slave_mapping_with_name(cc, 
-                        &nodes_name, master, master->name);
-                    if(ret != REDIS_OK)
-                    {
-                        cluster_node_deinit(master);
-                        hi_free(master);
-                        goto error;
-                    }
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                        "subcommand reply is lost");
                 }
                 
-                if(myself == 1)
+                goto done;
+            }
+            
+            reply = fans[i].replies[j];
+            fans[i].replies[j] = NULL;
+
+            //only the redirected ones are executed again below
+            error_type = cluster_reply_error_type(reply);
+            if(error_type == CLUSTER_ERR_MOVED)
+            {
+                cluster_update_route_by_moved(cc, reply);
+                freeReplyObject(reply);
+                continue;
+            }
+            else if(error_type == CLUSTER_ERR_ASK)
+            {
+                node = node_get_by_redirect_reply(cc, reply, &slot_num);
+                if(node != NULL)
                 {
-                    master->con = c;
-                    c = NULL;
+                    cluster_ask_cache_add(cc, sub_command, 
+                        (uint32_t)slot_num, node);
                 }
                 
-                for(k = 8; k < count_part; k ++)
-                {
-                    slot_start_end = sdssplitlen(part[k], 
-                        sdslen(part[k]), "-", 1, &count_slot_start_end);
-                    
-                    if(slot_start_end == NULL)
-                    {
-                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                            "split slot start end error(NULL)");
-                        goto error;
-                    }
-                    else if(count_slot_start_end == 1)
-                    {
-                        slot_start = 
-                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));
-                        slot_end = slot_start;
-                    }
-                    else if(count_slot_start_end == 2)
-                    {
-                        slot_start = 
-                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));;
-                        slot_end = 
-                            hi_atoi(slot_start_end[1], sdslen(slot_start_end[1]));;
-                    }
-                    else
-                    {
-                        slot_start = -1;
-                        slot_end = -1;
-                    }
-                    
-                    sdsfreesplitres(slot_start_end, count_slot_start_end);
-                    count_slot_start_end = 0;
-                    slot_start_end = NULL;
+                freeReplyObject(reply);
+                continue;
+            }
+            else if(error_type == CLUSTER_ERR_TRYAGAIN)
+            {
+                freeReplyObject(reply);
+                continue;
+            }
 
-                    if(slot_start < 0 || slot_end < 0 || 
-                        slot_start > slot_end || slot_end >= REDIS_CLUSTER_SLOTS)
-                    {
-                        continue;
-                    }
+            sub_command->reply = reply;
+        }
+    }
 
-                    for(j = slot_start; j <= slot_end; j ++)
-                    {
-                        if(table[j] != NULL)
-                        {
-                            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                "diffent node hold a same slot");
-                            goto error;
-                        }
-                        table[j] = master;
-                    }
-                    
-                    slot = hiarray_push(slots);
-                    if(slot == NULL)
-                    {
-                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                            "slot push in array error");
-                        goto error;
-                    }
+    if(cc->err)
+    {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
 
-                    *slot = cluster_slot_create(master);
-                    if(*slot == NULL)
-                    {
-                        __redisClusterSetError(cc,REDIS_ERR_OOM,
-                            "Out of memory");
-                        goto error;
-                    }
+    for(ln = listFirst(commands); ln != NULL; ln = listNextNode(ln))
+    {
+        sub_command = listNodeValue(ln);
+        if(sub_command->reply != NULL)
+        {
+            continue;
+        }
 
-                    (*slot)->start = (uint32_t)slot_start;
-                    (*slot)->end = (uint32_t)slot_end;                    
-                }
+        sub_command->reply = redis_cluster_command_execute(cc, sub_command);
+        if(sub_command->reply == NULL)
+        {
+            goto done;
+        }
+    }
 
-            }
-            //add slave node
-            else if((cc->flags & HIRCLUSTER_FLAG_ADD_SLAVE) && 
-                (role_len >= 5 && memcmp(role, "slave", 5) == 0))
-            {
-                slave = node_get_with_nodes(cc, part, 
-                    count_part, REDIS_ROLE_SLAVE);
-                if(slave == NULL)
-                {
-                    goto error;
-                }
+    ret = REDIS_OK;
 
-                ret = cluster_master_slave_mapping_with_name(cc, 
-                    &nodes_name, slave, part[3]);
-                if(ret != REDIS_OK)
-                {
-                    cluster_node_deinit(slave);
-                    hi_free(slave);
-                    goto error;
-                }
-                
-                if(myself == 1)
-                {
-                    slave->con = c;
-                    c = NULL;
-                }
-            }
+done:
 
-            if(myself == 1)
+    for(i = 0; fans != NULL && i < n; i ++)
+    {
+        for(j = 0; fans[i].replies != NULL && j < fans[i].received; j ++)
+        {
+            if(fans[i].replies[j] != NULL)
             {
-                myself = 0;
+                freeReplyObject(fans[i].replies[j]);
             }
+        }
 
-            sdsfreesplitres(part, count_part);
-            count_part = 0;
-            part = NULL;
-            
-            start = pos + 1;
-            line_start = start;
-            pos = start;
+        if(fans[i].replies != NULL)
+        {
+            hi_free(fans[i].replies);
         }
     }
 
-    if(cc->slots != NULL)
+    if(fans != NULL)
     {
-        cc->slots->nelem = 0;
-        hiarray_destroy(cc->slots);
-        cc->slots = NULL;
+        hi_free(fans);
     }
-    cc->slots = slots;
-
-    cluster_nodes_swap_ctx(cc->nodes, nodes);
 
-    if(cc->nodes != NULL)
+    if(groups != NULL)
     {
-        dictRelease(cc->nodes);
-        cc->nodes = NULL;
+        hi_free(groups);
     }
-    cc->nodes = nodes;
 
-    hiarray_sort(cc->slots, cluster_slot_start_cmp);
+    return ret;
+}
 
-    memcpy(cc->table, table, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
-    cc->route_version ++;
-    
-    freeReplyObject(reply);
+/*
+ * Find the keys of the formatted command by the offset and the length
+ * of each of its arguments, argpos as redisvFormatCommandPos sets it,
+ * instead of parsing the command.
+ */
+static void command_parse_by_pos(redisClusterContext *cc, 
+    struct cmd *command, const size_t *argpos, int argc)
+{
+    struct keypos *args;
+    int j;
 
-    if(c != NULL)
+    if(argc <= 0)
     {
-        redisFree(c);
+        command->result = CMD_PARSE_ERROR;
+        return;
     }
 
-    if(nodes_name != NULL)
+    args = hi_alloc(argc * sizeof(*args));
+    if(args == NULL)
     {
-        dictRelease(nodes_name);
+        command->result = CMD_PARSE_ENOMEM;
+        return;
     }
-    
-    return REDIS_OK;
 
-error:
-        
-    if(part != NULL)
+    for(j = 0; j < argc; j ++)
     {
-        sdsfreesplitres(part, count_part);
-        count_part = 0;
-        part = NULL;
+        args[j].start = command->cmd + argpos[2*j];
+        args[j].end = args[j].start + argpos[2*j+1];
+        args[j].remain_len = 0;
     }
 
-    if(slot_start_end != NULL)
+    redis_parse_cmd_args(command, args, (uint32_t)argc);
+    if(command->result == CMD_PARSE_ERROR && 
+        command->type == CMD_UNKNOWN && cc->command_infos != NULL)
     {
-        sdsfreesplitres(slot_start_end, count_slot_start_end);
-        count_slot_start_end = 0;
-        slot_start_end = NULL;
+        cluster_command_parse_args_by_info(cc, command, 
+            args, (uint32_t)argc);
     }
 
-    if(slots != NULL)
-    {
-        if(slots == cc->slots)
-        {
-            cc->slots = NULL;
-        }
+    hi_free(args);
+}
 
-        slots->nelem = 0;
-        hiarray_destroy(slots);
+/* 
+ * Split the command into subcommands by slot
+ * The keys are found by argpos if it is not NULL, see command_parse_by_pos.
+ * 
+ * Returns slot_num
+ * If slot_num < 0 or slot_num >=  REDIS_CLUSTER_SLOTS means this function runs error;
+ * Otherwise if  the commands > 1 , slot_num is the last subcommand slot number. 
+ */
+static int command_format_by_slot(redisClusterContext *cc, 
+    struct cmd *command, hilist *commands, const size_t *argpos, int argc)
+{
+    struct keypos *kp;
+    int key_count;
+    int slot_num = -1;
+
+    if(cc == NULL || commands == NULL ||
+        command == NULL || 
+        command->cmd == NULL || command->clen <= 0)
+    {
+        goto done;
     }
 
-    if(nodes != NULL)
+    if(argpos != NULL)
+    {
+        command_parse_by_pos(cc, command, argpos, argc);
+    }
+    else
     {
-        if(nodes == cc->nodes)
+        redis_parse_cmd(command);
+        if(command->result == CMD_PARSE_ERROR && 
+            command->type == CMD_UNKNOWN && cc->command_infos != NULL)
         {
-            cc->nodes = NULL;
+            cluster_command_parse_by_info(cc, command);
         }
+    }
+    
+    if(command->result == CMD_PARSE_ENOMEM)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, "Parse command error: out of memory");
+        goto done;
+    }
+    else if(command->result != CMD_PARSE_OK)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, command->errstr);
+        goto done;
+    }
 
-        dictRelease(nodes);
+    key_count = hiarray_n(command->keys);
+
+    if(key_count <= 0)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "No keys in command(must have keys for redis cluster mode)");
+        goto done;
+    }
+    else if(key_count == 1)
+    {
+        kp = hiarray_get(command->keys, 0);
+        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+        command->slot_num = slot_num;
+
+        goto done;
     }
 
-    if(nodes_name != NULL)
+    slot_num = command_pre_fragment(cc, command, commands);
+
+done:
+    
+    return slot_num;
+}
+
+
+/*
+ * Set slots[i] to the slot of the key keys[i] of lens[i] bytes, for the
+ * n keys, strlen is used for the lengths if lens is NULL. It needs no
+ * context, bulk loaders hash their keys in one call with it.
+ */
+int redisClusterKeySlots(const char **keys, const size_t *lens, 
+    int n, int *slots)
+{
+    int i;
+
+    if(n < 0 || (n > 0 && (keys == NULL || slots == NULL)))
     {
-        dictRelease(nodes_name);
+        return REDIS_ERR;
     }
 
-    if(reply != NULL)
+    for(i = 0; i < n; i ++)
     {
-        freeReplyObject(reply);
-        reply = NULL;
+        slots[i] = (int)keyHashSlot(keys[i], 
+            lens ? (int)lens[i] : (int)strlen(keys[i]));
     }
 
-    if(c != NULL)
+    return REDIS_OK;
+}
+
+/*
+ * Let the command name span slots like mget, it is split by slot as
+ * split says and the replies are merged as merge says. It is shared by
+ * all the contexts, call it before sending any command. A command with
+ * a fixed layout of keys and arguments, like hmget, is refused.
+ */
+int redisClusterRegisterReducer(const char *name, int split, int merge)
+{
+    if(name == NULL ||
+        (split != HIRCLUSTER_SPLIT_KEYS &&
+        split != HIRCLUSTER_SPLIT_KEY_VALUES) ||
+        (merge != HIRCLUSTER_MERGE_SUM &&
+        merge != HIRCLUSTER_MERGE_CONCAT &&
+        merge != HIRCLUSTER_MERGE_ALL_OK))
     {
-        redisFree(c);
+        return REDIS_ERR;
     }
-    
-    return REDIS_ERR;
+
+    return command_reducer_register(name, 
+        split == HIRCLUSTER_SPLIT_KEYS ? 
+        CMD_SPLIT_KEYS : CMD_SPLIT_KEY_VALUES,
+        merge == HIRCLUSTER_MERGE_SUM ? CMD_MERGE_SUM :
+        merge == HIRCLUSTER_MERGE_CONCAT ? 
+        CMD_MERGE_CONCAT : CMD_MERGE_ALL_OK);
 }
 
-int
-cluster_update_route(redisClusterContext *cc)
+void redisClusterSetMaxRedirect(redisClusterContext *cc, int max_redirect_count)
 {
-    int ret;
-    int flag_err_not_set = 1;
-    cluster_node *node;
-    dictIterator *it;
-    dictEntry *de;
-    
+    if(cc == NULL || max_redirect_count <= 0)
+    {
+        return;
+    }
+
+    cc->max_redirect_count = max_redirect_count;
+}
+
+static void *cluster_formatted_command(redisClusterContext *cc, 
+    char *cmd, int len, const size_t *argpos, int argc) {
+    redisReply *reply = NULL;
+    int slot_num;
+    struct cmd *command = NULL;
+    hilist *commands = NULL;
+
     if(cc == NULL)
     {
-        return REDIS_ERR;
+        return NULL;
     }
 
-    if(cc->ip != NULL && cc->port > 0)
+    if(cc->err)
     {
-        ret = cluster_update_route_by_addr(cc, cc->ip, cc->port);
-        if(ret == REDIS_OK)
-        {
-            return REDIS_OK;
-        }
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }  
 
-        flag_err_not_set = 0;
+    cluster_update_route_deferred(cc);
+    
+    command = command_get();
+    if(command == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
     }
+    
+    command->cmd = cmd;
+    command->clen = len;
 
-    if(cc->nodes == NULL)
+    commands = listCreate();
+    if(commands == NULL)
     {
-        if(flag_err_not_set)
-        {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, "no server address");
-        }
-        
-        return REDIS_ERR;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
+    }
+
+    commands->free = listCommandFree;
+
+    slot_num = command_format_by_slot(cc, command, commands, argpos, argc);
+
+    if(slot_num < 0)
+    {
+        goto error;
+    }
+    else if(slot_num >= REDIS_CLUSTER_SLOTS)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"slot_num is out of range");
+        goto error;
     }
 
-    it = dictGetIterator(cc->nodes);
-    while ((de = dictNext(it)) != NULL)
+    //all keys belong to one slot
+    if(listLength(commands) == 0)
     {
-        node = dictGetEntryVal(de);
-        if(node == NULL || node->host == NULL || node->port < 0)
-        {
-            continue;
-        }
+        reply = redis_cluster_command_execute(cc, command);
+        goto done;
+    }
 
-        ret = cluster_update_route_by_addr(cc, node->host, node->port);
-        if(ret == REDIS_OK)
-        {
-            if(cc->err)
-            {
-                cc->err = 0;
-                memset(cc->errstr, '\0', strlen(cc->errstr));
-            }
-            
-            dictReleaseIterator(it);
-            return REDIS_OK;
-        }
+    ASSERT(listLength(commands) != 1);
+
+    if(command_execute_by_node(cc, command, commands) != REDIS_OK)
+    {
+        goto error;
+    }
+
+    reply = command_post_fragment(cc, command, commands);
+    
+done:
+
+    command->cmd = NULL;
+    command_destroy(command);
 
-        flag_err_not_set = 0;
+    if(commands != NULL)
+    {
+        listRelease(commands);
     }
+
+    cc->retry_count = 0;
     
-    dictReleaseIterator(it);
+    return reply;
+
+error:
 
-    if(flag_err_not_set)
+    if(command != NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "no valid server address");
+        command->cmd = NULL;
+        command_destroy(command);
+    }
+
+    if(commands != NULL)
+    {
+        listRelease(commands);
+    }
+
+    cc->retry_count = 0;
+    
+    return NULL;
+}
+
+void *redisClusterFormattedCommand(redisClusterContext *cc, char *cmd, int len) {
+    return cluster_formatted_command(cc, cmd, len, NULL, 0);
+}
+
+void *redisClustervCommand(redisClusterContext *cc, const char *format, va_list ap) {
+    redisReply *reply;
+    char *cmd;
+    size_t *argpos;
+    int len, argc;
+
+    if(cc == NULL)
+    {
+        return NULL;
     }
 
-    return REDIS_ERR;
+    //the formatter tells where the arguments are, the keys are found
+    //by them without parsing the command again
+    len = redisvFormatCommandPos(&cmd,&argpos,&argc,format,ap);
+
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    } else if (len == -2) {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"Invalid format string");
+        return NULL;
+    }   
+
+    reply = cluster_formatted_command(cc, cmd, len, argpos, argc);
+
+    free(argpos);
+    free(cmd);
+
+    return reply;
+}
+
+void *redisClusterCommand(redisClusterContext *cc, const char *format, ...) {
+    va_list ap;
+    redisReply *reply = NULL;
+    
+    va_start(ap,format);
+    reply = redisClustervCommand(cc, format, ap);
+    va_end(ap);
+
+    return reply;
 }
 
-static void print_cluster_node_list(redisClusterContext *cc)
+/**
+  * Find the slot of the command given by argv from its arguments, 
+  * without formatting it. Returns -1 if the command is not known or
+  * its keys are not in one slot, it goes the formatted way then.
+  */
+static int command_slot_by_argv(redisClusterContext *cc, 
+    struct cmd *command)
 {
-    dictIterator *di = NULL;
-    dictEntry *de;
-    listIter *it;
-    listNode *ln;
-    cluster_node *master, *slave;
-    hilist *slaves;
+    struct keypos *args, *kp;
+    uint32_t key_count, i;
+    int slot_num = -1, slot;
+    size_t len;
+    int j;
 
-    if(cc == NULL)
+    if(command->argc <= 0)
     {
-        return;
+        return -1;
     }
 
-    di = dictGetIterator(cc->nodes);
+    args = hi_alloc(command->argc * sizeof(*args));
+    if(args == NULL)
+    {
+        return -1;
+    }
 
-    printf("name\taddress\trole\tslaves\n");
-    
-    while((de = dictNext(di)) != NULL) {
-        master = dictGetEntryVal(de);
+    for(j = 0; j < command->argc; j ++)
+    {
+        len = command->argvlen ? command->argvlen[j] : 
+            strlen(command->argv[j]);
+        args[j].start = (char *)command->argv[j];
+        args[j].end = args[j].start + len;
+        args[j].remain_len = 0;
+    }
 
-        printf("%s\t%s\t%d\t%s\n",master->name, master->addr, 
-            master->role, master->slaves?"hava":"null");
+    redis_parse_cmd_args(command, args, (uint32_t)command->argc);
+    if(command->result == CMD_PARSE_ERROR && 
+        command->type == CMD_UNKNOWN && cc->command_infos != NULL)
+    {
+        cluster_command_parse_args_by_info(cc, command, 
+            args, (uint32_t)command->argc);
+    }
 
-        slaves = master->slaves;
-        if(slaves == NULL)
-        {
-            continue;
-        }
-        
-        it = listGetIterator(slaves, AL_START_HEAD);
-        while((ln = listNext(it)) != NULL)
+    if(command->result == CMD_PARSE_OK)
+    {
+        key_count = hiarray_n(command->keys);
+        for(i = 0; i < key_count; i ++)
         {
-            slave = listNodeValue(ln);
-            printf("%s\t%s\t%d\t%s\n",slave->name, slave->addr, 
-                slave->role, slave->slaves?"hava":"null");
+            kp = hiarray_get(command->keys, i);
+            slot = keyHashSlot(kp->start, kp->end - kp->start);
+            if(i > 0 && slot != slot_num)
+            {
+                slot_num = -1;
+                break;
+            }
+            slot_num = slot;
         }
+    }
 
-        listReleaseIterator(it);
+    hi_free(args);
 
-        printf("\n");
-    }
+    return slot_num;
 }
 
+void *redisClusterCommandArgv(redisClusterContext *cc, int argc, const char **argv, const size_t *argvlen) {
+    redisReply *reply = NULL;
+    struct cmd *command;
+    char *cmd;
+    int len;
 
-int test_cluster_update_route(redisClusterContext *cc)
-{
-    int ret;
-    
-    ret = cluster_update_route(cc);
+    if(cc == NULL)
+    {
+        return NULL;
+    }
 
-    //print_cluster_node_list(cc);
-    
-    return ret;
-}
+    if(cc->err)
+    {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
 
-redisClusterContext *redisClusterContextInit(void) {
-    redisClusterContext *cc;
+    cluster_update_route_deferred(cc);
 
-    cc = calloc(1,sizeof(redisClusterContext));
-    if (cc == NULL)
+    command = command_get();
+    if(command == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
         return NULL;
+    }
 
-    cc->err = 0;
-    cc->errstr[0] = '\0';
-    cc->ip = NULL;
-    cc->port = 0;
-    cc->flags = 0;
-    cc->connect_timeout = NULL;
-    cc->timeout = NULL;
-    cc->nodes = NULL;
-    cc->slots = NULL;
-    cc->max_redirect_count = CLUSTER_DEFAULT_MAX_REDIRECT_COUNT;
-    cc->retry_count = 0;
-    cc->requests = NULL;
-    cc->need_update_route = 0;
-    cc->update_route_time = 0LL;
+    command->argc = argc;
+    command->argv = argv;
+    command->argvlen = argvlen;
 
-    cc->route_version = 0LL;
+    //the keys in one slot are found in argv, the command is formatted 
+    //only once, right into the output buffer of the node
+    command->slot_num = command_slot_by_argv(cc, command);
+    if(command->slot_num >= 0)
+    {
+        reply = redis_cluster_command_execute(cc, command);
+        command_destroy(command);
+        cc->retry_count = 0;
+        
+        return reply;
+    }
 
-    memset(cc->table, 0, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
+    command_destroy(command);
 
-    cc->flags |= REDIS_BLOCK;
-    
-    return cc;
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+	
+    reply = redisClusterFormattedCommand(cc, cmd, len);
+
+    free(cmd);
+
+    return reply;
 }
 
-void redisClusterFree(redisClusterContext *cc) {
-    
-    if (cc == NULL)
-        return;
+/* Parse the formatted command and split it by slot into the fragments
+ * kept in its sub_commands. Return NULL on error.
+ */
+static struct cmd *cluster_request_parse(redisClusterContext *cc, 
+    const char *cmd, int len)
+{
+    int slot_num;
+    struct cmd *command = NULL;
+    hilist *commands = NULL;
 
-    if(cc->ip)
+    command = command_get();
+    if(command == NULL)
     {
-        sdsfree(cc->ip);
-        cc->ip = NULL;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
     }
 
-    if (cc->connect_timeout)
+    //kept to send the command again if it is redirected
+    command->cmd = malloc(len * sizeof(*command->cmd));
+    if(command->cmd == NULL)
     {
-        free(cc->connect_timeout);
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
     }
+    memcpy(command->cmd, cmd, len);
+    command->clen = len;
 
-    if (cc->timeout)
+    commands = listCreate();
+    if(commands == NULL)
     {
-        free(cc->timeout);
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
     }
 
-    memset(cc->table, 0, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
+    commands->free = listCommandFree;
+
+    slot_num = command_format_by_slot(cc, command, commands, NULL, 0);
 
-    if(cc->slots != NULL)
+    if(slot_num < 0)
     {
-        cc->slots->nelem = 0;
-        hiarray_destroy(cc->slots);
-        cc->slots = NULL;
+        goto error;
     }
-
-    if(cc->nodes != NULL)
+    else if(slot_num >= REDIS_CLUSTER_SLOTS)
     {
-        dictRelease(cc->nodes);
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"slot_num is out of range");
+        goto error;
     }
 
-    if(cc->requests != NULL)
+    //all keys belong to one slot
+    if(listLength(commands) == 0)
     {
-        listRelease(cc->requests);
+        listRelease(commands);
+        return command;
     }
+
+    ASSERT(listLength(commands) != 1);
+
+    command->sub_commands = commands;
     
-    free(cc);
-}
+    return command;
 
-/* Connect to a Redis cluster. On error the field error in the returned
- * context will be set to the return value of the error function.
- * When no set of reply functions is given, the default set will be used. */
-static int _redisClusterConnect2(redisClusterContext *cc)
-{
+error:
 
-    if (cc->nodes == NULL || dictSize(cc->nodes) == 0)
+    if(command != NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"servers address does not set up");
-        return REDIS_ERR;
+        command_destroy(command);
     }
-    
-    return cluster_update_route(cc);
-}
-
-/* Connect to a Redis cluster. On error the field error in the returned
- * context will be set to the return value of the error function.
- * When no set of reply functions is given, the default set will be used. */
-static redisClusterContext *_redisClusterConnect(redisClusterContext *cc, const char *addrs) {
 
-    int ret;
-    
-    ret = redisClusterSetOptionAddNodes(cc, addrs);
-    if (ret != REDIS_OK)
+    if(commands != NULL)
     {
-        return cc;
+        listRelease(commands);
     }
     
-    cluster_update_route(cc);
-
-    return cc;
+    return NULL;
 }
 
-redisClusterContext *redisClusterConnect(const char *addrs, int flags)
+/* Write the parsed command, or its fragments, to the nodes and add it 
+ * to the requests of the pipeline. The command is not owned here.
+ */
+static int cluster_request_append(redisClusterContext *cc, 
+    struct cmd *command)
 {
-    redisClusterContext *cc;
-
-    cc = redisClusterContextInit();
+    struct cmd *sub_command;
+    listNode *list_node;
+    listIter *list_iter;
 
-    if(cc == NULL)
+    if(cc->requests == NULL)
     {
-        return NULL;
+        cc->requests = listCreate();
+        if(cc->requests == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
+
+        cc->requests->free = listCommandFree;
     }
 
-    cc->flags |= REDIS_BLOCK;
-    if(flags)
+    //a new pipeline
+    if(listLength(cc->requests) == 0)
     {
-        cc->flags |= flags;
+        cc->requests_redirected = 0;
     }
-    
-    return _redisClusterConnect(cc, addrs);
-}
 
-redisClusterContext *redisClusterConnectWithTimeout(
-    const char *addrs, const struct timeval tv, int flags)
-{
-    redisClusterContext *cc;
+    if(command->sub_commands == NULL)
+    {
+        if(__redisClusterAppendCommand(cc, command) != REDIS_OK)
+        {
+            return REDIS_ERR;
+        }
+    }
+    else
+    {
+        list_iter = listGetIterator(command->sub_commands, AL_START_HEAD);
+        if(list_iter == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
+        
+        while((list_node = listNext(list_iter)) != NULL)
+        {
+            sub_command = list_node->value;
+            
+            if(__redisClusterAppendCommand(cc, sub_command) != REDIS_OK)
+            {
+                /* Attention: mybe here we must pop the 
+                  sub_commands that had append to the nodes.  
+                  But now we do not handle it. */
+                listReleaseIterator(list_iter);
+                return REDIS_ERR;
+            }
+        }
 
-    cc = redisClusterContextInit();
+        listReleaseIterator(list_iter);
+    }
 
-    if(cc == NULL)
+    if(listAddNodeTail(cc->requests, command) == NULL)
     {
-        return NULL;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
     }
+    
+    return REDIS_OK;
+}
+
+int redisClusterAppendFormattedCommand(redisClusterContext *cc, 
+    char *cmd, int len) {
+    struct cmd *command;
 
-    cc->flags |= REDIS_BLOCK;
-    if(flags)
+    command = cluster_request_parse(cc, cmd, len);
+    if(command == NULL)
     {
-        cc->flags |= flags;
+        return REDIS_ERR;
     }
-    
-    if (cc->connect_timeout == NULL)
+
+    if(cluster_request_append(cc, command) != REDIS_OK)
     {
-        cc->connect_timeout = malloc(sizeof(struct timeval));
+        command_destroy(command);
+        return REDIS_ERR;
     }
-    
-    memcpy(cc->connect_timeout, &tv, sizeof(struct timeval));
-    
-    return _redisClusterConnect(cc, addrs);
+
+    return REDIS_OK;
 }
 
-redisClusterContext *redisClusterConnectNonBlock(const char *addrs, int flags) {
 
-    redisClusterContext *cc;
+int redisClustervAppendCommand(redisClusterContext *cc, 
+    const char *format, va_list ap) {
+    int ret;
+    char *cmd;
+    int len;
+    
+    len = redisvFormatCommand(&cmd,format,ap);  
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    } else if (len == -2) {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"Invalid format string");
+        return REDIS_ERR;
+    }   
 
-    cc = redisClusterContextInit();
+    ret = redisClusterAppendFormattedCommand(cc, cmd, len);
 
-    if(cc == NULL)
+    free(cmd);
+
+    return ret;
+}
+
+int redisClusterAppendCommand(redisClusterContext *cc, 
+    const char *format, ...) {
+
+    int ret;
+    va_list ap;
+
+    if(cc == NULL || format == NULL)
     {
-        return NULL;
+        return REDIS_ERR;
     }
+    
+    va_start(ap,format);
+    ret = redisClustervAppendCommand(cc, format, ap);
+    va_end(ap);
 
-    cc->flags &= ~REDIS_BLOCK;
-    if(flags)
-    {
-        cc->flags |= flags;
+    return ret;
+}
+
+int redisClusterAppendCommandArgv(redisClusterContext *cc, 
+    int argc, const char **argv, const size_t *argvlen) {
+    int ret;
+    char *cmd;
+    int len;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
     }
     
-    return _redisClusterConnect(cc, addrs);
+    ret = redisClusterAppendFormattedCommand(cc, cmd, len);
+    
+    free(cmd);
+
+    return ret;
 }
 
-int redisClusterSetOptionAddNode(redisClusterContext *cc, const char *addr)
+static int redisCLusterSendAll(redisClusterContext *cc)
 {
-    dictEntry *node_entry;
-    cluster_node *node;
-    sds *ip_port = NULL;
-    int ip_port_count = 0;
-    sds ip;
-    int port;
-    sds addr_sds = NULL;
+    dictIterator *di;
+    dictEntry *de;
+    struct cluster_node *node;
+    redisContext *c = NULL;
+    int wdone = 0;
     
-    if(cc == NULL)
+    if(cc == NULL || cc->nodes == NULL)
     {
         return REDIS_ERR;
     }
 
-    if(cc->nodes == NULL)
+    di = dictGetIterator(cc->nodes);
+    while((de = dictNext(di)) != NULL)
     {
-        cc->nodes = dictCreate(&clusterNodesDictType, NULL);
-        if(cc->nodes == NULL)
+        node = dictGetEntryVal(de);
+        if(node == NULL)
         {
-            return REDIS_ERR;
+            continue;
         }
-    }
-
-    addr_sds = sdsnew(addr);
-    node_entry = dictFind(cc->nodes, addr_sds);
-    sdsfree(addr_sds);
-    if(node_entry == NULL)
-    {
-        ip_port = sdssplitlen(addr, strlen(addr), 
-            IP_PORT_SEPARATOR, strlen(IP_PORT_SEPARATOR), &ip_port_count);
-        if(ip_port == NULL || ip_port_count != 2 || 
-            sdslen(ip_port[0]) <= 0 || sdslen(ip_port[1]) <= 0)
+        
+        c = ctx_get_by_node(cc, node);
+        if(c == NULL)
         {
-            if(ip_port != NULL)
-            {
-                sdsfreesplitres(ip_port, ip_port_count);
-            }
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"server address is error(correct is like: 127.0.0.1:1234)");
-            return REDIS_ERR;
+            continue;
         }
 
-        ip = ip_port[0];
-        port = hi_atoi(ip_port[1], sdslen(ip_port[1]));
-
-        if(port <= 0)
-        {
-            sdsfreesplitres(ip_port, ip_port_count);
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"server port is error");
-            return REDIS_ERR;
+        if (c->flags & REDIS_BLOCK) {
+            /* Write until done */
+            do {
+                if (redisBufferWrite(c,&wdone) == REDIS_ERR)
+                {
+                    dictReleaseIterator(di);
+                    return REDIS_ERR;
+                }
+            } while (!wdone);
         }
+    }
+    
+    dictReleaseIterator(di);
 
-        sdsfree(ip_port[1]);
-        free(ip_port);
-        ip_port = NULL;
+    return REDIS_OK;
+}
+
+static int redisCLusterClearAll(redisClusterContext *cc)
+{
+    dictIterator *di;
+    dictEntry *de;
+    struct cluster_node *node;
+    redisContext *c = NULL;
     
-        node = hi_alloc(sizeof(cluster_node));
+    if (cc == NULL) {
+        return REDIS_ERR;
+    }
+
+    if (cc->err) {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
+
+    if (cc->nodes == NULL) {
+        return REDIS_ERR;
+    }
+    di = dictGetIterator(cc->nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        node = dictGetEntryVal(de);
         if(node == NULL)
         {
-            sdsfree(ip);
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"alloc cluster node error");
-            return REDIS_ERR;
+            continue;
         }
 
-        cluster_node_init(node);
-
-        node->addr = sdsnew(addr);
-        if(node->addr == NULL)
+        c = node->con;
+        if(c == NULL)
         {
-            sdsfree(ip);
-            hi_free(node);
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"new node address error");
-            return REDIS_ERR;
+            continue;
         }
 
-        node->host = ip;
-        node->port = port;
-
-        dictAdd(cc->nodes, sdsnewlen(node->addr, sdslen(node->addr)), node);
+        redisFree(c);
+        node->con = NULL;
     }
     
+    dictReleaseIterator(di);
+    
     return REDIS_OK;
 }
 
-int redisClusterSetOptionAddNodes(redisClusterContext *cc, const char *addrs)
+/* Flush the pipelined commands to all the nodes at once and read the 
+ * replies from all of them as they arrive. The replies are kept in the
+ * commands until redisClusterGetReply() hands them out, the commands 
+ * without one read ahead get their replies in the blocking way.
+ */
+static void cluster_pipeline_fetch(redisClusterContext *cc)
 {
-    int ret;
-    sds *address = NULL;
-    int address_count = 0;
-    int i;
+    struct cmd *command, **commands = NULL;
+    cluster_fanout *fans = NULL;
+    cluster_node *node;
+    redisContext *c;
+    listNode *ln, *ln_sub;
+    uint32_t *command_fan = NULL, *fan_next = NULL;
+    uint32_t i, j, count = 0, n = 0, skip;
 
-    if(cc == NULL)
+    skip = cc->requests_fetched;
+    for(ln = listFirst(cc->requests); ln != NULL; ln = listNextNode(ln))
     {
-        return REDIS_ERR;
+        command = listNodeValue(ln);
+        count += command->sub_commands != NULL ? 
+            listLength(command->sub_commands) : 1;
     }
 
-    address = sdssplitlen(addrs, strlen(addrs), CLUSTER_ADDRESS_SEPARATOR, 
-        strlen(CLUSTER_ADDRESS_SEPARATOR), &address_count);
-    if(address == NULL || address_count <= 0)
+    commands = hi_alloc(count * sizeof(*commands));
+    command_fan = hi_alloc(count * sizeof(*command_fan));
+    fans = hi_zalloc(count * sizeof(*fans));
+    if(commands == NULL || command_fan == NULL || fans == NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"servers address is error(correct is like: 127.0.0.1:1234,127.0.0.2:5678)");
-        return REDIS_ERR;
+        goto done;
     }
 
-    for(i = 0; i < address_count; i ++)
+    //the requests and their subcommands in the order they were appended
+    count = 0;
+    for(ln = listFirst(cc->requests); ln != NULL; ln = listNextNode(ln))
     {
-        ret = redisClusterSetOptionAddNode(cc, address[i]);
-        if(ret != REDIS_OK)
+        command = listNodeValue(ln);
+        if(skip > 0)
         {
-            sdsfreesplitres(address, address_count);
-            return REDIS_ERR;
+            skip --;
+            continue;
+        }
+        
+        if(command->sub_commands == NULL)
+        {
+            commands[count++] = command;
+            continue;
         }
-    }
 
-    sdsfreesplitres(address, address_count);
+        for(ln_sub = listFirst(command->sub_commands); ln_sub != NULL; 
+            ln_sub = listNextNode(ln_sub))
+        {
+            commands[count++] = listNodeValue(ln_sub);
+        }
+    }
 
-    return REDIS_OK;
-}
+    for(i = 0; i < count; i ++)
+    {
+        command_fan[i] = UINT32_MAX;
+        if(commands[i]->slot_num < 0 || commands[i]->reply != NULL)
+        {
+            continue;
+        }
+        
+        node = commands[i]->node;
+        if(node == NULL)
+        {
+            node = node_get_by_table(cc, (uint32_t)commands[i]->slot_num);
+        }
+        
+        c = node != NULL ? node->con : NULL;
+        if(c == NULL || c->err)
+        {
+            continue;
+        }
 
-int redisClusterSetOptionConnectBlock(redisClusterContext *cc)
-{
+        for(j = 0; j < n && fans[j].c != c; j ++);
+        if(j == n)
+        {
+            fans[n++].c = c;
+        }
 
-    if(cc == NULL)
-    {
-        return REDIS_ERR;
+        command_fan[i] = j;
+        fans[j].expected ++;
     }
 
-    cc->flags |= REDIS_BLOCK;
-
-    return REDIS_OK;
-}
+    for(j = 0; j < n; j ++)
+    {
+        fans[j].replies = hi_zalloc(fans[j].expected * sizeof(void *));
+        if(fans[j].replies == NULL)
+        {
+            goto done;
+        }
+    }
 
-int redisClusterSetOptionConnectNonBlock(redisClusterContext *cc)
-{
+    if(cluster_fanout_io(cc, fans, n) != REDIS_OK)
+    {
+        goto done;
+    }
 
-    if(cc == NULL)
+    fan_next = hi_zalloc((n + 1) * sizeof(*fan_next));
+    if(fan_next == NULL)
     {
-        return REDIS_ERR;
+        goto done;
     }
 
-    cc->flags &= ~REDIS_BLOCK;
+    for(i = 0; i < count; i ++)
+    {
+        j = command_fan[i];
+        if(j == UINT32_MAX || fan_next[j] >= fans[j].received)
+        {
+            continue;
+        }
 
-    return REDIS_OK;
-}
+        commands[i]->reply = fans[j].replies[fan_next[j]];
+        fans[j].replies[fan_next[j]++] = NULL;
+    }
 
-int redisClusterSetOptionParseSlaves(redisClusterContext *cc)
-{
+    cc->requests_fetched = (int)listLength(cc->requests);
 
-    if(cc == NULL)
+done:
+
+    if(cc->err)
     {
-        return REDIS_ERR;
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
     }
 
-    cc->flags |= HIRCLUSTER_FLAG_ADD_SLAVE;
+    for(j = 0; fans != NULL && j < n; j ++)
+    {
+        for(i = 0; fans[j].replies != NULL && i < fans[j].received; i ++)
+        {
+            if(fans[j].replies[i] != NULL)
+            {
+                freeReplyObject(fans[j].replies[i]);
+            }
+        }
 
-    return REDIS_OK;
-}
+        if(fans[j].replies != NULL)
+        {
+            hi_free(fans[j].replies);
+        }
+    }
 
-int redisClusterSetOptionParseOpenSlots(redisClusterContext *cc)
-{
+    if(fans != NULL)
+    {
+        hi_free(fans);
+    }
 
-    if(cc == NULL)
+    if(commands != NULL)
     {
-        return REDIS_ERR;
+        hi_free(commands);
     }
 
-    cc->flags |= HIRCLUSTER_FLAG_ADD_OPENSLOT;
+    if(command_fan != NULL)
+    {
+        hi_free(command_fan);
+    }
 
-    return REDIS_OK;
+    if(fan_next != NULL)
+    {
+        hi_free(fan_next);
+    }
 }
 
-int redisClusterSetOptionRouteUseSlots(redisClusterContext *cc)
-{
+int redisClusterGetReply(redisClusterContext *cc, void **reply) {
 
-    if(cc == NULL)
-    {
+    struct cmd *command, *sub_command;
+    hilist *commands = NULL;
+    listNode *list_command, *list_sub_command;
+    listIter *list_iter;
+    int ret;
+    void *sub_reply;
+
+    if(cc == NULL || reply == NULL)
         return REDIS_ERR;
-    }
 
-    cc->flags |= HIRCLUSTER_FLAG_ROUTE_USE_SLOTS;
+    cc->err = 0;
+    cc->errstr[0] = '\0';
 
-    return REDIS_OK;
-}
+    *reply = NULL;
 
-int redisClusterSetOptionConnectTimeout(redisClusterContext *cc, const struct timeval tv)
-{
+    if (cc->requests == NULL)
+        return REDIS_ERR;
 
-    if(cc == NULL)
+    list_command = listFirst(cc->requests);
+
+    //no more reply
+    if(list_command == NULL)
     {
-        return REDIS_ERR;
+        *reply = NULL;
+        return REDIS_OK;
     }
 
-    if (cc->connect_timeout == NULL)
+    if(cc->requests_fetched == 0)
     {
-        cc->connect_timeout = malloc(sizeof(struct timeval));
+        cluster_pipeline_fetch(cc);
     }
-    
-    memcpy(cc->connect_timeout, &tv, sizeof(struct timeval));
-
-    return REDIS_OK;
-}
-
-int redisClusterSetOptionTimeout(redisClusterContext *cc, const struct timeval tv)
-{
 
-    if(cc == NULL)
+    //the head request is removed below in any case
+    if(cc->requests_fetched > 0)
     {
-        return REDIS_ERR;
+        cc->requests_fetched --;
     }
-
-    if (cc->timeout == NULL)
+    
+    command = list_command->value;
+    if(command == NULL)
     {
-        cc->timeout = malloc(sizeof(struct timeval));
-        memcpy(cc->timeout, &tv, sizeof(struct timeval));
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "command in the requests list is null");
+        goto error;
     }
-    else if (cc->timeout->tv_sec != tv.tv_sec || cc->timeout->tv_usec != tv.tv_usec)
+    
+    if(command->slot_num >= 0)
     {
-        memcpy(cc->timeout, &tv, sizeof(struct timeval));
-
-        if (cc->nodes && dictSize(cc->nodes) > 0)
-        {
-            dictEntry *de;
-            dictIterator *di;
-            cluster_node *node;
-
-            di = dictGetIterator(cc->nodes);
-
-            while (de=dictNext(di))
-            {
-                node = dictGetEntryVal(de);
-                if (node->con && node->con->flags&REDIS_CONNECTED && node->con->err == 0)
-                {
-                    redisSetTimeout(node->con, tv);
-                }
+        ret = __redisClusterGetReply(cc, command, reply);
+        listDelNode(cc->requests, list_command);
+        return ret;
+    }
 
-                if (node->slaves && listLength(node->slaves) > 0)
-                {
-                    cluster_node *slave;
-                    listIter *li;
-                    listNode *ln;
-                    
-                    li = listGetIterator(node->slaves, AL_START_HEAD);
-                    while (ln = listNext(li))
-                    {
-                        slave = listNodeValue(ln);
-                        if (slave->con && slave->con->flags&REDIS_CONNECTED && slave->con->err == 0)
-                        {
-                            redisSetTimeout(slave->con, tv);
-                        }
-                    }
+    commands = command->sub_commands;
+    if(commands == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "sub_commands in command is null");
+        goto error;
+    }
 
-                    listReleaseIterator(li);
-                }
-            }
+    ASSERT(listLength(commands) != 1);
 
-            dictReleaseIterator(di);
+    list_iter = listGetIterator(commands, AL_START_HEAD);
+    while((list_sub_command = listNext(list_iter)) != NULL)
+    {
+        sub_command = list_sub_command->value;
+        if(sub_command == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "sub_command is null");
+            goto error;
+        }
+        
+        if(sub_command->slot_num < 0)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "sub_command slot_num is less then zero");
+            goto error;
         }
+        
+        if(__redisClusterGetReply(cc, sub_command, &sub_reply) != REDIS_OK)
+        {
+            goto error;
+        }
+
+        sub_command->reply = sub_reply;
     }
-    
-    return REDIS_OK;
-}
 
-int redisClusterSetOptionMaxRedirect(redisClusterContext *cc, int max_redirect_count)
-{
-    if(cc == NULL || max_redirect_count <= 0)
+    *reply = command_post_fragment(cc, command, commands);
+    if(*reply == NULL)
     {
-        return REDIS_ERR;
+        goto error;
     }
 
-    cc->max_redirect_count = max_redirect_count;
-
+    listDelNode(cc->requests, list_command);
     return REDIS_OK;
+
+error:
+
+    listDelNode(cc->requests, list_command);
+    return REDIS_ERR;
 }
 
-int redisClusterConnect2(redisClusterContext *cc)
+void redisClusterReset(redisClusterContext *cc)
 {
+    int status;
+    void *reply;
     
-    if(cc == NULL)
+    if(cc == NULL || cc->nodes == NULL)
     {
-        return REDIS_ERR;
+        return;
     }
-    
-    return _redisClusterConnect2(cc);
-}
 
-redisContext *ctx_get_by_node(redisClusterContext *cc, cluster_node *node)
-{
-    redisContext *c = NULL;
-    if(node == NULL)
+    if (cc->err) {
+        redisCLusterClearAll(cc);
+    } else {
+        redisCLusterSendAll(cc);
+        
+        do {
+            status = redisClusterGetReply(cc, &reply);
+            if (status == REDIS_OK) {
+                freeReplyObject(reply);
+            } else {
+                redisCLusterClearAll(cc);
+                break;
+            }
+        } while(reply != NULL);
+    }
+    
+    if(cc->requests)
     {
-        return NULL;
+        listRelease(cc->requests);
+        cc->requests = NULL;
     }
+    cc->requests_fetched = 0;
 
-    c = node->con;
-    if(c != NULL)
+    if(cc->need_update_route)
     {
-        if(c->err)
+        //a delayed update is run later by cluster_update_route_deferred
+        status = cluster_update_route_governed(cc);
+        if(status == REDIS_ERR)
         {
-            redisReconnect(c);
-
-            if (cc->timeout && c->err == 0) {
-                redisSetTimeout(c, *cc->timeout);
-            }
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "route update error, please recreate redisClusterContext!");
+            return;
         }
+        cc->need_update_route = 0;
+    }
+    else
+    {
+        cluster_update_route_deferred(cc);
+    }
+}
 
-        return c;
+struct redisClusterBatch {
+    sds buf;            /* the formatted commands back to back */
+    size_t *offsets;    /* offset of each command in buf */
+    int *lens;          /* length of each command */
+    struct cmd **commands;  /* parsed on the first execution, then kept */
+    int count;
+    int size;           /* commands offsets lens and commands have room for */
+};
+
+/* Drop the replies left in the parsed command by its last execution. */
+static void cluster_batch_command_clear(struct cmd *command)
+{
+    struct cmd *sub_command;
+    listNode *list_node;
+    listIter *list_iter;
+
+    if(command->reply != NULL)
+    {
+        freeReplyObject(command->reply);
+        command->reply = NULL;
     }
 
-    if(node->host == NULL || node->port <= 0)
+    if(command->sub_commands == NULL)
     {
-        return NULL;
+        return;
     }
 
-    if(cc->connect_timeout)
+    list_iter = listGetIterator(command->sub_commands, AL_START_HEAD);
+    if(list_iter == NULL)
     {
-        c = redisConnectWithTimeout(node->host, node->port, *cc->connect_timeout);
+        return;
     }
-    else
+
+    while((list_node = listNext(list_iter)) != NULL)
     {
-        c = redisConnect(node->host, node->port);
+        sub_command = list_node->value;
+        if(sub_command->reply != NULL)
+        {
+            freeReplyObject(sub_command->reply);
+            sub_command->reply = NULL;
+        }
     }
 
-    if (cc->timeout && c != NULL && c->err == 0) {
-        redisSetTimeout(c, *cc->timeout);
-    }
+    listReleaseIterator(list_iter);
+}
 
-    node->con = c;
+static void cluster_batch_commands_free(redisClusterBatch *batch)
+{
+    int i;
 
-    return c;
+    for(i = 0; i < batch->count; i ++)
+    {
+        if(batch->commands[i] != NULL)
+        {
+            command_destroy(batch->commands[i]);
+            batch->commands[i] = NULL;
+        }
+    }
 }
 
-static cluster_node *node_get_by_slot(redisClusterContext *cc, uint32_t slot_num)
+redisClusterBatch *redisClusterBatchCreate(void)
 {
-    struct hiarray *slots;
-    uint32_t slot_count;
-    cluster_slot **slot;
-    uint32_t middle, start, end;
-    uint8_t stop = 0;
-    
-    if(cc == NULL)
+    redisClusterBatch *batch;
+
+    batch = hi_zalloc(sizeof(*batch));
+    if(batch == NULL)
     {
         return NULL;
     }
 
-    if(slot_num >= REDIS_CLUSTER_SLOTS)
+    batch->buf = sdsempty();
+    if(batch->buf == NULL)
     {
+        hi_free(batch);
         return NULL;
     }
 
-    slots = cc->slots;
-    if(slots == NULL)
+    return batch;
+}
+
+void redisClusterBatchFree(redisClusterBatch *batch)
+{
+    if(batch == NULL)
     {
-        return NULL;
+        return;
     }
-    slot_count = hiarray_n(slots);
 
-    start = 0;
-    end = slot_count - 1;
-    middle = 0;
+    cluster_batch_commands_free(batch);
 
-    do{
-        if(start >= end)
-        {
-            stop = 1;
-            middle = end;
-        }
-        else
-        {
-            middle = start + (end - start)/2;
-        }
+    if(batch->buf != NULL)
+    {
+        sdsfree(batch->buf);
+    }
 
-        ASSERT(middle < slot_count);
+    if(batch->commands != NULL)
+    {
+        hi_free(batch->commands);
+    }
 
-        slot = hiarray_get(slots, middle);
-        if((*slot)->start > slot_num)
-        {
-            end = middle - 1;
-        }
-        else if((*slot)->end < slot_num)
-        {
-            start = middle + 1;
-        }
-        else
-        {
-            return (*slot)->node;
-        }
-            
-        
-    }while(!stop);
+    if(batch->offsets != NULL)
+    {
+        hi_free(batch->offsets);
+    }
 
-    printf("slot_num : %d\n", slot_num);
-    printf("slot_count : %d\n", slot_count);
-    printf("start : %d\n", start);
-    printf("end : %d\n", end);
-    printf("middle : %d\n", middle);
+    if(batch->lens != NULL)
+    {
+        hi_free(batch->lens);
+    }
 
-    return NULL;
+    hi_free(batch);
 }
 
-
-static cluster_node *node_get_by_table(redisClusterContext *cc, uint32_t slot_num)
-{   
-    if(cc == NULL)
+/* Empty the batch to be filled again, the memory is kept. */
+void redisClusterBatchReset(redisClusterBatch *batch)
+{
+    if(batch == NULL)
     {
-        return NULL;
+        return;
     }
 
-    if(slot_num >= REDIS_CLUSTER_SLOTS)
-    {
-        return NULL;
-    }
+    cluster_batch_commands_free(batch);
 
-    return cc->table[slot_num];
-    
+    sdsclear(batch->buf);
+    batch->count = 0;
 }
 
-static cluster_node *node_get_witch_connected(redisClusterContext *cc)
+int redisClusterBatchCount(redisClusterBatch *batch)
 {
-    dictIterator *di;
-    dictEntry *de;
-    struct cluster_node *node;
-    redisContext *c = NULL;
-    redisReply *reply = NULL;
+    return batch == NULL ? 0 : batch->count;
+}
 
-    if(cc == NULL || cc->nodes == NULL)
+int redisClusterBatchAppendFormattedCommand(redisClusterBatch *batch, 
+    const char *cmd, int len)
+{
+    size_t *offsets;
+    int *lens;
+    struct cmd **commands;
+    sds buf;
+    int size;
+
+    if(batch == NULL || cmd == NULL || len <= 0)
     {
-        return NULL;
+        return REDIS_ERR;
     }
 
-    di = dictGetIterator(cc->nodes);
-    while((de = dictNext(di)) != NULL)
+    if(batch->count == batch->size)
     {
-        node = dictGetEntryVal(de);
-        if(node == NULL)
-        {
-            continue;
-        }
+        size = batch->size == 0 ? 16 : batch->size * 2;
         
-        c = ctx_get_by_node(cc, node);
-        if(c == NULL || c->err)
+        offsets = hi_realloc(batch->offsets, size * sizeof(*offsets));
+        if(offsets == NULL)
         {
-            continue;
+            return REDIS_ERR;
         }
+        batch->offsets = offsets;
 
-        reply = redisCommand(c, REDIS_COMMAND_PING);
-        if(reply != NULL && reply->type == REDIS_REPLY_STATUS &&
-            reply->str != NULL && strcmp(reply->str, "PONG") == 0)
+        lens = hi_realloc(batch->lens, size * sizeof(*lens));
+        if(lens == NULL)
         {
-            freeReplyObject(reply);
-            reply = NULL;
-            
-            dictReleaseIterator(di);            
-        
-            return node;
+            return REDIS_ERR;
         }
-        else if(reply != NULL)
+        batch->lens = lens;
+
+        commands = hi_realloc(batch->commands, size * sizeof(*commands));
+        if(commands == NULL)
         {
-            freeReplyObject(reply);
-            reply = NULL;
+            return REDIS_ERR;
         }
+        batch->commands = commands;
+        
+        batch->size = size;
     }
 
-    dictReleaseIterator(di);
+    buf = sdscatlen(batch->buf, cmd, len);
+    if(buf == NULL)
+    {
+        return REDIS_ERR;
+    }
+    batch->buf = buf;
 
-    return NULL;
+    batch->offsets[batch->count] = sdslen(buf) - len;
+    batch->lens[batch->count] = len;
+    batch->commands[batch->count] = NULL;
+    batch->count ++;
+
+    return REDIS_OK;
 }
 
-static int slot_get_by_command(redisClusterContext *cc, char *cmd, int len)
+int redisClusterBatchvAppendCommand(redisClusterBatch *batch, 
+    const char *format, va_list ap)
 {
-    struct cmd *command = NULL;
-    struct keypos *kp;
-    int key_count;
-    uint32_t i;
-    int slot_num = -1;
-
-    if(cc == NULL || cmd == NULL || len <= 0)
-    {
-        goto done;
-    }
-
-    command = command_get();
-    if(command == NULL)
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto done;
-    }
+    int ret;
+    char *cmd;
+    int len;
     
-    command->cmd = cmd;
-    command->clen = len;
-    redis_parse_cmd(command);
-    if(command->result != CMD_PARSE_OK)
-    {
-        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, "parse command error");
-        goto done;
+    len = redisvFormatCommand(&cmd,format,ap);  
+    if (len < 0) {
+        return REDIS_ERR;
     }
 
-    key_count = hiarray_n(command->keys);
+    ret = redisClusterBatchAppendFormattedCommand(batch, cmd, len);
 
-    if(key_count <= 0)
-    {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "no keys in command(must have keys for redis cluster mode)");
-        goto done;
-    }
-    else if(key_count == 1)
-    {
-        kp = hiarray_get(command->keys, 0);
-        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+    free(cmd);
 
-        goto done;
+    return ret;
+}
+
+int redisClusterBatchAppendCommand(redisClusterBatch *batch, 
+    const char *format, ...)
+{
+    int ret;
+    va_list ap;
+
+    if(batch == NULL || format == NULL)
+    {
+        return REDIS_ERR;
     }
     
-    for(i = 0; i < hiarray_n(command->keys); i ++)
-    {
-        kp = hiarray_get(command->keys, i);
+    va_start(ap,format);
+    ret = redisClusterBatchvAppendCommand(batch, format, ap);
+    va_end(ap);
 
-        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
-    }
+    return ret;
+}
 
-done:
-    
-    if(command != NULL)
-    {
-        command->cmd = NULL;
-        command_destroy(command);
+int redisClusterBatchAppendCommandArgv(redisClusterBatch *batch, 
+    int argc, const char **argv, const size_t *argvlen)
+{
+    int ret;
+    char *cmd;
+    int len;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        return REDIS_ERR;
     }
     
-    return slot_num;
+    ret = redisClusterBatchAppendFormattedCommand(batch, cmd, len);
+    
+    free(cmd);
+
+    return ret;
 }
 
-/* Get the cluster config from one node.
-  * Return value: config_value string must free by usr.
-  */
-static char * cluster_config_get(redisClusterContext *cc, 
-    const char *config_name, int *config_value_len)
+/* Execute all the commands of the batch in one pass over the nodes, as 
+ * a pipeline does. replies and status are filled for each command in 
+ * order, the status is REDIS_OK if the reply is got. The replies are 
+ * owned by the caller. Return REDIS_ERR if any command failed, the err
+ * field of the context tells the last failure.
+ *
+ * The commands are parsed and split by slot on the first execution,
+ * the next executions write them to the nodes as they are.
+ */
+int redisClusterBatchExecute(redisClusterContext *cc, 
+    redisClusterBatch *batch, void **replies, int *status)
 {
-    redisContext *c;
-    cluster_node *node;
-    redisReply *reply = NULL, *sub_reply;
-    char *config_value = NULL;
+    int i, ret = REDIS_OK;
+    int err = 0;
+    char errstr[128];
+    struct cmd *command;
 
-    if(cc == NULL || config_name == NULL
-        || config_value_len == NULL)
+    if(cc == NULL || batch == NULL || replies == NULL || status == NULL)
     {
-        return NULL;
+        return REDIS_ERR;
     }
-    
-    node = node_get_witch_connected(cc);
-    if(node == NULL)
+
+    if(cc->requests != NULL && listLength(cc->requests) > 0)
     {
-        __redisClusterSetError(cc, 
-            REDIS_ERR_OTHER, "no reachable node in cluster");
-        goto error;
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "batch can not be executed with a pipeline in progress");
+        return REDIS_ERR;
     }
 
-    c = ctx_get_by_node(cc, node);
-    
-    reply = redisCommand(c, "config get %s", config_name);
-    if(reply == NULL)
+    if(cc->requests == NULL)
     {
-        __redisClusterSetError(cc, 
-            REDIS_ERR_OTHER, "reply for config get is null");
-        goto error;
+        cc->requests = listCreate();
+        if(cc->requests == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
     }
 
-    if(reply->type != REDIS_REPLY_ARRAY)
-    {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get type is not array");
-        goto error;
+    //the commands belong to the batch, redisClusterReset keeps them
+    cc->requests->free = NULL;
+
+    for(i = 0; i < batch->count; i ++)
+    {
+        replies[i] = NULL;
+        
+        command = batch->commands[i];
+        if(command == NULL)
+        {
+            command = cluster_request_parse(cc, 
+                batch->buf + batch->offsets[i], batch->lens[i]);
+            batch->commands[i] = command;
+        }
+        else
+        {
+            cluster_batch_command_clear(command);
+        }
+
+        status[i] = command != NULL ? 
+            cluster_request_append(cc, command) : REDIS_ERR;
+        if(status[i] != REDIS_OK)
+        {
+            err = cc->err;
+            memcpy(errstr, cc->errstr, sizeof(errstr));
+            cc->err = 0;
+            memset(cc->errstr, '\0', strlen(cc->errstr));
+        }
     }
 
-    if(reply->elements != 2)
+    for(i = 0; i < batch->count; i ++)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get elements number is not 2");
-        goto error;
+        if(status[i] != REDIS_OK)
+        {
+            ret = REDIS_ERR;
+            continue;
+        }
+
+        status[i] = redisClusterGetReply(cc, &replies[i]);
+        if(status[i] != REDIS_OK)
+        {
+            err = cc->err;
+            memcpy(errstr, cc->errstr, sizeof(errstr));
+            ret = REDIS_ERR;
+        }
     }
 
-    sub_reply = reply->element[0];
-    if(sub_reply == NULL || sub_reply->type != REDIS_REPLY_STRING)
+    redisClusterReset(cc);
+
+    if(cc->requests != NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get config name is not string");
-        goto error;
+        while(listFirst(cc->requests) != NULL)
+        {
+            listDelNode(cc->requests, listFirst(cc->requests));
+        }
+        
+        cc->requests->free = listCommandFree;
     }
 
-    if(strcmp(sub_reply->str, config_name))
+    for(i = 0; i < batch->count; i ++)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get config name is not we want");
-        goto error;
+        if(batch->commands[i] != NULL)
+        {
+            cluster_batch_command_clear(batch->commands[i]);
+        }
     }
 
-    sub_reply = reply->element[1];
-    if(sub_reply == NULL || sub_reply->type != REDIS_REPLY_STRING)
+    if(err)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get config value type is not string");
-        goto error;
+        __redisClusterSetError(cc, err, errstr);
     }
 
-    config_value = sub_reply->str;
-    *config_value_len = sub_reply->len;
-    sub_reply->str= NULL;
+    return ret;
+}
 
-    if(reply != NULL)
-    {
-        freeReplyObject(reply);    
-    }
+/* One SCAN over a node, it yields the keys of the slots assigned to it. */
+typedef struct cluster_scan_pass {
+    sds addr;           /* address of the node */
+    sds cursor;         /* "0" before the first call */
+    int done;
+    int failures;       /* rounds failed in a row */
+} cluster_scan_pass;
 
-    return config_value;
+struct redisClusterScan {
+    redisClusterContext *cc;
+    sds match;          /* MATCH pattern, NULL for all the keys */
+    sds count;          /* COUNT hint, NULL for the default */
+    sds type;           /* TYPE filter, NULL for all the types */
+    cluster_scan_pass *passes;
+    uint32_t npasses;
+    uint64_t route_version;     /* of the route the slots are assigned by */
+    uint32_t slot_pass[REDIS_CLUSTER_SLOTS];    /* pass index + 1, 0 if none */
+    int finished;
+};
 
-error:
+/* Assign the slots whose master is not the node of their pass to new 
+ * passes over their masters, the keys of the slots are scanned again
+ * there. A pass left without slots is done. Return the number of the 
+ * new passes, or -1 on error. */
+static int cluster_scan_assign(redisClusterScan *scan)
+{
+    redisClusterContext *cc = scan->cc;
+    cluster_scan_pass *pass;
+    cluster_node *node, *last_node = NULL;
+    uint32_t slot, i, first = scan->npasses, last_pass = 0;
+    uint8_t *owns;
 
-    if(reply != NULL)
+    for(slot = 0; slot < REDIS_CLUSTER_SLOTS; slot ++)
     {
-        freeReplyObject(reply);    
-    }
+        node = node_get_by_table(cc, slot);
+        if(node == NULL || node->addr == NULL)
+        {
+            continue;
+        }
 
-    return NULL;
-}
+        i = scan->slot_pass[slot];
+        if(i > 0 && sdscmp(scan->passes[i - 1].addr, node->addr) == 0)
+        {
+            continue;
+        }
 
-/* Helper function for the redisClusterAppendCommand* family of functions.
- *
- * Write a formatted command to the output buffer. When this family
- * is used, you need to call redisGetReply yourself to retrieve
- * the reply (or replies in pub/sub).
- */
-static int __redisClusterAppendCommand(redisClusterContext *cc, 
-    struct cmd *command) {
+        if(node != last_node)
+        {
+            for(i = first; i < scan->npasses; i ++)
+            {
+                if(sdscmp(scan->passes[i].addr, node->addr) == 0)
+                {
+                    break;
+                }
+            }
 
-    cluster_node *node;
-    redisContext *c = NULL;
+            if(i == scan->npasses)
+            {
+                pass = hi_realloc(scan->passes, 
+                    (scan->npasses + 1) * sizeof(*pass));
+                if(pass == NULL)
+                {
+                    __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+                    return -1;
+                }
+                scan->passes = pass;
 
-    if(cc == NULL || command == NULL)
-    {
-        return REDIS_ERR;
-    }
-    
-    node = node_get_by_table(cc, (uint32_t)command->slot_num);
-    if(node == NULL)
-    {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by slot error");
-        return REDIS_ERR;
+                pass = &scan->passes[scan->npasses];
+                memset(pass, 0, sizeof(*pass));
+                pass->addr = sdsdup(node->addr);
+                pass->cursor = sdsnew("0");
+                scan->npasses ++;
+
+                if(pass->addr == NULL || pass->cursor == NULL)
+                {
+                    __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+                    return -1;
+                }
+            }
+
+            last_node = node;
+            last_pass = i + 1;
+        }
+
+        scan->slot_pass[slot] = last_pass;
     }
 
-    c = ctx_get_by_node(cc, node);
-    if(c == NULL)
+    //the node of a pass without slots is drained or gone, its keys
+    //moved with the slots and are covered by the new passes
+    owns = hi_zalloc(scan->npasses * sizeof(*owns) + 1);
+    if(owns == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
-        return REDIS_ERR;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return -1;
     }
-    else if(c->err)
+
+    for(slot = 0; slot < REDIS_CLUSTER_SLOTS; slot ++)
     {
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return REDIS_ERR;
+        if(scan->slot_pass[slot] > 0)
+        {
+            owns[scan->slot_pass[slot] - 1] = 1;
+        }
     }
 
-    if (__redisAppendCommand(c, command->cmd, command->clen) != REDIS_OK) 
+    for(i = 0; i < first; i ++)
     {
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return REDIS_ERR;
+        if(!owns[i])
+        {
+            scan->passes[i].done = 1;
+        }
     }
-    
-    return REDIS_OK;
+
+    hi_free(owns);
+
+    scan->route_version = cc->route_version;
+
+    return (int)(scan->npasses - first);
 }
 
-/* Helper function for the redisClusterGetReply* family of functions.
+/*
+ * Create an iterator over the keys of the whole cluster, with one SCAN
+ * cursor per master. match, count and type are the options of SCAN,
+ * NULL or 0 to leave them out.
  */
-static int __redisClusterGetReply(redisClusterContext *cc, int slot_num, void **reply)
+redisClusterScan *redisClusterScanCreate(redisClusterContext *cc, 
+    const char *match, long long count, const char *type)
 {
-    cluster_node *node;
-    redisContext *c;
+    redisClusterScan *scan;
 
-    if(cc == NULL || slot_num < 0 || reply == NULL)
+    if(cc == NULL)
     {
-        return REDIS_ERR;
+        return NULL;
     }
 
-    node = node_get_by_table(cc, (uint32_t)slot_num);
-    if(node == NULL)
+    if(cc->err)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table is null");
-        return REDIS_ERR;
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
     }
 
-    c = ctx_get_by_node(cc, node);
-    if(c == NULL)
+    if(cc->route == NULL && cluster_update_route(cc) != REDIS_OK)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return REDIS_ERR;
+        return NULL;
     }
-    else if(c->err)
+
+    scan = hi_zalloc(sizeof(*scan));
+    if(scan == NULL)
     {
-        if(cc->need_update_route == 0)
-        {
-            cc->retry_count ++;
-            if(cc->retry_count > cc->max_redirect_count)
-            {
-                cc->need_update_route = 1;
-                cc->retry_count = 0;
-            }
-        }
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return REDIS_ERR;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
     }
 
-    if(redisGetReply(c, reply) != REDIS_OK)
+    scan->cc = cc;
+
+    if((match != NULL && (scan->match = sdsnew(match)) == NULL) ||
+        (count > 0 && (scan->count = sdsfromlonglong(count)) == NULL) ||
+        (type != NULL && (scan->type = sdsnew(type)) == NULL))
     {
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return REDIS_ERR;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        redisClusterScanFree(scan);
+        return NULL;
     }
-    
-    if(cluster_reply_error_type(*reply) == CLUSTER_ERR_MOVED)
+
+    if(cluster_scan_assign(scan) < 0)
     {
-        cc->need_update_route = 1;
+        redisClusterScanFree(scan);
+        return NULL;
     }
 
-    return REDIS_OK;
+    return scan;
 }
 
-static cluster_node *node_get_by_ask_error_reply(
-    redisClusterContext *cc, redisReply *reply)
+void redisClusterScanFree(redisClusterScan *scan)
 {
-    sds *part = NULL, *ip_port = NULL;
-    int part_len = 0, ip_port_len;
-    dictEntry *de;
-    cluster_node *node = NULL;
+    uint32_t i;
 
-    if(cc == NULL || reply == NULL)
+    if(scan == NULL)
     {
-        return NULL;
+        return;
     }
 
-    if(cluster_reply_error_type(reply) != CLUSTER_ERR_ASK)
+    for(i = 0; i < scan->npasses; i ++)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply is not ask error!");
-        return NULL;
+        sdsfree(scan->passes[i].addr);
+        sdsfree(scan->passes[i].cursor);
     }
-    
-    part = sdssplitlen(reply->str, reply->len, " ", 1, &part_len);
 
-    if(part != NULL && part_len == 3)
+    if(scan->passes != NULL)
     {
-        ip_port = sdssplitlen(part[2], sdslen(part[2]), 
-            ":", 1, &ip_port_len);
-
-        if(ip_port != NULL && ip_port_len == 2)
-        {
-            de = dictFind(cc->nodes, part[2]);
-            if(de == NULL)
-            {
-                node = hi_alloc(sizeof(cluster_node));
-                if(node == NULL)
-                {
-                    __redisClusterSetError(cc, 
-                        REDIS_ERR_OOM, "Out of memory");
-
-                    goto done;
-                }
+        hi_free(scan->passes);
+    }
 
-                cluster_node_init(node);
-                node->addr = part[1];
-                node->host = ip_port[0];
-                node->port = hi_atoi(ip_port[1], sdslen(ip_port[1]));
-                node->role = REDIS_ROLE_MASTER;
+    sdsfree(scan->match);
+    sdsfree(scan->count);
+    sdsfree(scan->type);
 
-                dictAdd(cc->nodes, sdsnewlen(node->addr, sdslen(node->addr)), node);
-                
-                part = NULL;
-                ip_port = NULL;
-            }
-            else
-            {
-                node = de->val;
+    hi_free(scan);
+}
 
-                goto done;
-            }
-        }
-        else
-        {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                "ask error reply address part parse error!");
+/* Append the SCAN of the pass to the connection. */
+static int cluster_scan_append(redisClusterScan *scan, 
+    cluster_scan_pass *pass, redisContext *c)
+{
+    const char *argv[8];
+    size_t argvlen[8];
+    int argc = 0;
 
-            goto done;
-        }
+    argv[argc] = "SCAN";
+    argvlen[argc++] = 4;
+    argv[argc] = pass->cursor;
+    argvlen[argc++] = sdslen(pass->cursor);
 
-    }
-    else
+    if(scan->match != NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "ask error reply parse error!");
-
-        goto done;
+        argv[argc] = "MATCH";
+        argvlen[argc++] = 5;
+        argv[argc] = scan->match;
+        argvlen[argc++] = sdslen(scan->match);
     }
 
-done:
-
-    if(part != NULL)
+    if(scan->count != NULL)
     {
-        sdsfreesplitres(part, part_len);
-        part = NULL;
+        argv[argc] = "COUNT";
+        argvlen[argc++] = 5;
+        argv[argc] = scan->count;
+        argvlen[argc++] = sdslen(scan->count);
     }
 
-    if(ip_port != NULL)
+    if(scan->type != NULL)
     {
-        sdsfreesplitres(ip_port, ip_port_len);
-        ip_port = NULL;
+        argv[argc] = "TYPE";
+        argvlen[argc++] = 4;
+        argv[argc] = scan->type;
+        argvlen[argc++] = sdslen(scan->type);
     }
-    
-    return node;
+
+    return redisAppendCommandArgv(c, argc, argv, argvlen);
 }
 
-static void *redis_cluster_command_execute(redisClusterContext *cc, 
-    struct cmd *command)
+/*
+ * Scan one more round: a SCAN is sent to every node with a pass left,
+ * to all of them at once, and the keys they reply are returned in an
+ * array, which may be empty. A node with several passes gets their 
+ * SCANs pipelined. Return NULL when the scan is finished or on error,
+ * the err of the context is set for the latter.
+ */
+redisReply *redisClusterScanNext(redisClusterScan *scan)
 {
-    int ret;
-    void *reply = NULL;
+    redisClusterContext *cc;
+    cluster_scan_pass *pass;
+    cluster_fanout *fans = NULL;
     cluster_node *node;
-    redisContext *c = NULL;
-    int error_type;
+    redisReply *reply = NULL, *r, *keys;
+    redisContext *c;
+    dictEntry *de;
+    void **replies = NULL;
+    uint32_t *order = NULL, *fan_pass = NULL;
+    uint32_t i, j, k, f, nfans = 0, nreplies = 0;
+    size_t total = 0;
+    int ret, failed = 0;
 
-retry:
-    
-    node = node_get_by_table(cc, (uint32_t)command->slot_num);
-    if(node == NULL)
+    if(scan == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table error");
         return NULL;
     }
 
-    c = ctx_get_by_node(cc, node);
-    if(c == NULL)
+    cc = scan->cc;
+
+    if(cc->err)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
-        return NULL;
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
     }
-    else if(c->err)
+
+    while(1)
     {
-        node = node_get_witch_connected(cc);
-        if(node == NULL)
+        if(scan->finished)
         {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, "no reachable node in cluster");
             return NULL;
         }
 
-        cc->retry_count ++;
-        if(cc->retry_count > cc->max_redirect_count)
+        if(cc->route_share != NULL)
+        {
+            cluster_route_sync(cc);
+        }
+
+        if(cc->route_version != scan->route_version && 
+            cluster_scan_assign(scan) < 0)
         {
-            __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
-                "too many cluster redirect");
             return NULL;
         }
 
-        c = ctx_get_by_node(cc, node);
-        if(c == NULL)
+        for(i = 0; i < scan->npasses && scan->passes[i].done; i ++){}
+        if(i < scan->npasses)
+        {
+            break;
+        }
+
+        //all scanned, check the slots moved in the meantime
+        if(cluster_update_route(cc) != REDIS_OK)
+        {
+            return NULL;
+        }
+
+        ret = cluster_scan_assign(scan);
+        if(ret < 0)
         {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node error");
             return NULL;
         }
-        else if(c->err)
+        else if(ret == 0)
+        {
+            scan->finished = 1;
+        }
+    }
+
+    fans = hi_zalloc(scan->npasses * sizeof(*fans));
+    replies = hi_zalloc(scan->npasses * sizeof(*replies));
+    order = hi_alloc(scan->npasses * sizeof(*order));
+    fan_pass = hi_alloc(scan->npasses * sizeof(*fan_pass));
+    if(fans == NULL || replies == NULL || order == NULL || fan_pass == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
+    }
+
+    //the passes are grouped by node, a fan per node
+    for(i = 0; i < scan->npasses; i ++)
+    {
+        if(scan->passes[i].done)
+        {
+            continue;
+        }
+
+        for(f = 0; f < nfans; f ++)
         {
-            __redisClusterSetError(cc, c->err, c->errstr);
-            return NULL;
+            if(sdscmp(scan->passes[fan_pass[f]].addr, 
+                scan->passes[i].addr) == 0)
+            {
+                break;
+            }
         }
-    }
 
-ask_retry:
+        if(f == nfans)
+        {
+            fan_pass[nfans ++] = i;
+        }
 
-    if (__redisAppendCommand(c,command->cmd, command->clen) != REDIS_OK) 
-    {
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return NULL;
+        fans[f].expected ++;
     }
-    
-    reply = __redisBlockForReply(c);
-    if(reply == NULL)
+
+    for(f = 0; f < nfans; f ++)
     {
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return NULL;
+        fans[f].replies = replies + nreplies;
+        nreplies += fans[f].expected;
+        fans[f].expected = 0;
     }
 
-    error_type = cluster_reply_error_type(reply);
-    if(error_type > CLUSTER_NOT_ERR && error_type < CLUSTER_ERR_SENTINEL)
+    for(i = 0; i < scan->npasses; i ++)
     {
-        cc->retry_count ++;
-        if(cc->retry_count > cc->max_redirect_count)
+        if(scan->passes[i].done)
         {
-            __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
-                "too many cluster redirect");
-            freeReplyObject(reply);
-            return NULL;
+            continue;
         }
-        
-        switch(error_type)
-        {
-        case CLUSTER_ERR_MOVED:
-            freeReplyObject(reply);
-            reply = NULL;
-            ret = cluster_update_route(cc);
-            if(ret != REDIS_OK)
-            {
-                __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                    "route update error, please recreate redisClusterContext!");
-                return NULL;
-            }
-            
-            goto retry;
-            
-            break;
-        case CLUSTER_ERR_ASK:
-            node = node_get_by_ask_error_reply(cc, reply);
-            if(node == NULL)
-            {
-                freeReplyObject(reply);
-                return NULL;
-            }
 
-            freeReplyObject(reply);
-            reply = NULL;
+        for(f = 0; sdscmp(scan->passes[fan_pass[f]].addr, 
+            scan->passes[i].addr) != 0; f ++){}
 
-            c = ctx_get_by_node(cc, node);
-            if(c == NULL)
-            {
-                __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node error");
-                return NULL;
-            }
-            else if(c->err)
-            {
-                __redisClusterSetError(cc, c->err, c->errstr);
-                return NULL;
-            }
+        order[(fans[f].replies - replies) + fans[f].expected ++] = i;
+    }
 
-            reply = redisCommand(c, REDIS_COMMAND_ASKING);
-            if(reply == NULL)
+    for(f = 0; f < nfans; f ++)
+    {
+        de = dictFind(cc->nodes, scan->passes[fan_pass[f]].addr);
+        node = de != NULL ? dictGetEntryVal(de) : NULL;
+        c = node != NULL ? ctx_get_by_node(cc, node) : NULL;
+        if(c == NULL || c->err)
+        {
+            continue;
+        }
+
+        for(k = 0; k < fans[f].expected; k ++)
+        {
+            pass = &scan->passes[order[(fans[f].replies - replies) + k]];
+            if(cluster_scan_append(scan, pass, c) != REDIS_OK)
             {
-                __redisClusterSetError(cc, c->err, c->errstr);
-                return NULL;
+                //the connection is reset with the commands appended
+                __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
+                break;
             }
-
-            freeReplyObject(reply);
-            reply = NULL;
-            
-            goto ask_retry;
-
-            break;
-        case CLUSTER_ERR_TRYAGAIN:
-        case CLUSTER_ERR_CROSSSLOT:
-        case CLUSTER_ERR_CLUSTERDOWN:
-            freeReplyObject(reply);
-            reply = NULL;
-            goto retry;
-            
-            break;
-        default:
-
-            break;
         }
-    }
-    
-    return reply;
-}
 
-static int command_pre_fragment(redisClusterContext *cc, 
-    struct cmd *command, hilist *commands)
-{
-    
-    struct keypos *kp, *sub_kp;
-    uint32_t key_count;
-    uint32_t i, j;
-    uint32_t idx;
-    uint32_t key_len;
-    int slot_num = -1;
-    struct cmd *sub_command;
-    struct cmd **sub_commands = NULL;
-    char num_str[12];
-    uint8_t num_str_len;
-    
+        fans[f].c = c;
+    }
 
-    if(command == NULL || commands == NULL)
+    if(cluster_fanout_io(cc, fans, nfans) != REDIS_OK)
     {
-        goto done;
+        goto error;
     }
 
-    key_count = hiarray_n(command->keys);
+    for(j = 0; j < nreplies; j ++)
+    {
+        r = replies[j];
+        if(r != NULL && r->type == REDIS_REPLY_ARRAY && r->elements == 2 &&
+            r->element[1]->type == REDIS_REPLY_ARRAY)
+        {
+            total += r->element[1]->elements;
+        }
+    }
 
-    sub_commands = hi_zalloc(REDIS_CLUSTER_SLOTS * sizeof(*sub_commands));
-    if (sub_commands == NULL) 
+    reply = hi_calloc(1, sizeof(*reply));
+    if(reply == NULL)
     {
         __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto done;
+        goto error;
     }
 
-    command->frag_seq = hi_alloc(key_count * sizeof(*command->frag_seq));
-    if(command->frag_seq == NULL)
+    reply->type = REDIS_REPLY_ARRAY;
+    if(total > 0)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto done;
+        reply->element = hi_calloc(total, sizeof(*reply->element));
+        if(reply->element == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            goto error;
+        }
     }
-    
-    
-    for(i = 0; i < key_count; i ++)
+
+    for(f = 0; f < nfans; f ++)
     {
-        kp = hiarray_get(command->keys, i);
+        for(k = 0; k < fans[f].expected; k ++)
+        {
+            i = order[(fans[f].replies - replies) + k];
+            pass = &scan->passes[i];
+            r = fans[f].replies[k];
 
-        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+            if(r == NULL)
+            {
+                failed = 1;
+                if(++ pass->failures > cc->max_redirect_count)
+                {
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                        fans[f].c != NULL && fans[f].c->err ? 
+                        fans[f].c->errstr : "scan node error");
+                    goto error;
+                }
 
-        if(slot_num < 0 || slot_num >= REDIS_CLUSTER_SLOTS)
-        {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"keyHashSlot return error");
-            goto done;
-        }
+                continue;
+            }
+            else if(r->type == REDIS_REPLY_ERROR)
+            {
+                __redisClusterSetError(cc, REDIS_ERR_OTHER, r->str);
+                goto error;
+            }
+            else if(r->type != REDIS_REPLY_ARRAY || r->elements != 2 ||
+                r->element[0]->type != REDIS_REPLY_STRING ||
+                r->element[1]->type != REDIS_REPLY_ARRAY)
+            {
+                __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, 
+                    "scan reply type is error");
+                goto error;
+            }
 
-        if (sub_commands[slot_num] == NULL) {
-            sub_commands[slot_num] = command_get();
-            if (sub_commands[slot_num] == NULL) {
+            pass->failures = 0;
+            pass->cursor = sdscpylen(pass->cursor, 
+                r->element[0]->str, r->element[0]->len);
+            if(pass->cursor == NULL)
+            {
                 __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-                slot_num = -1;
-                goto done;
+                goto error;
             }
-        }
 
-        command->frag_seq[i] = sub_command = sub_commands[slot_num];
+            pass->done = strcmp(pass->cursor, "0") == 0;
 
-        sub_command->narg++;
+            //only the keys of the slots assigned to the pass, the others
+            //are being moved and scanned on their new master
+            keys = r->element[1];
+            for(j = 0; j < keys->elements; j ++)
+            {
+                if(keys->element[j]->type != REDIS_REPLY_STRING || 
+                    scan->slot_pass[keyHashSlot(keys->element[j]->str, 
+                    keys->element[j]->len)] != i + 1)
+                {
+                    continue;
+                }
 
-        sub_kp = hiarray_push(sub_command->keys);
-        if (sub_kp == NULL) {
-            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-            slot_num = -1;
-            goto done;
+                reply->element[reply->elements ++] = keys->element[j];
+                keys->element[j] = NULL;
+            }
         }
-        
-        sub_kp->start = kp->start;
-        sub_kp->end = kp->end;
+    }
 
-        key_len = (uint32_t)(kp->end - kp->start);
+    //the failed nodes are tried again next round on the updated route
+    if(failed && cluster_update_route(cc) != REDIS_OK)
+    {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
 
-        sub_command->clen += key_len + uint_len(key_len);
+    goto done;
 
-        sub_command->slot_num = slot_num;
+error:
 
-        if (command->type == CMD_REQ_REDIS_MSET) {
-            uint32_t len = 0;
-            char *p;
+    if(reply != NULL)
+    {
+        freeReplyObject(reply);
+        reply = NULL;
+    }
 
-            for (p = sub_kp->end + 1; !isdigit(*p); p++){}
-            
-            p = sub_kp->end + 1;
-            while(!isdigit(*p))
-            {
-                p ++;
-            }
+done:
 
-            for (; isdigit(*p); p++) {              
-                len = len * 10 + (uint32_t)(*p - '0');
-            }
-            
-            len += CRLF_LEN * 2;
-            len += (p - sub_kp->end);
-            sub_kp->remain_len = len;
-            sub_command->clen += len;
+    for(j = 0; j < nreplies; j ++)
+    {
+        if(replies[j] != NULL)
+        {
+            freeReplyObject(replies[j]);
         }
     }
 
-    for (i = 0; i < REDIS_CLUSTER_SLOTS; i++) {     /* prepend command header */
-        sub_command = sub_commands[i];
-        if (sub_command == NULL) {
-            continue;
-        }
-
-        idx = 0;            
-        if (command->type == CMD_REQ_REDIS_MGET) {
-            //"*%d\r\n$4\r\nmget\r\n"
-            
-            sub_command->clen += 5*sub_command->narg;
+    if(fans != NULL)
+    {
+        hi_free(fans);
+    }
 
-            sub_command->narg ++;
+    if(replies != NULL)
+    {
+        hi_free(replies);
+    }
 
-            hi_itoa(num_str, sub_command->narg);
-            num_str_len = (uint8_t)(strlen(num_str));
+    if(order != NULL)
+    {
+        hi_free(order);
+    }
 
-            sub_command->clen += 13 + num_str_len;
+    if(fan_pass != NULL)
+    {
+        hi_free(fan_pass);
+    }
 
-            sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
-            if(sub_command->cmd == NULL)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-                slot_num = -1;
-                goto done;
-            }
+    return reply;
+}
 
-            sub_command->cmd[idx++] = '*';
-            memcpy(sub_command->cmd + idx, num_str, num_str_len);
-            idx += num_str_len;
-            memcpy(sub_command->cmd + idx, "\r\n$4\r\nmget\r\n", 12);
-            idx += 12;
-            
-            for(j = 0; j < hiarray_n(sub_command->keys); j ++)
-            {
-                kp = hiarray_get(sub_command->keys, j);
-                key_len = (uint32_t)(kp->end - kp->start);
-                hi_itoa(num_str, key_len);
-                num_str_len = strlen(num_str);
-
-                sub_command->cmd[idx++] = '$';
-                memcpy(sub_command->cmd + idx, num_str, num_str_len);
-                idx += num_str_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
-                memcpy(sub_command->cmd + idx, kp->start, key_len);
-                idx += key_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
-            }
-        } else if (command->type == CMD_REQ_REDIS_DEL) {
-            //"*%d\r\n$3\r\ndel\r\n"
-            
-            sub_command->clen += 5*sub_command->narg;
+/* Copy the reply and all its elements. */
+static redisReply *cluster_reply_dup(redisReply *reply)
+{
+    redisReply *dup;
+    size_t i;
 
-            sub_command->narg ++;
+    dup = hi_calloc(1, sizeof(*dup));
+    if(dup == NULL)
+    {
+        return NULL;
+    }
 
-            hi_itoa(num_str, sub_command->narg);
-            num_str_len = (uint8_t)strlen(num_str);
-            
-            sub_command->clen += 12 + num_str_len;
+    dup->type = reply->type;
+    dup->integer = reply->integer;
 
-            sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
-            if(sub_command->cmd == NULL)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-                slot_num = -1;
-                goto done;
-            }
+    if(reply->str != NULL)
+    {
+        dup->str = hi_alloc(reply->len + 1);
+        if(dup->str == NULL)
+        {
+            freeReplyObject(dup);
+            return NULL;
+        }
 
-            sub_command->cmd[idx++] = '*';
-            memcpy(sub_command->cmd + idx, num_str, num_str_len);
-            idx += num_str_len;
-            memcpy(sub_command->cmd + idx, "\r\n$3\r\ndel\r\n", 11);
-            idx += 11;
+        memcpy(dup->str, reply->str, reply->len);
+        dup->str[reply->len] = '\0';
+        dup->len = reply->len;
+    }
+
+    if(reply->elements > 0)
+    {
+        dup->element = hi_calloc(reply->elements, sizeof(*dup->element));
+        if(dup->element == NULL)
+        {
+            freeReplyObject(dup);
+            return NULL;
+        }
 
-            for(j = 0; j < hiarray_n(sub_command->keys); j ++)
+        for(i = 0; i < reply->elements; i ++)
+        {
+            dup->element[i] = cluster_reply_dup(reply->element[i]);
+            if(dup->element[i] == NULL)
             {
-                kp = hiarray_get(sub_command->keys, j);
-                key_len = (uint32_t)(kp->end - kp->start);
-                hi_itoa(num_str, key_len);
-                num_str_len = strlen(num_str);
-
-                sub_command->cmd[idx++] = '$';
-                memcpy(sub_command->cmd + idx, num_str, num_str_len);
-                idx += num_str_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
-                memcpy(sub_command->cmd + idx, kp->start, key_len);
-                idx += key_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
+                freeReplyObject(dup);
+                return NULL;
             }
-        } else if (command->type == CMD_REQ_REDIS_MSET) {
-            //"*%d\r\n$4\r\nmset\r\n"
-            
-            sub_command->clen += 3*sub_command->narg;
 
-            sub_command->narg *= 2;
+            dup->elements ++;
+        }
+    }
 
-            sub_command->narg ++;
+    return dup;
+}
 
-            hi_itoa(num_str, sub_command->narg);
-            num_str_len = (uint8_t)strlen(num_str);
-        
-            sub_command->clen += 13 + num_str_len;
+/* Merge the replies of the nodes as merge says. Return NULL if a node 
+ * failed or replied an error or a reply of another type. */
+static redisReply *cluster_replies_reduce(redisReply **replies, 
+    int count, int merge)
+{
+    redisReply *reduced, *reply;
+    size_t elements = 0, j;
+    int i, type;
 
-            sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
-            if(sub_command->cmd == NULL)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-                slot_num = -1;
-                goto done;
-            }
+    if(merge != HIRCLUSTER_MERGE_SUM && merge != HIRCLUSTER_MERGE_CONCAT &&
+        merge != HIRCLUSTER_MERGE_ALL_OK)
+    {
+        return NULL;
+    }
 
-            sub_command->cmd[idx++] = '*';
-            memcpy(sub_command->cmd + idx, num_str, num_str_len);
-            idx += num_str_len;
-            memcpy(sub_command->cmd + idx, "\r\n$4\r\nmset\r\n", 12);
-            idx += 12;
-            
-            for(j = 0; j < hiarray_n(sub_command->keys); j ++)
-            {
-                kp = hiarray_get(sub_command->keys, j);
-                key_len = (uint32_t)(kp->end - kp->start);
-                hi_itoa(num_str, key_len);
-                num_str_len = strlen(num_str);
-
-                sub_command->cmd[idx++] = '$';
-                memcpy(sub_command->cmd + idx, num_str, num_str_len);
-                idx += num_str_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
-                memcpy(sub_command->cmd + idx, kp->start, key_len + kp->remain_len);
-                idx += key_len + kp->remain_len;
-                
-            }
-        } else {
-            NOT_REACHED();
-        }
+    type = merge == HIRCLUSTER_MERGE_SUM ? REDIS_REPLY_INTEGER :
+        merge == HIRCLUSTER_MERGE_CONCAT ? REDIS_REPLY_ARRAY : 
+        REDIS_REPLY_STATUS;
 
-        //printf("len : %d\n", sub_command->clen);
-        //print_string_with_length_fix_CRLF(sub_command->cmd, sub_command->clen);
-        
-        sub_command->type = command->type;
+    for(i = 0; i < count; i ++)
+    {
+        reply = replies[i];
+        if(reply == NULL || reply->type != type || 
+            (merge == HIRCLUSTER_MERGE_ALL_OK && 
+            strcmp(reply->str, REDIS_STATUS_OK) != 0))
+        {
+            return NULL;
+        }
 
-        listAddNodeTail(commands, sub_command);
+        elements += reply->elements;
     }
 
-done:
+    if(merge == HIRCLUSTER_MERGE_ALL_OK)
+    {
+        return count > 0 ? cluster_reply_dup(replies[0]) : NULL;
+    }
 
-    if(sub_commands != NULL)
+    reduced = hi_calloc(1, sizeof(*reduced));
+    if(reduced == NULL)
     {
-        hi_free(sub_commands);
+        return NULL;
     }
 
-    if(slot_num >= 0 && commands != NULL 
-        && listLength(commands) == 1)
+    reduced->type = type;
+
+    if(merge == HIRCLUSTER_MERGE_SUM)
     {
-        listNode *list_node = listFirst(commands);
-        listDelNode(commands, list_node);
-        if(command->frag_seq)
+        for(i = 0; i < count; i ++)
         {
-            hi_free(command->frag_seq);
-            command->frag_seq = NULL;
+            reduced->integer += replies[i]->integer;
         }
 
-        command->slot_num = slot_num;
+        return reduced;
     }
 
-    return slot_num;
-}
-
-static void *command_post_fragment(redisClusterContext *cc, 
-    struct cmd *command, hilist *commands)
-{
-    struct cmd *sub_command;
-    listNode *list_node;
-    listIter *list_iter;
-    redisReply *reply, *sub_reply;
-    long long count = 0;
-    
-    list_iter = listGetIterator(commands, AL_START_HEAD);
-    while((list_node = listNext(list_iter)) != NULL)
+    if(elements > 0)
     {
-        sub_command = list_node->value;
-        reply = sub_command->reply;
-        if(reply == NULL)
+        reduced->element = hi_calloc(elements, sizeof(*reduced->element));
+        if(reduced->element == NULL)
         {
+            freeReplyObject(reduced);
             return NULL;
         }
-        else if(reply->type == REDIS_REPLY_ERROR)
-        {
-            return reply;
-        }
+    }
 
-        if (command->type == CMD_REQ_REDIS_MGET) {
-            if(reply->type != REDIS_REPLY_ARRAY)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be array)");
-                return NULL;
-            }
-        }else if(command->type == CMD_REQ_REDIS_DEL){
-            if(reply->type != REDIS_REPLY_INTEGER)
+    for(i = 0; i < count; i ++)
+    {
+        for(j = 0; j < replies[i]->elements; j ++)
+        {
+            reply = cluster_reply_dup(replies[i]->element[j]);
+            if(reply == NULL)
             {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be integer)");
+                freeReplyObject(reduced);
                 return NULL;
             }
 
-            count += reply->integer;
-        }else if(command->type == CMD_REQ_REDIS_MSET){
-            if(reply->type != REDIS_REPLY_STATUS ||
-                reply->len != 2 || strcmp(reply->str, REDIS_STATUS_OK) != 0)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be status and ok)");
-                return NULL;
-            }
-        }else {
-            NOT_REACHED();
+            reduced->element[reduced->elements ++] = reply;
         }
     }
 
-    reply = hi_calloc(1,sizeof(*reply));
+    return reduced;
+}
 
-    if (reply == NULL)
+/* Get the nodes selected by filter, the masters first. */
+static cluster_node **cluster_nodes_select(redisClusterContext *cc, 
+    int filter, int *count)
+{
+    cluster_node **nodes = NULL, **list, *node, *slave;
+    dictIterator *di;
+    dictEntry *de;
+    listIter li;
+    listNode *ln;
+    int size = 0, n = 0, pass;
+
+    *count = 0;
+
+    if(cc->route_share != NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return NULL;
+        cluster_route_sync(cc);
     }
 
-    if (command->type == CMD_REQ_REDIS_MGET) {
-        int i;
-        uint32_t key_count;
-
-        reply->type = REDIS_REPLY_ARRAY;
+    if(cc->nodes == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "no nodes in the route");
+        return NULL;
+    }
 
-        key_count = hiarray_n(command->keys);
+    //the first pass counts, the second one fills
+    for(pass = 0; pass < 2; pass ++)
+    {
+        di = dictGetIterator(cc->nodes);
+        while((de = dictNext(di)) != NULL)
+        {
+            node = dictGetEntryVal(de);
 
-        reply->elements = key_count;
-        reply->element = hi_calloc(key_count, sizeof(*reply));
-        if (reply->element == NULL) {
-            freeReplyObject(reply);
-            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-            return NULL;
-        }
-            
-        for (i = key_count - 1; i >= 0; i--) {      /* for each key */
-            sub_reply = command->frag_seq[i]->reply;            /* get it's reply */
-            if (sub_reply == NULL) {
-                freeReplyObject(reply);
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,"sub reply is null");
-                return NULL;
+            if(filter & HIRCLUSTER_NODE_MASTERS)
+            {
+                if(pass == 1)
+                {
+                    nodes[n] = node;
+                }
+                n ++;
             }
 
-            if(sub_reply->type == REDIS_REPLY_STRING)
+            if(!(filter & HIRCLUSTER_NODE_REPLICAS) || node->slaves == NULL)
             {
-                reply->element[i] = sub_reply;
+                continue;
             }
-            else if(sub_reply->type == REDIS_REPLY_ARRAY)
+
+            listRewind(node->slaves, &li);
+            while((ln = listNext(&li)) != NULL)
             {
-                if(sub_reply->elements == 0)
+                slave = listNodeValue(ln);
+                if(pass == 1)
                 {
-                    freeReplyObject(reply);
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,"sub reply elements error");
-                    return NULL;
+                    nodes[n] = slave;
                 }
-                
-                reply->element[i] = sub_reply->element[sub_reply->elements - 1];
-                sub_reply->elements --;
+                n ++;
             }
         }
-    }else if(command->type == CMD_REQ_REDIS_DEL){
-        reply->type = REDIS_REPLY_INTEGER;
-        reply->integer = count;
-    }else if(command->type == CMD_REQ_REDIS_MSET){
-        reply->type = REDIS_REPLY_STATUS;
-        uint32_t str_len = strlen(REDIS_STATUS_OK);
-        reply->str = hi_alloc((str_len + 1) * sizeof(char*));
-        if(reply->str == NULL)
+        dictReleaseIterator(di);
+
+        if(pass == 1)
+        {
+            break;
+        }
+
+        size = n;
+        n = 0;
+
+        list = hi_calloc(size > 0 ? size : 1, sizeof(*list));
+        if(list == NULL)
         {
-            freeReplyObject(reply);
             __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
             return NULL;
         }
-
-        reply->len = str_len;
-        memcpy(reply->str, REDIS_STATUS_OK, str_len);
-        reply->str[str_len] = '\0';
-    }else {
-        NOT_REACHED();
+        nodes = list;
     }
 
-    return reply;
+    *count = n;
+
+    return nodes;
 }
 
-/* 
- * Split the command into subcommands by slot
- * 
- * Returns slot_num
- * If slot_num < 0 or slot_num >=  REDIS_CLUSTER_SLOTS means this function runs error;
- * Otherwise if  the commands > 1 , slot_num is the last subcommand slot number. 
- */
-static int command_format_by_slot(redisClusterContext *cc, 
-    struct cmd *command, hilist *commands)
+/* Create the replies for the nodes, with their addresses. */
+static redisClusterNodeReplies *cluster_node_replies_create(
+    cluster_node **nodes, int count)
 {
-    struct keypos *kp;
-    int key_count;
-    int slot_num = -1;
+    redisClusterNodeReplies *replies;
+    int i;
 
-    if(cc == NULL || commands == NULL ||
-        command == NULL || 
-        command->cmd == NULL || command->clen <= 0)
+    replies = hi_zalloc(sizeof(*replies));
+    if(replies == NULL)
     {
-        goto done;
+        return NULL;
     }
 
-    
-    redis_parse_cmd(command);
-    if(command->result == CMD_PARSE_ENOMEM)
-    {
-        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, "Parse command error: out of memory");
-        goto done;
-    }
-    else if(command->result != CMD_PARSE_OK)
+    replies->addrs = hi_calloc(count > 0 ? count : 1, sizeof(*replies->addrs));
+    replies->replies = hi_calloc(count > 0 ? count : 1, sizeof(*replies->replies));
+    if(replies->addrs == NULL || replies->replies == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, command->errstr);
-        goto done;
+        redisClusterNodeRepliesFree(replies);
+        return NULL;
     }
 
-    key_count = hiarray_n(command->keys);
-
-    if(key_count <= 0)
+    for(i = 0; i < count; i ++)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "No keys in command(must have keys for redis cluster mode)");
-        goto done;
-    }
-    else if(key_count == 1)
-    {
-        kp = hiarray_get(command->keys, 0);
-        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
-        command->slot_num = slot_num;
+        replies->addrs[i] = sdsdup(nodes[i]->addr);
+        if(replies->addrs[i] == NULL)
+        {
+            redisClusterNodeRepliesFree(replies);
+            return NULL;
+        }
 
-        goto done;
+        replies->count ++;
     }
 
-    slot_num = command_pre_fragment(cc, command, commands);
-
-done:
-    
-    return slot_num;
+    return replies;
 }
 
-
-void redisClusterSetMaxRedirect(redisClusterContext *cc, int max_redirect_count)
+void redisClusterNodeRepliesFree(redisClusterNodeReplies *replies)
 {
-    if(cc == NULL || max_redirect_count <= 0)
+    int i;
+
+    if(replies == NULL)
     {
         return;
     }
 
-    cc->max_redirect_count = max_redirect_count;
-}
+    for(i = 0; i < replies->count; i ++)
+    {
+        sdsfree(replies->addrs[i]);
+        if(replies->replies[i] != NULL)
+        {
+            freeReplyObject(replies->replies[i]);
+        }
+    }
 
-void *redisClusterFormattedCommand(redisClusterContext *cc, char *cmd, int len) {
-    redisReply *reply = NULL;
-    int slot_num;
-    struct cmd *command = NULL, *sub_command;
-    hilist *commands = NULL;
-    listNode *list_node;
-    listIter *list_iter = NULL;
+    if(replies->addrs != NULL)
+    {
+        hi_free(replies->addrs);
+    }
+
+    if(replies->replies != NULL)
+    {
+        hi_free(replies->replies);
+    }
+
+    if(replies->reduced != NULL)
+    {
+        freeReplyObject(replies->reduced);
+    }
+
+    hi_free(replies);
+}
+
+/*
+ * Send the command to all the nodes selected by filter at once, and 
+ * wait for all of them. The replies of the nodes are merged as merge
+ * says into the reduced reply, HIRCLUSTER_MERGE_NONE for none.
+ */
+redisClusterNodeReplies *redisClusterBroadcastFormattedCommand(
+    redisClusterContext *cc, int filter, int merge, char *cmd, int len)
+{
+    redisClusterNodeReplies *replies = NULL;
+    cluster_node **nodes;
+    cluster_fanout *fans = NULL;
+    redisContext *c;
+    int i, count;
 
     if(cc == NULL)
     {
@@ -3627,112 +8499,85 @@ void *redisClusterFormattedCommand(redisClusterContext *cc, char *cmd, int len)
     {
         cc->err = 0;
         memset(cc->errstr, '\0', strlen(cc->errstr));
-    }  
-    
-    command = command_get();
-    if(command == NULL)
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return NULL;
-    }
-    
-    command->cmd = cmd;
-    command->clen = len;
-
-    commands = listCreate();
-    if(commands == NULL)
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto error;
     }
 
-    commands->free = listCommandFree;
-
-    slot_num = command_format_by_slot(cc, command, commands);
-
-    if(slot_num < 0)
-    {
-        goto error;
-    }
-    else if(slot_num >= REDIS_CLUSTER_SLOTS)
+    nodes = cluster_nodes_select(cc, filter, &count);
+    if(nodes == NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"slot_num is out of range");
-        goto error;
+        return NULL;
     }
 
-    //all keys belong to one slot
-    if(listLength(commands) == 0)
+    replies = cluster_node_replies_create(nodes, count);
+    fans = hi_calloc(count > 0 ? count : 1, sizeof(*fans));
+    if(replies == NULL || fans == NULL)
     {
-        reply = redis_cluster_command_execute(cc, command);
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        redisClusterNodeRepliesFree(replies);
+        replies = NULL;
         goto done;
     }
 
-    ASSERT(listLength(commands) != 1);
-
-    list_iter = listGetIterator(commands, AL_START_HEAD);
-    while((list_node = listNext(list_iter)) != NULL)
+    for(i = 0; i < count; i ++)
     {
-        sub_command = list_node->value;
-        
-        reply = redis_cluster_command_execute(cc, sub_command);
-        if(reply == NULL)
+        fans[i].replies = (void **)&replies->replies[i];
+        fans[i].expected = 1;
+
+        c = ctx_get_by_node(cc, nodes[i]);
+        if(c == NULL || c->err)
         {
-            goto error;
+            continue;
         }
-        else if(reply->type == REDIS_REPLY_ERROR)
+
+        if(redisAppendFormattedCommand(c, cmd, len) != REDIS_OK)
         {
-            goto done;
+            __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
         }
 
-        sub_command->reply = reply;
+        fans[i].c = c;
     }
 
-    reply = command_post_fragment(cc, command, commands);
-    
-done:
-
-    command->cmd = NULL;
-    command_destroy(command);
-
-    if(commands != NULL)
+    if(cluster_fanout_io(cc, fans, (uint32_t)count) != REDIS_OK)
     {
-        listRelease(commands);
+        redisClusterNodeRepliesFree(replies);
+        replies = NULL;
+        goto done;
     }
 
-    if(list_iter != NULL)
+    //the first failure is kept in the context, the others are NULL too
+    for(i = 0; i < count && cc->err == 0; i ++)
     {
-        listReleaseIterator(list_iter);
+        if(replies->replies[i] == NULL)
+        {
+            c = fans[i].c;
+            __redisClusterSetError(cc, 
+                c != NULL && c->err ? c->err : REDIS_ERR_OTHER, 
+                c != NULL && c->err ? c->errstr : "node connection error");
+        }
     }
 
-    cc->retry_count = 0;
-    
-    return reply;
-
-error:
-
-    if(command != NULL)
+    if(merge != HIRCLUSTER_MERGE_NONE)
     {
-        command->cmd = NULL;
-        command_destroy(command);
+        replies->reduced = cluster_replies_reduce(replies->replies, 
+            replies->count, merge);
     }
 
-    if(commands != NULL)
-    {
-        listRelease(commands);
-    }
+done:
 
-    if(list_iter != NULL)
+    if(fans != NULL)
     {
-        listReleaseIterator(list_iter);
+        hi_free(fans);
     }
 
-    cc->retry_count = 0;
-    
-    return NULL;
+    hi_free(nodes);
+
+    return replies;
 }
 
-void *redisClustervCommand(redisClusterContext *cc, const char *format, va_list ap) {
-    redisReply *reply;
+redisClusterNodeReplies *redisClusterBroadcastCommand(
+    redisClusterContext *cc, int filter, int merge, const char *format, ...)
+{
+    redisClusterNodeReplies *replies;
+    va_list ap;
     char *cmd;
     int len;
 
@@ -3741,7 +8586,9 @@ void *redisClustervCommand(redisClusterContext *cc, const char *format, va_list
         return NULL;
     }
 
+    va_start(ap,format);
     len = redisvFormatCommand(&cmd,format,ap);
+    va_end(ap);
 
     if (len == -1) {
         __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
@@ -3749,676 +8596,742 @@ void *redisClustervCommand(redisClusterContext *cc, const char *format, va_list
     } else if (len == -2) {
         __redisClusterSetError(cc,REDIS_ERR_OTHER,"Invalid format string");
         return NULL;
-    }   
+    }
 
-    reply = redisClusterFormattedCommand(cc, cmd, len);
+    replies = redisClusterBroadcastFormattedCommand(cc, filter, merge, cmd, len);
 
     free(cmd);
 
-    return reply;
+    return replies;
 }
 
-void *redisClusterCommand(redisClusterContext *cc, const char *format, ...) {
-    va_list ap;
-    redisReply *reply = NULL;
+/*############redis cluster async############*/
+
+/* We want the error field to be accessible directly instead of requiring
+ * an indirection to the redisContext struct. */
+static void __redisClusterAsyncCopyError(redisClusterAsyncContext *acc) {
+    if (!acc)
+        return;
+
+    redisClusterContext *cc = acc->cc;
+    acc->err = cc->err;
+    memcpy(acc->errstr, cc->errstr, 128);
+}
+
+static void __redisClusterAsyncSetError(redisClusterAsyncContext *acc, 
+    int type, const char *str) {
     
-    va_start(ap,format);
-    reply = redisClustervCommand(cc, format, ap);
-    va_end(ap);
+    size_t len;
 
-    return reply;
+    acc->err = type;
+    if (str != NULL) {
+        len = strlen(str);
+        len = len < (sizeof(acc->errstr)-1) ? len : (sizeof(acc->errstr)-1);
+        memcpy(acc->errstr,str,len);
+        acc->errstr[len] = '\0';
+    } else {
+        /* Only REDIS_ERR_IO may lack a description! */
+        assert(type == REDIS_ERR_IO);
+        __redis_strerror_r(errno, acc->errstr, sizeof(acc->errstr));
+    }
 }
 
-void *redisClusterCommandArgv(redisClusterContext *cc, int argc, const char **argv, const size_t *argvlen) {
-    redisReply *reply = NULL;
-    char *cmd;
-    int len;
+static redisClusterAsyncContext *redisClusterAsyncInitialize(redisClusterContext *cc) {
+    redisClusterAsyncContext *acc;
 
-    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-    if (len == -1) {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+    if(cc == NULL)
+    {
         return NULL;
     }
-	
-    reply = redisClusterFormattedCommand(cc, cmd, len);
 
-    free(cmd);
+    acc = hi_alloc(sizeof(redisClusterAsyncContext));
+    if (acc == NULL)
+        return NULL;
 
-    return reply;
+    acc->cc = cc;
+
+    acc->err = 0;
+    acc->data = NULL;
+    acc->adapter = NULL;
+    acc->attach_fn = NULL;
+
+    acc->onConnect = NULL;
+    acc->onDisconnect = NULL;
+
+    acc->parked_requests = NULL;
+
+    return acc;
 }
 
-int redisClusterAppendFormattedCommand(redisClusterContext *cc, 
-    char *cmd, int len) {
-    int slot_num;
-    struct cmd *command = NULL, *sub_command;
-    hilist *commands = NULL;
-    listNode *list_node;
-    listIter *list_iter = NULL;
+static cluster_async_data *cluster_async_data_get(void)
+{
+    cluster_async_data *cad;
 
-    if(cc->requests == NULL)
+    cad = hi_alloc(sizeof(cluster_async_data));
+    if(cad == NULL)
     {
-        cc->requests = listCreate();
-        if(cc->requests == NULL)
-        {
-            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-            goto error;
-        }
-
-        cc->requests->free = listCommandFree;
+        return NULL;
     }
-    
-    command = command_get();
-    if(command == NULL)
+
+    cad->acc = NULL;
+    cad->command = NULL;
+    cad->callback = NULL;
+    cad->privdata = NULL;
+    cad->retry_count = 0;
+    cad->start_time = 0;
+    cad->parent = NULL;
+    cad->partial = NULL;
+    cad->pending = 0;
+    cad->err = 0;
+    cad->errstr = NULL;
+
+    return cad;
+}
+
+static void cluster_async_data_free(cluster_async_data *cad)
+{
+    if(cad == NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto error;
+        return;
     }
-    
-    command->cmd = cmd;
-    command->clen = len;
 
-    commands = listCreate();
-    if(commands == NULL)
+    if(cad->command != NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto error;
+        command_destroy(cad->command);
     }
 
-    commands->free = listCommandFree;
-
-    slot_num = command_format_by_slot(cc, command, commands);
-
-    if(slot_num < 0)
+    if(cad->errstr != NULL)
     {
-        goto error;
+        sdsfree(cad->errstr);
     }
-    else if(slot_num >= REDIS_CLUSTER_SLOTS)
+    
+    hi_free(cad);
+    cad = NULL;
+}
+
+/* Take the reply over from hiredis, which frees the empty shell left. */
+static redisReply *cluster_reply_steal(redisReply *reply)
+{
+    redisReply *stolen;
+
+    stolen = hi_alloc(sizeof(*stolen));
+    if(stolen == NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"slot_num is out of range");
-        goto error;
+        return NULL;
     }
 
-    //all keys belong to one slot
-    if(listLength(commands) == 0)
+    memcpy(stolen, reply, sizeof(*stolen));
+    memset(reply, 0, sizeof(*reply));
+    reply->type = REDIS_REPLY_NIL;
+
+    return stolen;
+}
+
+/* Pass the reply of the fragment to the partial callback of the multi-key
+ * command, with the indexes of its keys in the command. */
+static void cluster_async_partial(redisClusterAsyncContext *acc, 
+    cluster_async_data *parent, struct cmd *sub_command)
+{
+    struct cmd *command = parent->command;
+    struct keypos *kp, *sub_kp;
+    uint32_t *indexes;
+    uint32_t i, nkeys, low, high, mid;
+
+    nkeys = hiarray_n(sub_command->keys);
+    indexes = hi_alloc(nkeys * sizeof(*indexes));
+    if(indexes == NULL)
     {
-        if(__redisClusterAppendCommand(cc, command) == REDIS_OK)
-        {
-            goto done;
-        }
-        else
-        {
-            goto error;
-        }
+        return;
     }
 
-    ASSERT(listLength(commands) != 1);
-
-    list_iter = listGetIterator(commands, AL_START_HEAD);
-    while((list_node = listNext(list_iter)) != NULL)
+    //the keys of both are in the order of the command buffer
+    for(i = 0; i < nkeys; i ++)
     {
-        sub_command = list_node->value;
-        
-        if(__redisClusterAppendCommand(cc, sub_command) == REDIS_OK)
-        {
-            continue;
-        }
-        else
+        sub_kp = hiarray_get(sub_command->keys, i);
+
+        low = 0;
+        high = hiarray_n(command->keys) - 1;
+        while(low < high)
         {
-            goto error;
+            mid = low + (high - low) / 2;
+            kp = hiarray_get(command->keys, mid);
+            if(kp->start < sub_kp->start)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
         }
+
+        indexes[i] = low;
     }
 
-done:
+    parent->partial(acc, sub_command->reply, indexes, nkeys, parent->privdata);
 
-    if(command->cmd != NULL)
-    {
-        command->cmd = NULL;
-    }
-    else
+    hi_free(indexes);
+}
+
+/* Run the callback of cad with the reply and free it. A fragment of a 
+ * multi-key command keeps its reply instead, the callback runs once with
+ * the merged reply when the last fragment is finished. */
+static void cluster_async_data_finish(redisClusterAsyncContext *acc, 
+    cluster_async_data *cad, redisReply *reply)
+{
+    cluster_async_data *parent = cad->parent;
+    struct cmd *command;
+
+    if(parent == NULL)
     {
-        goto error;
+        cad->callback(acc, reply, cad->privdata);
+        cluster_async_data_free(cad);
+        return;
     }
 
-    if(commands != NULL)
+    if(reply != NULL)
     {
-        if(listLength(commands) > 0)
-        {
-            command->sub_commands = commands;
-        }
-        else
+        cad->command->reply = cluster_reply_steal(reply);
+        if(cad->command->reply == NULL)
         {
-            listRelease(commands);
+            __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
         }
     }
-
-    if(list_iter != NULL)
+    
+    if(cad->command->reply == NULL && parent->err == 0)
     {
-        listReleaseIterator(list_iter);
+        parent->err = acc->err ? acc->err : REDIS_ERR_OTHER;
+        parent->errstr = sdsnew(acc->err ? acc->errstr : "sub command failed");
     }
 
-    listAddNodeTail(cc->requests, command);
-    
-    return REDIS_OK;
+    if(cad->command->reply != NULL && parent->partial != NULL)
+    {
+        cluster_async_partial(acc, parent, cad->command);
+    }
 
-error:
+    //the fragment is owned by the multi-key command
+    cad->command = NULL;
+    cluster_async_data_free(cad);
 
-    if(command != NULL)
+    if(--parent->pending > 0)
     {
-        command->cmd = NULL;
-        command_destroy(command);
+        return;
     }
 
-    if(commands != NULL)
+    command = parent->command;
+    reply = NULL;
+    if(parent->err == 0)
     {
-        listRelease(commands);
+        reply = command_post_fragment(acc->cc, command, command->sub_commands);
+        if(reply == NULL)
+        {
+            __redisClusterAsyncSetError(acc, 
+                acc->cc->err ? acc->cc->err : REDIS_ERR_OTHER, 
+                acc->cc->err ? acc->cc->errstr : "sub reply is null");
+        }
     }
-
-    if(list_iter != NULL)
+    else
     {
-        listReleaseIterator(list_iter);
+        __redisClusterAsyncSetError(acc, parent->err, parent->errstr);
     }
 
-    /* Attention: mybe here we must pop the 
-      sub_commands that had append to the nodes.  
-      But now we do not handle it. */
-    
-    return REDIS_ERR;
-}
-
-
-int redisClustervAppendCommand(redisClusterContext *cc, 
-    const char *format, va_list ap) {
-    int ret;
-    char *cmd;
-    int len;
-    
-    len = redisvFormatCommand(&cmd,format,ap);  
-    if (len == -1) {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return REDIS_ERR;
-    } else if (len == -2) {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"Invalid format string");
-        return REDIS_ERR;
-    }   
-
-    ret = redisClusterAppendFormattedCommand(cc, cmd, len);
-
-    free(cmd);
-
-    return ret;
-}
-
-int redisClusterAppendCommand(redisClusterContext *cc, 
-    const char *format, ...) {
-
-    int ret;
-    va_list ap;
+    parent->callback(acc, reply, parent->privdata);
 
-    if(cc == NULL || format == NULL)
+    if(reply != NULL)
     {
-        return REDIS_ERR;
+        freeReplyObject(reply);
     }
-    
-    va_start(ap,format);
-    ret = redisClustervAppendCommand(cc, format, ap);
-    va_end(ap);
 
-    return ret;
+    cluster_async_data_free(parent);
 }
 
-int redisClusterAppendCommandArgv(redisClusterContext *cc, 
-    int argc, const char **argv, const size_t *argvlen) {
-    int ret;
-    char *cmd;
-    int len;
+static void redisClusterAsyncCallback(redisAsyncContext *ac, 
+    void *r, void *privdata);
+static redisAsyncContext *actx_get_by_command(redisClusterAsyncContext *acc, 
+    struct cmd *command, int *asking);
 
-    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-    if (len == -1) {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return REDIS_ERR;
-    }
-    
-    ret = redisClusterAppendFormattedCommand(cc, cmd, len);
-    
-    free(cmd);
+static void unlinkAsyncContextAndNode(redisAsyncContext* ac)
+{
+    cluster_node *node;
 
-    return ret;
+    if (ac->data) {
+        node = (cluster_node *)(ac->data);
+        node->acon = NULL;
+    }
 }
 
-static int redisCLusterSendAll(redisClusterContext *cc)
+redisAsyncContext * actx_get_by_node(redisClusterAsyncContext *acc, 
+    cluster_node *node)
 {
-    dictIterator *di;
-    dictEntry *de;
-    struct cluster_node *node;
-    redisContext *c = NULL;
-    int wdone = 0;
+    redisAsyncContext *ac;
     
-    if(cc == NULL || cc->nodes == NULL)
+    if(node == NULL)
     {
-        return REDIS_ERR;
+        return NULL;
     }
 
-    di = dictGetIterator(cc->nodes);
-    while((de = dictNext(di)) != NULL)
+    ac = node->acon;
+    if(ac != NULL)
     {
-        node = dictGetEntryVal(de);
-        if(node == NULL)
-        {
-            continue;
-        }
-        
-        c = ctx_get_by_node(cc, node);
-        if(c == NULL)
-        {
-            continue;
-        }
-
-        if (c->flags & REDIS_BLOCK) {
-            /* Write until done */
-            do {
-                if (redisBufferWrite(c,&wdone) == REDIS_ERR)
-                {
-                    dictReleaseIterator(di);
-                    return REDIS_ERR;
-                }
-            } while (!wdone);
+        if (ac->c.err == 0) {
+            return ac;
+        } else {
+            NOT_REACHED();
         }
     }
-    
-    dictReleaseIterator(di);
-
-    return REDIS_OK;
-}
 
-static int redisCLusterClearAll(redisClusterContext *cc)
-{
-    dictIterator *di;
-    dictEntry *de;
-    struct cluster_node *node;
-    redisContext *c = NULL;
-    
-    if (cc == NULL) {
-        return REDIS_ERR;
+    if(node->host == NULL || node->port <= 0)
+    {
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "node host or port is error");
+        return NULL;
     }
 
-    if (cc->err) {
-        cc->err = 0;
-        memset(cc->errstr, '\0', strlen(cc->errstr));
+    ac = redisAsyncConnect(node->host, node->port);
+    if(ac == NULL)
+    {
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "node host or port is error");
+        return NULL;
     }
 
-    if (cc->nodes == NULL) {
-        return REDIS_ERR;
-    }
-    di = dictGetIterator(cc->nodes);
-    while((de = dictNext(di)) != NULL)
+    if(acc->adapter)
     {
-        node = dictGetEntryVal(de);
-        if(node == NULL)
-        {
-            continue;
-        }
+        acc->attach_fn(ac, acc->adapter);
+    }
 
-        c = node->con;
-        if(c == NULL)
-        {
-            continue;
-        }
+    if(acc->onConnect)
+    {
+        redisAsyncSetConnectCallback(ac, acc->onConnect);
+    }
 
-        redisFree(c);
-        node->con = NULL;
+    if(acc->onDisconnect)
+    {
+        redisAsyncSetDisconnectCallback(ac, acc->onDisconnect);
     }
+
+    ac->data = node;
+    ac->dataHandler = unlinkAsyncContextAndNode;
+    node->acon = ac;
+    node->readonly &= ~CLUSTER_NODE_READONLY_ACON;
     
-    dictReleaseIterator(di);
-    
-    return REDIS_OK;
+    return ac;
 }
 
-int redisClusterGetReply(redisClusterContext *cc, void **reply) {
+/* Queue ASKING ahead of the next command, both are written to the node
+ * in one write by the event loop. Its reply is not needed: if the node
+ * is not importing the slot, the command behind it gets MOVED and that
+ * drops the ask cache of the slot. Nothing of the command is passed, 
+ * the command may be freed before the reply of ASKING comes. */
+static int actx_asking(redisAsyncContext *ac)
+{
+    return redisAsyncFormattedCommand(ac, NULL, NULL, 
+        REDIS_PROTOCOL_ASKING, strlen(REDIS_PROTOCOL_ASKING));
+}
 
-    struct cmd *command, *sub_command;
-    hilist *commands = NULL;
-    listNode *list_command, *list_sub_command;
-    listIter *list_iter;
-    int slot_num;
-    void *sub_reply;
+/* Get the async connection to the importing node the keys of the 
+ * command are all moved to, the command is sent with ASKING ahead.
+ * Return NULL if any key is not known to be moved. */
+static redisAsyncContext *actx_get_by_ask_cache(redisClusterAsyncContext *acc, 
+    struct cmd *command)
+{
+    redisAsyncContext *ac;
+    cluster_node *node;
 
-    if(cc == NULL || reply == NULL)
-        return REDIS_ERR;
+    node = node_get_by_ask_cache(acc->cc, command);
+    if(node == NULL)
+    {
+        return NULL;
+    }
 
-    cc->err = 0;
-    cc->errstr[0] = '\0';
+    ac = actx_get_by_node(acc, node);
+    if(ac != NULL && ac->err == 0)
+    {
+        return ac;
+    }
 
-    *reply = NULL;
+    if(acc->err)
+    {
+        acc->err = 0;
+        memset(acc->errstr, '\0', strlen(acc->errstr));
+    }
 
-    if (cc->requests == NULL)
-        return REDIS_ERR;
+    return NULL;
+}
 
-    list_command = listFirst(cc->requests);
+/* Get the async connection to the replica for the reads, READONLY is 
+ * queued once ahead of the commands on each new connection. */
+static redisAsyncContext *actx_get_by_replica(redisClusterAsyncContext *acc, 
+    cluster_node *node)
+{
+    redisAsyncContext *ac;
 
-    //no more reply
-    if(list_command == NULL)
+    ac = actx_get_by_node(acc, node);
+    if(ac == NULL || ac->err)
     {
-        *reply = NULL;
-        return REDIS_OK;
+        goto down;
     }
-    
-    command = list_command->value;
-    if(command == NULL)
+
+    if(node->readonly & CLUSTER_NODE_READONLY_ACON)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "command in the requests list is null");
-        goto error;
+        return ac;
     }
-    
-    slot_num = command->slot_num;
-    if(slot_num >= 0)
+
+    if(redisAsyncCommand(ac, NULL, NULL, REDIS_COMMAND_READONLY) != REDIS_OK)
     {
-        listDelNode(cc->requests, list_command);
-        return __redisClusterGetReply(cc, slot_num, reply);
+        goto down;
     }
 
-    commands = command->sub_commands;
-    if(commands == NULL)
+    node->readonly |= CLUSTER_NODE_READONLY_ACON;
+
+    return ac;
+
+down:
+
+    if(acc->err)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "sub_commands in command is null");
-        goto error;
+        acc->err = 0;
+        memset(acc->errstr, '\0', strlen(acc->errstr));
     }
 
-    ASSERT(listLength(commands) != 1);
+    node->down_until = hi_usec_now() + CLUSTER_REPLICA_DOWN_TIME;
 
-    list_iter = listGetIterator(commands, AL_START_HEAD);
-    while((list_sub_command = listNext(list_iter)) != NULL)
+    return NULL;
+}
+
+/* Get a healthy async context to send the route update command on.
+ * The connections already established are preferred, so the event 
+ * loop does not wait for a new connection. */
+static redisAsyncContext *actx_get_for_route_update(
+    redisClusterAsyncContext *acc)
+{
+    redisClusterContext *cc = acc->cc;
+    dictIterator *di;
+    dictEntry *de;
+    cluster_node *node, *node_first = NULL;
+    redisAsyncContext *ac;
+
+    if(cc->nodes == NULL)
     {
-        sub_command = list_sub_command->value;
-        if(sub_command == NULL)
+        return NULL;
+    }
+
+    di = dictGetIterator(cc->nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        node = dictGetEntryVal(de);
+        if(node == NULL)
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                "sub_command is null");
-            goto error;
+            continue;
         }
-        
-        slot_num = sub_command->slot_num;
-        if(slot_num < 0)
+
+        ac = node->acon;
+        if(ac != NULL && ac->err == 0 && 
+            !(ac->c.flags & (REDIS_DISCONNECTING | REDIS_FREEING)))
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                "sub_command slot_num is less then zero");
-            goto error;
+            dictReleaseIterator(di);
+            return ac;
         }
-        
-        if(__redisClusterGetReply(cc, slot_num, &sub_reply) != REDIS_OK)
+
+        if(node_first == NULL && node->acon == NULL)
         {
-            goto error;
+            node_first = node;
         }
-
-        sub_command->reply = sub_reply;
     }
 
-    *reply = command_post_fragment(cc, command, commands);
-    if(*reply == NULL)
+    dictReleaseIterator(di);
+
+    if(node_first == NULL)
     {
-        goto error;
+        return NULL;
     }
 
-    listDelNode(cc->requests, list_command);
-    return REDIS_OK;
-
-error:
-
-    listDelNode(cc->requests, list_command);
-    return REDIS_ERR;
+    return actx_get_by_node(acc, node_first);
 }
 
-void redisClusterReset(redisClusterContext *cc)
+/* Replay the commands parked by MOVED to the nodes in the new route,
+ * or fail them if the route update did not succeed. */
+static void cluster_async_parked_release(
+    redisClusterAsyncContext *acc, int replay)
 {
-    int status;
-    void *reply;
-    
-    if(cc == NULL || cc->nodes == NULL)
+    redisClusterContext *cc = acc->cc;
+    hilist *parked;
+    listNode *lnode;
+    cluster_async_data *cad;
+    cluster_node *node;
+    redisAsyncContext *ac;
+
+    parked = acc->parked_requests;
+    if(parked == NULL)
     {
         return;
     }
 
-    if (cc->err) {
-        redisCLusterClearAll(cc);
-    } else {
-        redisCLusterSendAll(cc);
-        
-        do {
-            status = redisClusterGetReply(cc, &reply);
-            if (status == REDIS_OK) {
-                freeReplyObject(reply);
-            } else {
-                redisCLusterClearAll(cc);
-                break;
-            }
-        } while(reply != NULL);
-    }
-    
-    if(cc->requests)
-    {
-        listRelease(cc->requests);
-        cc->requests = NULL;
-    }
+    acc->parked_requests = NULL;
 
-    if(cc->need_update_route)
+    while((lnode = listFirst(parked)) != NULL)
     {
-        status = cluster_update_route(cc);
-        if(status != REDIS_OK)
+        cad = listNodeValue(lnode);
+        listDelNode(parked, lnode);
+
+        if(replay)
         {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                "route update error, please recreate redisClusterContext!");
-            return;
+            node = node_get_by_table(cc, (uint32_t)cad->command->slot_num);
+            ac = node != NULL ? actx_get_by_node(acc, node) : NULL;
+            if(ac != NULL && ac->err == 0 && 
+                redisAsyncFormattedCommand(ac, redisClusterAsyncCallback, 
+                cad, cad->command->cmd, cad->command->clen) == REDIS_OK)
+            {
+                continue;
+            }
+
+            __redisClusterAsyncSetError(acc, 
+                REDIS_ERR_OTHER, "replay command after route update error");
         }
-        cc->need_update_route = 0;
-    }
-}
 
-/*############redis cluster async############*/
+        cluster_async_data_finish(acc, cad, NULL);
+    }
 
-/* We want the error field to be accessible directly instead of requiring
- * an indirection to the redisContext struct. */
-static void __redisClusterAsyncCopyError(redisClusterAsyncContext *acc) {
-    if (!acc)
-        return;
+    listRelease(parked);
 
-    redisClusterContext *cc = acc->cc;
-    acc->err = cc->err;
-    memcpy(acc->errstr, cc->errstr, 128);
+    if(acc->err)
+    {
+        acc->err = 0;
+        memset(acc->errstr, '\0', strlen(acc->errstr));
+    }
 }
 
-static void __redisClusterAsyncSetError(redisClusterAsyncContext *acc, 
-    int type, const char *str) {
-    
-    size_t len;
+static void clusterRouteUpdateCallback(redisAsyncContext *ac, 
+    void *r, void *privdata)
+{
+    int ret = REDIS_ERR;
+    redisReply *reply = r;
+    redisClusterAsyncContext *acc = privdata;
+    redisClusterContext *cc = acc->cc;
 
-    acc->err = type;
-    if (str != NULL) {
-        len = strlen(str);
-        len = len < (sizeof(acc->errstr)-1) ? len : (sizeof(acc->errstr)-1);
-        memcpy(acc->errstr,str,len);
-        acc->errstr[len] = '\0';
-    } else {
-        /* Only REDIS_ERR_IO may lack a description! */
-        assert(type == REDIS_ERR_IO);
-        __redis_strerror_r(errno, acc->errstr, sizeof(acc->errstr));
-    }
-}
+    DICT_NOTUSED(ac);
 
-static redisClusterAsyncContext *redisClusterAsyncInitialize(redisClusterContext *cc) {
-    redisClusterAsyncContext *acc;
+    cc->route_updating = 0;
 
-    if(cc == NULL)
+    if(reply != NULL)
     {
-        return NULL;
+        ret = cluster_update_route_by_reply(cc, reply);
     }
 
-    acc = hi_alloc(sizeof(redisClusterAsyncContext));
-    if (acc == NULL)
-        return NULL;
-
-    acc->cc = cc;
-
-    acc->err = 0;
-    acc->data = NULL;
-    acc->adapter = NULL;
-    acc->attach_fn = NULL;
-
-    acc->onConnect = NULL;
-    acc->onDisconnect = NULL;
+    if(ret == REDIS_OK)
+    {
+        cc->update_route_time = 0LL;
+    }
+    else
+    {
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
+            "route update error, please recreate redisClusterContext!");
+    }
+    
+    if(cc->err)
+    {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
 
-    return acc;
+    cluster_async_parked_release(acc, ret == REDIS_OK);
 }
 
-static cluster_async_data *cluster_async_data_get(void)
+static void clusterCommandInfosCallback(redisAsyncContext *ac, 
+    void *r, void *privdata)
 {
-    cluster_async_data *cad;
+    redisReply *reply = r;
+    redisClusterAsyncContext *acc = privdata;
 
-    cad = hi_alloc(sizeof(cluster_async_data));
-    if(cad == NULL)
+    DICT_NOTUSED(ac);
+
+    if(reply != NULL)
     {
-        return NULL;
+        cluster_command_infos_set(acc->cc, reply);
     }
-
-    cad->acc = NULL;
-    cad->command = NULL;
-    cad->callback = NULL;
-    cad->privdata = NULL;
-    cad->retry_count = 0;
-
-    return cad;
 }
 
-static void cluster_async_data_free(cluster_async_data *cad)
+/* Set the route update scheduled for a failed node to the end of the
+ * cluster-node-timeout of the cluster, the failover is done by then. */
+static void clusterNodeTimeoutCallback(redisAsyncContext *ac, 
+    void *r, void *privdata)
 {
-    if(cad == NULL)
+    redisReply *reply = r, *sub_reply;
+    redisClusterAsyncContext *acc = privdata;
+    redisClusterContext *cc = acc->cc;
+    int cluster_timeout;
+
+    DICT_NOTUSED(ac);
+
+    if(reply == NULL || reply->type != REDIS_REPLY_ARRAY || 
+        reply->elements != 2)
     {
         return;
     }
 
-    if(cad->command != NULL)
+    sub_reply = reply->element[1];
+    if(sub_reply == NULL || sub_reply->type != REDIS_REPLY_STRING)
     {
-        command_destroy(cad->command);
+        return;
     }
-    
-    hi_free(cad);
-    cad = NULL;
-}
 
-static void unlinkAsyncContextAndNode(redisAsyncContext* ac)
-{
-    cluster_node *node;
+    cluster_timeout = hi_atoi(sub_reply->str, sub_reply->len);
+    if(cluster_timeout <= 0)
+    {
+        return;
+    }
 
-    if (ac->data) {
-        node = (cluster_node *)(ac->data);
-        node->acon = NULL;
+    //the route may be updated already
+    if(cc->update_route_time == 0 || cc->route_updating)
+    {
+        return;
     }
+
+    cc->update_route_time = hi_usec_now() + cluster_timeout * 1000LL;
 }
 
-redisAsyncContext * actx_get_by_node(redisClusterAsyncContext *acc, 
-    cluster_node *node)
+/* Fetch the route over the async connections without blocking the
+ * event loop. The route update governor applies: the callers arrived
+ * during the route update in flight share it, and a route update 
+ * requested before the min interval passed is scheduled for the end
+ * of it, see actx_update_route_deferred(). The async API has no timer,
+ * so parked commands do not wait for the interval: the update they
+ * start is the one shared by all of them.
+ */
+static int cluster_update_route_async(redisClusterAsyncContext *acc, 
+    redisAsyncContext *ac, int parked)
 {
-    redisAsyncContext *ac;
-    
-    if(node == NULL)
+    int ret;
+    int64_t now;
+    redisClusterContext *cc = acc->cc;
+
+    now = hi_usec_now();
+    if(parked && !cc->route_updating)
     {
-        return NULL;
+        ret = CLUSTER_ROUTE_UPDATE_START;
     }
-
-    ac = node->acon;
-    if(ac != NULL)
+    else
     {
-        if (ac->c.err == 0) {
-            return ac;
-        } else {
-            NOT_REACHED();
-        }
+        ret = cluster_route_update_admit(cc, now);
     }
-
-    if(node->host == NULL || node->port <= 0)
+    
+    if(ret != CLUSTER_ROUTE_UPDATE_START)
     {
-        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "node host or port is error");
-        return NULL;
+        return REDIS_OK;
     }
 
-    ac = redisAsyncConnect(node->host, node->port);
-    if(ac == NULL)
+    if(ac == NULL || ac->err || 
+        (ac->c.flags & (REDIS_DISCONNECTING | REDIS_FREEING)))
     {
-        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "node host or port is error");
-        return NULL;
+        ac = actx_get_for_route_update(acc);
+        if(ac == NULL || ac->err)
+        {
+            __redisClusterAsyncSetError(acc, 
+                REDIS_ERR_OTHER, "no reachable node in cluster");
+            return REDIS_ERR;
+        }
     }
 
-    if(acc->adapter)
+    if(cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS)
     {
-        acc->attach_fn(ac, acc->adapter);
+        ret = redisAsyncCommand(ac, clusterRouteUpdateCallback, 
+            acc, REDIS_COMMAND_CLUSTER_SLOTS);
     }
-
-    if(acc->onConnect)
+    else
     {
-        redisAsyncSetConnectCallback(ac, acc->onConnect);
+        ret = redisAsyncCommand(ac, clusterRouteUpdateCallback, 
+            acc, REDIS_COMMAND_CLUSTER_NODES);
     }
 
-    if(acc->onDisconnect)
+    if(ret != REDIS_OK)
     {
-        redisAsyncSetDisconnectCallback(ac, acc->onDisconnect);
+        __redisClusterAsyncSetError(acc, 
+            REDIS_ERR_OTHER, "send route update command error");
+        return REDIS_ERR;
     }
 
-    ac->data = node;
-    ac->dataHandler = unlinkAsyncContextAndNode;
-    node->acon = ac;
-    
-    return ac;
+    //the commands are kept as they are if it fails
+    redisAsyncCommand(ac, clusterCommandInfosCallback, 
+        acc, REDIS_COMMAND_COMMAND);
+
+    cluster_route_update_started(cc, now);
+
+    return REDIS_OK;
 }
 
-static redisAsyncContext *actx_get_after_update_route_by_slot(
-    redisClusterAsyncContext *acc, int slot_num)
+/* Do the full route update scheduled by cluster_update_route_by_moved
+ * over the async connections when it is due. */
+static void actx_update_route_deferred(redisClusterAsyncContext *acc)
 {
-    int ret;
-    redisClusterContext *cc;
-    redisAsyncContext *ac;
-    cluster_node *node;
+    redisClusterContext *cc = acc->cc;
 
-    if(acc == NULL || slot_num < 0)
+    if(cc->update_route_time == 0 || cc->route_updating)
     {
-        return NULL;
+        return;
     }
 
-    cc = acc->cc;
-    if(cc == NULL)
+    if(hi_usec_now() < cc->update_route_time)
     {
-        return NULL;
+        return;
     }
-    
-    ret = cluster_update_route(cc);
-    if(ret != REDIS_OK)
+
+    if(cluster_update_route_async(acc, NULL, 0) != REDIS_OK)
     {
-        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
-            "route update error, please recreate redisClusterContext!");
-        return NULL;
+        acc->err = 0;
+        memset(acc->errstr, '\0', strlen(acc->errstr));
     }
+}
 
-    node = node_get_by_table(cc, (uint32_t)slot_num);
-    if(node == NULL)
+/* Park the command until the route update in flight, or the one 
+ * started for it, is finished. */
+static int cluster_async_park_request(redisClusterAsyncContext *acc, 
+    redisAsyncContext *ac, cluster_async_data *cad)
+{
+    if(acc->parked_requests == NULL)
     {
-        __redisClusterAsyncSetError(acc, 
-            REDIS_ERR_OTHER, "node get by table error");
-        return NULL;
+        acc->parked_requests = listCreate();
+        if(acc->parked_requests == NULL)
+        {
+            __redisClusterAsyncSetError(acc, REDIS_ERR_OOM, "Out of memory");
+            return REDIS_ERR;
+        }
     }
 
-    ac = actx_get_by_node(acc, node);
-    if(ac == NULL)
+    if(cluster_update_route_async(acc, ac, 1) != REDIS_OK)
     {
-        __redisClusterAsyncSetError(acc, 
-            REDIS_ERR_OTHER, "actx get by node error");
-        return NULL;
+        return REDIS_ERR;
     }
-    else if(ac->err)
+
+    if(listAddNodeTail(acc->parked_requests, cad) == NULL)
+    {
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+/* Connect the context set up with the redisClusterSetOption* functions
+ * for the asynchronous API. The context is owned by the returned one. */
+redisClusterAsyncContext *redisClusterAsyncConnect2(redisClusterContext *cc)
+{
+    redisClusterAsyncContext *acc;
+
+    if(cc == NULL)
     {
-        __redisClusterAsyncSetError(acc, ac->err, ac->errstr);
         return NULL;
     }
 
-    return ac;
+    cc->flags &= ~REDIS_BLOCK;
+    _redisClusterConnect2(cc);
+
+    acc = redisClusterAsyncInitialize(cc);
+    if (acc == NULL) {
+        redisClusterFree(cc);
+        return NULL;
+    }
+    
+    __redisClusterAsyncCopyError(acc);
+    
+    return acc;
 }
 
 redisClusterAsyncContext *redisClusterAsyncConnect(const char *addrs, int flags) {
@@ -4472,9 +9385,11 @@ static void redisClusterAsyncCallback(redisAsyncContext *ac, void *r, void *priv
     redisClusterContext *cc;
     redisAsyncContext *ac_retry = NULL;
     int error_type;
+    int slot_num;
+    int asking;
     cluster_node *node;
     struct cmd *command;
-    int64_t now, next;
+    int64_t now;
 
     if(cad == NULL)
     {
@@ -4510,24 +9425,56 @@ static void redisClusterAsyncCallback(redisAsyncContext *ac, void *r, void *priv
         //My email: diguo58@gmail.com
         
         node = (cluster_node *)(ac->data);
-        ASSERT(node != NULL);
         
         __redisClusterAsyncSetError(acc, 
             ac->err, ac->errstr);
+
+        //the node is already removed from the route
+        if(node == NULL)
+        {
+            goto done;
+        }
+
+        //the reads go to another node for a while, and this one is 
+        //sent there again unless the context is being freed
+        if(node->role == REDIS_ROLE_SLAVE)
+        {
+            node->down_until = hi_usec_now() + CLUSTER_REPLICA_DOWN_TIME;
+            
+            if(ac->err == 0 || (ac->c.flags & REDIS_FREEING) || 
+                ++ cad->retry_count > cc->max_redirect_count)
+            {
+                goto done;
+            }
+
+            ac_retry = actx_get_by_command(acc, command, &asking);
+            if(ac_retry == NULL)
+            {
+                goto done;
+            }
+
+            acc->err = 0;
+            memset(acc->errstr, '\0', strlen(acc->errstr));
+
+            if(asking && actx_asking(ac_retry) != REDIS_OK)
+            {
+                goto error;
+            }
+
+            goto retry;
+        }
         
         if(cc->update_route_time != 0)
         {
             now = hi_usec_now();
             if(now >= cc->update_route_time)
             {
-                ret = cluster_update_route(cc);
+                ret = cluster_update_route_async(acc, NULL, 0);
                 if(ret != REDIS_OK)
                 {
                     __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
                         "route update error, please recreate redisClusterContext!");
                 }
-                
-                cc->update_route_time = 0LL;
             }
             
             goto done;
@@ -4536,53 +9483,36 @@ static void redisClusterAsyncCallback(redisAsyncContext *ac, void *r, void *priv
         node->failure_count ++;
         if(node->failure_count > cc->max_redirect_count)
         {
-            char *cluster_timeout_str;
-            int cluster_timeout_str_len;
-            int cluster_timeout;
-
             node->failure_count = 0;
             if(cc->update_route_time != 0)
             {
                 goto done;
             }
-            
-            cluster_timeout_str = cluster_config_get(cc, 
-                "cluster-node-timeout", &cluster_timeout_str_len);
-            if(cluster_timeout_str == NULL)
-            {
-                __redisClusterAsyncSetError(acc, 
-                    cc->err, cc->errstr);
-                goto done;
-            }
-
-            cluster_timeout = hi_atoi(cluster_timeout_str, 
-                cluster_timeout_str_len);
-            free(cluster_timeout_str);
-            if(cluster_timeout <= 0)
-            {
-                __redisClusterAsyncSetError(acc, 
-                    REDIS_ERR_OTHER, 
-                    "cluster_timeout_str convert to integer error");
-                goto done;
-            }
 
+            //update the route once the failover is done, the default
+            //wait is replaced by the cluster-node-timeout when it arrives
             now = hi_usec_now();
-            if (now < 0) {
-                __redisClusterAsyncSetError(acc, 
-                    REDIS_ERR_OTHER, 
-                    "get now usec time error");
-                goto done;
-            }
+            cc->update_route_time = now + CLUSTER_DEFAULT_NODE_TIMEOUT * 1000LL;
 
-            next = now + (cluster_timeout * 1000LL);
-
-            cc->update_route_time = next;
+            ac_retry = actx_get_for_route_update(acc);
+            if(ac_retry != NULL && ac_retry->err == 0)
+            {
+                redisAsyncCommand(ac_retry, clusterNodeTimeoutCallback, 
+                    acc, REDIS_COMMAND_CONFIG_GET_NODE_TIMEOUT);
+            }
             
+            acc->err = 0;
+            memset(acc->errstr, '\0', strlen(acc->errstr));
         }
 
         goto done;
     }
 
+    if(cad->start_time > 0 && ac->data != NULL)
+    {
+        node_latency_update(ac->data, cad->start_time);
+    }
+
     error_type = cluster_reply_error_type(reply);
 
     if(error_type > CLUSTER_NOT_ERR && error_type < CLUSTER_ERR_SENTINEL)
@@ -4600,15 +9530,33 @@ static void redisClusterAsyncCallback(redisAsyncContext *ac, void *r, void *priv
         switch(error_type)
         {
         case CLUSTER_ERR_MOVED:
-            ac_retry = actx_get_after_update_route_by_slot(acc, command->slot_num);
-            if(ac_retry == NULL)
+            node = cluster_update_route_by_moved(cc, reply);
+            if(node != NULL)
+            {
+                ac_retry = actx_get_by_node(acc, node);
+                if(ac_retry != NULL && ac_retry->err == 0)
+                {
+                    actx_update_route_deferred(acc);
+                    break;
+                }
+            }
+
+            if(cc->err)
+            {
+                cc->err = 0;
+                memset(cc->errstr, '\0', strlen(cc->errstr));
+            }
+
+            ret = cluster_async_park_request(acc, ac, cad);
+            if(ret != REDIS_OK)
             {
                 goto done;
             }
-            
-            break;
+
+            //replayed after the route update
+            return;
         case CLUSTER_ERR_ASK:
-            node = node_get_by_ask_error_reply(cc, reply);
+            node = node_get_by_redirect_reply(cc, reply, &slot_num);
             if(node == NULL)
             {
                 __redisClusterAsyncSetError(acc, 
@@ -4616,6 +9564,8 @@ static void redisClusterAsyncCallback(redisAsyncContext *ac, void *r, void *priv
                 goto done;
             }
 
+            cluster_ask_cache_add(cc, command, (uint32_t)slot_num, node);
+
             ac_retry = actx_get_by_node(acc, node);
             if(ac_retry == NULL)
             {
@@ -4630,85 +9580,247 @@ static void redisClusterAsyncCallback(redisAsyncContext *ac, void *r, void *priv
                 goto done;
             }
 
-            ret = redisAsyncCommand(ac_retry,
-                NULL,NULL,REDIS_COMMAND_ASKING);
-            if(ret != REDIS_OK)
-            {
-                goto error;
-            }
-            
-            break;
-        case CLUSTER_ERR_TRYAGAIN:
-        case CLUSTER_ERR_CROSSSLOT:
-        case CLUSTER_ERR_CLUSTERDOWN:
-            ac_retry = ac;
-            
+            ret = actx_asking(ac_retry);
+            if(ret != REDIS_OK)
+            {
+                goto error;
+            }
+            
+            break;
+        case CLUSTER_ERR_TRYAGAIN:
+        case CLUSTER_ERR_CROSSSLOT:
+        case CLUSTER_ERR_CLUSTERDOWN:
+            ac_retry = ac;
+            
+            break;
+        default:
+
+            goto done;
+            break;
+        }
+
+        goto retry;
+    }
+
+done:
+
+    cluster_async_data_finish(acc, cad, acc->err ? NULL : reply);
+
+    if(cc->err)
+    {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
+
+    if(acc->err)
+    {
+        acc->err = 0;
+        memset(acc->errstr, '\0', strlen(acc->errstr));
+    }
+
+    return;
+
+retry:
+
+    ret = redisAsyncFormattedCommand(ac_retry,
+        redisClusterAsyncCallback,cad,command->cmd,command->clen);
+    if(ret != REDIS_OK)
+    {
+        goto error;
+    }
+    
+    return;
+
+error:
+
+    //the other fragments of the command still wait for this one
+    if(cad != NULL && cad->parent != NULL && cad->acc != NULL)
+    {
+        cluster_async_data_finish(cad->acc, cad, NULL);
+    }
+    else if(cad != NULL)
+    {
+        cluster_async_data_free(cad);
+    }
+}
+
+/* Get the async connection the command goes to by the ask cache, the
+ * read preference and the route, asking is set if ASKING goes first. */
+static redisAsyncContext *actx_get_by_command(redisClusterAsyncContext *acc, 
+    struct cmd *command, int *asking)
+{
+    redisClusterContext *cc = acc->cc;
+    cluster_node *node, *node_read;
+    redisAsyncContext *ac;
+
+    node = node_get_by_table(cc, (uint32_t)command->slot_num);
+    if(node == NULL)
+    {
+        __redisClusterAsyncSetError(acc, 
+            REDIS_ERR_OTHER, "node get by table error");
+        return NULL;
+    }
+
+    ac = NULL;
+    *asking = 0;
+    if(cc->ask_slots != NULL && listLength(cc->ask_slots) > 0)
+    {
+        ac = actx_get_by_ask_cache(acc, command);
+        *asking = ac != NULL;
+    }
+    
+    if(ac == NULL && cc->read_preference != HIRCLUSTER_READ_MASTER && 
+        redis_cmd_readonly(command))
+    {
+        node_read = node_get_for_read(cc, node);
+        if(node_read == NULL)
+        {
+            __redisClusterAsyncSetError(acc, 
+                REDIS_ERR_OTHER, "no healthy replica for the read");
+            return NULL;
+        }
+
+        if(node_read != node)
+        {
+            ac = actx_get_by_replica(acc, node_read);
+            if(ac == NULL && 
+                cc->read_preference == HIRCLUSTER_READ_REPLICA_ONLY)
+            {
+                __redisClusterAsyncSetError(acc, 
+                    REDIS_ERR_OTHER, "no healthy replica for the read");
+                return NULL;
+            }
+        }
+    }
+    
+    if(ac == NULL)
+    {
+        ac = actx_get_by_node(acc, node);
+    }
+    
+    if(ac == NULL)
+    {
+        __redisClusterAsyncSetError(acc, 
+            REDIS_ERR_OTHER, "actx get by node error");
+        return NULL;
+    }
+    else if(ac->err)
+    {
+        __redisClusterAsyncSetError(acc, ac->err, ac->errstr);
+        return NULL;
+    }
+    return ac;
+}
+
+/* Send the fragments of the multi-key command to their nodes, the 
+ * replies are merged when the last one is in. The command is owned by
+ * the request from now on. */
+static int actx_send_fragments(redisClusterAsyncContext *acc, 
+    redisClusterPartialCallbackFn *partial_fn, redisClusterCallbackFn *fn, 
+    void *privdata, struct cmd *command)
+{
+    redisClusterContext *cc = acc->cc;
+    cluster_async_data *parent, *cad;
+    redisAsyncContext *ac;
+    struct cmd *sub_command;
+    listNode *list_node;
+    listIter li;
+    uint32_t unsent;
+    int asking;
+
+    parent = cluster_async_data_get();
+    if(parent == NULL)
+    {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
+        command_destroy(command);
+        return REDIS_ERR;
+    }
+
+    parent->acc = acc;
+    parent->command = command;
+    parent->callback = fn;
+    parent->partial = partial_fn;
+    parent->privdata = privdata;
+    parent->pending = unsent = listLength(command->sub_commands);
+
+    //the event loop writes them to all the nodes at once
+    listRewind(command->sub_commands, &li);
+    while((list_node = listNext(&li)) != NULL)
+    {
+        sub_command = listNodeValue(list_node);
+
+        ac = actx_get_by_command(acc, sub_command, &asking);
+        if(ac == NULL)
+        {
             break;
-        default:
+        }
 
-            goto done;
+        cad = cluster_async_data_get();
+        if(cad == NULL)
+        {
+            __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
             break;
         }
 
-        goto retry;
-    }
+        cad->acc = acc;
+        cad->command = sub_command;
+        cad->parent = parent;
 
-done:
+        if(cc->read_preference != HIRCLUSTER_READ_MASTER)
+        {
+            cad->start_time = hi_usec_now();
+        }
 
-    if(acc->err)
-    {
-        cad->callback(acc, NULL, cad->privdata);
+        if((asking && actx_asking(ac) != REDIS_OK) || 
+            redisAsyncFormattedCommand(ac, redisClusterAsyncCallback, 
+            cad, sub_command->cmd, sub_command->clen) != REDIS_OK)
+        {
+            cad->command = NULL;
+            cluster_async_data_free(cad);
+            break;
+        }
+
+        unsent --;
     }
-    else
+
+    if(unsent == 0)
     {
-        cad->callback(acc, r, cad->privdata);
+        return REDIS_OK;
     }
 
-    if(cc->err)
+    if(unsent == parent->pending)
     {
-        cc->err = 0;
-        memset(cc->errstr, '\0', strlen(cc->errstr));
+        cluster_async_data_free(parent);
+        return REDIS_ERR;
     }
 
+    //the fragments in flight finish the command with the error
+    parent->pending -= unsent;
+    parent->err = acc->err ? acc->err : REDIS_ERR_OTHER;
+    parent->errstr = sdsnew(acc->err ? acc->errstr : "sub command send error");
+
     if(acc->err)
     {
         acc->err = 0;
         memset(acc->errstr, '\0', strlen(acc->errstr));
     }
-    
-    if(cad != NULL)
-    {
-        cluster_async_data_free(cad);
-    }
-
-    return;
-
-retry:
-
-    ret = redisAsyncFormattedCommand(ac_retry,
-        redisClusterAsyncCallback,cad,command->cmd,command->clen);
-    if(ret != REDIS_OK)
-    {
-        goto error;
-    }
-    
-    return;
 
-error:
-
-    if(cad != NULL)
-    {
-        cluster_async_data_free(cad);
-    }
+    return REDIS_OK;
 }
 
-int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc, 
-    redisClusterCallbackFn *fn, void *privdata, char *cmd, int len) {
+/*
+ * Send the command like redisClusterAsyncFormattedCommand, and if it is
+ * split by slot, partial_fn is called with the reply of every fragment
+ * as it comes in, before fn gets the merged reply.
+ */
+int redisClusterAsyncFormattedCommandPartial(redisClusterAsyncContext *acc, 
+    redisClusterPartialCallbackFn *partial_fn, redisClusterCallbackFn *fn, 
+    void *privdata, char *cmd, int len) {
     
     redisClusterContext *cc;
     int status = REDIS_OK;
     int slot_num;
-    cluster_node *node;
+    int asking;
     redisAsyncContext *ac;
     struct cmd *command = NULL;
     hilist *commands = NULL;
@@ -4733,6 +9845,8 @@ int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc,
         memset(acc->errstr, '\0', strlen(acc->errstr));
     }
 
+    actx_update_route_deferred(acc);
+
     command = command_get();
     if(command == NULL)
     {
@@ -4758,7 +9872,7 @@ int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc,
 
     commands->free = listCommandFree;
 
-    slot_num = command_format_by_slot(cc, command, commands);
+    slot_num = command_format_by_slot(cc, command, commands, NULL, 0);
 
     if(slot_num < 0)
     {
@@ -4777,30 +9891,14 @@ int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc,
     if(listLength(commands) > 0)
     {
         ASSERT(listLength(commands) != 1);
-        
-        __redisClusterAsyncSetError(acc,REDIS_ERR_OTHER,
-            "Asynchronous API now not support multi-key command");
-        goto error;
-    }
 
-    node = node_get_by_table(cc, (uint32_t) slot_num);
-    if(node == NULL)
-    {
-        __redisClusterAsyncSetError(acc, 
-            REDIS_ERR_OTHER, "node get by table error");
-        goto error;
+        command->sub_commands = commands;
+        return actx_send_fragments(acc, partial_fn, fn, privdata, command);
     }
-    
-    ac = actx_get_by_node(acc, node);
+
+    ac = actx_get_by_command(acc, command, &asking);
     if(ac == NULL)
     {
-        __redisClusterAsyncSetError(acc, 
-            REDIS_ERR_OTHER, "actx get by node error");
-        goto error;
-    }
-    else if(ac->err)
-    {
-        __redisClusterAsyncSetError(acc, ac->err, ac->errstr);
         goto error;
     }
 
@@ -4815,6 +9913,18 @@ int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc,
     cad->command = command;
     cad->callback = fn;
     cad->privdata = privdata;
+
+    if(cc->read_preference != HIRCLUSTER_READ_MASTER)
+    {
+        cad->start_time = hi_usec_now();
+    }
+
+    if(asking && actx_asking(ac) != REDIS_OK)
+    {
+        cad->command = NULL;
+        cluster_async_data_free(cad);
+        goto error;
+    }
     
     status = redisAsyncFormattedCommand(ac,
         redisClusterAsyncCallback,cad,cmd,len);
@@ -4846,6 +9956,12 @@ error:
 }
 
 
+int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc, 
+    redisClusterCallbackFn *fn, void *privdata, char *cmd, int len) {
+    return redisClusterAsyncFormattedCommandPartial(acc, NULL, fn, 
+        privdata, cmd, len);
+}
+
 int redisClustervAsyncCommand(redisClusterAsyncContext *acc, 
     redisClusterCallbackFn *fn, void *privdata, const char *format, va_list ap) {
     int ret;
@@ -4885,6 +10001,39 @@ int redisClusterAsyncCommand(redisClusterAsyncContext *acc,
     return ret;
 }
 
+int redisClusterAsyncCommandPartial(redisClusterAsyncContext *acc, 
+    redisClusterPartialCallbackFn *partial_fn, redisClusterCallbackFn *fn, 
+    void *privdata, const char *format, ...) {
+    int ret;
+    char *cmd;
+    int len;
+    va_list ap;
+
+    if(acc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    va_start(ap,format);
+    len = redisvFormatCommand(&cmd,format,ap);
+    va_end(ap);
+
+    if (len == -1) {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    } else if (len == -2) {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OTHER,"Invalid format string");
+        return REDIS_ERR;
+    }
+
+    ret = redisClusterAsyncFormattedCommandPartial(acc, partial_fn, fn, 
+        privdata, cmd, len);
+
+    free(cmd);
+
+    return ret;
+}
+
 int redisClusterAsyncCommandArgv(redisClusterAsyncContext *acc, 
     redisClusterCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
     int ret;
@@ -4904,6 +10053,205 @@ int redisClusterAsyncCommandArgv(redisClusterAsyncContext *acc,
     return ret;
 }
 
+/* A command sent to several nodes by redisClusterAsyncBroadcastCommand. */
+typedef struct cluster_async_broadcast cluster_async_broadcast;
+
+typedef struct cluster_async_broadcast_node {
+    cluster_async_broadcast *broadcast;
+    int index;          /* of the node in the replies */
+} cluster_async_broadcast_node;
+
+struct cluster_async_broadcast {
+    redisClusterAsyncContext *acc;
+    redisClusterBroadcastCallbackFn *callback;
+    void *privdata;
+    int merge;
+    int pending;        /* replies not in yet */
+    redisClusterNodeReplies *replies;
+    cluster_async_broadcast_node *nodes;
+};
+
+static void cluster_async_broadcast_free(cluster_async_broadcast *broadcast)
+{
+    redisClusterNodeRepliesFree(broadcast->replies);
+
+    if(broadcast->nodes != NULL)
+    {
+        hi_free(broadcast->nodes);
+    }
+
+    hi_free(broadcast);
+}
+
+static void clusterBroadcastCallback(redisAsyncContext *ac, void *r, 
+    void *privdata)
+{
+    cluster_async_broadcast_node *bnode = privdata;
+    cluster_async_broadcast *broadcast = bnode->broadcast;
+    redisClusterAsyncContext *acc = broadcast->acc;
+
+    DICT_NOTUSED(ac);
+
+    if(r != NULL)
+    {
+        broadcast->replies->replies[bnode->index] = cluster_reply_steal(r);
+    }
+
+    if(-- broadcast->pending > 0)
+    {
+        return;
+    }
+
+    if(broadcast->merge != HIRCLUSTER_MERGE_NONE)
+    {
+        broadcast->replies->reduced = cluster_replies_reduce(
+            broadcast->replies->replies, broadcast->replies->count, 
+            broadcast->merge);
+    }
+
+    broadcast->callback(acc, broadcast->replies, broadcast->privdata);
+
+    cluster_async_broadcast_free(broadcast);
+}
+
+/*
+ * Send the command to all the nodes selected by filter. The callback is
+ * called once when all of them replied, the replies are only valid for
+ * the duration of the callback.
+ */
+int redisClusterAsyncBroadcastFormattedCommand(redisClusterAsyncContext *acc, 
+    int filter, int merge, redisClusterBroadcastCallbackFn *fn, 
+    void *privdata, char *cmd, int len)
+{
+    redisClusterContext *cc;
+    cluster_async_broadcast *broadcast = NULL;
+    cluster_node **nodes;
+    redisAsyncContext *ac;
+    int i, count, sent = 0;
+
+    if(acc == NULL || fn == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc = acc->cc;
+
+    if(acc->err)
+    {
+        acc->err = 0;
+        memset(acc->errstr, '\0', strlen(acc->errstr));
+    }
+
+    nodes = cluster_nodes_select(cc, filter, &count);
+    if(nodes == NULL)
+    {
+        __redisClusterAsyncSetError(acc, cc->err, cc->errstr);
+        return REDIS_ERR;
+    }
+
+    broadcast = hi_zalloc(sizeof(*broadcast));
+    if(broadcast == NULL)
+    {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
+    }
+
+    broadcast->acc = acc;
+    broadcast->callback = fn;
+    broadcast->privdata = privdata;
+    broadcast->merge = merge;
+    broadcast->replies = cluster_node_replies_create(nodes, count);
+    broadcast->nodes = hi_calloc(count > 0 ? count : 1, 
+        sizeof(*broadcast->nodes));
+    if(broadcast->replies == NULL || broadcast->nodes == NULL)
+    {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
+    }
+
+    for(i = 0; i < count; i ++)
+    {
+        broadcast->nodes[i].broadcast = broadcast;
+        broadcast->nodes[i].index = i;
+
+        ac = actx_get_by_node(acc, nodes[i]);
+        if(ac != NULL && ac->err == 0 && 
+            redisAsyncFormattedCommand(ac, clusterBroadcastCallback, 
+            &broadcast->nodes[i], cmd, len) == REDIS_OK)
+        {
+            sent ++;
+        }
+    }
+
+    if(sent == 0)
+    {
+        if(acc->err == 0)
+        {
+            __redisClusterAsyncSetError(acc, 
+                REDIS_ERR_OTHER, "no node to send the command to");
+        }
+        goto error;
+    }
+
+    //the nodes not reached keep NULL replies
+    broadcast->pending = sent;
+
+    if(acc->err)
+    {
+        acc->err = 0;
+        memset(acc->errstr, '\0', strlen(acc->errstr));
+    }
+
+    hi_free(nodes);
+
+    return REDIS_OK;
+
+error:
+
+    if(broadcast != NULL)
+    {
+        cluster_async_broadcast_free(broadcast);
+    }
+
+    hi_free(nodes);
+
+    return REDIS_ERR;
+}
+
+int redisClusterAsyncBroadcastCommand(redisClusterAsyncContext *acc, 
+    int filter, int merge, redisClusterBroadcastCallbackFn *fn, 
+    void *privdata, const char *format, ...)
+{
+    int ret;
+    char *cmd;
+    int len;
+    va_list ap;
+
+    if(acc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    va_start(ap,format);
+    len = redisvFormatCommand(&cmd,format,ap);
+    va_end(ap);
+
+    if (len == -1) {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    } else if (len == -2) {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OTHER,"Invalid format string");
+        return REDIS_ERR;
+    }
+
+    ret = redisClusterAsyncBroadcastFormattedCommand(acc, filter, merge, 
+        fn, privdata, cmd, len);
+
+    free(cmd);
+
+    return ret;
+}
+
 void redisClusterAsyncDisconnect(redisClusterAsyncContext *acc) {
 
     redisClusterContext *cc;
@@ -4957,6 +10305,8 @@ void redisClusterAsyncFree(redisClusterAsyncContext *acc)
 
     cc = acc->cc;
 
+    cluster_async_parked_release(acc, 0);
+
     redisClusterFree(cc);
 
     hi_free(acc);
@@ -6,7 +6,7 @@
 #include "async.h"
 
 #define HIREDIS_VIP_MAJOR 1
-#define HIREDIS_VIP_MINOR 0
+#define HIREDIS_VIP_MINOR 1
 #define HIREDIS_VIP_PATCH 0
 
 #define REDIS_CLUSTER_SLOTS 16384
@@ -30,22 +30,49 @@
   * is 'cluster nodes' command.*/
 #define HIRCLUSTER_FLAG_ROUTE_USE_SLOTS     0x4000
 
+/* Read preference: the node the read only commands are sent to. */
+#define HIRCLUSTER_READ_MASTER              0   /* the master (default) */
+#define HIRCLUSTER_READ_PREFER_REPLICA      1   /* a replica, or the master if none is healthy */
+#define HIRCLUSTER_READ_REPLICA_ONLY        2   /* a replica only */
+#define HIRCLUSTER_READ_NEAREST             3   /* the master or a replica with the least latency */
+
+/* Reducer: how a multi-key command is split by slot... */
+#define HIRCLUSTER_SPLIT_KEYS               0   /* every argument is a key */
+#define HIRCLUSTER_SPLIT_KEY_VALUES         1   /* the arguments are key-value pairs */
+
+/* ...and how the replies of the fragments are merged. */
+#define HIRCLUSTER_MERGE_SUM                0   /* add up the integer replies */
+#define HIRCLUSTER_MERGE_CONCAT             1   /* an array of one element per key, in key order */
+#define HIRCLUSTER_MERGE_ALL_OK             2   /* OK if every fragment replied OK */
+#define HIRCLUSTER_MERGE_NONE               -1  /* no merge, for the broadcast commands */
+
+/* The nodes a broadcast command is sent to. */
+#define HIRCLUSTER_NODE_MASTERS             0x1
+#define HIRCLUSTER_NODE_REPLICAS            0x2
+#define HIRCLUSTER_NODE_ALL                 (HIRCLUSTER_NODE_MASTERS | HIRCLUSTER_NODE_REPLICAS)
+
 struct dict;
 struct hilist;
+struct cmd;
 
 typedef struct cluster_node
 {
+    /* Fields read on every command, kept in the first cache line. */
+    redisContext *con;
+    redisAsyncContext *acon;
+    int failure_count;
+    uint8_t role;
+    uint8_t myself;   /* myself ? */
+    uint8_t readonly; /* READONLY is sent on con and/or acon */
+    int64_t latency;  /* EWMA of the reply latency(usec) */
+    int64_t down_until; /* not used for reads until then(usec) */
+    
     sds name;
     sds addr;
     sds host;
     int port;
-    uint8_t role;
-    uint8_t myself;   /* myself ? */
-    redisContext *con;
-    redisAsyncContext *acon;
     struct hilist *slots;
     struct hilist *slaves;
-    int failure_count;
     void *data;     /* Not used by hiredis */
     struct hiarray *migrating;  /* copen_slot[] */
     struct hiarray *importing;  /* copen_slot[] */
@@ -66,6 +93,25 @@ typedef struct copen_slot
     cluster_node *node; /* master that this slot belong to */
 }copen_slot;
 
+/* Route snapshot: the slot table, the slot regions and the master nodes.
+ * A snapshot published to a redisClusterRouteShare is never modified, 
+ * every context attached to the share holds a reference to the one it 
+ * uses and picks up the newer one on its next lookup. */
+typedef struct cluster_route
+{
+    uint64_t version;
+    int refcount;
+    struct dict *nodes;     /* masters, NULL if the context owns them */
+    struct hiarray *slots;  /* cluster_slot[] sorted by start */
+    cluster_node **node_list;   /* masters by index, node_list[0] is NULL */
+    uint32_t node_count;
+    uint32_t node_size;
+    uint16_t table[REDIS_CLUSTER_SLOTS];    /* slot to node_list index */
+    int from_file;  /* loaded from the route file, not verified yet */
+}cluster_route;
+
+typedef struct redisClusterRouteShare redisClusterRouteShare;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -84,20 +130,38 @@ typedef struct redisClusterContext {
 
     struct timeval *timeout;    /* receive and send timeout. */
     
-    struct hiarray *slots;
-
     struct dict *nodes;
-    cluster_node *table[REDIS_CLUSTER_SLOTS];
+    struct cluster_route *route;
+    redisClusterRouteShare *route_share;
+    cluster_node **route_nodes; /* own nodes by route index if shared */
+    sds route_file;     /* file the route is saved to and loaded from */
+    int route_file_dirty;   /* the route is not saved to route_file yet */
 
     uint64_t route_version;
 
     int max_redirect_count;
     int retry_count;
 
+    int read_preference;
+
+    struct dict *command_infos; /* the server commands by name, from COMMAND */
+
+    struct hilist *ask_slots;   /* slots in migration, see cluster_ask_slot */
+
     struct hilist *requests;
+    int requests_fetched;   /* leading requests with the replies read ahead */
+    int requests_redirected;    /* requests of the pipeline sent again by MOVED or ASK */
 
     int need_update_route;
     int64_t update_route_time;
+
+    /* Route update governor, see cluster_update_route_governed(). */
+    int route_updating;             /* a route update is in flight */
+    int64_t route_update_interval;  /* min usec between two route updates */
+    int64_t last_route_update_time; /* usec the last route update started */
+    uint64_t route_update_count;    /* route updates started */
+    uint64_t route_update_skipped;  /* requests delayed by the interval */
+    uint64_t route_update_coalesced;/* requests merged into another one */
 } redisClusterContext;
 
 redisClusterContext *redisClusterConnect(const char *addrs, int flags);
@@ -118,11 +182,22 @@ int redisClusterSetOptionRouteUseSlots(redisClusterContext *cc);
 int redisClusterSetOptionConnectTimeout(redisClusterContext *cc, const struct timeval tv);
 int redisClusterSetOptionTimeout(redisClusterContext *cc, const struct timeval tv);
 int redisClusterSetOptionMaxRedirect(redisClusterContext *cc,  int max_redirect_count);
+int redisClusterSetOptionRouteUpdateInterval(redisClusterContext *cc, const struct timeval tv);
+int redisClusterSetOptionRouteShare(redisClusterContext *cc, redisClusterRouteShare *share);
+int redisClusterSetOptionRouteFile(redisClusterContext *cc, const char *path);
+int redisClusterSetOptionReadPreference(redisClusterContext *cc, int read_preference);
+
+redisClusterRouteShare *redisClusterRouteShareCreate(void);
+void redisClusterRouteShareRelease(redisClusterRouteShare *share);
 
 int redisClusterConnect2(redisClusterContext *cc);
 
 void redisClusterSetMaxRedirect(redisClusterContext *cc, int max_redirect_count);
 
+int redisClusterRegisterReducer(const char *name, int split, int merge);
+
+int redisClusterKeySlots(const char **keys, const size_t *lens, int n, int *slots);
+
 void *redisClusterFormattedCommand(redisClusterContext *cc, char *cmd, int len);
 void *redisClustervCommand(redisClusterContext *cc, const char *format, va_list ap);
 void *redisClusterCommand(redisClusterContext *cc, const char *format, ...);
@@ -137,8 +212,43 @@ int redisClusterAppendCommandArgv(redisClusterContext *cc, int argc, const char
 int redisClusterGetReply(redisClusterContext *cc, void **reply);
 void redisClusterReset(redisClusterContext *cc);
 
+/* A batch of commands executed as a unit, see redisClusterBatchExecute().
+ * The batch can be reset and filled again, its memory is kept. */
+typedef struct redisClusterBatch redisClusterBatch;
+
+redisClusterBatch *redisClusterBatchCreate(void);
+void redisClusterBatchFree(redisClusterBatch *batch);
+void redisClusterBatchReset(redisClusterBatch *batch);
+int redisClusterBatchCount(redisClusterBatch *batch);
+int redisClusterBatchAppendFormattedCommand(redisClusterBatch *batch, const char *cmd, int len);
+int redisClusterBatchvAppendCommand(redisClusterBatch *batch, const char *format, va_list ap);
+int redisClusterBatchAppendCommand(redisClusterBatch *batch, const char *format, ...);
+int redisClusterBatchAppendCommandArgv(redisClusterBatch *batch, int argc, const char **argv, const size_t *argvlen);
+int redisClusterBatchExecute(redisClusterContext *cc, redisClusterBatch *batch, void **replies, int *status);
+
+/* The replies of a command sent to several nodes. */
+typedef struct redisClusterNodeReplies {
+    int count;
+    sds *addrs;             /* address of each node */
+    redisReply **replies;   /* reply of each node, NULL if it failed */
+    redisReply *reduced;    /* the replies merged, NULL if not asked or they can not be */
+} redisClusterNodeReplies;
+
+redisClusterNodeReplies *redisClusterBroadcastFormattedCommand(redisClusterContext *cc, int filter, int merge, char *cmd, int len);
+redisClusterNodeReplies *redisClusterBroadcastCommand(redisClusterContext *cc, int filter, int merge, const char *format, ...);
+void redisClusterNodeRepliesFree(redisClusterNodeReplies *replies);
+
+/* An iterator over the keys of all the masters, see redisClusterScanNext(). */
+typedef struct redisClusterScan redisClusterScan;
+
+redisClusterScan *redisClusterScanCreate(redisClusterContext *cc, const char *match, long long count, const char *type);
+redisReply *redisClusterScanNext(redisClusterScan *scan);
+void redisClusterScanFree(redisClusterScan *scan);
+
 int cluster_update_route(redisClusterContext *cc);
 int test_cluster_update_route(redisClusterContext *cc);
+int test_cluster_command_infos_set(redisClusterContext *cc, redisReply *reply);
+void test_cluster_command_parse(redisClusterContext *cc, struct cmd *command);
 struct dict *parse_cluster_nodes(redisClusterContext *cc, char *str, int str_len, int flags);
 struct dict *parse_cluster_slots(redisClusterContext *cc, redisReply *reply, int flags);
 
@@ -150,6 +260,10 @@ struct redisClusterAsyncContext;
 typedef int (adapterAttachFn)(redisAsyncContext*, void*);
 
 typedef void (redisClusterCallbackFn)(struct redisClusterAsyncContext*, void*, void*);
+/* The replies of all the nodes a command was broadcast to. */
+typedef void (redisClusterBroadcastCallbackFn)(struct redisClusterAsyncContext*, redisClusterNodeReplies*, void*);
+/* The reply of a fragment, with the indexes of its keys in the command. */
+typedef void (redisClusterPartialCallbackFn)(struct redisClusterAsyncContext*, void*, const uint32_t*, uint32_t, void*);
 
 /* Context for an async connection to Redis */
 typedef struct redisClusterAsyncContext {
@@ -173,15 +287,23 @@ typedef struct redisClusterAsyncContext {
     /* Called when the first write event was received. */
     redisConnectCallback *onConnect;
 
+    /* Commands redirected by MOVED, replayed when the route is updated. */
+    struct hilist *parked_requests;
+
 } redisClusterAsyncContext;
 
 redisClusterAsyncContext *redisClusterAsyncConnect(const char *addrs, int flags);
+redisClusterAsyncContext *redisClusterAsyncConnect2(redisClusterContext *cc);
 int redisClusterAsyncSetConnectCallback(redisClusterAsyncContext *acc, redisConnectCallback *fn);
 int redisClusterAsyncSetDisconnectCallback(redisClusterAsyncContext *acc, redisDisconnectCallback *fn);
 int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, char *cmd, int len);
 int redisClustervAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const char *format, va_list ap);
 int redisClusterAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const char *format, ...);
 int redisClusterAsyncCommandArgv(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+int redisClusterAsyncFormattedCommandPartial(redisClusterAsyncContext *acc, redisClusterPartialCallbackFn *partial_fn, redisClusterCallbackFn *fn, void *privdata, char *cmd, int len);
+int redisClusterAsyncCommandPartial(redisClusterAsyncContext *acc, redisClusterPartialCallbackFn *partial_fn, redisClusterCallbackFn *fn, void *privdata, const char *format, ...);
+int redisClusterAsyncBroadcastFormattedCommand(redisClusterAsyncContext *acc, int filter, int merge, redisClusterBroadcastCallbackFn *fn, void *privdata, char *cmd, int len);
+int redisClusterAsyncBroadcastCommand(redisClusterAsyncContext *acc, int filter, int merge, redisClusterBroadcastCallbackFn *fn, void *privdata, const char *format, ...);
 void redisClusterAsyncDisconnect(redisClusterAsyncContext *acc);
 void redisClusterAsyncFree(redisClusterAsyncContext *acc);
 
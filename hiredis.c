@@ -207,9 +207,15 @@ static size_t bulklen(size_t len) {
     return 1+countDigits(len)+2+len+2;
 }
 
-int redisvFormatCommand(char **target, const char *format, va_list ap) {
+/* Format a command like redisvFormatCommand. When argpos is not NULL,
+ * the offset in the command and the length of each of its arguments are
+ * set in a malloc'ed array of 2 * argc size_t, *argpos, and the argument
+ * count in *argcp, so the command is not parsed again to find them. */
+int redisvFormatCommandPos(char **target, size_t **argpos, int *argcp,
+                           const char *format, va_list ap) {
     const char *c = format;
     char *cmd = NULL; /* final command */
+    size_t *pos_argv = NULL; /* offset and length of each argument */
     int pos; /* position in final command */
     sds curarg, newarg; /* current argument */
     int touched = 0; /* was the current argument touched? */
@@ -396,6 +402,11 @@ int redisvFormatCommand(char **target, const char *format, va_list ap) {
     /* Add bytes needed to hold multi bulk count */
     totlen += 1+countDigits(argc)+2;
 
+    if (argpos != NULL) {
+        pos_argv = malloc(sizeof(size_t)*2*(argc+1));
+        if (pos_argv == NULL) goto memory_err;
+    }
+
     /* Build the command at protocol level */
     cmd = malloc(totlen+1);
     if (cmd == NULL) goto memory_err;
@@ -403,6 +414,10 @@ int redisvFormatCommand(char **target, const char *format, va_list ap) {
     pos = sprintf(cmd,"*%d\r\n",argc);
     for (j = 0; j < argc; j++) {
         pos += sprintf(cmd+pos,"$%zu\r\n",sdslen(curargv[j]));
+        if (pos_argv != NULL) {
+            pos_argv[2*j] = pos;
+            pos_argv[2*j+1] = sdslen(curargv[j]);
+        }
         memcpy(cmd+pos,curargv[j],sdslen(curargv[j]));
         pos += sdslen(curargv[j]);
         sdsfree(curargv[j]);
@@ -414,6 +429,10 @@ int redisvFormatCommand(char **target, const char *format, va_list ap) {
 
     free(curargv);
     *target = cmd;
+    if (argpos != NULL) {
+        *argpos = pos_argv;
+        *argcp = argc;
+    }
     return totlen;
 
 format_err:
@@ -433,6 +452,9 @@ cleanup:
 
     sdsfree(curarg);
 
+    if (pos_argv != NULL)
+        free(pos_argv);
+
     /* No need to check cmd since it is the last statement that can fail,
      * but do it anyway to be as defensive as possible. */
     if (cmd != NULL)
@@ -441,6 +463,10 @@ cleanup:
     return error_type;
 }
 
+int redisvFormatCommand(char **target, const char *format, va_list ap) {
+    return redisvFormatCommandPos(target,NULL,NULL,format,ap);
+}
+
 /* Format a command according to the Redis protocol. This function
  * takes a format similar to printf:
  *
@@ -9,9 +9,15 @@
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <ctype.h>
+#include <stdarg.h>
 
 #include "hiredis.h"
 #include "net.h"
+#include "hiutil.h"
+#include "hiarray.h"
+#include "hircluster.h"
+#include "command.h"
 
 enum connection_type {
     CONN_TCP,
@@ -226,6 +232,378 @@ static void test_format_commands(void) {
     free(cmd);
 }
 
+static int format_command_pos(char **target, size_t **argpos, int *argc,
+                              const char *format, ...) {
+    va_list ap;
+    int len;
+
+    va_start(ap,format);
+    len = redisvFormatCommandPos(target,argpos,argc,format,ap);
+    va_end(ap);
+    return len;
+}
+
+static void test_format_commands_pos(void) {
+    char *cmd;
+    size_t *argpos;
+    int argc, len;
+
+    test("Format command with the positions of %%s and %%b arguments: ");
+    len = format_command_pos(&cmd,&argpos,&argc,"MSET %s %b k%sy v",
+        "foo","b\0r",(size_t)3,"e");
+    test_cond(len == 4+4+(4+2)+4+(3+2)+4+(3+2)+4+(3+2)+4+(1+2) && argc == 5 &&
+        argpos[0] == 8 && argpos[1] == 4 &&
+        argpos[2] == 18 && argpos[3] == 3 &&
+        argpos[4] == 27 && argpos[5] == 3 &&
+        argpos[6] == 36 && argpos[7] == 3 &&
+        argpos[8] == 45 && argpos[9] == 1 &&
+        memcmp(cmd+argpos[2],"foo",3) == 0 &&
+        memcmp(cmd+argpos[4],"b\0r",3) == 0 &&
+        memcmp(cmd+argpos[6],"key",3) == 0);
+    free(argpos);
+    free(cmd);
+
+    test("Format command with the positions of an empty argument: ");
+    len = format_command_pos(&cmd,&argpos,&argc,"GET %s","");
+    test_cond(len == 4+4+(3+2)+4+(0+2) && argc == 2 &&
+        argpos[2] == 17 && argpos[3] == 0);
+    free(argpos);
+    free(cmd);
+}
+
+/* The CRC16 of the key slots computed bit by bit, as the cluster spec
+ * describes it, to check the table driven one against. */
+static uint16_t crc16_bitwise(const char *buf, int len) {
+    uint16_t crc = 0;
+    int i, j;
+
+    for (i = 0; i < len; i++) {
+        crc ^= (uint16_t)((unsigned char)buf[i] << 8);
+        for (j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+static int key_slot_bitwise(const char *key, int len) {
+    int s, e;
+
+    for (s = 0; s < len; s++)
+        if (key[s] == '{') break;
+    if (s == len) return crc16_bitwise(key,len) & 16383;
+    for (e = s+1; e < len; e++)
+        if (key[e] == '}') break;
+    if (e == len || e == s+1) return crc16_bitwise(key,len) & 16383;
+    return crc16_bitwise(key+s+1,e-s-1) & 16383;
+}
+
+static void test_cluster_key_slots(void) {
+    const char *keys[5] = { "123456789", "{user1000}.following",
+        "{user1000}.followers", "foo{}{bar}", "foo{{bar}}zap" };
+    size_t lens[5];
+    int slots[5];
+    static char buf[20000][24];
+    static const char *rkeys[20000];
+    static size_t rlens[20000];
+    static int rslots[20000];
+    int i, j, ok;
+
+    test("CRC16 of the key slots is XMODEM: ");
+    test_cond(crc16("123456789",9) == 0x31C3 && crc16("",0) == 0);
+
+    test("Key slots of untagged and tagged keys: ");
+    test_cond(redisClusterKeySlots(keys,NULL,5,slots) == REDIS_OK &&
+        slots[0] == 12739 && slots[1] == slots[2] &&
+        slots[1] == (crc16("user1000",8) & 16383) &&
+        slots[3] == (crc16("foo{}{bar}",10) & 16383) &&
+        slots[4] == (crc16("{bar",4) & 16383));
+
+    srand(1234);
+    for (i = 0; i < 20000; i++) {
+        rlens[i] = 1 + rand() % (int)sizeof(buf[i]);
+        for (j = 0; j < (int)rlens[i]; j++) {
+            /* braces are frequent so that many keys are tagged */
+            switch (rand() % 16) {
+            case 0: buf[i][j] = '{'; break;
+            case 1: buf[i][j] = '}'; break;
+            default: buf[i][j] = (char)(rand() % 256);
+            }
+        }
+        rkeys[i] = buf[i];
+    }
+
+    test("Key slots of 20000 random keys match a bitwise CRC16: ");
+    ok = redisClusterKeySlots(rkeys,rlens,20000,rslots) == REDIS_OK;
+    for (i = 0; ok && i < 20000; i++)
+        ok = rslots[i] == key_slot_bitwise(rkeys[i],(int)rlens[i]);
+    test_cond(ok);
+
+    lens[0] = 0;
+    test("Key slot of an empty key: ");
+    test_cond(redisClusterKeySlots(keys,lens,1,slots) == REDIS_OK && slots[0] == 0);
+}
+
+static void test_cluster_command_lookup(void) {
+    struct cmd *r;
+    const char *name;
+    char mixed[32];
+    uint32_t i, j, len;
+    int ok = 1;
+
+    test("Every known command is found in mixed case: ");
+    for (i = 0; ok && (name = redis_cmd_name(i)) != NULL; i++) {
+        len = (uint32_t)strlen(name);
+        for (j = 0; j < len && j < sizeof(mixed); j++)
+            mixed[j] = (j + i) % 2 ? (char)toupper(name[j]) : name[j];
+        r = command_get();
+        ok = r != NULL && redisFormatCommand(&r->cmd,"%b",mixed,(size_t)len) > 0;
+        if (ok) {
+            r->clen = (uint32_t)strlen(r->cmd);
+            redis_parse_cmd(r);
+            ok = r->type != CMD_UNKNOWN && r->type != CMD_REQ_REDIS_CUSTOM;
+        }
+        command_destroy(r);
+    }
+    test_cond(ok && i > 100);
+
+    test("An unknown command is not found: ");
+    r = command_get();
+    r->clen = (uint32_t)redisFormatCommand(&r->cmd,"GETX foo");
+    redis_parse_cmd(r);
+    test_cond(r->type == CMD_UNKNOWN && r->result == CMD_PARSE_ERROR);
+    command_destroy(r);
+}
+
+static sds resp_array(sds s, int n) {
+    return sdscatprintf(s,"*%d\r\n",n);
+}
+
+static sds resp_bulk(sds s, const char *str) {
+    return sdscatprintf(s,"$%d\r\n%s\r\n",(int)strlen(str),str);
+}
+
+static sds resp_int(sds s, int n) {
+    return sdscatprintf(s,":%d\r\n",n);
+}
+
+/* An element of the COMMAND reply of redis 6, the keys are given by
+ * the first key, the last key and the step. */
+static sds command_reply_legacy(sds s, const char *name, int arity,
+    int first, int last, int step)
+{
+    s = resp_array(s,7);
+    s = resp_bulk(s,name);
+    s = resp_int(s,arity);
+    s = resp_array(s,0);
+    s = resp_int(s,first);
+    s = resp_int(s,last);
+    s = resp_int(s,step);
+    return resp_array(s,0);
+}
+
+/* An element of the COMMAND reply of redis 7 with one key spec. The
+ * search begins at the index or at the keyword searched from the index,
+ * the keys are found by "range" (lastkey, keystep, limit) or "keynum"
+ * (keynumidx, firstkey, keystep). */
+static sds command_reply_spec(sds s, const char *name, int arity,
+    const char *keyword, int index, const char *find, int a, int b, int c)
+{
+    int range = strcmp(find,"range") == 0;
+
+    s = resp_array(s,10);
+    s = resp_bulk(s,name);
+    s = resp_int(s,arity);
+    s = resp_array(s,0);
+    s = resp_int(s,0);
+    s = resp_int(s,0);
+    s = resp_int(s,0);
+    s = resp_array(s,0);
+    s = resp_array(s,0);
+
+    s = resp_array(s,1);
+    s = resp_array(s,6);
+    s = resp_bulk(s,"flags");
+    s = resp_array(s,0);
+    s = resp_bulk(s,"begin_search");
+    s = resp_array(s,4);
+    s = resp_bulk(s,"type");
+    if (keyword != NULL) {
+        s = resp_bulk(s,"keyword");
+        s = resp_bulk(s,"spec");
+        s = resp_array(s,4);
+        s = resp_bulk(s,"keyword");
+        s = resp_bulk(s,keyword);
+        s = resp_bulk(s,"startfrom");
+    } else {
+        s = resp_bulk(s,"index");
+        s = resp_bulk(s,"spec");
+        s = resp_array(s,2);
+        s = resp_bulk(s,"index");
+    }
+    s = resp_int(s,index);
+    s = resp_bulk(s,"find_keys");
+    s = resp_array(s,4);
+    s = resp_bulk(s,"type");
+    s = resp_bulk(s,find);
+    s = resp_bulk(s,"spec");
+    s = resp_array(s,6);
+    s = resp_bulk(s,range ? "lastkey" : "keynumidx");
+    s = resp_int(s,a);
+    s = resp_bulk(s,range ? "keystep" : "firstkey");
+    s = resp_int(s,b);
+    s = resp_bulk(s,range ? "limit" : "keystep");
+    s = resp_int(s,c);
+
+    return resp_array(s,0);
+}
+
+/* Whether the keys found in the command are the ones separated by
+ * spaces in keys, or keys is "error" and the command is not parsed.
+ * Without cc the command is parsed by the command table only. */
+static int command_keys_are(redisClusterContext *cc, const char *keys,
+    const char *cmd)
+{
+    struct cmd *r;
+    struct keypos *kp;
+    sds found = sdsempty();
+    uint32_t i;
+    int ret;
+
+    r = command_get();
+    r->clen = (uint32_t)redisFormatCommand(&r->cmd,cmd);
+
+    if (cc != NULL)
+        test_cluster_command_parse(cc,r);
+    else
+        redis_parse_cmd(r);
+    if (r->result != CMD_PARSE_OK) {
+        found = sdscat(found,"error");
+    } else {
+        for (i = 0; i < hiarray_n(r->keys); i++) {
+            kp = hiarray_get(r->keys,i);
+            found = sdscatprintf(found,"%s%.*s",i ? " " : "",
+                (int)(kp->end - kp->start),kp->start);
+        }
+    }
+
+    ret = strcmp(found,keys) == 0;
+    sdsfree(found);
+    command_destroy(r);
+    return ret;
+}
+
+static void test_cluster_command_infos(void) {
+    redisClusterContext *cc;
+    redisReader *reader;
+    redisReply *reply;
+    sds s;
+
+    s = resp_array(sdsempty(),6);
+    /* XREADGROUP: the keys follow STREAMS, half of the arguments left */
+    s = command_reply_spec(s,"myxreadgroup",-7,"STREAMS",4,"range",-1,1,2);
+    /* EVAL: the key count is the argument at the index */
+    s = command_reply_spec(s,"myeval",-3,NULL,2,"keynum",0,1,1);
+    /* MIGRATE: KEYS is searched backward from the end */
+    s = command_reply_spec(s,"mymigrate",-6,"KEYS",-2,"range",-1,1,0);
+    /* redis 6: MSET keys, and three keys in a row */
+    s = command_reply_legacy(s,"mymset",-3,1,-1,2);
+    s = command_reply_legacy(s,"mythree",5,1,3,1);
+    s = command_reply_legacy(s,"mynokey",1,0,0,0);
+
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,s,sdslen(s));
+    sdsfree(s);
+    reply = NULL;
+    redisReaderGetReply(reader,(void**)&reply);
+    redisReaderFree(reader);
+
+    cc = redisClusterContextInit();
+    test("Command infos are read from a COMMAND reply: ");
+    test_cond(reply != NULL &&
+        test_cluster_command_infos_set(cc,reply) == REDIS_OK);
+    if (reply != NULL)
+        freeReplyObject(reply);
+
+    test("Keys after a keyword (XREADGROUP STREAMS): ");
+    test_cond(command_keys_are(cc,"s1 s2",
+        "MYXREADGROUP GROUP g c COUNT 1 STREAMS s1 s2 > >"));
+
+    test("Keys counted by an argument (EVAL numkeys): ");
+    test_cond(command_keys_are(cc,"k1 k2","MYEVAL script 2 k1 k2 a1") &&
+        command_keys_are(cc,"","MYEVAL script 0 a1") &&
+        command_keys_are(cc,"error","MYEVAL script 3 k1 k2"));
+
+    test("Keys after a keyword searched backward (MIGRATE KEYS): ");
+    test_cond(command_keys_are(cc,"k1 k2",
+        "MYMIGRATE host 6379 \"\" 0 5000 KEYS k1 k2"));
+
+    test("Keys by the first key, last key and step of redis 6: ");
+    test_cond(command_keys_are(cc,"a b","MYMSET a 1 b 2") &&
+        command_keys_are(cc,"k1 k2 k3","MYTHREE k1 k2 k3 x") &&
+        command_keys_are(cc,"error","MYTHREE k1 k2"));
+
+    test("Commands out of the infos are not parsed: ");
+    test_cond(command_keys_are(cc,"error","MYOTHER k1"));
+
+    test("An error reply keeps the command infos: ");
+    reply = NULL;
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"-ERR unknown command\r\n",22);
+    redisReaderGetReply(reader,(void**)&reply);
+    redisReaderFree(reader);
+    test_cond(reply != NULL &&
+        test_cluster_command_infos_set(cc,reply) == REDIS_ERR &&
+        command_keys_are(cc,"a b","MYMSET a 1 b 2"));
+    if (reply != NULL)
+        freeReplyObject(reply);
+
+    redisClusterFree(cc);
+}
+
+static int command_reducer_is(const char *cmd, int type, cmd_merge_t merge) {
+    struct cmd *r;
+    int ret;
+
+    r = command_get();
+    r->clen = (uint32_t)redisFormatCommand(&r->cmd,cmd);
+    redis_parse_cmd(r);
+    ret = r->result == CMD_PARSE_OK && (int)r->type == type &&
+        r->reducer != NULL && r->reducer->merge == merge;
+    command_destroy(r);
+    return ret;
+}
+
+static void test_cluster_command_reducers(void) {
+    test("EXISTS, TOUCH and UNLINK are split by key and summed: ");
+    test_cond(command_keys_are(NULL,"a b c","EXISTS a b c") &&
+        command_keys_are(NULL,"a b","TOUCH a b") &&
+        command_keys_are(NULL,"a","UNLINK a") &&
+        command_reducer_is("EXISTS a b",CMD_REQ_REDIS_EXISTS,CMD_MERGE_SUM) &&
+        command_reducer_is("touch a b",CMD_REQ_REDIS_TOUCH,CMD_MERGE_SUM) &&
+        command_reducer_is("Unlink a b",CMD_REQ_REDIS_UNLINK,CMD_MERGE_SUM));
+
+    test("Commands with arguments other than keys get no reducer: ");
+    test_cond(redisClusterRegisterReducer("hmget",HIRCLUSTER_SPLIT_KEYS,
+            HIRCLUSTER_MERGE_CONCAT) == REDIS_ERR &&
+        redisClusterRegisterReducer("ZADD",HIRCLUSTER_SPLIT_KEY_VALUES,
+            HIRCLUSTER_MERGE_SUM) == REDIS_ERR &&
+        redisClusterRegisterReducer("mset",HIRCLUSTER_SPLIT_KEYS,
+            HIRCLUSTER_MERGE_ALL_OK) == REDIS_ERR &&
+        command_keys_are(NULL,"h","HMGET h f1 f2"));
+
+    test("Unknown commands are parsed by their registered reducer: ");
+    test_cond(redisClusterRegisterReducer("myxget",HIRCLUSTER_SPLIT_KEYS,
+            HIRCLUSTER_MERGE_CONCAT) == REDIS_OK &&
+        redisClusterRegisterReducer("MyKvSet",HIRCLUSTER_SPLIT_KEY_VALUES,
+            HIRCLUSTER_MERGE_ALL_OK) == REDIS_OK &&
+        command_keys_are(NULL,"a b c","MYXGET a b c") &&
+        command_reducer_is("myxget a",CMD_REQ_REDIS_CUSTOM,CMD_MERGE_CONCAT) &&
+        command_keys_are(NULL,"a b","mykvset a 1 b 2") &&
+        command_reducer_is("MYKVSET a 1",CMD_REQ_REDIS_CUSTOM,CMD_MERGE_ALL_OK) &&
+        command_keys_are(NULL,"error","MYKVSET a 1 b") &&
+        command_keys_are(NULL,"error","MYXGETX a"));
+}
+
 static void test_append_formatted_commands(struct config config) {
     redisContext *c;
     redisReply *reply;
@@ -769,6 +1147,11 @@ int main(int argc, char **argv) {
     }
 
     test_format_commands();
+    test_format_commands_pos();
+    test_cluster_key_slots();
+    test_cluster_command_lookup();
+    test_cluster_command_infos();
+    test_cluster_command_reducers();
     test_reply_reader();
     test_blocking_connection_errors();
     test_free_null();
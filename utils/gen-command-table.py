@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+#
+# Generate the perfect hash table of the commands known by the cluster
+# command parser, and write it into command.c between the markers.
+#
+# The hash of a command name is its length plus the association values
+# of its first four and last characters, taken case insensitively
+# (c & 0x1f), masked by the table size. The association values are
+# searched so that no two commands share a slot, thus a lookup is one
+# probe followed by one case insensitive compare.
+#
+# Run it from the repository root after adding a command here:
+#
+#   python3 utils/gen-command-table.py
+#
+
+import random
+import re
+import sys
+
+# (name, key spec): the type of each command is CMD_REQ_REDIS_<NAME>.
+COMMANDS = [
+    ("get", "ARG0"),
+    ("set", "ARGN"),
+    ("ttl", "ARG0"),
+    ("del", "MULTI"),
+    ("pttl", "ARG0"),
+    ("decr", "ARG0"),
+    ("dump", "ARG0"),
+    ("hdel", "ARGN"),
+    ("hget", "ARG1"),
+    ("hlen", "ARG0"),
+    ("hset", "ARG2"),
+    ("incr", "ARG0"),
+    ("llen", "ARG0"),
+    ("lpop", "ARG0"),
+    ("lrem", "ARG2"),
+    ("lset", "ARG2"),
+    ("rpop", "ARG0"),
+    ("sadd", "ARGN"),
+    ("spop", "ARG0"),
+    ("srem", "ARGN"),
+    ("type", "ARG0"),
+    ("mget", "MULTI"),
+    ("mset", "MULTI"),
+    ("zadd", "ARGN"),
+    ("zrem", "ARGN"),
+    ("eval", "EVAL"),
+    ("sort", "ARG0"),
+    ("ping", "NONE"),
+    ("quit", "NONE"),
+    ("auth", "ARG0"),
+    ("touch", "MULTI"),
+    ("hkeys", "ARG0"),
+    ("hmget", "ARGN"),
+    ("hmset", "ARGN"),
+    ("hvals", "ARG0"),
+    ("hscan", "ARGN"),
+    ("lpush", "ARGN"),
+    ("ltrim", "ARG2"),
+    ("rpush", "ARGN"),
+    ("scard", "ARG0"),
+    ("sdiff", "ARGN"),
+    ("setex", "ARG2"),
+    ("setnx", "ARG1"),
+    ("smove", "ARG2"),
+    ("sscan", "ARGN"),
+    ("zcard", "ARG0"),
+    ("zrank", "ARG1"),
+    ("zscan", "ARGN"),
+    ("pfadd", "ARGN"),
+    ("append", "ARG1"),
+    ("decrby", "ARG1"),
+    ("exists", "MULTI"),
+    ("unlink", "MULTI"),
+    ("expire", "ARG1"),
+    ("getbit", "ARG1"),
+    ("getset", "ARG1"),
+    ("psetex", "ARG2"),
+    ("hsetnx", "ARG2"),
+    ("incrby", "ARG1"),
+    ("lindex", "ARG1"),
+    ("lpushx", "ARG1"),
+    ("lrange", "ARG2"),
+    ("rpushx", "ARG1"),
+    ("setbit", "ARG2"),
+    ("sinter", "ARGN"),
+    ("strlen", "ARG0"),
+    ("sunion", "ARGN"),
+    ("zcount", "ARG2"),
+    ("zrange", "ARGN"),
+    ("zscore", "ARG1"),
+    ("persist", "ARG0"),
+    ("pexpire", "ARG1"),
+    ("hexists", "ARG1"),
+    ("hgetall", "ARG0"),
+    ("hincrby", "ARG2"),
+    ("linsert", "ARG3"),
+    ("zincrby", "ARG2"),
+    ("evalsha", "EVAL"),
+    ("restore", "ARG2"),
+    ("pfcount", "ARG0"),
+    ("pfmerge", "ARGN"),
+    ("expireat", "ARG1"),
+    ("bitcount", "ARGN"),
+    ("getrange", "ARG2"),
+    ("setrange", "ARG2"),
+    ("smembers", "ARG0"),
+    ("zrevrank", "ARG1"),
+    ("pexpireat", "ARG1"),
+    ("rpoplpush", "ARG1"),
+    ("sismember", "ARG1"),
+    ("zrevrange", "ARGN"),
+    ("zlexcount", "ARG2"),
+    ("sdiffstore", "ARGN"),
+    ("incrbyfloat", "ARG1"),
+    ("sinterstore", "ARGN"),
+    ("srandmember", "ARGN"),
+    ("sunionstore", "ARGN"),
+    ("zinterstore", "ARGN"),
+    ("zunionstore", "ARGN"),
+    ("zrangebylex", "ARGN"),
+    ("hincrbyfloat", "ARG2"),
+    ("zrangebyscore", "ARGN"),
+    ("zremrangebylex", "ARG2"),
+    ("zremrangebyrank", "ARG2"),
+    ("zremrangebyscore", "ARG2"),
+    ("zrevrangebyscore", "ARGN"),
+]
+
+TABLE_SIZE = 256
+POSITIONS = (0, 1, 2, 3, -1)
+BEGIN = "/* Generated by utils/gen-command-table.py, do not edit. */\n"
+END = "/* End of the generated command table. */\n"
+
+
+def hash_name(name, asso):
+    h = len(name)
+    for pos in POSITIONS:
+        i = pos if pos >= 0 else len(name) + pos
+        if i < len(name):
+            h += asso[ord(name[i]) & 0x1f]
+    return h & (TABLE_SIZE - 1)
+
+
+def collisions(asso):
+    hashes = set(hash_name(name, asso) for name, _ in COMMANDS)
+    return len(COMMANDS) - len(hashes)
+
+
+def search():
+    rnd = random.Random(0)
+    for attempt in range(100):
+        asso = [rnd.randrange(TABLE_SIZE) for _ in range(32)]
+        count = collisions(asso)
+        for _ in range(50000):
+            if count == 0:
+                return asso
+            c = rnd.randrange(1, 27)
+            old = asso[c]
+            asso[c] = rnd.randrange(TABLE_SIZE)
+            new = collisions(asso)
+            if new <= count:
+                count = new
+            else:
+                asso[c] = old
+    sys.exit("no perfect hash found, try a larger TABLE_SIZE")
+
+
+def rows(values, per_row):
+    out = []
+    for i in range(0, len(values), per_row):
+        out.append("    " + ", ".join("%3d" % v for v in values[i:i + per_row]) + ",\n")
+    return "".join(out)
+
+
+def generate():
+    names = [name for name, _ in COMMANDS]
+    assert len(set(names)) == len(names), "duplicated command"
+    assert all(re.match("^[a-z]{3,}$", name) for name in names)
+    assert len(COMMANDS) < 256
+
+    asso = search()
+    index = [0] * TABLE_SIZE
+    for i, (name, _) in enumerate(COMMANDS):
+        index[hash_name(name, asso)] = i + 1
+
+    width = max(len(name) for name in names)
+    out = [BEGIN, "\n"]
+    out.append("#define CMD_NAME_MINLEN %d\n" % min(len(n) for n in names))
+    out.append("#define CMD_NAME_MAXLEN %d\n" % width)
+    out.append("#define CMD_TABLE_SIZE  %d\n\n" % TABLE_SIZE)
+    out.append("static const uint8_t cmd_asso[32] = {\n")
+    out.append(rows(asso, 16))
+    out.append("};\n\n")
+    out.append("static const struct cmd_spec cmd_specs[] = {\n")
+    for name, spec in COMMANDS:
+        out.append("    { %-*s %2d, %-*s CMD_KEYSPEC_%s },\n" % (
+            width + 3, '"%s",' % name, len(name),
+            width + 15, "CMD_REQ_REDIS_%s," % name.upper(), spec))
+    out.append("};\n\n")
+    out.append("/* The index in cmd_specs plus one of the command hashed to each slot */\n")
+    out.append("static const uint8_t cmd_index[CMD_TABLE_SIZE] = {\n")
+    out.append(rows(index, 16))
+    out.append("};\n\n")
+    out.append(END)
+    return "".join(out)
+
+
+def main():
+    path = "command.c"
+    with open(path) as f:
+        src = f.read()
+
+    begin = src.index(BEGIN)
+    end = src.index(END) + len(END)
+
+    with open(path, "w") as f:
+        f.write(src[:begin] + generate() + src[end:])
+
+
+if __name__ == "__main__":
+    main()